@@ -2,16 +2,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <rdma/rdma_cma.h>
 
+#include "coalesce.h"
+#include "credit_flow.h"
+#include "rdma_log.h"
+
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
 
-const int BUFFER_SIZE = 1024;
 const int TIMEOUT_IN_MS = 500; /* ms */
+const int MAX_CONTEXTS = 16;
+const int MAX_TARGETS = 4096;
+const int MAX_SIZES = 16;
+/* latency histogram: 8 linear sub-buckets per power of two nanoseconds */
+const int HIST_SUB_BITS = 3;
+const int HIST_BUCKETS = 64 << HIST_SUB_BITS;
 
 struct context
 {
@@ -19,58 +32,290 @@ struct context
     struct ibv_pd *pd;
     struct ibv_cq *cq;
     struct ibv_comp_channel *comp_channel;
+    struct coalesce_queue due;
+    int cqe;
+    int max_cqe;
+    int num_connections;        /* with a QP on this device right now */
+
+    /*
+     * sessions the CM thread hands the poller, which sends their messages,
+     * and connections it is done with, which the poller tears down
+     */
+    int epoll_fd;               /* completion channel and wake_fd */
+    int wake_fd;                /* eventfd, bumped when <starts> or <gone> fill */
+    pthread_mutex_t lock;
+    struct connection *starts;
+    struct connection *gone;
 
     pthread_t cq_poller_thread;
 };
 
+/*
+ * A server to connect to, with the sessions still to run against it and
+ * its warm pool: spare connections set up ahead of the sessions that will
+ * take them. Only touched by the CM thread.
+ */
+struct target
+{
+    const char *host;
+    const char *port;
+    struct addrinfo *addr;
+
+    unsigned long long sessions;        /* not started yet */
+    int active;                         /* sessions running */
+    struct connection *pool;            /* spares that are up */
+    int pooled;                         /* spares, up or still connecting */
+};
+
+enum conn_state
+{
+    CONN_RESOLVING_ADDR, CONN_RESOLVING_ROUTE, CONN_CONNECTING,
+    CONN_ESTABLISHED
+};
+
 struct connection
 {
+    struct context *ctx;
     struct rdma_cm_id *id;
     struct ibv_qp *qp;
 
-    struct ibv_mr *recv_mr;
-    struct ibv_mr *send_mr;
-
-    char *recv_region;
-    char *send_region;
-
-    int num_completions;
+    /* connection setup, CM thread */
+    struct target *target;
+    struct connection *next;    /* in the target's pool */
+    enum conn_state state;
+    int session;                /* 0 = a spare for the pool */
+    const char *failed;         /* why it is being disconnected before it could be used */
+    unsigned long long setup_ns;        /* when rdma_resolve_addr() was called */
+    unsigned long long addr_ns;         /* each step, from setup_ns */
+    unsigned long long route_ns;
+    unsigned long long established_ns;
+
+    struct ibv_mr *mr;
+    char *rings;
+
+    /* set up by the CM thread, then only touched by the poller */
+    struct credit_flow flow;
+    int peer_depth;
+    struct connection *next_start;      /* in the context's <starts> */
+    struct connection *next_gone;       /* in the context's <gone> */
+    int running;                /* session begun by the poller */
+    int gone;                   /* being torn down: completions are ignored */
+    int broken;                 /* the server sent garbage, or a WR failed */
+    unsigned long long to_send;
+    unsigned long long msgs_sent;
+    unsigned long long bytes_sent;
+    int disconnecting;
+    unsigned long long start_ns;
+    unsigned long long end_ns;
+    unsigned long long deadline_ns;
+
+    /* echo mode: send times of the requests in flight, answered in order */
+    unsigned long long *stamps;
+    unsigned long long requests;
+    unsigned long long responses;
+
+    /* coalescing: messages go out in batches and come back in batches */
+    struct coalescer batch;
+    unsigned long long records;
 };
 
 static void die(const char *reason);
 
-static void build_context(struct ibv_context *verbs);
-static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
+static struct context * build_context(struct ibv_context *verbs);
+static void build_qp_attr(struct context *ctx, struct ibv_qp_init_attr *qp_attr);
 static void * poll_cq(void *);
-static void post_receives(struct connection *conn);
 static void register_memory(struct connection *conn);
+static void pump(struct connection *conn);
+static void print_rate(struct connection *conn);
+static void print_histogram(unsigned long long count);
+static void print_setup_times(void);
 
 static int on_addr_resolved(struct rdma_cm_id *id);
 static void on_completion(struct ibv_wc *wc);
 static int on_connection(void *context);
+static int on_connect_error(struct rdma_cm_id *id, const char *why);
 static int on_disconnect(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
 static int on_route_resolved(struct rdma_cm_id *id);
+static void begin_session(struct connection *conn);
+static void start_session(struct target *t);
+
+static struct context *s_ctx[MAX_CONTEXTS];
+static int s_num_ctx = 0;
+
+static struct rdma_event_channel *s_ec = NULL;
+static struct target s_targets[MAX_TARGETS];
+static int s_num_targets = 0;
+static int s_parallel = 1;              /* sessions at once per target */
+static unsigned long long s_sessions = 1;       /* per target */
+static int s_pool = 0;                  /* warm spares per target */
+static int s_live = 0;                  /* connections not torn down yet */
+static int s_failed = 0;
+static unsigned long long s_pool_hits = 0;
+static unsigned long long s_pool_misses = 0;
+static unsigned long long s_first_setup_ns = 0;
+static unsigned long long s_last_established_ns = 0;
+static unsigned long long *s_setup_times = NULL;
+static int s_num_setups = 0;
+static int s_max_setups = 0;
+static unsigned long long s_responses = 0;      /* of connections closed so far */
+
+static int s_recv_depth = FLOW_DEFAULT_DEPTH;
+static int s_max_inline = FLOW_DEFAULT_INLINE;
+static unsigned long long s_messages = 1000;
+static char s_payload[FLOW_SLOT_SIZE];
+static uint32_t s_sizes[MAX_SIZES];
+static int s_num_sizes = 0;
+static int s_duration = 0; /* seconds, 0 = send s_messages */
+static int s_echo = 0;
+static int s_outstanding = 1;
+static int s_coalesce = 0;
+static int s_coalesce_us = COALESCE_DEFAULT_DELAY_US;
+static uint32_t s_coalesce_bytes = 0;   /* 0 = full batches */
+static unsigned long long s_hist[HIST_BUCKETS];
+static unsigned long long s_lat_min = ~0ULL;
+static unsigned long long s_lat_max = 0;
+static unsigned long long s_lat_sum = 0;
+
+/* Comma separated payload sizes, used round robin. */
+static int parse_sizes(char *arg)
+{
+    char *tok;
+    unsigned long size;
+
+    for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ","))
+    {
+        size = strtoul(tok, NULL, 0);
+        if (s_num_sizes == MAX_SIZES || size < 1 || size > flow_max_payload())
+            return -1;
+        s_sizes[s_num_sizes++] = size;
+    }
 
-static struct context *s_ctx = NULL;
+    return s_num_sizes ? 0 : -1;
+}
+
+static void add_target(const char *host, const char *port)
+{
+    struct target *t;
+
+    if (s_num_targets == MAX_TARGETS)
+        die("client: too many targets.");
+    t = &s_targets[s_num_targets++];
+    TEST_Z(t->host = strdup(host));
+    TEST_Z(t->port = strdup(port));
+}
+
+/* One "<address> <port>" per line; blank lines and # comments are skipped. */
+static void read_targets(const char *path)
+{
+    char line[512], host[256], port[32];
+    FILE *f;
+
+    if (!(f = fopen(path, "r")))
+        die("client: cannot open the targets file.");
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%255s %31s", host, port) == 2 && host[0] != '#')
+            add_target(host, port);
+        else if (sscanf(line, "%255s", host) == 1 && host[0] != '#')
+            die("client: targets file lines are <address> <port>.");
+    }
+    fclose(f);
+
+    if (!s_num_targets)
+        die("client: no targets in the targets file.");
+}
 
 int main(int argc, char **argv)
 {
-    addrinfo *addr;
     rdma_cm_event *event = NULL;
-    rdma_cm_id *conn = NULL;
-    rdma_event_channel *ec = NULL;
-
-    if (argc != 3 && argc != 4)
-        die("usage: client <server-address> <server-port> <file>");
+    struct target *t;
+    int opt, i;
 
-    TEST_NZ(getaddrinfo(argv[1], argv[2], NULL, &addr));
+    while ((opt = getopt(argc, argv, "m:r:s:t:eo:i:b:B:T:c:S:W:")) != -1)
+    {
+        if (opt == 'm')
+            s_messages = strtoull(optarg, NULL, 0);
+        else if (opt == 'r')
+            s_recv_depth = atoi(optarg);
+        else if (opt == 's')
+        {
+            if (parse_sizes(optarg))
+                die("client: sizes must be 1 to 1016 bytes, at most 16 of them");
+        }
+        else if (opt == 't')
+            s_duration = atoi(optarg);
+        else if (opt == 'e')
+            s_echo = 1;
+        else if (opt == 'o')
+            s_outstanding = atoi(optarg);
+        else if (opt == 'i')
+            s_max_inline = atoi(optarg);
+        else if (opt == 'b')
+        {
+            s_coalesce = 1;
+            s_coalesce_us = atoi(optarg);
+        }
+        else if (opt == 'B')
+            s_coalesce_bytes = strtoul(optarg, NULL, 0);
+        else if (opt == 'T')
+            read_targets(optarg);
+        else if (opt == 'c')
+            s_parallel = atoi(optarg);
+        else if (opt == 'S')
+            s_sessions = strtoull(optarg, NULL, 0);
+        else if (opt == 'W')
+            s_pool = atoi(optarg);
+        else
+            break;
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (opt != -1 || (s_num_targets ? argc != 1 : (argc != 3 && argc != 4))
+            || s_messages < 1
+            || s_recv_depth < FLOW_MIN_DEPTH || s_recv_depth > FLOW_MAX_DEPTH
+            || s_outstanding < 1 || s_duration < 0 || s_max_inline < 0
+            || s_coalesce_us < 0 || s_parallel < 1 || s_sessions < 1
+            || s_pool < 0)
+        die("usage: client [-m messages | -t seconds] [-r receive depth] [-s size[,size...]]\n"
+            "              [-e [-o outstanding]] [-i max inline bytes, 0 = off]\n"
+            "              [-b coalesce delay us [-B flush bytes]]\n"
+            "              [-c sessions at once per target] [-S sessions per target]\n"
+            "              [-W warm spare connections per target]\n"
+            "              <server-address> <server-port> <file> | -T <targets file>");
+    if (!s_num_sizes)
+        s_sizes[s_num_sizes++] = s_coalesce ?
+                coalesce_max_message() : flow_max_payload();
+    for (i = 0; s_coalesce && i < s_num_sizes; ++i)
+        if (s_sizes[i] > coalesce_max_message())
+            die("client: sizes must be at most 1014 bytes when coalescing");
+
+    rlog_init();
+
+    if (!s_num_targets)
+        add_target(argv[1], argv[2]);
+    for (i = 0; i < s_num_targets; ++i)
+        TEST_NZ(getaddrinfo(s_targets[i].host, s_targets[i].port, NULL,
+                &s_targets[i].addr));
+
+    snprintf(s_payload, sizeof(s_payload),
+            "message from active/client side with pid %d", getpid());
 
-    TEST_Z(ec = rdma_create_event_channel());
-    TEST_NZ(rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP));
-    TEST_NZ(rdma_resolve_addr(conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+    if (s_coalesce)
+        LOG_INFO("coalescing for up to %lld us or %lld bytes\n", s_coalesce_us,
+                s_coalesce_bytes ? s_coalesce_bytes : flow_max_payload());
 
-    freeaddrinfo(addr);
+    /* every target's first sessions go out at once; the CM does the rest */
+    TEST_Z(s_ec = rdma_create_event_channel());
+    s_first_setup_ns = coalesce_now();
+    for (i = 0; i < s_num_targets; ++i)
+    {
+        t = &s_targets[i];
+        t->sessions = s_sessions;
+        while (t->active < s_parallel && t->sessions)
+            start_session(t);
+    }
 
     if (argc == 4)
     {
@@ -81,208 +326,792 @@ int main(int argc, char **argv)
     	fprintf(stdout, "The is %d bye long.\n", (int)fileinfo.st_size);
     }
 
-    while (rdma_get_cm_event(ec, &event) == 0)
+    while (rdma_get_cm_event(s_ec, &event) == 0)
     {
         struct rdma_cm_event event_copy;
 
         memcpy(&event_copy, event, sizeof(*event));
+        /* the private data goes away with the event; it holds the server's depth */
+        if (event->event == RDMA_CM_EVENT_ESTABLISHED
+                && event->param.conn.private_data_len >= sizeof(uint32_t))
+        {
+            struct flow_params params;
+
+            memcpy(&params.depth, event->param.conn.private_data,
+                    sizeof(params.depth));
+            ((struct connection *) event->id->context)->peer_depth =
+                    params.depth;
+        }
         rdma_ack_cm_event(event);
 
         if (on_event(&event_copy))
             break;
     }
 
-    rdma_destroy_event_channel(ec);
+    print_setup_times();
+    if (s_echo && s_responses)
+        print_histogram(s_responses);
+
+    for (i = 0; i < s_num_targets; ++i)
+        freeaddrinfo(s_targets[i].addr);
+    rdma_destroy_event_channel(s_ec);
 
     return 0;
 }
 
 void die(const char *reason)
 {
+    rlog_flush();
     fprintf(stderr, "%s\n", reason);
     exit(EXIT_FAILURE);
 }
 
-void build_context(struct ibv_context *verbs)
+/*
+ * Look up the context for the device an id resolved to, setting up its PD,
+ * CQ and poller the first time the device is seen.
+ */
+struct context * build_context(struct ibv_context *verbs)
 {
-    if (s_ctx)
-    {
-        if (s_ctx->ctx != verbs)
-            die("cannot handle events in more than one context.");
+    struct context *ctx;
+    struct ibv_device_attr attr;
+    struct epoll_event ev;
+    int i;
 
-        return;
-    }
+    for (i = 0; i < s_num_ctx; ++i)
+        if (s_ctx[i]->ctx == verbs)
+            return s_ctx[i];
 
-    s_ctx = (struct context *) malloc(sizeof(struct context));
+    if (s_num_ctx == MAX_CONTEXTS)
+        die("build_context: too many devices.");
 
-    s_ctx->ctx = verbs;
+    TEST_Z(ctx = (struct context *) calloc(1, sizeof(struct context)));
 
-    TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
-    TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
+    ctx->ctx = verbs;
+    TEST_NZ(ibv_query_device(verbs, &attr));
+    ctx->max_cqe = attr.max_cqe;
+    ctx->cqe = 2 * s_recv_depth;        /* every send and receive of one connection */
+
+    TEST_Z(ctx->pd = ibv_alloc_pd(ctx->ctx));
+    TEST_Z(ctx->comp_channel = ibv_create_comp_channel(ctx->ctx));
     TEST_Z(
-            s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
-    TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
+            ctx->cq = ibv_create_cq(ctx->ctx, ctx->cqe, NULL, ctx->comp_channel, 0));
+    TEST_NZ(ibv_req_notify_cq(ctx->cq, 0));
+
+    TEST_NZ(pthread_mutex_init(&ctx->lock, NULL));
+    TEST_Z((ctx->wake_fd = eventfd(0, EFD_NONBLOCK)) >= 0);
+    TEST_Z((ctx->epoll_fd = epoll_create1(0)) >= 0);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    TEST_NZ(epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->comp_channel->fd, &ev));
+    ev.data.ptr = ctx;
+    TEST_NZ(epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ctx->wake_fd, &ev));
+
+    TEST_NZ(pthread_create(&ctx->cq_poller_thread, NULL, poll_cq, ctx));
 
-    TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+    s_ctx[s_num_ctx++] = ctx;
+
+    return ctx;
 }
 
-void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
+/*
+ * Count one more connection on the device and grow its CQ, in powers of
+ * two, if all of their sends and receives could no longer complete at
+ * once. The CQ never shrinks.
+ */
+static void add_connection(struct context *ctx)
+{
+    int need = __atomic_add_fetch(&ctx->num_connections, 1, __ATOMIC_RELAXED)
+            * 2 * s_recv_depth;
+    int cqe = ctx->cqe;
+
+    if (need <= cqe || cqe >= ctx->max_cqe)
+        return;
+    while (cqe < need && cqe < ctx->max_cqe)
+        cqe *= 2;
+    if (cqe > ctx->max_cqe)
+        cqe = ctx->max_cqe;
+
+    if (ibv_resize_cq(ctx->cq, cqe))
+        LOG_WARN("could not grow the CQ to %lld entries\n", cqe);
+    else
+        ctx->cqe = cqe;
+}
+
+void build_qp_attr(struct context *ctx, struct ibv_qp_init_attr *qp_attr)
 {
     memset(qp_attr, 0, sizeof(*qp_attr));
 
-    qp_attr->send_cq = s_ctx->cq;
-    qp_attr->recv_cq = s_ctx->cq;
+    qp_attr->send_cq = ctx->cq;
+    qp_attr->recv_cq = ctx->cq;
     qp_attr->qp_type = IBV_QPT_RC;
 
-    qp_attr->cap.max_send_wr = 10;
-    qp_attr->cap.max_recv_wr = 10;
-    qp_attr->cap.max_send_sge = 1;
+    qp_attr->cap.max_send_wr = s_recv_depth;
+    qp_attr->cap.max_recv_wr = s_recv_depth;
+    qp_attr->cap.max_send_sge = 2;      /* header + payload on inline sends */
+    qp_attr->cap.max_inline_data = s_max_inline;
     qp_attr->cap.max_recv_sge = 1;
 }
 
-void * poll_cq(void *ctx)
+/*
+ * The CM thread is done with <conn>: destroy the QP, handle what the CQ
+ * still holds of it and give everything back. Poller only.
+ */
+static void close_connection(struct connection *conn)
 {
-    struct ibv_cq *cq;
+    struct context *ctx = conn->ctx;
     struct ibv_wc wc;
 
-    while (1)
-    {
-        TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx));
-        ibv_ack_cq_events(cq, 1);
-        TEST_NZ(ibv_req_notify_cq(cq, 0));
+    if (conn->batch.queued)
+        coalesce_unlink(&conn->batch);
+    rdma_destroy_qp(conn->id);
+    while (ibv_poll_cq(ctx->cq, 1, &wc))
+        on_completion(&wc);
+    __atomic_sub_fetch(&ctx->num_connections, 1, __ATOMIC_RELAXED);
+
+    ibv_dereg_mr(conn->mr);
+    free(conn->rings);
+    free(conn->stamps);
+    rdma_destroy_id(conn->id);
+    free(conn);
+}
 
-        while (ibv_poll_cq(cq, 1, &wc))
-            on_completion(&wc);
-    }
+/*
+ * Begin the sessions the CM thread queued on <ctx> and tear down the
+ * connections it gave up. A connection may be on both lists if it went
+ * before its session began. Poller only.
+ */
+static void take_handoffs(struct context *ctx)
+{
+    struct connection *conn, *next, *gone;
+    uint64_t n;
 
-    return NULL;
+    if (read(ctx->wake_fd, &n, sizeof(n)) != sizeof(n))
+        return;
+    pthread_mutex_lock(&ctx->lock);
+    conn = ctx->starts;
+    ctx->starts = NULL;
+    gone = ctx->gone;
+    ctx->gone = NULL;
+    pthread_mutex_unlock(&ctx->lock);
+
+    for (next = gone; next; next = next->next_gone)
+        next->gone = 1;
+    for (; conn; conn = next)
+    {
+        next = conn->next_start;
+        if (!conn->gone)
+            begin_session(conn);
+    }
+    for (conn = gone; conn; conn = next)
+    {
+        next = conn->next_gone;
+        close_connection(conn);
+    }
 }
 
-void post_receives(struct connection *conn)
+void * poll_cq(void *arg)
 {
-    struct ibv_recv_wr wr, *bad_wr = NULL;
-    struct ibv_sge sge;
+    struct context *ctx = (struct context *) arg;
+    struct ibv_cq *cq;
+    struct ibv_wc wc;
+    struct epoll_event evs[2];
+    void *cq_context;
+    unsigned long long now = 0, next;
+    int r, i, n;
 
-    wr.wr_id = (uintptr_t) conn;
-    wr.next = NULL;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
+    /* batch deadlines are a few microseconds away */
+    prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
 
-    sge.addr = (uintptr_t) conn->recv_region;
-    sge.length = BUFFER_SIZE;
-    sge.lkey = conn->recv_mr->lkey;
+    while (1)
+    {
+        next = 0;
+        if (ctx->due.head)
+        {
+            now = coalesce_now();
+            TEST_NZ(coalesce_run(&ctx->due, now, &next));
+        }
+        TEST_Z((r = coalesce_poll(ctx->epoll_fd, now, next)) >= 0);
+        if (!r)
+            continue;
+
+        TEST_Z((n = epoll_wait(ctx->epoll_fd, evs, 2, 0)) >= 0);
+        for (i = 0; i < n; ++i)
+        {
+            if (evs[i].data.ptr)
+            {
+                take_handoffs(ctx);
+                continue;
+            }
+
+            TEST_NZ(ibv_get_cq_event(ctx->comp_channel, &cq, &cq_context));
+            ibv_ack_cq_events(cq, 1);
+            TEST_NZ(ibv_req_notify_cq(cq, 0));
+
+            while (ibv_poll_cq(cq, 1, &wc))
+                on_completion(&wc);
+        }
+    }
 
-    TEST_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr));
+    return NULL;
 }
 
+
 void register_memory(struct connection *conn)
 {
-    conn->send_region = (char*) malloc(BUFFER_SIZE);
-    conn->recv_region = (char*) malloc(BUFFER_SIZE);
+    size_t size = 2 * flow_ring_size(s_recv_depth);
 
-    TEST_Z(
-            conn->send_mr = ibv_reg_mr(s_ctx->pd, conn->send_region,
-                    BUFFER_SIZE,
-                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    TEST_Z(conn->rings = (char*) malloc(size));
 
     TEST_Z(
-            conn->recv_mr = ibv_reg_mr(s_ctx->pd, conn->recv_region,
-                    BUFFER_SIZE,
+            conn->mr = ibv_reg_mr(conn->ctx->pd, conn->rings, size,
                     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
 }
 
 int on_addr_resolved(struct rdma_cm_id *id)
 {
     struct ibv_qp_init_attr qp_attr;
-    struct connection *conn;
-
-    printf("address resolved.\n");
+    struct context *ctx;
+    struct connection *conn = (struct connection *) id->context;
 
-    build_context(id->verbs);
-    build_qp_attr(&qp_attr);
+    LOG_TEXT(LOG_LEVEL_INFO, "address resolved to %s.\n",
+            ibv_get_device_name(id->verbs->device));
+    conn->addr_ns = coalesce_now() - conn->setup_ns;
 
-    TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
+    ctx = build_context(id->verbs);
+    add_connection(ctx);
+    build_qp_attr(ctx, &qp_attr);
 
-    id->context = conn = (struct connection *) malloc(
-            sizeof(struct connection));
+    if (rdma_create_qp(id, ctx->pd, &qp_attr))
+    {
+        /* the device may not do this much inline; do without */
+        qp_attr.cap.max_inline_data = 0;
+        if (rdma_create_qp(id, ctx->pd, &qp_attr))
+        {
+            __atomic_sub_fetch(&ctx->num_connections, 1, __ATOMIC_RELAXED);
+            return on_connect_error(id, "cannot create a QP");
+        }
+    }
 
-    conn->id = id;
+    /* from here on the poller has to take it down */
+    conn->state = CONN_RESOLVING_ROUTE;
+    conn->ctx = ctx;
     conn->qp = id->qp;
-    conn->num_completions = 0;
+    conn->peer_depth = 0;
+    conn->to_send = 0;          /* until a session has it */
+    conn->msgs_sent = 0;
+    conn->bytes_sent = 0;
+    conn->disconnecting = 0;
+    conn->requests = 0;
+    conn->responses = 0;
+    TEST_Z(conn->stamps = (unsigned long long *) calloc(s_outstanding,
+            sizeof(*conn->stamps)));
 
     register_memory(conn);
-    post_receives(conn);
-
-    TEST_NZ(rdma_resolve_route(id, TIMEOUT_IN_MS));
+    coalesce_init(&conn->batch, &conn->flow, &ctx->due, s_coalesce_bytes,
+            s_coalesce_us * 1000ULL);
+    conn->records = 0;
+    if (flow_init(&conn->flow, conn->qp, conn->mr->lkey, (uintptr_t) conn,
+            qp_attr.cap.max_inline_data, conn->rings,
+            conn->rings + flow_ring_size(s_recv_depth), s_recv_depth))
+        return on_connect_error(id, "cannot post the receives");
+    LOG_INFO("inline sends up to %lld bytes\n", conn->flow.max_inline);
+
+    if (rdma_resolve_route(id, TIMEOUT_IN_MS))
+        return on_connect_error(id, "cannot resolve the route");
 
     return 0;
 }
 
+static unsigned long long now_ns(void)
+{
+    return coalesce_now();
+}
+
+static int hist_bucket(unsigned long long ns)
+{
+    int msb = 63 - __builtin_clzll(ns | 1);
+
+    if (msb < HIST_SUB_BITS)
+        return ns;
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+            + ((ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* Smallest latency that falls in bucket <b>. */
+static unsigned long long hist_lower(int b)
+{
+    int exp = b >> HIST_SUB_BITS;
+    int sub = b & ((1 << HIST_SUB_BITS) - 1);
+
+    if (!exp)
+        return sub;
+    return (unsigned long long) ((1 << HIST_SUB_BITS) + sub) << (exp - 1);
+}
+
+static void hist_add(unsigned long long ns)
+{
+    ++s_hist[hist_bucket(ns)];
+    s_lat_sum += ns;
+    if (ns < s_lat_min)
+        s_lat_min = ns;
+    if (ns > s_lat_max)
+        s_lat_max = ns;
+}
+
+static unsigned long long hist_percentile(unsigned long long count, double pct)
+{
+    unsigned long long want = (unsigned long long) (count * pct / 100) + 1;
+    unsigned long long seen = 0;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; ++b)
+        if ((seen += s_hist[b]) >= want)
+            return hist_lower(b + 1) < s_lat_max ? hist_lower(b + 1) : s_lat_max;
+    return s_lat_max;
+}
+
+/* One row per power of two between the fastest and slowest reply. */
+static void print_histogram(unsigned long long count)
+{
+    unsigned long long rows[64] = { 0 }, peak = 0;
+    int b, row, first = 64, last = 0;
+
+    for (b = 0; b < HIST_BUCKETS; ++b)
+    {
+        if (!s_hist[b])
+            continue;
+        row = 63 - __builtin_clzll(hist_lower(b) | 1);
+        rows[row] += s_hist[b];
+        if (row < first)
+            first = row;
+        if (row > last)
+            last = row;
+    }
+    for (row = first; row <= last; ++row)
+        if (rows[row] > peak)
+            peak = rows[row];
+
+    printf("latency: min %.2f avg %.2f p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f us\n",
+            s_lat_min / 1e3, (double) s_lat_sum / count / 1e3,
+            hist_percentile(count, 50) / 1e3, hist_percentile(count, 90) / 1e3,
+            hist_percentile(count, 99) / 1e3, hist_percentile(count, 99.9) / 1e3,
+            s_lat_max / 1e3);
+    for (row = first; row <= last; ++row)
+        printf("  %10.2f - %10.2f us %10llu %.*s\n",
+                (1ULL << row) / 1e3, (2ULL << row) / 1e3, rows[row],
+                (int) (rows[row] * 50 / peak),
+                "##################################################");
+}
+
+/*
+ * Post the next data message, or add it to the batch when coalescing,
+ * stamping it in echo mode. Returns 1 if it was taken, 0 if the credit
+ * window or the outstanding limit is full.
+ */
+static int send_next(struct connection *conn)
+{
+    uint32_t size = s_sizes[conn->msgs_sent % s_num_sizes];
+    unsigned long long now = 0;
+    int r;
+
+    if (s_echo && conn->requests - conn->responses == (unsigned) s_outstanding)
+        return 0;
+
+    if (s_echo || s_coalesce)
+        now = now_ns();
+    if (s_echo)
+        conn->stamps[conn->requests % s_outstanding] = now;
+    if (!s_coalesce)
+        r = flow_send(&conn->flow, s_payload, size);
+    else if (!conn->msgs_sent)
+        r = coalesce_send_now(&conn->batch, s_payload, size);
+    else
+        r = coalesce_push(&conn->batch, s_payload, size, now);
+    TEST_Z(r >= 0);
+    if (r)
+    {
+        --conn->to_send;
+        ++conn->msgs_sent;
+        conn->bytes_sent += size;
+        conn->requests += s_echo;
+    }
+
+    return r;
+}
+
+/*
+ * Send as much as the credit window allows and hand back reposted receive
+ * slots. Once every message is out (and, in echo mode, answered) or the
+ * time is up, and the server has said something, hang up.
+ */
+void pump(struct connection *conn)
+{
+    if (s_duration && conn->to_send && now_ns() >= conn->deadline_ns)
+        conn->to_send = 0;
+
+    while (conn->to_send && send_next(conn))
+        ;
+    /* nothing more can join the batch before a reply comes back */
+    if (s_coalesce && conn->batch.count && (!conn->to_send || (s_echo
+            && conn->requests - conn->responses == (unsigned) s_outstanding)))
+        TEST_Z(coalesce_flush(&conn->batch, now_ns()) >= 0);
+    TEST_Z(flow_return_credits(&conn->flow) >= 0);
+
+    if (conn->running && !conn->to_send && !conn->disconnecting
+            && !conn->batch.count
+            && conn->flow.send_done == conn->flow.send_posted
+            && conn->flow.msgs_received
+            && conn->responses == conn->requests)
+    {
+        conn->end_ns = now_ns();
+        conn->disconnecting = 1;
+        rdma_disconnect(conn->id);
+    }
+}
+
 void on_completion(struct ibv_wc *wc)
 {
     struct connection *conn = (struct connection *) (uintptr_t) wc->wr_id;
+    struct msg_hdr *msg;
+    const char *data;
+    uint32_t off = 0;
+    uint16_t len;
+
+    /* receives still posted when the QP is torn down */
+    if (wc->status == IBV_WC_WR_FLUSH_ERR || conn->gone || conn->broken)
+        return;
 
-    if (wc->status != IBV_WC_SUCCESS)
-        die("on_completion: status is not IBV_WC_SUCCESS.");
+    /* one bad server ends its own session, not the run */
+    if (wc->status != IBV_WC_SUCCESS
+            || ((wc->opcode & IBV_WC_RECV)
+                    && (!flow_recv_ok(&conn->flow, wc->byte_len)
+                            || !(msg = flow_on_recv(&conn->flow)))))
+    {
+        fprintf(stderr, "%s:%s: %s, disconnecting\n", conn->target->host,
+                conn->target->port, wc->status != IBV_WC_SUCCESS ?
+                        ibv_wc_status_str(wc->status) : "malformed message");
+        conn->broken = 1;
+        rdma_disconnect(conn->id);
+        return;
+    }
 
     if (wc->opcode & IBV_WC_RECV)
-        printf("received message: %s\n", conn->recv_region);
+    {
+        if (msg->len && s_coalesce)
+        {
+            while ((data = coalesce_next(msg, &off, &len)))
+            {
+                ++conn->records;
+                if (s_echo)
+                    hist_add(now_ns() - conn->stamps[conn->responses++ % s_outstanding]);
+                else
+                    LOG_TEXT(LOG_LEVEL_INFO, "received message: %s\n", data);
+            }
+        }
+        else if (msg->len && s_echo)
+            hist_add(now_ns() - conn->stamps[conn->responses++ % s_outstanding]);
+        else if (msg->len)
+            LOG_TEXT(LOG_LEVEL_INFO, "received message: %s\n",
+                    (char *) (msg + 1));
+    }
     else if (wc->opcode == IBV_WC_SEND)
-        printf("send completed successfully.\n");
+    {
+        LOG_DEBUG("send completed successfully.\n");
+        flow_on_send(&conn->flow);
+    }
     else
         die("on_completion: completion isn't a send or a receive.");
 
-    if (++conn->num_completions == 2)
-        rdma_disconnect(conn->id);
+    pump(conn);
+}
+
+/* Set up <t>'s next connection, for a session or as a spare. */
+static struct connection * start_connect(struct target *t, int session)
+{
+    struct connection *conn;
+
+    TEST_Z(conn = (struct connection *) calloc(1, sizeof(struct connection)));
+    conn->target = t;
+    conn->session = session;
+    conn->state = CONN_RESOLVING_ADDR;
+    conn->setup_ns = now_ns();
+    TEST_NZ(rdma_create_id(s_ec, &conn->id, conn, RDMA_PS_TCP));
+    TEST_NZ(rdma_resolve_addr(conn->id, NULL, t->addr->ai_addr, TIMEOUT_IN_MS));
+    ++s_live;
+
+    return conn;
+}
+
+/*
+ * Start sending on an established connection, on the poller. Only the
+ * first message goes out from here; the rest follow as completions and
+ * the server's credits come back.
+ */
+void begin_session(struct connection *conn)
+{
+    LOG_INFO("connected. posting send...\n");
+
+    conn->running = 1;
+    conn->to_send = s_duration ? ~0ULL : s_messages;
+    conn->start_ns = now_ns();
+    conn->deadline_ns = conn->start_ns + s_duration * 1000000000ULL;
+    TEST_Z(send_next(conn));
+}
+
+/*
+ * Hand an established session connection to its poller, which may be in
+ * pump() for it already on returned credits.
+ */
+static void queue_start(struct connection *conn)
+{
+    struct context *ctx = conn->ctx;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&ctx->lock);
+    conn->next_start = ctx->starts;
+    ctx->starts = conn;
+    pthread_mutex_unlock(&ctx->lock);
+    TEST_Z(write(ctx->wake_fd, &one, sizeof(one)) == sizeof(one));
+}
+
+/*
+ * Run the next session against <t>: on a spare from the warm pool
+ * if there is one, else on a connection set up for it now. Then top the
+ * pool up again, but never beyond the sessions still to come.
+ */
+void start_session(struct target *t)
+{
+    struct connection *conn;
+
+    --t->sessions;
+    ++t->active;
+
+    if ((conn = t->pool))
+    {
+        t->pool = conn->next;
+        conn->next = NULL;
+        conn->session = 1;
+        --t->pooled;
+        ++s_pool_hits;
+        queue_start(conn);
+    }
+    else
+    {
+        s_pool_misses += s_pool > 0;
+        start_connect(t, 1);
+    }
+
+    while (t->pooled < s_pool && (unsigned long long) t->pooled < t->sessions)
+    {
+        ++t->pooled;
+        start_connect(t, 0);
+    }
+}
+
+/* A session is over: run the next one, or close the spares after the last. */
+static void end_session(struct target *t)
+{
+    struct connection *conn;
+
+    --t->active;
+    if (t->sessions)
+        start_session(t);
+    else if (!t->active)
+        for (conn = t->pool; conn; conn = conn->next)
+            rdma_disconnect(conn->id);
+}
+
+static void record_setup(unsigned long long ns)
+{
+    if (s_num_setups == s_max_setups)
+    {
+        s_max_setups = s_max_setups ? 2 * s_max_setups : 64;
+        TEST_Z(s_setup_times = (unsigned long long *) realloc(s_setup_times,
+                s_max_setups * sizeof(*s_setup_times)));
+    }
+    s_setup_times[s_num_setups++] = ns;
 }
 
 int on_connection(void *context)
 {
     struct connection *conn = (struct connection *) context;
-    struct ibv_send_wr wr, *bad_wr = NULL;
-    struct ibv_sge sge;
+    struct target *t = conn->target;
 
-    snprintf(conn->send_region, BUFFER_SIZE,
-            "message from active/client side with pid %d", getpid());
+    /* failed once the disconnect is through; on_disconnect() sees to it */
+    if (!conn->peer_depth)
+    {
+        conn->failed = "the server did not send its receive depth";
+        rdma_disconnect(conn->id);
+        return 0;
+    }
+    flow_set_peer_depth(&conn->flow, conn->peer_depth);
+
+    conn->state = CONN_ESTABLISHED;
+    s_last_established_ns = now_ns();
+    conn->established_ns = s_last_established_ns - conn->setup_ns;
+    record_setup(conn->established_ns);
+    printf("%s:%s connected in %.1f us: address %.1f, route %.1f, connect %.1f%s\n",
+            t->host, t->port, conn->established_ns / 1e3, conn->addr_ns / 1e3,
+            (conn->route_ns - conn->addr_ns) / 1e3,
+            (conn->established_ns - conn->route_ns) / 1e3,
+            conn->session ? "" : " (spare)");
+
+    if (conn->session)
+    {
+        queue_start(conn);
+        return 0;
+    }
+
+    /* a spare nobody is left to take */
+    if (!t->sessions && !t->active)
+    {
+        rdma_disconnect(conn->id);
+        return 0;
+    }
+    /* ready as it is: the server only greets once a session has sent */
+    conn->next = t->pool;
+    t->pool = conn;
 
-    printf("connected. posting send...\n");
+    return 0;
+}
 
-    memset(&wr, 0, sizeof(wr));
+void print_rate(struct connection *conn)
+{
+    double secs = (conn->end_ns - conn->start_ns) / 1e9;
 
-    wr.wr_id = (uintptr_t) conn;
-    wr.opcode = IBV_WR_SEND;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-    wr.send_flags = IBV_SEND_SIGNALED;
+    if (!conn->disconnecting || secs <= 0)
+        return;
 
-    sge.addr = (uintptr_t) conn->send_region;
-    sge.length = BUFFER_SIZE;
-    sge.lkey = conn->send_mr->lkey;
+    if (!s_echo)
+        printf("sent %llu messages in %.3f s: %.0f msg/s, %.2f MB/s\n",
+                conn->msgs_sent, secs, conn->msgs_sent / secs,
+                conn->bytes_sent / secs / 0x100000);
+    else
+        printf("%llu requests, %d outstanding, in %.3f s: %.0f req/s, %.2f MB/s each way\n",
+                conn->responses, s_outstanding, secs, conn->responses / secs,
+                conn->bytes_sent / secs / 0x100000);
 
-    TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+    if (s_coalesce && conn->batch.batches)
+        printf("coalescing: %.1f messages per batch out, %.1f in, %.2f us added per message out\n",
+                (double) conn->batch.msgs / conn->batch.batches,
+                conn->flow.msgs_received ?
+                        (double) conn->records / conn->flow.msgs_received : 0.0,
+                conn->batch.wait_ns / 1e3 / conn->batch.msgs);
 
-    return 0;
 }
 
+static int compare_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Setup times over every connection that came up, spares included. */
+static void print_setup_times(void)
+{
+    int n = s_num_setups;
+    unsigned long long sum = 0;
+    int i;
+
+    if (!n)
+    {
+        printf("setup: no connection came up, %d failed\n", s_failed);
+        return;
+    }
+    qsort(s_setup_times, n, sizeof(*s_setup_times), compare_ull);
+    for (i = 0; i < n; ++i)
+        sum += s_setup_times[i];
+
+    printf("setup: %d connection(s) to %d target(s), %d failed, the last up %.3f ms after the first started\n",
+            n, s_num_targets, s_failed,
+            (s_last_established_ns - s_first_setup_ns) / 1e6);
+    printf("setup: avg %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f us\n",
+            (double) sum / n / 1e3, s_setup_times[n / 2] / 1e3,
+            s_setup_times[n * 9 / 10] / 1e3, s_setup_times[n * 99 / 100] / 1e3,
+            s_setup_times[n - 1] / 1e3);
+    if (s_pool)
+        printf("warm pool: %llu session(s) on a spare, %llu connected on demand\n",
+                s_pool_hits, s_pool_misses);
+}
+
+/*
+ * The CM thread is done with <conn>. Once it has a QP the poller may be in
+ * pump() for it, or have it queued to start, so it is handed over to be
+ * torn down there; the CM thread must not touch it afterwards.
+ */
+static void release_connection(struct connection *conn)
+{
+    struct context *ctx = conn->ctx;
+    uint64_t one = 1;
+
+    if (conn->state < CONN_RESOLVING_ROUTE)
+    {
+        rdma_destroy_id(conn->id);
+        free(conn);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    conn->next_gone = ctx->gone;
+    ctx->gone = conn;
+    pthread_mutex_unlock(&ctx->lock);
+    TEST_Z(write(ctx->wake_fd, &one, sizeof(one)) == sizeof(one));
+}
+
+/* Returns 1 to leave the event loop once no connection is left. */
 int on_disconnect(struct rdma_cm_id *id)
 {
     struct connection *conn = (struct connection *) id->context;
+    struct target *t = conn->target;
+    struct connection **p;
 
-    printf("disconnected.\n");
+    if (conn->failed)
+        return on_connect_error(id, conn->failed);
 
-    rdma_destroy_qp(id);
+    LOG_INFO("disconnected.\n");
 
-    ibv_dereg_mr(conn->send_mr);
-    ibv_dereg_mr(conn->recv_mr);
+    print_rate(conn);
+    s_responses += conn->responses;
 
-    free(conn->send_region);
-    free(conn->recv_region);
+    if (conn->session)
+        end_session(t);
+    else
+    {
+        /* a spare, closed at the end or by the server */
+        for (p = &t->pool; *p && *p != conn; p = &(*p)->next)
+            ;
+        if (*p)
+            *p = conn->next;
+        --t->pooled;
+    }
+    release_connection(conn);
 
-    free(conn);
+    return !--s_live;
+}
 
-    rdma_destroy_id(id);
+/*
+ * A connection failed on its way up. Sessions are not retried: the next
+ * one is started instead, so a dead target cannot hold the run up.
+ */
+int on_connect_error(struct rdma_cm_id *id, const char *why)
+{
+    static const char *steps[] = { "resolving the address",
+            "resolving the route", "connecting", "connected" };
+    struct connection *conn = (struct connection *) id->context;
+    struct target *t = conn->target;
 
-    return 1; /* exit event loop */
+    printf("%s:%s: %s while %s\n", t->host, t->port, why, steps[conn->state]);
+    ++s_failed;
+
+    if (conn->session)
+        end_session(t);
+    else
+        --t->pooled;
+    release_connection(conn);
+
+    return !--s_live;
 }
 
 int on_event(struct rdma_cm_event *event)
@@ -297,6 +1126,14 @@ int on_event(struct rdma_cm_event *event)
         r = on_connection(event->id->context);
     else if (event->event == RDMA_CM_EVENT_DISCONNECTED)
         r = on_disconnect(event->id);
+    else if (event->event == RDMA_CM_EVENT_ADDR_ERROR
+            || event->event == RDMA_CM_EVENT_ROUTE_ERROR
+            || event->event == RDMA_CM_EVENT_CONNECT_ERROR
+            || event->event == RDMA_CM_EVENT_UNREACHABLE
+            || event->event == RDMA_CM_EVENT_REJECTED)
+        r = on_connect_error(event->id, rdma_event_str(event->event));
+    else if (event->event == RDMA_CM_EVENT_TIMEWAIT_EXIT)
+        ; /* an id the poller hasn't destroyed yet; it may have by now */
     else
         die("on_event: unknown event.");
 
@@ -306,11 +1143,25 @@ int on_event(struct rdma_cm_event *event)
 int on_route_resolved(struct rdma_cm_id *id)
 {
     struct rdma_conn_param cm_params;
+    struct flow_params params;
+
+    struct connection *conn = (struct connection *) id->context;
+
+    LOG_INFO("route resolved.\n");
+    conn->route_ns = now_ns() - conn->setup_ns;
+    conn->state = CONN_CONNECTING;
 
-    printf("route resolved.\n");
+    memset(&params, 0, sizeof(params));
+    params.depth = s_recv_depth;
+    params.flags = (s_echo ? FLOW_ECHO : 0) | (s_max_inline ? 0 : FLOW_NO_INLINE)
+            | (s_coalesce ? FLOW_COALESCE : 0);
+    params.coalesce_us = s_coalesce_us;
 
     memset(&cm_params, 0, sizeof(cm_params));
-    TEST_NZ(rdma_connect(id, &cm_params));
+    cm_params.private_data = &params;
+    cm_params.private_data_len = sizeof(params);
+    if (rdma_connect(id, &cm_params))
+        return on_connect_error(id, "cannot connect");
 
     return 0;
 }
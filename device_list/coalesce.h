@@ -0,0 +1,261 @@
+/*
+ * coalesce.h - pack small application messages into one credit_flow send,
+ * shared by client_rdma and server_rdma.
+ *
+ * Messages pushed into a coalescer are appended to a batch as records of
+ * a 16-bit length followed by the bytes. The batch goes out as a single
+ * data message, so one WR and one completion on each side, once it holds
+ * <limit> bytes or once its oldest message has waited <delay> ns. The
+ * receiver walks the records with coalesce_next().
+ *
+ * Coalescers with a non-empty batch sit on their poller's coalesce_queue.
+ * Every coalescer on a queue uses the same delay, so the queue is in
+ * deadline order and only its head decides how long the poller may sleep.
+ * A poller loop calls coalesce_run() and then sleeps in coalesce_poll().
+ *
+ * A batch that is due but has no send credit simply stays queued and
+ * keeps growing; it goes out on the first coalesce_run() after credits
+ * come back. Like credit_flow, everything here belongs to the poller
+ * thread of the connection, except coalesce_send_now().
+ */
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "credit_flow.h"
+
+static const int COALESCE_DEFAULT_DELAY_US = 20;
+
+struct coalescer;
+
+struct coalesce_queue
+{
+    struct coalescer *head;
+    struct coalescer *tail;
+};
+
+struct coalescer
+{
+    struct credit_flow *flow;
+    struct coalesce_queue *queue;
+    struct coalescer *prev;
+    struct coalescer *next;
+    int queued;
+
+    uint32_t limit;             /* flush once the batch holds this many bytes */
+    unsigned long long delay_ns;
+
+    char batch[FLOW_SLOT_SIZE];
+    uint32_t used;
+    uint32_t count;
+    unsigned long long first_ns;        /* when the oldest message was pushed */
+    unsigned long long push_ns_sum;
+
+    unsigned long long batches;
+    unsigned long long msgs;
+    unsigned long long wait_ns;         /* summed over msgs, push to post */
+};
+
+static inline unsigned long long coalesce_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Largest message that fits in a batch on its own. */
+static inline uint32_t coalesce_max_message(void)
+{
+    return flow_max_payload() - sizeof(uint16_t);
+}
+
+/* <limit> of 0 or past the payload size means a full batch. */
+static inline void coalesce_init(struct coalescer *c, struct credit_flow *flow,
+        struct coalesce_queue *queue, uint32_t limit, unsigned long long delay_ns)
+{
+    memset(c, 0, sizeof(*c));
+    c->flow = flow;
+    c->queue = queue;
+    c->limit = limit && limit < flow_max_payload() ? limit : flow_max_payload();
+    c->delay_ns = delay_ns;
+}
+
+static inline void coalesce_unlink(struct coalescer *c)
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        c->queue->head = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    else
+        c->queue->tail = c->prev;
+    c->prev = c->next = 0;
+    c->queued = 0;
+}
+
+/*
+ * Post the batch if there is one. Returns 1 if the coalescer is empty
+ * afterwards, 0 if there was no send credit, -1 on error.
+ */
+static inline int coalesce_flush(struct coalescer *c, unsigned long long now)
+{
+    int r;
+
+    if (!c->count)
+        return 1;
+    if ((r = flow_send(c->flow, c->batch, c->used)) <= 0)
+        return r;
+
+    ++c->batches;
+    c->msgs += c->count;
+    c->wait_ns += c->count * now - c->push_ns_sum;
+    c->used = 0;
+    c->count = 0;
+    c->push_ns_sum = 0;
+    if (c->queued)
+        coalesce_unlink(c);
+
+    return 1;
+}
+
+/*
+ * Add a message of at most coalesce_max_message() bytes. A batch it does
+ * not fit in is flushed first. Returns 1 if the message was taken, 0 if
+ * that flush had no credit, -1 on error.
+ */
+static inline int coalesce_push(struct coalescer *c, const void *data,
+        uint16_t len, unsigned long long now)
+{
+    int r;
+
+    if (c->used + sizeof(len) + len > flow_max_payload()
+            && (r = coalesce_flush(c, now)) <= 0)
+        return r;
+
+    memcpy(c->batch + c->used, &len, sizeof(len));
+    memcpy(c->batch + c->used + sizeof(len), data, len);
+    c->used += sizeof(len) + len;
+    c->push_ns_sum += now;
+    if (!c->count++)
+    {
+        c->first_ns = now;
+        c->prev = c->queue->tail;
+        if (c->prev)
+            c->prev->next = c;
+        else
+            c->queue->head = c;
+        c->queue->tail = c;
+        c->queued = 1;
+    }
+
+    if (c->used >= c->limit)
+        return coalesce_flush(c, now) < 0 ? -1 : 1;
+
+    return 1;
+}
+
+/*
+ * Send one message as a batch of its own right away, bypassing the queue,
+ * for a thread other than the poller kicking a connection off. The
+ * coalescer must be empty.
+ */
+static inline int coalesce_send_now(struct coalescer *c, const void *data,
+        uint16_t len)
+{
+    char batch[FLOW_SLOT_SIZE];
+
+    memcpy(batch, &len, sizeof(len));
+    memcpy(batch + sizeof(len), data, len);
+
+    /* counted first: the poller owns c once the send is posted */
+    ++c->batches;
+    ++c->msgs;
+
+    return flow_send(c->flow, batch, sizeof(len) + len);
+}
+
+/*
+ * Flush every due batch that has credit. Sets *next to the deadline of
+ * the first batch not due yet, 0 if there is none. Returns 0, or -1 on
+ * error.
+ */
+static inline int coalesce_run(struct coalesce_queue *queue,
+        unsigned long long now, unsigned long long *next)
+{
+    struct coalescer *c = queue->head, *after;
+
+    *next = 0;
+    for (; c; c = after)
+    {
+        after = c->next;
+        if (now - c->first_ns < c->delay_ns)
+        {
+            *next = c->first_ns + c->delay_ns;
+            break;
+        }
+        if (coalesce_flush(c, now) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for <fd> (a completion channel) to become readable, but only until
+ * <next> as set by coalesce_run(), 0 meaning no limit. Returns 1 if fd is
+ * readable, 0 on timeout, -1 on error. Pollers should lower their timer
+ * slack, or the kernel rounds these short sleeps up by 50 us.
+ */
+static inline int coalesce_poll(int fd, unsigned long long now,
+        unsigned long long next)
+{
+    struct pollfd pfd;
+    struct timespec ts;
+    int r;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (next)
+    {
+        ts.tv_sec = (next - now) / 1000000000ULL;
+        ts.tv_nsec = (next - now) % 1000000000ULL;
+    }
+
+    r = ppoll(&pfd, 1, next ? &ts : 0, 0);
+    if (r < 0 && errno == EINTR)
+        return 0;
+    return r;
+}
+
+/*
+ * Walk the records of a received batch. Start with *off = 0; returns the
+ * next message and its length, or 0 at the end of the batch (or at a
+ * record that runs past it).
+ */
+static inline const char * coalesce_next(const struct msg_hdr *msg,
+        uint32_t *off, uint16_t *len)
+{
+    const char *p = (const char *) (msg + 1) + *off;
+    uint16_t n;
+
+    if (*off + sizeof(n) > msg->len)
+        return 0;
+    memcpy(&n, p, sizeof(n));
+    if (*off + sizeof(n) + n > msg->len)
+        return 0;
+
+    *len = n;
+    *off += sizeof(n) + n;
+
+    return p + sizeof(n);
+}
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ * credit_flow.h - receive rings and credit-based flow control for one
+ * RC connection, shared by client_rdma and server_rdma.
+ *
+ * Each side keeps <depth> receives posted out of a ring of FLOW_SLOT_SIZE
+ * slots and has a matching ring of send slots. Every message starts with
+ * a msg_hdr whose credits field returns receive slots the sender has
+ * reposted since its last message. A side may only send while it holds
+ * credits for the peer, so the peer always has a receive posted and RNR
+ * retries never happen. The initial credit count is the peer's depth,
+ * exchanged in the CM private data as struct flow_params.
+ *
+ * Messages no bigger than the QP's inline limit are posted with
+ * IBV_SEND_INLINE straight from the caller's buffer: the header and
+ * payload go into the WQE as two SGEs, so there is no copy into the send
+ * ring and the HCA does not have to DMA-read it. The QP therefore needs
+ * max_send_sge >= 2.
+ *
+ * Receives and sends on an RC QP complete in order, so slots are found
+ * by counting completions rather than encoding them in wr_id.
+ *
+ * One credit is kept back for credit-only messages; without it both
+ * sides could spend their last credit on data and then wait for each
+ * other forever. Credit-only messages go out when a batch of slots used
+ * by data is ready to return, or when the peer is down to its reserve.
+ * Slots used by credit-only messages are otherwise left to ride on the
+ * next message, or the two sides would bounce credits back and forth.
+ *
+ * A side that copies a message aside to deal with later can hold its
+ * credit back with flow_hold() until flow_release(), so the peer can never
+ * have more messages outstanding than the side has room to keep.
+ *
+ * All functions must be called from one thread per connection, normally
+ * the CQ poller. A send may also be posted from another thread as long as
+ * that thread leaves the connection alone afterwards.
+ */
+#ifndef CREDIT_FLOW_H
+#define CREDIT_FLOW_H
+
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <string.h>
+
+static const int FLOW_SLOT_SIZE = 1024;
+static const int FLOW_MIN_DEPTH = 4;
+static const int FLOW_DEFAULT_DEPTH = 32;
+static const int FLOW_MAX_DEPTH = 4096;
+static const int FLOW_DEFAULT_INLINE = 256;
+
+/* Sent in the CM private data by both sides. */
+struct flow_params
+{
+    uint32_t depth;             /* receive ring depth, the peer's first credits */
+    uint32_t flags;             /* FLOW_* from the client, 0 from the server */
+    uint32_t coalesce_us;       /* FLOW_COALESCE: longest the client's messages wait */
+};
+
+/* Client asks the server to send every data message straight back. */
+static const uint32_t FLOW_ECHO = 1;
+/* Client asks the server not to use inline sends, for A/B comparisons. */
+static const uint32_t FLOW_NO_INLINE = 2;
+/* Client asks for data messages both ways to be batches (see coalesce.h). */
+static const uint32_t FLOW_COALESCE = 4;
+
+struct msg_hdr
+{
+    uint32_t credits;           /* receive slots freed since the last message */
+    uint32_t len;               /* payload bytes after the header, 0 = credits only */
+};
+
+struct credit_flow
+{
+    struct ibv_qp *qp;
+    uint32_t lkey;
+    uint64_t wr_id;
+    uint32_t max_inline;        /* bytes, header included; 0 = never inline */
+    char *send_ring;
+    char *recv_ring;
+    int depth;
+    int batch;
+
+    unsigned int recv_done;     /* receives completed */
+    int to_repost;              /* completed, not yet posted again */
+    int to_return;              /* posted again, not yet advertised to the peer */
+    int held;                   /* received, credit kept back (flow_hold) */
+    unsigned int returned;      /* advertised so far */
+    int owed;                   /* data arrived since our last send */
+
+    unsigned int send_posted;
+    unsigned int send_done;
+    int credits;                /* receives the peer has posted for us */
+
+    unsigned long long msgs_sent;
+    unsigned long long msgs_received;
+};
+
+/* Ring bytes needed for one direction of a connection with <depth> slots. */
+static inline size_t flow_ring_size(int depth)
+{
+    return (size_t) depth * FLOW_SLOT_SIZE;
+}
+
+static inline int flow_post_recvs(struct credit_flow *flow, unsigned int first,
+        int n)
+{
+    struct ibv_recv_wr wr[64], *bad_wr = 0;
+    struct ibv_sge sge[64];
+    int i, chunk;
+
+    while (n > 0)
+    {
+        chunk = n < 64 ? n : 64;
+        for (i = 0; i < chunk; ++i)
+        {
+            sge[i].addr = (uintptr_t) (flow->recv_ring
+                    + (size_t) ((first + i) % flow->depth) * FLOW_SLOT_SIZE);
+            sge[i].length = FLOW_SLOT_SIZE;
+            sge[i].lkey = flow->lkey;
+
+            wr[i].wr_id = flow->wr_id;
+            wr[i].sg_list = &sge[i];
+            wr[i].num_sge = 1;
+            wr[i].next = i + 1 < chunk ? &wr[i + 1] : 0;
+        }
+        if (ibv_post_recv(flow->qp, wr, &bad_wr))
+            return -1;
+        first += chunk;
+        n -= chunk;
+    }
+
+    return 0;
+}
+
+/*
+ * Set up the rings and post every receive slot. <wr_id> tags all work
+ * requests of this connection; <max_inline> is what the QP ended up with
+ * in cap.max_inline_data.
+ */
+static inline int flow_init(struct credit_flow *flow, struct ibv_qp *qp,
+        uint32_t lkey, uint64_t wr_id, uint32_t max_inline, char *send_ring,
+        char *recv_ring, int depth)
+{
+    memset(flow, 0, sizeof(*flow));
+    flow->qp = qp;
+    flow->lkey = lkey;
+    flow->wr_id = wr_id;
+    flow->max_inline = max_inline;
+    flow->send_ring = send_ring;
+    flow->recv_ring = recv_ring;
+    flow->depth = depth;
+    flow->batch = depth / 4 > 0 ? depth / 4 : 1;
+
+    return flow_post_recvs(flow, 0, depth);
+}
+
+/* The peer's receive depth, from the CM private data. */
+static inline void flow_set_peer_depth(struct credit_flow *flow, int depth)
+{
+    flow->credits = depth;
+}
+
+/*
+ * Whether the next receive, <byte_len> bytes long, holds a whole message
+ * whose len fits both what arrived and a slot. Call it before
+ * flow_on_recv(): the peer is not to be trusted with either.
+ */
+static inline int flow_recv_ok(const struct credit_flow *flow,
+        uint32_t byte_len)
+{
+    const struct msg_hdr *msg = (const struct msg_hdr *) (flow->recv_ring
+            + (size_t) (flow->recv_done % flow->depth) * FLOW_SLOT_SIZE);
+
+    return byte_len >= sizeof(*msg)
+            && msg->len <= byte_len - sizeof(*msg)
+            && msg->len <= FLOW_SLOT_SIZE - sizeof(*msg);
+}
+
+/*
+ * A receive completed: take the credits it carries and repost slots once
+ * a batch of them has been consumed. Returns the message, or 0 when the
+ * repost failed. The message stays valid until this side sends again,
+ * since that is what hands its slot back to the peer.
+ */
+static inline struct msg_hdr * flow_on_recv(struct credit_flow *flow)
+{
+    struct msg_hdr *msg = (struct msg_hdr *) (flow->recv_ring
+            + (size_t) (flow->recv_done % flow->depth) * FLOW_SLOT_SIZE);
+
+    ++flow->recv_done;
+    flow->credits += msg->credits;
+    if (msg->len)
+    {
+        ++flow->msgs_received;
+        flow->owed = 1;
+    }
+
+    if (++flow->to_repost == flow->batch)
+    {
+        if (flow_post_recvs(flow, flow->recv_done - flow->to_repost,
+                flow->to_repost))
+            return 0;
+        flow->to_return += flow->to_repost;
+        flow->to_repost = 0;
+    }
+
+    return msg;
+}
+
+/* Keep back the credit of a message received, until flow_release(). */
+static inline void flow_hold(struct credit_flow *flow)
+{
+    ++flow->held;
+}
+
+static inline void flow_release(struct credit_flow *flow)
+{
+    --flow->held;
+}
+
+/*
+ * Credits that can go to the peer now: reposted slots, less those held.
+ * Every slot not yet returned counts toward what is held, whether it has
+ * been reposted or not.
+ */
+static inline int flow_returnable(const struct credit_flow *flow)
+{
+    int free = flow->to_repost + flow->to_return - flow->held;
+
+    return free < flow->to_return ? (free > 0 ? free : 0) : flow->to_return;
+}
+
+static inline void flow_on_send(struct credit_flow *flow)
+{
+    ++flow->send_done;
+}
+
+static inline int flow_post_send(struct credit_flow *flow, const void *data,
+        uint32_t len)
+{
+    struct ibv_send_wr wr, *bad_wr = 0;
+    struct ibv_sge sge[2];
+    struct msg_hdr hdr;
+    char *slot;
+
+    hdr.credits = flow_returnable(flow);
+    hdr.len = len;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = flow->wr_id;
+    wr.opcode = IBV_WR_SEND;
+    wr.sg_list = sge;
+    wr.send_flags = IBV_SEND_SIGNALED;
+
+    if (sizeof(hdr) + len <= flow->max_inline)
+    {
+        /* copied into the WQE by ibv_post_send, no lkey needed */
+        wr.send_flags |= IBV_SEND_INLINE;
+        wr.num_sge = len ? 2 : 1;
+        sge[0].addr = (uintptr_t) &hdr;
+        sge[0].length = sizeof(hdr);
+        sge[1].addr = (uintptr_t) data;
+        sge[1].length = len;
+    }
+    else
+    {
+        slot = flow->send_ring
+                + (size_t) (flow->send_posted % flow->depth) * FLOW_SLOT_SIZE;
+        memcpy(slot, &hdr, sizeof(hdr));
+        memcpy(slot + sizeof(hdr), data, len);
+
+        wr.num_sge = 1;
+        sge[0].addr = (uintptr_t) slot;
+        sge[0].length = sizeof(hdr) + len;
+        sge[0].lkey = flow->lkey;
+    }
+
+    /* account first: the completion may be handled before post returns */
+    flow->returned += hdr.credits;
+    flow->to_return -= hdr.credits;
+    flow->owed = 0;
+    --flow->credits;
+    ++flow->send_posted;
+    if (len)
+        ++flow->msgs_sent;
+
+    return ibv_post_send(flow->qp, &wr, &bad_wr) ? -1 : 0;
+}
+
+/* Largest payload a message can carry. */
+static inline uint32_t flow_max_payload(void)
+{
+    return FLOW_SLOT_SIZE - sizeof(struct msg_hdr);
+}
+
+/* Whether a data message can go out now without eating the reserve credit. */
+static inline int flow_can_send(struct credit_flow *flow)
+{
+    return flow->credits > 1
+            && (int) (flow->send_posted - flow->send_done) < flow->depth;
+}
+
+/*
+ * Send a data message carrying any pending credits. Returns 1 if sent,
+ * 0 if the window is closed, -1 on error.
+ */
+static inline int flow_send(struct credit_flow *flow, const void *data,
+        uint32_t len)
+{
+    if (!flow_can_send(flow))
+        return 0;
+
+    return flow_post_send(flow, data, len) ? -1 : 1;
+}
+
+/*
+ * Return credits on their own when no data is going the other way to
+ * carry them. Returns 1 if a message went out.
+ */
+static inline int flow_return_credits(struct credit_flow *flow)
+{
+    /* what the peer can still send us, less anything in flight */
+    int peer_credits = (int) (flow->depth + flow->returned - flow->recv_done);
+    int returnable = flow_returnable(flow);
+
+    if (!returnable || flow->credits < 1
+            || (int) (flow->send_posted - flow->send_done) >= flow->depth)
+        return 0;
+    if (!(flow->owed && returnable >= flow->batch) && peer_credits > 1)
+        return 0;
+
+    return flow_post_send(flow, 0, 0) ? -1 : 1;
+}
+
+#endif
@@ -0,0 +1,29 @@
+#!/bin/sh
+# message rate and latency of echo requests with and without inline sends
+# needs server_rdma already running on <server> <port>
+# example: inline_bench.sh 10.0.0.1 7471 5
+
+if [ $# -lt 2 ] ; then
+        echo "Usage: inline_bench.sh <server> <port> [seconds] [outstanding]"
+        exit 3
+fi
+
+server=$1
+port=$2
+secs=${3:-5}
+outstanding=${4:-16}
+client=$(dirname $0)/client_rdma
+
+printf "%6s %8s %12s %10s %10s\n" bytes inline req/s p50_us p99_us
+for size in 8 16 32 64 128 256 512 1016 ; do
+        for inline in 256 0 ; do
+                $client -e -o $outstanding -t $secs -s $size -i $inline \
+                        $server $port | awk -v size=$size -v inline=$inline '
+                        / req\/s/ { for (i = 1; i < NF; i++) if ($(i + 1) == "req/s,") rate = $i }
+                        /^latency:/ { for (i = 1; i < NF; i++) {
+                                if ($i == "p50") p50 = $(i + 1)
+                                if ($i == "p99") p99 = $(i + 1) } }
+                        END { printf "%6d %8s %12s %10s %10s\n", size,
+                                inline ? "yes" : "no", rate, p50, p99 }'
+        done
+done
@@ -0,0 +1,786 @@
+/*
+ * rdma_co.h - C++20 coroutine API for the client side of the credit_flow
+ * protocol:
+ *
+ *     auto conn = co_await co::connect("host", "9876", FLOW_ECHO);
+ *     co_await conn->send(buf, len);
+ *     co::message msg = co_await conn->recv();
+ *     co_await conn->close();
+ *
+ * A co::scheduler belongs to one thread (pin it to have one per core). It
+ * runs a reactor over its rdma_cm event channel and the completion
+ * channel of its CQ, and resumes the waiting coroutine straight from the
+ * CQ poll loop: a receive completion hands its slot to the coroutine
+ * blocked in recv() without going through any queue.
+ *
+ * Nothing is allocated per operation. send() and recv() return awaiters
+ * that live in the caller's frame, and coroutine frames of co::task come
+ * from a per-thread free list (frame_pool), so a task called once per
+ * request only reaches the heap the first time.
+ *
+ * send() only waits when the peer has no credit left; the data is copied
+ * or inlined when it is posted, so the buffer is free once send() returns.
+ * A message from recv() stays valid until the next send() or recv() on
+ * the connection; its slot is not handed back to the peer before then,
+ * so a caller that sits on a message holds the peer up. One coroutine at
+ * a time may wait in send() and one in recv() on a connection, and a
+ * connection should be dropped only after close() or once its scheduler
+ * has stopped running. Messages nobody was waiting for are copied to a
+ * backlog, and their credits kept back until recv() takes them, so the
+ * peer can't send more than the backlog holds.
+ *
+ * Errors are thrown as rdma::error, including from co_await. Anything that
+ * goes wrong with a connection once it is up - a failed work completion,
+ * a malformed message, any CM event - fails that connection alone: its
+ * waiters are resumed and throw, and so does every later send() or recv().
+ */
+#ifndef RDMA_CO_H
+#define RDMA_CO_H
+
+#include <netdb.h>
+#include <stdlib.h>
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include "credit_flow.h"
+#include "rdma_raii.h"
+#include "reactor.h"
+
+namespace rdma
+{
+namespace co
+{
+
+/* Per-thread free lists of coroutine frames in 64-byte size classes. */
+class frame_pool
+{
+public:
+    static constexpr size_t GRAIN = 64;
+    static constexpr size_t CLASSES = 64;       /* pooled up to 4 KB */
+
+    static void * allocate(size_t size)
+    {
+        size_t c = (size + GRAIN - 1) / GRAIN;
+        block *b;
+
+        if (c < CLASSES && (b = free_[c]))
+        {
+            free_[c] = b->next;
+            return b;
+        }
+        ++heap_allocations_;
+        return ::operator new(c < CLASSES ? c * GRAIN : size);
+    }
+
+    static void deallocate(void *p, size_t size)
+    {
+        size_t c = (size + GRAIN - 1) / GRAIN;
+        block *b = static_cast<block *>(p);
+
+        if (c >= CLASSES)
+        {
+            ::operator delete(p);
+            return;
+        }
+        b->next = free_[c];
+        free_[c] = b;
+    }
+
+    /* Frames this thread had to get from the heap so far. */
+    static unsigned long long heap_allocations()
+    {
+        return heap_allocations_;
+    }
+
+private:
+    struct block
+    {
+        block *next;
+    };
+
+    static inline thread_local block *free_[CLASSES];
+    static inline thread_local unsigned long long heap_allocations_;
+};
+
+template<typename T = void>
+class task;
+
+namespace detail
+{
+
+struct promise_base
+{
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    static void * operator new(size_t size)
+    {
+        return frame_pool::allocate(size);
+    }
+
+    static void operator delete(void *p, size_t size)
+    {
+        frame_pool::deallocate(p, size);
+    }
+
+    /* lazy: the body starts when the task is awaited */
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    struct final_awaiter
+    {
+        bool await_ready() noexcept
+        {
+            return false;
+        }
+
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            std::coroutine_handle<> c = h.promise().continuation;
+
+            return c ? c : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept
+        {
+        }
+    };
+
+    final_awaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+        error = std::current_exception();
+    }
+};
+
+template<typename T>
+struct promise: promise_base
+{
+    std::optional<T> value;
+
+    task<T> get_return_object() noexcept;
+
+    void return_value(T v)
+    {
+        value.emplace(std::move(v));
+    }
+
+    T result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template<>
+struct promise<void> : promise_base
+{
+    task<void> get_return_object() noexcept;
+
+    void return_void() noexcept
+    {
+    }
+
+    void result()
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+}
+
+/* A lazily started coroutine returning T; awaiting it runs it to the end. */
+template<typename T>
+class task
+{
+public:
+    typedef detail::promise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    explicit task(handle_type h) noexcept :
+            handle_(h)
+    {
+    }
+
+    task(task &&other) noexcept :
+            handle_(std::exchange(other.handle_, nullptr))
+    {
+    }
+
+    task(const task &) = delete;
+    task & operator=(const task &) = delete;
+
+    ~task()
+    {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+        handle_.promise().continuation = caller;
+        return handle_;
+    }
+
+    T await_resume()
+    {
+        return handle_.promise().result();
+    }
+
+    handle_type handle() const noexcept
+    {
+        return handle_;
+    }
+
+private:
+    handle_type handle_;
+};
+
+namespace detail
+{
+
+template<typename T>
+inline task<T> promise<T>::get_return_object() noexcept
+{
+    return task<T>(std::coroutine_handle<promise<T> >::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+    return task<void>(std::coroutine_handle<promise<void> >::from_promise(*this));
+}
+
+}
+
+/* A received payload, see the note on lifetime at the top. */
+struct message
+{
+    const char *data;
+    uint32_t len;
+};
+
+class connection;
+
+/*
+ * One per thread. Owns the event channel, and the PD and CQ of the first
+ * device a connection resolves to; all its connections must use it.
+ */
+class scheduler
+{
+public:
+    explicit scheduler(int depth = FLOW_DEFAULT_DEPTH, int max_conns = 16) :
+            depth_(depth), max_conns_(max_conns), verbs_(0)
+    {
+        check(reactor_init(&reactor_, 0, -1), "reactor_init");
+        events_ = create_event_channel();
+        check(reactor_add(&reactor_, &cm_source_, events_->fd, on_cm, this),
+                "epoll_ctl");
+        current_ = this;
+    }
+
+    ~scheduler()
+    {
+        if (current_ == this)
+            current_ = 0;
+        ::close(reactor_.clock.fd);
+        ::close(reactor_.epfd);
+    }
+
+    scheduler(const scheduler &) = delete;
+    scheduler & operator=(const scheduler &) = delete;
+
+    static scheduler & current()
+    {
+        if (!current_)
+            throw error("co::scheduler", ENXIO);
+        return *current_;
+    }
+
+    /* Run <root> and everything it awaits until it returns. */
+    template<typename T>
+    T run(task<T> root)
+    {
+        root.handle().resume();
+        while (!root.handle().done())
+            check(reactor_run_once(&reactor_, -1) < 0 ? errno : 0,
+                    "epoll_wait");
+
+        return root.await_resume();
+    }
+
+    int depth() const
+    {
+        return depth_;
+    }
+
+    rdma_event_channel * events() const
+    {
+        return events_.get();
+    }
+
+    ibv_pd * pd_for(ibv_context *verbs);
+
+    ibv_cq * cq() const
+    {
+        return cq_.get();
+    }
+
+private:
+    static void on_cm(reactor_source *src);
+    static void on_cq(reactor_source *src);
+
+    static inline thread_local scheduler *current_;
+
+    int depth_;
+    int max_conns_;
+    reactor reactor_;
+    reactor_source cm_source_;
+    reactor_source cq_source_;
+    event_channel events_;
+
+    ibv_context *verbs_;
+    rdma::pd pd_;
+    comp_channel channel_;
+    rdma::cq cq_;
+};
+
+class connection
+{
+public:
+    explicit connection(scheduler &sched) :
+            sched_(sched), arena_(0, free), recv_waiter_(), send_waiter_(),
+            cm_waiter_(), cm_got_(), cm_pending_(false),
+            peer_depth_(0), backlog_head_(0), backlog_tail_(0), pending_(),
+            holding_(false), established_(false), failed_(0)
+    {
+        memset(&flow_, 0, sizeof(flow_));
+    }
+
+    connection(const connection &) = delete;
+    connection & operator=(const connection &) = delete;
+
+    struct send_awaiter
+    {
+        connection &conn;
+        const void *data;
+        uint32_t len;
+
+        bool await_ready()
+        {
+            conn.check_failed();
+            if (!flow_can_send(&conn.flow_))
+                return false;
+            conn.post(data, len);
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            conn.send_waiter_ = h;
+        }
+
+        /* only resumed once there is a credit */
+        void await_resume()
+        {
+            if (conn.send_waiter_)
+            {
+                conn.send_waiter_ = nullptr;
+                conn.check_failed();
+                conn.post(data, len);
+            }
+        }
+    };
+
+    struct recv_awaiter
+    {
+        connection &conn;
+
+        bool await_ready()
+        {
+            conn.check_failed();
+            return conn.backlog_tail_ != conn.backlog_head_;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            conn.recv_waiter_ = h;
+        }
+
+        message await_resume()
+        {
+            conn.recv_waiter_ = nullptr;
+            conn.check_failed();
+            if (conn.pending_.data)
+                return std::exchange(conn.pending_, message());
+            return conn.pop_backlog();
+        }
+    };
+
+    struct cm_awaiter
+    {
+        connection &conn;
+        rdma_cm_event_type expected;
+
+        bool await_ready() noexcept
+        {
+            return conn.cm_pending_;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) noexcept
+        {
+            conn.cm_waiter_ = h;
+        }
+
+        void await_resume()
+        {
+            conn.cm_waiter_ = nullptr;
+            conn.cm_pending_ = false;
+            if (conn.cm_got_ != expected)
+                throw error(rdma_event_str(conn.cm_got_), ECONNABORTED);
+        }
+    };
+
+    send_awaiter send(const void *data, uint32_t len)
+    {
+        release();
+        return send_awaiter { *this, data, len };
+    }
+
+    recv_awaiter recv()
+    {
+        release();
+        return recv_awaiter { *this };
+    }
+
+    /* Disconnect, or finish a disconnect the server started. */
+    task<void> close()
+    {
+        if (!(cm_pending_ && cm_got_ == RDMA_CM_EVENT_DISCONNECTED))
+            check(rdma_disconnect(id_.get()), "rdma_disconnect");
+        co_await cm_awaiter { *this, RDMA_CM_EVENT_DISCONNECTED };
+        qp_.reset();
+    }
+
+    const credit_flow & flow() const
+    {
+        return flow_;
+    }
+
+private:
+    friend class scheduler;
+    friend task<std::unique_ptr<connection> > connect(const char *host,
+            const char *port, uint32_t flags);
+
+    void check_failed()
+    {
+        if (failed_)
+            throw error("work completion", failed_);
+    }
+
+    void post(const void *data, uint32_t len)
+    {
+        if (flow_send(&flow_, data, len) < 0)
+            throw error("ibv_post_send", errno);
+    }
+
+    /*
+     * The caller is done with the message recv() handed over in place:
+     * its slot can go back to the peer now, with any others held back.
+     */
+    void release()
+    {
+        if (!holding_)
+            return;
+        holding_ = false;
+        if (flow_return_credits(&flow_) < 0)
+            throw error("ibv_post_send", errno);
+    }
+
+    char * slot(char *ring, unsigned int n)
+    {
+        return ring + (size_t) (n % sched_.depth()) * FLOW_SLOT_SIZE;
+    }
+
+    /* The copy stays put until the next recv(); its credit can go back now. */
+    message pop_backlog()
+    {
+        struct msg_hdr *msg = (struct msg_hdr *) slot(backlog_, backlog_tail_++);
+
+        flow_release(&flow_);
+        if (!holding_ && flow_return_credits(&flow_) < 0)
+            throw error("ibv_post_send", errno);
+
+        return message { (const char *) (msg + 1), msg->len };
+    }
+
+    /*
+     * A data message arrived and nobody is waiting: keep a copy, and its
+     * credit until recv() takes it. Returns false if the peer sent more
+     * than it had credits for.
+     */
+    bool push_backlog(struct msg_hdr *msg)
+    {
+        if (backlog_head_ - backlog_tail_ == (unsigned int) sched_.depth())
+            return false;
+        memcpy(slot(backlog_, backlog_head_++), msg, sizeof(*msg) + msg->len);
+        flow_hold(&flow_);
+
+        return true;
+    }
+
+    /* Fail this connection only: whoever waits on it throws <err>. */
+    void fail(int err)
+    {
+        if (!failed_)
+            failed_ = err;
+        wake();
+    }
+
+    /* Called from the CQ loop for every completion of this connection. */
+    void on_completion(const ibv_wc &wc)
+    {
+        struct msg_hdr *msg;
+
+        if (failed_)
+            return;
+        if (wc.status != IBV_WC_SUCCESS)
+            return fail(EIO);
+
+        if (!(wc.opcode & IBV_WC_RECV))
+            flow_on_send(&flow_);
+        else if (!flow_recv_ok(&flow_, wc.byte_len))
+            return fail(EPROTO);
+        else if (!(msg = flow_on_recv(&flow_)))
+            return fail(errno);
+        else if (msg->len && recv_waiter_ && backlog_tail_ == backlog_head_)
+        {
+            /* handed over in place: no credits back until send() or recv() */
+            pending_ = message { (const char *) (msg + 1), msg->len };
+            holding_ = true;
+        }
+        else if (msg->len && !push_backlog(msg))
+            return fail(ENOBUFS);
+
+        if (!holding_ && flow_return_credits(&flow_) < 0)
+            return fail(errno);
+
+        /* last, since a resumed coroutine may go on to anything */
+        if (send_waiter_ && flow_can_send(&flow_))
+            send_waiter_.resume();
+        if (pending_.data && recv_waiter_)
+            std::exchange(recv_waiter_, nullptr).resume();
+    }
+
+    void on_cm_event(rdma_cm_event_type event)
+    {
+        cm_got_ = event;
+        cm_pending_ = true;
+        /* once up, whatever the CM has to say ends the connection */
+        if (established_ && !failed_)
+            failed_ = event == RDMA_CM_EVENT_DISCONNECTED ?
+                    ECONNRESET : ECONNABORTED;
+        if (event == RDMA_CM_EVENT_ESTABLISHED)
+            established_ = true;
+        if (cm_waiter_)
+            std::exchange(cm_waiter_, nullptr).resume();
+        else
+            wake();
+    }
+
+    void wake()
+    {
+        if (recv_waiter_)
+            std::exchange(recv_waiter_, nullptr).resume();
+        else if (send_waiter_)
+            send_waiter_.resume();
+    }
+
+    scheduler &sched_;
+    cm_id id_;
+    std::unique_ptr<char, void (*)(void *)> arena_;
+    mr mr_;
+    cm_qp qp_;
+
+    credit_flow flow_;
+    char *backlog_;
+
+    std::coroutine_handle<> recv_waiter_;
+    std::coroutine_handle<> send_waiter_;
+    std::coroutine_handle<> cm_waiter_;
+    rdma_cm_event_type cm_got_;
+    bool cm_pending_;
+    uint32_t peer_depth_;
+
+    unsigned int backlog_head_;
+    unsigned int backlog_tail_;
+    message pending_;
+    bool holding_;              /* a message recv() returned is still in the ring */
+    bool established_;
+    int failed_;
+};
+
+inline ibv_pd * scheduler::pd_for(ibv_context *verbs)
+{
+    if (verbs_ == verbs)
+        return pd_.get();
+    if (verbs_)
+        throw error("co::scheduler: second device", EXDEV);
+
+    verbs_ = verbs;
+    pd_ = alloc_pd(verbs);
+    channel_ = create_comp_channel(verbs);
+    cq_ = create_cq(verbs, 2 * depth_ * max_conns_, this, channel_.get());
+    check(ibv_req_notify_cq(cq_.get(), 0), "ibv_req_notify_cq");
+    check(reactor_add(&reactor_, &cq_source_, channel_->fd, on_cq, this),
+            "epoll_ctl");
+
+    return pd_.get();
+}
+
+inline void scheduler::on_cm(reactor_source *src)
+{
+    scheduler *s = static_cast<scheduler *>(src->arg);
+    rdma_cm_event *event;
+    rdma_cm_event_type type;
+    connection *conn;
+
+    while (!rdma_get_cm_event(s->events(), &event))
+    {
+        conn = static_cast<connection *>(event->id->context);
+        type = event->event;
+        /* the private data goes away with the ack */
+        if (type == RDMA_CM_EVENT_ESTABLISHED
+                && event->param.conn.private_data_len >= sizeof(uint32_t))
+            memcpy(&conn->peer_depth_, event->param.conn.private_data,
+                    sizeof(conn->peer_depth_));
+        rdma_ack_cm_event(event);
+
+        conn->on_cm_event(type);
+    }
+    if (errno != EAGAIN)
+        throw error("rdma_get_cm_event", errno);
+}
+
+inline void scheduler::on_cq(reactor_source *src)
+{
+    scheduler *s = static_cast<scheduler *>(src->arg);
+    ibv_cq *cq;
+    void *cq_context;
+    ibv_wc wc[16];
+    unsigned int events = 0;
+    int i, n;
+
+    while (!ibv_get_cq_event(s->channel_.get(), &cq, &cq_context))
+        ++events;
+    if (!events)
+        return;
+    ibv_ack_cq_events(s->cq_.get(), events);
+    check(ibv_req_notify_cq(s->cq_.get(), 0), "ibv_req_notify_cq");
+
+    while ((n = ibv_poll_cq(s->cq_.get(), 16, wc)) > 0)
+        for (i = 0; i < n; ++i)
+        {
+            /* receives left posted when a QP goes away */
+            if (wc[i].status == IBV_WC_WR_FLUSH_ERR)
+                continue;
+            reinterpret_cast<connection *>(wc[i].wr_id)->on_completion(wc[i]);
+        }
+}
+
+/*
+ * Resolve, set up and connect to host:port on the current thread's
+ * scheduler. <flags> are the FLOW_* bits for the server.
+ */
+inline task<std::unique_ptr<connection> > connect(const char *host,
+        const char *port, uint32_t flags = 0)
+{
+    scheduler &sched = scheduler::current();
+    std::unique_ptr<connection> conn(new connection(sched));
+    ibv_qp_init_attr qp_attr;
+    rdma_conn_param cm_params;
+    flow_params params;
+    addrinfo *addr;
+    size_t ring = flow_ring_size(sched.depth());
+    void *arena;
+    ibv_pd *pd;
+    int r;
+
+    if ((r = getaddrinfo(host, port, 0, &addr)))
+        throw error(gai_strerror(r), EHOSTUNREACH);
+    conn->id_ = create_id(sched.events(), conn.get());
+    r = rdma_resolve_addr(conn->id_.get(), 0, addr->ai_addr, 500);
+    freeaddrinfo(addr);
+    check(r, "rdma_resolve_addr");
+    co_await connection::cm_awaiter { *conn, RDMA_CM_EVENT_ADDR_RESOLVED };
+
+    pd = sched.pd_for(conn->id_->verbs);
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.send_cq = qp_attr.recv_cq = sched.cq();
+    qp_attr.qp_type = IBV_QPT_RC;
+    qp_attr.cap.max_send_wr = qp_attr.cap.max_recv_wr = sched.depth();
+    qp_attr.cap.max_send_sge = 2;
+    qp_attr.cap.max_recv_sge = 1;
+    qp_attr.cap.max_inline_data = FLOW_DEFAULT_INLINE;
+    try
+    {
+        conn->qp_ = create_qp(conn->id_.get(), pd, qp_attr);
+    }
+    catch (const error &)
+    {
+        /* the device may not do inline sends at all */
+        qp_attr.cap.max_inline_data = 0;
+        conn->qp_ = create_qp(conn->id_.get(), pd, qp_attr);
+    }
+
+    /* send ring, receive ring, backlog */
+    if (posix_memalign(&arena, sysconf(_SC_PAGESIZE), 3 * ring))
+        throw error("posix_memalign", ENOMEM);
+    conn->arena_.reset(static_cast<char *>(arena));
+    conn->backlog_ = conn->arena_.get() + 2 * ring;
+    conn->mr_ = reg_mr(pd, arena, 2 * ring, IBV_ACCESS_LOCAL_WRITE);
+    check(flow_init(&conn->flow_, conn->qp_.get(), conn->mr_->lkey,
+            (uintptr_t) conn.get(), qp_attr.cap.max_inline_data,
+            conn->arena_.get(), conn->arena_.get() + ring, sched.depth()) ?
+            errno : 0, "ibv_post_recv");
+
+    check(rdma_resolve_route(conn->id_.get(), 500), "rdma_resolve_route");
+    co_await connection::cm_awaiter { *conn, RDMA_CM_EVENT_ROUTE_RESOLVED };
+
+    memset(&params, 0, sizeof(params));
+    params.depth = sched.depth();
+    params.flags = flags;
+    memset(&cm_params, 0, sizeof(cm_params));
+    cm_params.private_data = &params;
+    cm_params.private_data_len = sizeof(params);
+    check(rdma_connect(conn->id_.get(), &cm_params), "rdma_connect");
+    co_await connection::cm_awaiter { *conn, RDMA_CM_EVENT_ESTABLISHED };
+
+    if (!conn->peer_depth_)
+        throw error("server did not send its receive depth", EPROTO);
+    flow_set_peer_depth(&conn->flow_, conn->peer_depth_);
+
+    co_return std::move(conn);
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,337 @@
+/*
+ * rdma_log.h - asynchronous logging for the completion path.
+ *
+ * Every thread that logs gets its own single-producer ring of fixed-size
+ * records. Logging a record stores a timestamp, the format string pointer
+ * and up to four integer arguments; nothing is formatted and no lock is
+ * taken. A drain thread started by rlog_init() empties the rings and does
+ * the actual stdio work. If a ring is full the record is dropped and
+ * counted rather than blocking the caller.
+ *
+ * Levels below LOG_LEVEL compile to nothing, so the per-completion
+ * LOG_DEBUG() calls cost nothing in a default build. Build with
+ * -DLOG_LEVEL=LOG_LEVEL_DEBUG to get them back.
+ *
+ * Arguments are carried as unsigned long long, so formats should use ll
+ * conversions (%llu, %lld, %llx). A %s argument is only safe for strings
+ * that outlive the drain, i.e. literals; use LOG_TEXT() to copy a short
+ * string into the record instead.
+ *
+ * Header-only: all state is static, so include it in one translation unit
+ * per program. Usable from C and C++.
+ */
+#ifndef RDMA_LOG_H
+#define RDMA_LOG_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define RLOG_RING_SIZE   4096     /* records per thread, power of two */
+#define RLOG_MAX_THREADS 128
+#define RLOG_TEXT_LEN    32
+#define RLOG_IDLE_US     1000     /* drain thread nap when all rings are empty */
+#define RLOG_CACHE_LINE  64
+
+struct rlog_record
+{
+    unsigned long long stamp;
+    const char *fmt;
+    int level;
+    int text;                     /* args holds a string, not integers */
+    union
+    {
+        unsigned long long arg[4];
+        char str[RLOG_TEXT_LEN];
+    } u;
+};
+
+struct rlog_ring
+{
+    /* producer side */
+    unsigned long head;
+    unsigned long tail_cache;
+    unsigned long dropped;
+    char pad0[RLOG_CACHE_LINE - 3 * sizeof(unsigned long)];
+
+    /* consumer side */
+    unsigned long tail;
+    unsigned long dropped_seen;
+    char pad1[RLOG_CACHE_LINE - 2 * sizeof(unsigned long)];
+
+    struct rlog_record rec[RLOG_RING_SIZE];
+};
+
+static struct rlog_ring *rlog_rings[RLOG_MAX_THREADS];
+static int rlog_num_rings = 0;
+static __thread struct rlog_ring *rlog_self = 0;
+static int rlog_draining = 0;
+static pthread_t rlog_drain_thread;
+static unsigned long long rlog_start_stamp;
+static struct timespec rlog_start_time;
+
+static inline unsigned long long rlog_stamp(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* First record from a thread: give it a ring. Returns 0 when out of slots. */
+static inline struct rlog_ring * rlog_attach(void)
+{
+    struct rlog_ring *ring;
+    void *mem;
+    int i;
+
+    if (posix_memalign(&mem, RLOG_CACHE_LINE, sizeof(struct rlog_ring)))
+        return 0;
+    ring = (struct rlog_ring *) mem;
+    memset(ring, 0, sizeof(*ring));
+
+    i = __atomic_fetch_add(&rlog_num_rings, 1, __ATOMIC_RELAXED);
+    if (i >= RLOG_MAX_THREADS)
+    {
+        free(ring);
+        return 0;
+    }
+    __atomic_store_n(&rlog_rings[i], ring, __ATOMIC_RELEASE);
+    rlog_self = ring;
+
+    return ring;
+}
+
+static inline struct rlog_record * rlog_reserve(struct rlog_ring **ringp)
+{
+    struct rlog_ring *ring = rlog_self ? rlog_self : rlog_attach();
+
+    if (!ring)
+        return 0;
+    *ringp = ring;
+
+    if (ring->head - ring->tail_cache == RLOG_RING_SIZE)
+    {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (ring->head - ring->tail_cache == RLOG_RING_SIZE)
+        {
+            __atomic_store_n(&ring->dropped, ring->dropped + 1,
+                    __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+
+    return &ring->rec[ring->head & (RLOG_RING_SIZE - 1)];
+}
+
+static inline void rlog_push(int level, const char *fmt,
+        unsigned long long a0, unsigned long long a1,
+        unsigned long long a2, unsigned long long a3)
+{
+    struct rlog_ring *ring;
+    struct rlog_record *rec = rlog_reserve(&ring);
+
+    if (!rec)
+        return;
+
+    rec->stamp = rlog_stamp();
+    rec->fmt = fmt;
+    rec->level = level;
+    rec->text = 0;
+    rec->u.arg[0] = a0;
+    rec->u.arg[1] = a1;
+    rec->u.arg[2] = a2;
+    rec->u.arg[3] = a3;
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void rlog_push_text(int level, const char *fmt, const char *str)
+{
+    struct rlog_ring *ring;
+    struct rlog_record *rec = rlog_reserve(&ring);
+
+    if (!rec)
+        return;
+
+    rec->stamp = rlog_stamp();
+    rec->fmt = fmt;
+    rec->level = level;
+    rec->text = 1;
+    strncpy(rec->u.str, str, RLOG_TEXT_LEN - 1);
+    rec->u.str[RLOG_TEXT_LEN - 1] = '\0';
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Seconds per stamp tick, measured against the monotonic clock so far. */
+static inline double rlog_tick_seconds(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec now;
+    unsigned long long ticks = rlog_stamp() - rlog_start_stamp;
+    double ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (now.tv_sec - rlog_start_time.tv_sec) * 1e9
+            + (now.tv_nsec - rlog_start_time.tv_nsec);
+    if (!ticks || ns <= 0)
+        return 0;
+    return ns / ticks / 1e9;
+#else
+    return 1e-9;
+#endif
+}
+
+static inline int rlog_drain_ring(struct rlog_ring *ring, double tick)
+{
+    unsigned long tail = ring->tail;
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long dropped;
+    int n = 0;
+
+    for (; tail != head; ++tail, ++n)
+    {
+        struct rlog_record *rec = &ring->rec[tail & (RLOG_RING_SIZE - 1)];
+        FILE *out = rec->level <= LOG_LEVEL_WARN ? stderr : stdout;
+
+        fprintf(out, "[%12.6f] ", (rec->stamp - rlog_start_stamp) * tick);
+        if (rec->text)
+            fprintf(out, rec->fmt, rec->u.str);
+        else
+            fprintf(out, rec->fmt, rec->u.arg[0], rec->u.arg[1],
+                    rec->u.arg[2], rec->u.arg[3]);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->dropped_seen)
+    {
+        fprintf(stderr, "log: %lu record(s) dropped, ring full\n",
+                dropped - ring->dropped_seen);
+        ring->dropped_seen = dropped;
+    }
+
+    return n;
+}
+
+/*
+ * Empty every ring once. Safe to call from any thread; callers other than
+ * the drain thread just wait their turn.
+ */
+static inline int rlog_flush(void)
+{
+    double tick = rlog_tick_seconds();
+    int i, n, total = 0;
+
+    while (__atomic_exchange_n(&rlog_draining, 1, __ATOMIC_ACQUIRE))
+        usleep(10);
+
+    n = __atomic_load_n(&rlog_num_rings, __ATOMIC_RELAXED);
+    if (n > RLOG_MAX_THREADS)
+        n = RLOG_MAX_THREADS;
+    for (i = 0; i < n; ++i)
+    {
+        struct rlog_ring *ring = __atomic_load_n(&rlog_rings[i],
+                __ATOMIC_ACQUIRE);
+
+        if (ring)
+            total += rlog_drain_ring(ring, tick);
+    }
+    if (total)
+    {
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    __atomic_store_n(&rlog_draining, 0, __ATOMIC_RELEASE);
+
+    return total;
+}
+
+static inline void * rlog_drain(void *arg)
+{
+    (void) arg;
+
+    while (1)
+        if (!rlog_flush())
+            usleep(RLOG_IDLE_US);
+
+    return 0;
+}
+
+static inline void rlog_flush_at_exit(void)
+{
+    rlog_flush();
+}
+
+/* Start the drain thread. Records logged before this are kept. */
+static inline void rlog_init(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &rlog_start_time);
+    rlog_start_stamp = rlog_stamp();
+
+    if (pthread_create(&rlog_drain_thread, 0, rlog_drain, 0))
+    {
+        fprintf(stderr, "rlog_init: could not start drain thread\n");
+        exit(EXIT_FAILURE);
+    }
+    atexit(rlog_flush_at_exit);
+}
+
+/*
+ * LOG_X(fmt, ...) takes the format plus at most four integer arguments;
+ * the padding zeros fill the unused slots.
+ */
+#define RLOG_ARGS(fmt, a0, a1, a2, a3, ...) (fmt), \
+    (unsigned long long) (a0), (unsigned long long) (a1), \
+    (unsigned long long) (a2), (unsigned long long) (a3)
+#define RLOG(level, ...) \
+    rlog_push(level, RLOG_ARGS(__VA_ARGS__, 0, 0, 0, 0, 0))
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) RLOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) RLOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) RLOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) RLOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void) 0)
+#endif
+
+/* One %s in fmt, filled from a copy of at most RLOG_TEXT_LEN - 1 bytes of str. */
+#define LOG_TEXT(level, fmt, str) \
+    do { if ((level) <= LOG_LEVEL) rlog_push_text(level, fmt, str); } while (0)
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ * rdma_raii.h - move-only owners for verbs and rdma_cm objects, and post
+ * functions with the work request shape fixed at compile time.
+ *
+ * Every handle owns one object and releases it with the matching destroy
+ * call when it goes out of scope, so a connection torn down on any path
+ * (including an exception) gives everything back in reverse declaration
+ * order. Declare members in creation order: CM id, PD, CQ, MR, QP. The
+ * factories throw rdma::error instead of exiting.
+ *
+ * post_send<>(), post_rdma<>() and post_recv<>() take the opcode, send
+ * flags and SGE count as template arguments. The work request is built
+ * from constants plus the caller's wr_id and SGEs, with no memset and no
+ * tests on flags or sizes; only the fields the opcode uses are written,
+ * which is all an RC provider reads. post_bench.cpp compares this with
+ * flow_post_send() from credit_flow.h.
+ *
+ * Header-only, C++11.
+ */
+#ifndef RDMA_RAII_H
+#define RDMA_RAII_H
+
+#include <infiniband/verbs.h>
+#include <rdma/rdma_cma.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+
+namespace rdma
+{
+
+class error: public std::runtime_error
+{
+public:
+    error(const char *call, int err) :
+            std::runtime_error(std::string(call) + ": " + strerror(err)),
+            code(err)
+    {
+    }
+
+    int code;                   /* errno of the failed call */
+};
+
+/* Verbs return either 0 or a positive errno; rdma_cm returns -1 and sets errno. */
+inline void check(int ret, const char *call)
+{
+    if (ret)
+        throw error(call, ret > 0 ? ret : errno);
+}
+
+template<typename T>
+inline T * check(T *ptr, const char *call)
+{
+    if (!ptr)
+        throw error(call, errno ? errno : ENOMEM);
+    return ptr;
+}
+
+/* Owns one T, released with Deleter. Move-only. */
+template<typename T, typename Deleter>
+class handle
+{
+public:
+    handle() noexcept :
+            ptr_(0), deleter_()
+    {
+    }
+
+    explicit handle(T *ptr, Deleter deleter = Deleter()) noexcept :
+            ptr_(ptr), deleter_(deleter)
+    {
+    }
+
+    handle(handle &&other) noexcept :
+            ptr_(other.ptr_), deleter_(other.deleter_)
+    {
+        other.ptr_ = 0;
+    }
+
+    handle & operator=(handle &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            ptr_ = other.ptr_;
+            deleter_ = other.deleter_;
+            other.ptr_ = 0;
+        }
+        return *this;
+    }
+
+    handle(const handle &) = delete;
+    handle & operator=(const handle &) = delete;
+
+    ~handle()
+    {
+        reset();
+    }
+
+    T * get() const noexcept
+    {
+        return ptr_;
+    }
+
+    T * operator->() const noexcept
+    {
+        return ptr_;
+    }
+
+    explicit operator bool() const noexcept
+    {
+        return ptr_ != 0;
+    }
+
+    /* Give up ownership without destroying. */
+    T * release() noexcept
+    {
+        T *ptr = ptr_;
+
+        ptr_ = 0;
+        return ptr;
+    }
+
+    void reset() noexcept
+    {
+        if (ptr_)
+            deleter_(ptr_);
+        ptr_ = 0;
+    }
+
+private:
+    T *ptr_;
+    Deleter deleter_;
+};
+
+/* Deleter for the ibv_destroy_xxx(T *) style calls. */
+template<typename T, int (*Destroy)(T *)>
+struct destroy_with
+{
+    void operator()(T *ptr) const noexcept
+    {
+        Destroy(ptr);
+    }
+};
+
+struct event_channel_deleter
+{
+    void operator()(rdma_event_channel *ch) const noexcept
+    {
+        rdma_destroy_event_channel(ch);
+    }
+};
+
+/* A QP made by rdma_create_qp() belongs to its id and goes with rdma_destroy_qp(). */
+struct cm_qp_deleter
+{
+    rdma_cm_id *id;
+
+    void operator()(ibv_qp *) const noexcept
+    {
+        rdma_destroy_qp(id);
+    }
+};
+
+typedef handle<ibv_pd, destroy_with<ibv_pd, ibv_dealloc_pd> > pd;
+typedef handle<ibv_comp_channel,
+        destroy_with<ibv_comp_channel, ibv_destroy_comp_channel> > comp_channel;
+typedef handle<ibv_cq, destroy_with<ibv_cq, ibv_destroy_cq> > cq;
+typedef handle<ibv_mr, destroy_with<ibv_mr, ibv_dereg_mr> > mr;
+typedef handle<ibv_qp, destroy_with<ibv_qp, ibv_destroy_qp> > qp;
+typedef handle<ibv_qp, cm_qp_deleter> cm_qp;
+typedef handle<rdma_cm_id, destroy_with<rdma_cm_id, rdma_destroy_id> > cm_id;
+typedef handle<rdma_event_channel, event_channel_deleter> event_channel;
+
+inline pd alloc_pd(ibv_context *ctx)
+{
+    return pd(check(ibv_alloc_pd(ctx), "ibv_alloc_pd"));
+}
+
+inline comp_channel create_comp_channel(ibv_context *ctx)
+{
+    return comp_channel(check(ibv_create_comp_channel(ctx),
+            "ibv_create_comp_channel"));
+}
+
+inline cq create_cq(ibv_context *ctx, int cqe, void *cq_context = 0,
+        ibv_comp_channel *channel = 0, int comp_vector = 0)
+{
+    return cq(check(ibv_create_cq(ctx, cqe, cq_context, channel, comp_vector),
+            "ibv_create_cq"));
+}
+
+inline mr reg_mr(ibv_pd *pd, void *addr, size_t length, int access)
+{
+    return mr(check(ibv_reg_mr(pd, addr, length, access), "ibv_reg_mr"));
+}
+
+/* attr.cap comes back with what the device actually gave. */
+inline qp create_qp(ibv_pd *pd, ibv_qp_init_attr &attr)
+{
+    return qp(check(ibv_create_qp(pd, &attr), "ibv_create_qp"));
+}
+
+inline cm_qp create_qp(rdma_cm_id *id, ibv_pd *pd, ibv_qp_init_attr &attr)
+{
+    cm_qp_deleter deleter = { id };
+
+    check(rdma_create_qp(id, pd, &attr), "rdma_create_qp");
+    return cm_qp(id->qp, deleter);
+}
+
+inline event_channel create_event_channel()
+{
+    return event_channel(check(rdma_create_event_channel(),
+            "rdma_create_event_channel"));
+}
+
+inline cm_id create_id(rdma_event_channel *channel, void *context = 0,
+        rdma_port_space ps = RDMA_PS_TCP)
+{
+    rdma_cm_id *id;
+
+    check(rdma_create_id(channel, &id, context, ps), "rdma_create_id");
+    return cm_id(id);
+}
+
+inline ibv_sge sge(const void *addr, uint32_t length, uint32_t lkey)
+{
+    ibv_sge s;
+
+    s.addr = (uintptr_t) addr;
+    s.length = length;
+    s.lkey = lkey;
+    return s;
+}
+
+/*
+ * SEND or SEND_WITH_IMM of NumSge SGEs. Flags is any mix of
+ * IBV_SEND_SIGNALED, IBV_SEND_INLINE, IBV_SEND_SOLICITED, IBV_SEND_FENCE.
+ * Returns what ibv_post_send() does.
+ */
+template<ibv_wr_opcode Op, unsigned int Flags, int NumSge>
+inline int post_send(ibv_qp *qp, uint64_t wr_id, const ibv_sge (&sg_list)[NumSge],
+        uint32_t imm_data = 0)
+{
+    static_assert(Op == IBV_WR_SEND || Op == IBV_WR_SEND_WITH_IMM,
+            "post_send is for SEND opcodes, see post_rdma");
+    static_assert(NumSge >= 1, "at least one SGE");
+
+    ibv_send_wr wr, *bad_wr;
+
+    wr.wr_id = wr_id;
+    wr.next = 0;
+    wr.sg_list = const_cast<ibv_sge *>(sg_list);
+    wr.num_sge = NumSge;
+    wr.opcode = Op;
+    wr.send_flags = Flags;
+    if (Op == IBV_WR_SEND_WITH_IMM)
+        wr.imm_data = htonl(imm_data);
+
+    return ibv_post_send(qp, &wr, &bad_wr);
+}
+
+/* RDMA WRITE, WRITE_WITH_IMM or READ against remote_addr/rkey. */
+template<ibv_wr_opcode Op, unsigned int Flags, int NumSge>
+inline int post_rdma(ibv_qp *qp, uint64_t wr_id, const ibv_sge (&sg_list)[NumSge],
+        uint64_t remote_addr, uint32_t rkey, uint32_t imm_data = 0)
+{
+    static_assert(Op == IBV_WR_RDMA_WRITE || Op == IBV_WR_RDMA_WRITE_WITH_IMM
+            || Op == IBV_WR_RDMA_READ, "post_rdma is for RDMA opcodes");
+    static_assert(!(Op == IBV_WR_RDMA_READ && (Flags & IBV_SEND_INLINE)),
+            "a READ cannot be inline");
+    static_assert(NumSge >= 1, "at least one SGE");
+
+    ibv_send_wr wr, *bad_wr;
+
+    wr.wr_id = wr_id;
+    wr.next = 0;
+    wr.sg_list = const_cast<ibv_sge *>(sg_list);
+    wr.num_sge = NumSge;
+    wr.opcode = Op;
+    wr.send_flags = Flags;
+    wr.wr.rdma.remote_addr = remote_addr;
+    wr.wr.rdma.rkey = rkey;
+    if (Op == IBV_WR_RDMA_WRITE_WITH_IMM)
+        wr.imm_data = htonl(imm_data);
+
+    return ibv_post_send(qp, &wr, &bad_wr);
+}
+
+template<int NumSge>
+inline int post_recv(ibv_qp *qp, uint64_t wr_id, const ibv_sge (&sg_list)[NumSge])
+{
+    static_assert(NumSge >= 1, "at least one SGE");
+
+    ibv_recv_wr wr, *bad_wr;
+
+    wr.wr_id = wr_id;
+    wr.next = 0;
+    wr.sg_list = const_cast<ibv_sge *>(sg_list);
+    wr.num_sge = NumSge;
+
+    return ibv_post_recv(qp, &wr, &bad_wr);
+}
+
+}
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * reactor.h - one epoll loop per thread for rdma_cm event channels,
+ * completion channels and timers.
+ *
+ * Sources are non-blocking fds with a handler; a handler must drain its
+ * fd (until EAGAIN), since the loop is level-triggered but calls every
+ * ready handler only once per wakeup. Timers are kept in deadline order
+ * on one timerfd per reactor, so any number of them costs one fd and a
+ * timerfd_settime() only when the earliest deadline moves up.
+ *
+ * reactor_add() may be called from any thread, since epoll_ctl() is
+ * thread safe. Everything else, timers included, belongs to the thread
+ * running the reactor.
+ */
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REACTOR_MAX_EVENTS 32
+
+struct reactor_source;
+struct reactor_timer;
+
+typedef void (*reactor_handler)(struct reactor_source *src);
+typedef void (*reactor_fire)(struct reactor_timer *timer);
+
+struct reactor_source
+{
+    int fd;
+    reactor_handler handler;
+    void *arg;
+};
+
+struct reactor_timer
+{
+    unsigned long long deadline;        /* CLOCK_MONOTONIC ns */
+    reactor_fire fire;
+    void *arg;
+    struct reactor_timer *next;
+    int scheduled;
+};
+
+struct reactor
+{
+    int epfd;
+    struct reactor_source clock;        /* the timerfd */
+    struct reactor_timer *timers;       /* earliest first */
+    unsigned long long armed;           /* what the timerfd is set to, 0 = off */
+
+    int index;
+    int cpu;                            /* -1 = not pinned */
+    pthread_t thread;
+};
+
+static inline unsigned long long reactor_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int reactor_arm(struct reactor *r, unsigned long long deadline)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000000ULL;
+    its.it_value.tv_nsec = deadline % 1000000000ULL;
+    if (timerfd_settime(r->clock.fd, TFD_TIMER_ABSTIME, &its, 0))
+        return -1;
+    r->armed = deadline;
+
+    return 0;
+}
+
+/* Take <timer> off the list if it is on it. The timerfd is left alone. */
+static inline void reactor_cancel(struct reactor *r, struct reactor_timer *timer)
+{
+    struct reactor_timer **p;
+
+    if (!timer->scheduled)
+        return;
+    for (p = &r->timers; *p != timer; p = &(*p)->next)
+        ;
+    *p = timer->next;
+    timer->next = 0;
+    timer->scheduled = 0;
+}
+
+/* (Re)schedule <timer> for <deadline>. Returns 0, or -1 on error. */
+static inline int reactor_schedule(struct reactor *r, struct reactor_timer *timer,
+        unsigned long long deadline)
+{
+    struct reactor_timer **p;
+
+    if (timer->scheduled && timer->deadline == deadline)
+        return 0;
+    reactor_cancel(r, timer);
+
+    timer->deadline = deadline;
+    for (p = &r->timers; *p && (*p)->deadline <= deadline; p = &(*p)->next)
+        ;
+    timer->next = *p;
+    *p = timer;
+    timer->scheduled = 1;
+
+    /* a timerfd that goes off early just finds nothing due */
+    if (!r->armed || deadline < r->armed)
+        return reactor_arm(r, deadline);
+
+    return 0;
+}
+
+static inline void reactor_on_clock(struct reactor_source *src)
+{
+    struct reactor *r = (struct reactor *) src->arg;
+    struct reactor_timer *timer;
+    unsigned long long expirations, now;
+
+    while (read(src->fd, &expirations, sizeof(expirations)) > 0)
+        ;
+    r->armed = 0;
+
+    now = reactor_now();
+    while ((timer = r->timers) && timer->deadline <= now)
+    {
+        r->timers = timer->next;
+        timer->next = 0;
+        timer->scheduled = 0;
+        timer->fire(timer);
+    }
+
+    if (r->timers && (!r->armed || r->timers->deadline < r->armed))
+        reactor_arm(r, r->timers->deadline);
+}
+
+/* Watch <fd> for input, switching it to non-blocking. */
+static inline int reactor_add(struct reactor *r, struct reactor_source *src,
+        int fd, reactor_handler handler, void *arg)
+{
+    struct epoll_event ev;
+    int flags = fcntl(fd, F_GETFL);
+
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK))
+        return -1;
+
+    src->fd = fd;
+    src->handler = handler;
+    src->arg = arg;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = src;
+
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static inline int reactor_del(struct reactor *r, struct reactor_source *src)
+{
+    return epoll_ctl(r->epfd, EPOLL_CTL_DEL, src->fd, 0);
+}
+
+static inline int reactor_init(struct reactor *r, int index, int cpu)
+{
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    r->index = index;
+    r->cpu = cpu;
+
+    if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        return -1;
+
+    return reactor_add(r, &r->clock, fd, reactor_on_clock, r);
+}
+
+/*
+ * Wait for and dispatch one round of events. Returns the number of
+ * sources handled, or -1 on error.
+ */
+static inline int reactor_run_once(struct reactor *r, int timeout_ms)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int i, n;
+
+    n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < n; ++i)
+    {
+        struct reactor_source *src = (struct reactor_source *) events[i].data.ptr;
+
+        src->handler(src);
+    }
+
+    return n;
+}
+
+/* Run until an error. */
+static inline int reactor_run(struct reactor *r)
+{
+    while (reactor_run_once(r, -1) >= 0)
+        ;
+
+    return -1;
+}
+
+#endif
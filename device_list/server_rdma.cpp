@@ -10,155 +10,1135 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+#include "coalesce.h"
+#include "credit_flow.h"
+#include "rdma_log.h"
+#include "reactor.h"
 
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/0)."); } while (0)
 
-static const int BUFFER_SIZE = 1024;
 static const int EXITFAILURE = -1;
 static const short DEFAULT_PORT = 9876;
+static const int MAX_CONTEXTS = 16;
+static const int MAX_CQS = 64;
+static const int MAX_REACTORS = 64;
+static const int REPORT_INTERVAL = 1; /* seconds */
+/* the kernel caps this at net.rdma_ucm.max_backlog */
+static const int DEFAULT_BACKLOG = 1024;
+/* connect requests taken off the channel before any of them is set up */
+static const int ACCEPT_BATCH = 64;
+
+enum assign_policy
+{
+    ASSIGN_LEAST_LOADED, ASSIGN_ROUND_ROBIN
+};
+
+struct context;
+struct connection;
+
+/*
+ * A CQ with its own completion channel, served by one reactor. The
+ * counters are only written by that reactor. It holds <lock> while it
+ * handles completions or flushes batches, so the CM side can tear a
+ * connection down when the two are different threads. The slot only
+ * goes back once the reactor has drained the CQ of the connection's
+ * completions: the CM side puts it on <dead> and bumps <wake_fd>.
+ */
+struct shard
+{
+    struct context *ctx;
+    int index;
+    int cpu;
+
+    struct ibv_cq *cq;
+    struct ibv_comp_channel *comp_channel;
+    int cqe;
+
+    struct reactor *reactor;
+    struct reactor_source source;
+    pthread_mutex_t lock;
+    struct coalesce_queue due;  /* connections with a batch waiting */
+    struct reactor_timer timer; /* when the head of <due> falls due */
+    struct connection *dead;    /* QP destroyed, slot not yet given back */
+    int wake_fd;                /* eventfd, bumped when <dead> fills */
+    struct reactor_source wake_source;
+
+    unsigned long long bytes;
+    unsigned long long completions;
+    int num_connections;
+};
 
+/*
+ * A batch of connection objects whose send and receive buffers are carved
+ * out of one registered arena.
+ */
+struct slab
+{
+    struct slab *next;
+    struct connection *conns;
+    char *arena;
+    struct ibv_mr *mr;
+};
+
+/*
+ * One per device (ibv_context) that connections have arrived on, with its
+ * PD, s_num_cqs completion shards and the connection slabs. Contexts and
+ * shards are set up and assigned by the main reactor only; the slabs are
+ * shared with the CM workers, which give connections back, under <lock>.
+ */
 struct context
 {
     struct ibv_context *ctx;
     struct ibv_pd *pd;
-    struct ibv_cq *cq;
-    struct ibv_comp_channel *comp_channel;
+    int max_cqe;
+
+    struct shard *shards;
+    int num_shards;
+    unsigned int next_shard;
 
-    pthread_t cq_poller_thread;
+    pthread_mutex_t lock;
+    struct slab *slabs;
+    struct connection *free_conns;
+    int num_slabs;
+
+    int num_connections;
+    unsigned long long accepts;
+    unsigned long long accept_ns;
 };
 
 struct connection
 {
+    struct context *ctx;
+    struct shard *shard;
     struct ibv_qp *qp;
+    struct connection *next_free;       /* also links connect requests */
+
+    /* the connect request, until it is accepted */
+    struct rdma_cm_id *id;
+    struct flow_params peer;
+    unsigned long long request_ns;
+
+    struct ibv_mr *mr;
+    char *send_ring;
+    char *recv_ring;
+    char *echo_ring;
+
+    /* touched by the shard's reactor once the connection is accepted */
+    struct credit_flow flow;
+    int echo;
+    unsigned int echo_head;     /* requests waiting for send credits */
+    unsigned int echo_tail;
+    uint32_t echo_off;          /* records of the backlog head already queued */
+    int coalesce;
+    struct coalescer batch;
+    unsigned long long records; /* messages received, when coalescing */
+    int greeted;
+    int broken;                 /* sent us garbage or gone: completions are ignored */
+    struct timespec first_recv;
+    struct timespec last_recv;
+};
 
-    struct ibv_mr *recv_mr;
-    struct ibv_mr *send_mr;
+/*
+ * A reactor thread with an rdma_cm event channel of its own. The main
+ * reactor takes connect requests off the listener's channel, migrates
+ * their ids here and queues them; the worker sets them up, accepts them
+ * and gets every later event of those ids.
+ */
+struct cm_worker
+{
+    struct reactor *reactor;
+    struct rdma_event_channel *channel;
+    struct reactor_source cm_source;
+    int wake_fd;                        /* eventfd, bumped when <queue> fills */
+    struct reactor_source wake_source;
+
+    pthread_mutex_t lock;
+    struct connection *queue;
+    struct connection **queue_tail;
+};
 
-    char *recv_region;
-    char *send_region;
+/* Connect requests taken off a channel in one go, in arrival order. */
+struct request_batch
+{
+    struct connection *head;
+    struct connection **tail;
+    int count;
 };
 
-static struct context *s_ctx = 0;
+static struct context *s_ctx[MAX_CONTEXTS];
+static int s_num_ctx = 0;
+
+static int s_num_cqs = 1;
+static int s_expected_conns = 16;
+static enum assign_policy s_assign = ASSIGN_LEAST_LOADED;
+static int s_first_cpu = 0;
+static int s_recv_depth = FLOW_DEFAULT_DEPTH;
+static int s_max_inline = FLOW_DEFAULT_INLINE;
+static int s_num_reactors = 0;
+static int s_backlog = DEFAULT_BACKLOG;
+static int s_num_cm_workers = 0;
+/* one delay for every connection: a shard's due queue is kept in deadline order */
+static int s_coalesce_us = COALESCE_DEFAULT_DELAY_US;
+
+static struct cm_worker *s_cm_workers[MAX_REACTORS];
+static unsigned int s_next_cm_worker = 0;
+
+static struct reactor s_main;
+static struct reactor *s_reactor_threads[MAX_REACTORS];
+static int s_num_reactor_threads = 0;
 
 void die(const char* reason)
 {
+    rlog_flush();
     fprintf(stderr, "%s\n", reason);
     exit(EXITFAILURE);
 }
 
-void on_completion(struct ibv_wc *wc)
+/*
+ * Echo mode: copy a request aside when there is no credit to answer it
+ * right away. Its credit stays with us until the echo goes out, so the
+ * client can't have more requests outstanding than the backlog holds;
+ * one that does anyway is cut off.
+ */
+void echo_defer(struct connection *conn, struct msg_hdr *msg)
+{
+    char *slot = conn->echo_ring
+            + (size_t) (conn->echo_head % s_recv_depth) * FLOW_SLOT_SIZE;
+
+    if (conn->echo_head - conn->echo_tail == (unsigned int) s_recv_depth)
+    {
+        LOG_WARN("  -- echo backlog overflow, disconnecting\n");
+        conn->broken = 1;
+        rdma_disconnect(conn->id);
+        return;
+    }
+    ++conn->echo_head;
+    memcpy(slot, msg, sizeof(*msg) + msg->len);
+    flow_hold(&conn->flow);
+}
+
+/*
+ * Echo mode with coalescing: queue the messages of a deferred batch for
+ * sending, carrying on from where the last call ran out of credits.
+ * Returns 1 once all of them are queued.
+ */
+int echo_batch(struct connection *conn, struct msg_hdr *msg)
+{
+    unsigned long long now = coalesce_now();
+    uint32_t off = conn->echo_off;
+    const char *data;
+    uint16_t len;
+    int r;
+
+    while ((data = coalesce_next(msg, &off, &len)))
+    {
+        TEST_Z((r = coalesce_push(&conn->batch, data, len, now)) >= 0);
+        if (!r)
+            return 0;
+        conn->echo_off = off;
+    }
+    conn->echo_off = 0;
+
+    return 1;
+}
+
+/*
+ * Answer deferred echo requests in order, greet the peer once there is a
+ * credit for it and hand back reposted receive slots.
+ */
+void serve(struct connection *conn)
 {
+    char greeting[64];
+    int r;
+
+    while (conn->echo_tail != conn->echo_head)
+    {
+        struct msg_hdr *msg = (struct msg_hdr *) (conn->echo_ring
+                + (size_t) (conn->echo_tail % s_recv_depth) * FLOW_SLOT_SIZE);
+
+        if (conn->coalesce)
+            r = echo_batch(conn, msg);
+        else
+            TEST_Z((r = flow_send(&conn->flow, msg + 1, msg->len)) >= 0);
+        if (!r)
+            break;
+        ++conn->echo_tail;
+        flow_release(&conn->flow);
+    }
+
+    if (!conn->greeted)
+    {
+        snprintf(greeting, sizeof(greeting),
+                "message from passive/server side with pid %d", getpid());
+        if (conn->coalesce)
+            TEST_Z((r = coalesce_push(&conn->batch, greeting,
+                    strlen(greeting) + 1, coalesce_now())) >= 0);
+        else
+            TEST_Z((r = flow_send(&conn->flow, greeting,
+                    strlen(greeting) + 1)) >= 0);
+        conn->greeted = r;
+    }
+    TEST_Z(flow_return_credits(&conn->flow) >= 0);
+}
+
+void on_completion(struct shard *shard, struct ibv_wc *wc)
+{
+    struct connection *conn = (struct connection *) (uintptr_t) wc->wr_id;
+    struct msg_hdr *msg;
+    const char *data;
+    uint32_t off = 0;
+    uint16_t len;
+    int r;
+
+    /* receives still posted when a QP goes away */
+    if (wc->status == IBV_WC_WR_FLUSH_ERR || conn->broken)
+        return;
     if (wc->status != IBV_WC_SUCCESS)
         die("on_completion: status is not IBV_WC_SUCCESS.");
 
-    fprintf(stdout, "On Completion\n");
+    __atomic_store_n(&shard->completions, shard->completions + 1,
+            __ATOMIC_RELAXED);
 
     if (wc->opcode & IBV_WC_RECV)
     {
-        struct connection *conn = (struct connection *) (uintptr_t) wc->wr_id;
-
-        printf("  -- received message: %s\n", conn->recv_region);
+        __atomic_store_n(&shard->bytes, shard->bytes + wc->byte_len,
+                __ATOMIC_RELAXED);
 
+        /* a bad length would run the echo copies off the end of a slot */
+        if (!flow_recv_ok(&conn->flow, wc->byte_len))
+        {
+            LOG_WARN("  -- malformed message (%lld bytes), disconnecting\n",
+                    wc->byte_len);
+            conn->broken = 1;
+            rdma_disconnect(conn->id);
+            return;
+        }
+        TEST_Z(msg = flow_on_recv(&conn->flow));
+        if (msg->len)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &conn->last_recv);
+            if (conn->flow.msgs_received == 1)
+                conn->first_recv = conn->last_recv;
+            if (conn->coalesce)
+            {
+                r = 0;
+                while ((data = coalesce_next(msg, &off, &len)))
+                    ++r;
+                conn->records += r;
+                LOG_DEBUG("  -- received a batch of %lld message(s)\n", r);
+            }
+            else
+                LOG_TEXT(LOG_LEVEL_DEBUG, "  -- received message: %s\n",
+                        (char *) (msg + 1));
+
+            /* the request slot is only safe until our next send */
+            if (conn->echo && conn->coalesce)
+                echo_defer(conn, msg);
+            else if (conn->echo)
+            {
+                if (conn->echo_tail != conn->echo_head)
+                    echo_defer(conn, msg);
+                else
+                {
+                    TEST_Z((r = flow_send(&conn->flow, msg + 1, msg->len)) >= 0);
+                    if (!r)
+                        echo_defer(conn, msg);
+                }
+            }
+            if (conn->broken)
+                return;
+        }
+        serve(conn);
     }
     else if (wc->opcode == IBV_WC_SEND)
     {
-        printf("  -- send completed successfully.\n");
+        LOG_DEBUG("  -- send completed successfully.\n");
+        flow_on_send(&conn->flow);
+        serve(conn);
     }
     else
     {
-        printf("  -- Not sure what is completed, opcode: %d\n", wc->opcode);
+        LOG_WARN("  -- Not sure what is completed, opcode: %lld\n",
+                wc->opcode);
     }
 }
 
-void * poll_cq(void *ctx)
+/*
+ * Flush the batches of a shard that are due and set its timer for the
+ * next one. Called with the shard lock held, on the shard's reactor.
+ */
+void flush_due(struct shard *shard)
 {
+    unsigned long long next;
+
+    if (!shard->due.head)
+        return;
+    TEST_NZ(coalesce_run(&shard->due, coalesce_now(), &next));
+    if (next)
+        TEST_NZ(reactor_schedule(shard->reactor, &shard->timer, next));
+}
+
+void on_coalesce_timer(struct reactor_timer *timer)
+{
+    struct shard *shard = (struct shard *) timer->arg;
+
+    pthread_mutex_lock(&shard->lock);
+    flush_due(shard);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* The completion channel of a shard is readable. */
+void on_cq_event(struct reactor_source *src)
+{
+    struct shard *shard = (struct shard *) src->arg;
     struct ibv_cq *cq;
     struct ibv_wc wc;
+    void *cq_context;
+    unsigned int events = 0;
+
+    while (!ibv_get_cq_event(shard->comp_channel, &cq, &cq_context))
+        ++events;
+    if (errno != EAGAIN)
+        die("on_cq_event: ibv_get_cq_event failed.");
+    if (!events)
+        return;
+    ibv_ack_cq_events(shard->cq, events);
+    TEST_NZ(ibv_req_notify_cq(shard->cq, 0));
+
+    pthread_mutex_lock(&shard->lock);
+    while (ibv_poll_cq(shard->cq, 1, &wc))
+        on_completion(shard, &wc);
+    flush_due(shard);
+    pthread_mutex_unlock(&shard->lock);
+}
 
-    while (1)
-    {
-        TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx));
-        ibv_ack_cq_events(cq, 1);
-        TEST_NZ(ibv_req_notify_cq(cq, 0));
+void pin_thread(struct reactor *r)
+{
+    cpu_set_t cpus;
 
-        while (ibv_poll_cq(cq, 1, &wc))
-            on_completion(&wc);
-    }
+    /* batch deadlines are a few microseconds away */
+    prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+
+    if (r->cpu < 0)
+        return;
+    CPU_ZERO(&cpus);
+    CPU_SET(r->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+        LOG_WARN("pin_thread: could not pin reactor %lld to CPU %lld\n",
+                r->index, r->cpu);
+}
+
+void * run_reactor(void *arg)
+{
+    struct reactor *r = (struct reactor *) arg;
+
+    pin_thread(r);
+    reactor_run(r);
+    die("run_reactor: epoll_wait failed.");
 
     return 0;
 }
 
-void build_context(struct ibv_context *verbs)
+struct reactor * start_reactor(int cpu)
+{
+    struct reactor *r;
+
+    if (s_num_reactor_threads == MAX_REACTORS)
+        die("start_reactor: too many reactors.");
+    TEST_Z(r = (struct reactor *) calloc(1, sizeof(struct reactor)));
+    TEST_NZ(reactor_init(r, s_num_reactor_threads + 1, cpu));
+    s_reactor_threads[s_num_reactor_threads++] = r;
+    TEST_NZ(pthread_create(&r->thread, 0, run_reactor, r));
+
+    return r;
+}
+
+/*
+ * The reactor for the <n>th shard the server sets up. By default every
+ * shard gets a thread of its own; with --reactors the shards are dealt
+ * out over the main reactor and the extra threads.
+ */
+struct reactor * shard_reactor(int n, int cpu)
+{
+    if (!s_num_reactors)
+        return start_reactor(cpu);
+    if (n % s_num_reactors == 0)
+        return &s_main;
+
+    return s_reactor_threads[n % s_num_reactors - 1];
+}
+
+/*
+ * CQ depth for <conns> connections, rounded up to a power of two and
+ * clamped to what the device allows. Worst case every send and receive
+ * of a connection completes at once.
+ */
+int cq_depth(struct context *ctx, int conns)
 {
-    if (s_ctx)
+    int cqe = 64;
+
+    while (cqe < conns * 2 * s_recv_depth && cqe < ctx->max_cqe)
+        cqe *= 2;
+
+    return cqe < ctx->max_cqe ? cqe : ctx->max_cqe;
+}
+
+/*
+ * Add a slab of s_expected_conns connections to the context's free list.
+ * This is the only place connection buffers get allocated and registered.
+ */
+void grow_slabs(struct context *ctx)
+{
+    struct slab *slab;
+    size_t ring = flow_ring_size(s_recv_depth);
+    size_t size = (size_t) s_expected_conns * 3 * ring;
+    void *arena;
+    int i;
+
+    TEST_Z(slab = (struct slab *) calloc(1, sizeof(struct slab)));
+    TEST_Z(slab->conns = (struct connection *) calloc(s_expected_conns,
+            sizeof(struct connection)));
+    TEST_NZ(posix_memalign(&arena, sysconf(_SC_PAGESIZE), size));
+    slab->arena = (char *) arena;
+
+    TEST_Z(
+            slab->mr = ibv_reg_mr(ctx->pd, slab->arena, size,
+                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+
+    for (i = s_expected_conns - 1; i >= 0; --i)
     {
-        if (s_ctx->ctx != verbs)
-            die("cannot handle events in more than one context.");
+        struct connection *conn = &slab->conns[i];
+
+        conn->ctx = ctx;
+        conn->send_ring = slab->arena + (size_t) i * 3 * ring;
+        conn->recv_ring = conn->send_ring + ring;
+        conn->echo_ring = conn->recv_ring + ring;
+        conn->mr = slab->mr;
+        conn->next_free = ctx->free_conns;
+        ctx->free_conns = conn;
+    }
+
+    slab->next = ctx->slabs;
+    ctx->slabs = slab;
+    ++ctx->num_slabs;
+
+    LOG_INFO("  -- slab %lld: %lld connections in a %lld KB arena\n",
+            ctx->num_slabs, s_expected_conns, size / 1024);
+}
+
+struct connection * get_connection(struct context *ctx)
+{
+    struct connection *conn;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->free_conns)
+        grow_slabs(ctx);
 
+    conn = ctx->free_conns;
+    ctx->free_conns = conn->next_free;
+    conn->next_free = 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return conn;
+}
+
+/*
+ * Sustained receive rate of a connection, first to last data message,
+ * and how well batches filled up when coalescing.
+ */
+void print_rate(struct connection *conn)
+{
+    unsigned long long msgs = conn->coalesce ?
+            conn->records : conn->flow.msgs_received;
+    struct coalescer *batch = &conn->batch;
+    double secs = (conn->last_recv.tv_sec - conn->first_recv.tv_sec)
+            + (conn->last_recv.tv_nsec - conn->first_recv.tv_nsec) / 1e9;
+
+    if (msgs < 2 || secs <= 0)
         return;
+
+    printf("  -- %llu messages in %.3f s: %.0f msg/s, %llu credit message(s) sent\n",
+            msgs, secs, (msgs - 1) / secs,
+            conn->flow.send_posted - conn->flow.msgs_sent);
+    if (conn->coalesce && batch->batches)
+        printf("  -- %.1f messages per batch in, %.1f out, %.2f us added per message out\n",
+                (double) msgs / conn->flow.msgs_received,
+                (double) batch->msgs / batch->batches,
+                batch->wait_ns / 1e3 / batch->msgs);
+}
+
+void put_connection(struct connection *conn)
+{
+    conn->qp = 0;
+    conn->id = 0;
+    conn->shard = 0;
+    conn->greeted = 0;
+    conn->broken = 0;
+    conn->echo = 0;
+    conn->echo_head = 0;
+    conn->echo_tail = 0;
+    conn->echo_off = 0;
+    conn->coalesce = 0;
+    conn->records = 0;
+
+    pthread_mutex_lock(&conn->ctx->lock);
+    conn->next_free = conn->ctx->free_conns;
+    conn->ctx->free_conns = conn;
+    pthread_mutex_unlock(&conn->ctx->lock);
+}
+
+/*
+ * Connections were dropped: their QPs are gone, but completions of theirs
+ * may still sit in the CQ. Handle whatever is there before their slots
+ * go back to be reused.
+ */
+void on_shard_wake(struct reactor_source *src)
+{
+    struct shard *shard = (struct shard *) src->arg;
+    struct connection *conn, *next;
+    struct ibv_wc wc;
+    uint64_t count;
+
+    while (read(shard->wake_fd, &count, sizeof(count)) > 0)
+        ;
+
+    pthread_mutex_lock(&shard->lock);
+    while (ibv_poll_cq(shard->cq, 1, &wc))
+        on_completion(shard, &wc);
+    flush_due(shard);
+    conn = shard->dead;
+    shard->dead = 0;
+    pthread_mutex_unlock(&shard->lock);
+
+    for (; conn; conn = next)
+    {
+        next = conn->next_free;
+        conn->next_free = 0;
+        print_rate(conn);
+        put_connection(conn);
     }
+}
+
+/*
+ * Look up the context for the device a connection arrived on, setting up
+ * its PD and CQ shards the first time the device is seen. Each shard's CQ
+ * starts out sized for its part of s_expected_conns. Only called from the
+ * CM event loop.
+ */
+struct context * build_context(struct ibv_context *verbs)
+{
+    struct context *ctx;
+    struct ibv_device_attr attr;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
 
-    s_ctx = (struct context *) malloc(sizeof(struct context));
+    for (i = 0; i < s_num_ctx; ++i)
+        if (s_ctx[i]->ctx == verbs)
+            return s_ctx[i];
 
-    s_ctx->ctx = verbs;
+    if (s_num_ctx == MAX_CONTEXTS)
+        die("build_context: too many devices.");
 
-    TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
-    TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-    TEST_Z(
-            s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, 0, s_ctx->comp_channel,
-                    0)); /* cqe=10 is arbitrary */
-    TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
+    TEST_Z(ctx = (struct context *) calloc(1, sizeof(struct context)));
+
+    ctx->ctx = verbs;
+    TEST_NZ(ibv_query_device(verbs, &attr));
+    ctx->max_cqe = attr.max_cqe;
+
+    TEST_Z(ctx->pd = ibv_alloc_pd(ctx->ctx));
+    TEST_NZ(pthread_mutex_init(&ctx->lock, 0));
+
+    ctx->num_shards = s_num_cqs;
+    TEST_Z(ctx->shards = (struct shard *) calloc(ctx->num_shards,
+            sizeof(struct shard)));
+
+    for (i = 0; i < ctx->num_shards; ++i)
+    {
+        struct shard *shard = &ctx->shards[i];
+
+        shard->ctx = ctx;
+        shard->index = i;
+        /* devices take consecutive CPU ranges so their reactors don't share */
+        shard->reactor = shard_reactor(s_num_ctx * s_num_cqs + i,
+                (s_first_cpu + s_num_ctx * s_num_cqs + i) % (ncpus > 0 ? ncpus : 1));
+        shard->cpu = shard->reactor->cpu;
+        shard->timer.fire = on_coalesce_timer;
+        shard->timer.arg = shard;
+        shard->cqe = cq_depth(ctx,
+                (s_expected_conns + ctx->num_shards - 1) / ctx->num_shards);
+
+        TEST_NZ(pthread_mutex_init(&shard->lock, 0));
+        TEST_Z(shard->comp_channel = ibv_create_comp_channel(ctx->ctx));
+        TEST_Z(
+                shard->cq = ibv_create_cq(ctx->ctx, shard->cqe, shard,
+                        shard->comp_channel, 0));
+        TEST_NZ(ibv_req_notify_cq(shard->cq, 0));
+
+        TEST_NZ(reactor_add(shard->reactor, &shard->source,
+                shard->comp_channel->fd, on_cq_event, shard));
+        TEST_Z((shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0);
+        TEST_NZ(reactor_add(shard->reactor, &shard->wake_source,
+                shard->wake_fd, on_shard_wake, shard));
+    }
+
+    grow_slabs(ctx);
+
+    printf("  -- new context for device %s, %d CQ(s) of %d entries\n",
+            ibv_get_device_name(verbs->device), ctx->num_shards,
+            ctx->shards[0].cqe);
 
-    TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, 0, poll_cq, 0));
+    s_ctx[s_num_ctx] = ctx;
+    __atomic_store_n(&s_num_ctx, s_num_ctx + 1, __ATOMIC_RELEASE);
+
+    return ctx;
 }
 
-void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
+/*
+ * Pick the shard for a new connection and make sure its CQ can take the
+ * extra completions, growing it if the connection count went past what
+ * it was sized for.
+ */
+struct shard * assign_shard(struct context *ctx)
+{
+    struct shard *shard;
+    int i, cqe;
+
+    if (s_assign == ASSIGN_ROUND_ROBIN)
+    {
+        shard = &ctx->shards[ctx->next_shard++ % ctx->num_shards];
+    }
+    else
+    {
+        shard = &ctx->shards[0];
+        for (i = 1; i < ctx->num_shards; ++i)
+            if (ctx->shards[i].num_connections < shard->num_connections)
+                shard = &ctx->shards[i];
+    }
+
+    cqe = cq_depth(ctx, shard->num_connections + 1);
+    if (cqe > shard->cqe)
+    {
+        if (ibv_resize_cq(shard->cq, cqe))
+            LOG_WARN("  -- could not grow CQ %lld to %lld entries\n",
+                    shard->index, cqe);
+        else
+            shard->cqe = cqe;
+    }
+
+    __atomic_add_fetch(&shard->num_connections, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ctx->num_connections, 1, __ATOMIC_RELAXED);
+
+    return shard;
+}
+
+void release_shard(struct connection *conn)
+{
+    __atomic_sub_fetch(&conn->shard->num_connections, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&conn->ctx->num_connections, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Print per-device accept rate and throughput, aggregate throughput and
+ * the completion rate of every CQ shard, every REPORT_INTERVAL seconds as
+ * long as something moved. Runs as a timer on the main reactor.
+ */
+void report_throughput(struct reactor_timer *timer)
+{
+    static unsigned long long last_bytes[MAX_CONTEXTS][MAX_CQS];
+    static unsigned long long last_comps[MAX_CONTEXTS][MAX_CQS];
+    static unsigned long long last_accepts[MAX_CONTEXTS];
+    static unsigned long long last_accept_ns[MAX_CONTEXTS];
+    unsigned long long bytes, comps, dev_bytes, total, accepts, accept_ns;
+    int i, j, n;
+
+    n = __atomic_load_n(&s_num_ctx, __ATOMIC_ACQUIRE);
+    total = 0;
+    for (i = 0; i < n; ++i)
+    {
+        struct context *ctx = s_ctx[i];
+
+        dev_bytes = 0;
+        for (j = 0; j < ctx->num_shards; ++j)
+        {
+            bytes = __atomic_load_n(&ctx->shards[j].bytes,
+                    __ATOMIC_RELAXED);
+            dev_bytes += bytes - last_bytes[i][j];
+            last_bytes[i][j] = bytes;
+        }
+        total += dev_bytes;
+
+        accepts = __atomic_load_n(&ctx->accepts, __ATOMIC_RELAXED);
+        accept_ns = __atomic_load_n(&ctx->accept_ns, __ATOMIC_RELAXED);
+        if (accepts != last_accepts[i])
+            printf("  %-16s %10.0f accepts/s, %.1f us to accept\n",
+                    ibv_get_device_name(ctx->ctx->device),
+                    (double) (accepts - last_accepts[i]) / REPORT_INTERVAL,
+                    (double) (accept_ns - last_accept_ns[i])
+                            / (accepts - last_accepts[i]) / 1000);
+        last_accepts[i] = accepts;
+        last_accept_ns[i] = accept_ns;
+
+        if (!dev_bytes)
+            continue;
+
+        printf("  %-16s %10.2f MB/s, %d connection(s)\n",
+                ibv_get_device_name(ctx->ctx->device),
+                (double) dev_bytes / REPORT_INTERVAL / 0x100000,
+                __atomic_load_n(&ctx->num_connections, __ATOMIC_RELAXED));
+        for (j = 0; j < ctx->num_shards; ++j)
+        {
+            comps = __atomic_load_n(&ctx->shards[j].completions,
+                    __ATOMIC_RELAXED);
+            printf("    cq %-3d cpu %-3d %10.0f completions/s, %d connection(s)\n",
+                    j, ctx->shards[j].cpu,
+                    (double) (comps - last_comps[i][j]) / REPORT_INTERVAL,
+                    __atomic_load_n(&ctx->shards[j].num_connections,
+                            __ATOMIC_RELAXED));
+            last_comps[i][j] = comps;
+        }
+    }
+    if (total)
+        printf("aggregate: %10.2f MB/s over %d device(s)\n",
+                (double) total / REPORT_INTERVAL / 0x100000, n);
+
+    TEST_NZ(reactor_schedule(&s_main, timer,
+            timer->deadline + REPORT_INTERVAL * 1000000000ULL));
+}
+
+/*
+ * The id's connection is gone or never got going: destroy its QP and have
+ * the shard's reactor give the slot back once the CQ holds nothing of it.
+ */
+void drop_connection(struct rdma_cm_id *id)
+{
+    struct connection *conn = (struct connection *) id->context;
+    struct shard *shard = conn->shard;
+    uint64_t one = 1;
+
+    /* keep the shard's reactor off the connection while it goes away */
+    pthread_mutex_lock(&shard->lock);
+    if (conn->batch.queued)
+        coalesce_unlink(&conn->batch);
+    release_shard(conn);
+    conn->broken = 1;
+    rdma_destroy_qp(id);
+    conn->next_free = shard->dead;
+    shard->dead = conn;
+    pthread_mutex_unlock(&shard->lock);
+    TEST_Z(write(shard->wake_fd, &one, sizeof(one)) == sizeof(one));
+
+    rdma_destroy_id(id);
+}
+
+void build_qp_attr(struct shard *shard, struct ibv_qp_init_attr *qp_attr)
 {
     memset(qp_attr, 0, sizeof(*qp_attr));
 
-    qp_attr->send_cq = s_ctx->cq;
-    qp_attr->recv_cq = s_ctx->cq;
+    qp_attr->send_cq = shard->cq;
+    qp_attr->recv_cq = shard->cq;
     qp_attr->qp_type = IBV_QPT_RC;
 
-    qp_attr->cap.max_send_wr = 10;
-    qp_attr->cap.max_recv_wr = 10;
-    qp_attr->cap.max_send_sge = 1;
+    qp_attr->cap.max_send_wr = s_recv_depth;
+    qp_attr->cap.max_recv_wr = s_recv_depth;
+    qp_attr->cap.max_send_sge = 2;      /* header + payload on inline sends */
+    qp_attr->cap.max_inline_data = s_max_inline;
     qp_attr->cap.max_recv_sge = 1;
 }
 
-void post_receives(struct connection *conn)
+/*
+ * Everything a connection needs besides its slot, done off the critical
+ * path of the listener: create the QP, post the receives and accept. The
+ * request was taken by take_request(), on this thread or the main one.
+ */
+void accept_request(struct connection *conn)
 {
-    struct ibv_recv_wr wr, *bad_wr = 0;
-    struct ibv_sge sge;
+    struct rdma_cm_id *id = conn->id;
+    struct shard *shard = conn->shard;
+    struct context *ctx = conn->ctx;
+    ibv_qp_init_attr qp_attr;
+    rdma_conn_param cm_params;
+    flow_params local_params;
 
-    wr.wr_id = (uintptr_t) conn;
-    wr.next = 0;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
+    build_qp_attr(shard, &qp_attr);
+    LOG_DEBUG("  -- Built QP attributes\n");
 
-    sge.addr = (uintptr_t) conn->recv_region;
-    sge.length = BUFFER_SIZE;
-    sge.lkey = conn->recv_mr->lkey;
+    if (rdma_create_qp(id, ctx->pd, &qp_attr) != 0)
+    {
+        /* the device may not do this much inline; do without */
+        qp_attr.cap.max_inline_data = 0;
+        if (rdma_create_qp(id, ctx->pd, &qp_attr) != 0)
+        {
+            LOG_ERROR("  -- ERROR: Failed to create Queue Pair\n");
+            rdma_reject(id, 0, 0);
+            release_shard(conn);
+            put_connection(conn);
+            rdma_destroy_id(id);
+            return;
+        }
+    }
+    conn->qp = id->qp;
 
-    TEST_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr));
+    if (flow_init(&conn->flow, conn->qp, conn->mr->lkey,
+            (uintptr_t) conn,
+            conn->peer.flags & FLOW_NO_INLINE ?
+                    0 : qp_attr.cap.max_inline_data,
+            conn->send_ring, conn->recv_ring, s_recv_depth))
+    {
+        LOG_ERROR("  -- ERROR: Failed to post receives\n");
+        rdma_reject(id, 0, 0);
+        drop_connection(id);
+        return;
+    }
+    flow_set_peer_depth(&conn->flow, conn->peer.depth);
+    /* an echo client counts every data message as a reply: no greeting */
+    conn->echo = conn->greeted = !!(conn->peer.flags & FLOW_ECHO);
+    conn->coalesce = !!(conn->peer.flags & FLOW_COALESCE);
+    if (conn->coalesce)
+        coalesce_init(&conn->batch, &conn->flow, &shard->due, 0,
+                s_coalesce_us * 1000ULL);
+
+    memset(&local_params, 0, sizeof(local_params));
+    local_params.depth = s_recv_depth;
+    memset(&cm_params, 0, sizeof(cm_params));
+    cm_params.private_data = &local_params;
+    cm_params.private_data_len = sizeof(local_params);
+    if (rdma_accept(id, &cm_params))
+    {
+        /* in a storm the client may well have timed out already */
+        LOG_WARN("  -- accept failed, dropping the connection\n");
+        drop_connection(id);
+        return;
+    }
+
+    /* from the request coming off the channel, queueing included */
+    __atomic_add_fetch(&ctx->accept_ns, reactor_now() - conn->request_ns,
+            __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ctx->accepts, 1, __ATOMIC_RELAXED);
 }
 
-void register_memory(struct connection *conn)
+/*
+ * A connect request: pick its device context, shard and connection slot
+ * and add it to <batch>. Nothing that talks to the device per connection
+ * happens here. Main reactor only.
+ */
+void take_request(struct rdma_cm_id *id, struct flow_params *peer,
+        unsigned long long now, struct request_batch *batch)
 {
-    conn->send_region = (char*) malloc(BUFFER_SIZE);
-    conn->recv_region = (char*) malloc(BUFFER_SIZE);
-    //should check for memory allocation failure BTW
+    struct context *ctx;
+    struct shard *shard;
+    struct connection *conn;
 
-    TEST_Z(
-            conn->send_mr = ibv_reg_mr(s_ctx->pd, conn->send_region,
-                    BUFFER_SIZE,
-                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    if (!peer->depth)
+    {
+        LOG_WARN("  -- rejecting peer without a receive depth\n");
+        rdma_reject(id, 0, 0);
+        rdma_destroy_id(id);
+        return;
+    }
+    LOG_TEXT(LOG_LEVEL_INFO, "Connection Requested on %s\n",
+            ibv_get_device_name(id->verbs->device));
+    ctx = build_context(id->verbs);
+    LOG_DEBUG("  -- Built context\n");
+    shard = assign_shard(ctx);
+    LOG_INFO("  -- Assigned to CQ %lld\n", shard->index);
+
+    id->context = conn = get_connection(ctx);
+    conn->shard = shard;
+    conn->id = id;
+    conn->peer = *peer;
+    conn->request_ns = now;
+
+    *batch->tail = conn;
+    batch->tail = &conn->next_free;
+    ++batch->count;
+}
 
-    TEST_Z(
-            conn->recv_mr = ibv_reg_mr(s_ctx->pd, conn->recv_region,
-                    BUFFER_SIZE,
-                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+/*
+ * Accept a batch of requests here, or deal them out round robin to the
+ * CM workers: each id moves to its worker's channel, and each worker is
+ * woken once for its share of the batch.
+ */
+void dispatch_requests(struct request_batch *batch)
+{
+    struct connection *conn, *next;
+    struct cm_worker *worker;
+    struct request_batch shares[MAX_REACTORS];
+    uint64_t one = 1;
+    int i;
+
+    *batch->tail = 0;
+    if (!s_num_cm_workers)
+    {
+        for (conn = batch->head; conn; conn = next)
+        {
+            next = conn->next_free;
+            conn->next_free = 0;
+            accept_request(conn);
+        }
+    }
+    else
+    {
+        for (i = 0; i < s_num_cm_workers; ++i)
+        {
+            shares[i].head = 0;
+            shares[i].tail = &shares[i].head;
+            shares[i].count = 0;
+        }
+        for (conn = batch->head; conn; conn = next)
+        {
+            next = conn->next_free;
+            i = s_next_cm_worker++ % s_num_cm_workers;
+            TEST_NZ(rdma_migrate_id(conn->id, s_cm_workers[i]->channel));
+            *shares[i].tail = conn;
+            shares[i].tail = &conn->next_free;
+            ++shares[i].count;
+        }
+        for (i = 0; i < s_num_cm_workers; ++i)
+        {
+            if (!shares[i].count)
+                continue;
+            worker = s_cm_workers[i];
+            *shares[i].tail = 0;
+
+            pthread_mutex_lock(&worker->lock);
+            *worker->queue_tail = shares[i].head;
+            worker->queue_tail = shares[i].tail;
+            pthread_mutex_unlock(&worker->lock);
+            TEST_Z(write(worker->wake_fd, &one, sizeof(one)) == sizeof(one));
+        }
+    }
+
+    batch->head = 0;
+    batch->tail = &batch->head;
+    batch->count = 0;
+}
+
+void on_cm_event(struct rdma_cm_event *event, struct request_batch *batch)
+{
+    rdma_cm_event event_copy;
+    flow_params peer_params;
+
+    //event only lasts till the next one is on the queue therefore,
+    //copy it to a more sustainable location
+
+    memcpy(&event_copy, event, sizeof(rdma_cm_event));
+    //so does the private data, which carries the peer's receive depth
+    if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
+    {
+        memset(&peer_params, 0, sizeof(peer_params));
+        memcpy(&peer_params, event->param.conn.private_data,
+                event->param.conn.private_data_len < sizeof(peer_params) ?
+                        event->param.conn.private_data_len :
+                        sizeof(peer_params));
+    }
+    rdma_ack_cm_event(event);
+    switch (event_copy.event)
+    {
+    case RDMA_CM_EVENT_CONNECT_REQUEST:
+
+        take_request(event_copy.id, &peer_params, reactor_now(), batch);
+        break;
+
+    case RDMA_CM_EVENT_ESTABLISHED:
+
+        /* the greeting goes out from the shard's reactor with the first credits */
+        LOG_INFO("Connection Established\n");
+        break;
+
+    case RDMA_CM_EVENT_DISCONNECTED:
+        LOG_INFO("Connection disconnected\n");
+        drop_connection(event_copy.id);
+        break;
+
+    case RDMA_CM_EVENT_CONNECT_ERROR:
+    case RDMA_CM_EVENT_UNREACHABLE:
+    case RDMA_CM_EVENT_REJECTED:
+        /* accepted, but the client gave up before it was established */
+        LOG_WARN("  -- %s on an accepted connection\n",
+                rdma_event_str(event_copy.event));
+        drop_connection(event_copy.id);
+        break;
+
+    default:
+        break;
+
+    }
+}
+
+/*
+ * A CM event channel is readable: the listener's on the main reactor or
+ * a worker's. Connect requests are set up in batches of ACCEPT_BATCH, so
+ * a storm of them is acked quickly instead of one accept at a time.
+ */
+void on_cm_events(struct reactor_source *src)
+{
+    struct rdma_event_channel *ec = (struct rdma_event_channel *) src->arg;
+    struct rdma_cm_event *event;
+    struct request_batch batch;
+
+    batch.head = 0;
+    batch.tail = &batch.head;
+    batch.count = 0;
+
+    while (!rdma_get_cm_event(ec, &event))
+    {
+        on_cm_event(event, &batch);
+        if (batch.count == ACCEPT_BATCH)
+            dispatch_requests(&batch);
+    }
+    if (errno != EAGAIN)
+        die("on_cm_events: rdma_get_cm_event failed.");
+    if (batch.count)
+        dispatch_requests(&batch);
+}
+
+/* A CM worker was handed requests: set them all up and accept them. */
+void on_cm_wake(struct reactor_source *src)
+{
+    struct cm_worker *worker = (struct cm_worker *) src->arg;
+    struct connection *conn, *next;
+    uint64_t count;
+
+    while (read(worker->wake_fd, &count, sizeof(count)) > 0)
+        ;
+
+    pthread_mutex_lock(&worker->lock);
+    conn = worker->queue;
+    worker->queue = 0;
+    worker->queue_tail = &worker->queue;
+    pthread_mutex_unlock(&worker->lock);
+
+    for (; conn; conn = next)
+    {
+        next = conn->next_free;
+        conn->next_free = 0;
+        accept_request(conn);
+    }
+}
+
+void start_cm_worker(void)
+{
+    struct cm_worker *worker;
+
+    TEST_Z(worker = (struct cm_worker *) calloc(1, sizeof(struct cm_worker)));
+    TEST_NZ(pthread_mutex_init(&worker->lock, 0));
+    worker->queue_tail = &worker->queue;
+    TEST_Z(worker->channel = rdma_create_event_channel());
+    TEST_Z((worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0);
+
+    /* not pinned: the CPUs from --cpu belong to the CQ reactors */
+    worker->reactor = start_reactor(-1);
+    TEST_NZ(reactor_add(worker->reactor, &worker->cm_source,
+            worker->channel->fd, on_cm_events, worker->channel));
+    TEST_NZ(reactor_add(worker->reactor, &worker->wake_source,
+            worker->wake_fd, on_cm_wake, worker));
+
+    s_cm_workers[s_num_cm_workers++] = worker;
 }
 
 int main(int argc, char* argv[])
@@ -168,6 +1148,16 @@ int main(int argc, char* argv[])
     { "server", 0, 0, 's' },
     { "client", 1, 0, 'c' },
     { "port", 1, 0, 'p' },
+    { "cqs", 1, 0, 'q' },
+    { "conns", 1, 0, 'n' },
+    { "assign", 1, 0, 'a' },
+    { "cpu", 1, 0, 'C' },
+    { "depth", 1, 0, 'r' },
+    { "inline", 1, 0, 'i' },
+    { "reactors", 1, 0, 'R' },
+    { "backlog", 1, 0, 'b' },
+    { "cm-threads", 1, 0, 'L' },
+    { "batch-us", 1, 0, 'B' },
     { 0, 0, 0, 0 } };
 
     int num_devices = 0;
@@ -175,18 +1165,12 @@ int main(int argc, char* argv[])
     ibv_device** ib_devices = ibv_get_device_list(&num_devices);
 
     sockaddr_in addr;
-    rdma_cm_event *event = 0;
     rdma_cm_id *listener = 0;
     rdma_event_channel *ec = 0;
-
-    //Connection request
-    ibv_qp_init_attr qp_attr;
-    connection* conn;
-    rdma_conn_param cm_params;
-
-    //Connection
-    ibv_send_wr wr, *bad_wr = 0;
-    ibv_sge sge;
+    reactor_source cm_source;
+    reactor_timer report_timer;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
 
     char* address = 0;
     unsigned short port = DEFAULT_PORT;
@@ -197,7 +1181,7 @@ int main(int argc, char* argv[])
 
     while (!done_option)
     {
-        opt = getopt_long(argc, argv, "s::c:p:", long_options, 0);
+        opt = getopt_long(argc, argv, "s::c:p:q:n:a:C:r:i:R:b:L:B:", long_options, 0);
         printf("Option selected: %d", opt);
         switch (opt)
         {
@@ -222,10 +1206,67 @@ int main(int argc, char* argv[])
             TEST_Z(sscanf(optarg, "%hud", &port)); //unsigned short
             fprintf(stdout, "Processing port option: %d <- %s\n", port, optarg);
             break;
+        case 'q':
+            s_num_cqs = atoi(optarg);
+            if (s_num_cqs < 1 || s_num_cqs > MAX_CQS)
+                die("--cqs must be between 1 and 64");
+            break;
+        case 'n':
+            s_expected_conns = atoi(optarg);
+            if (s_expected_conns < 1)
+                die("--conns must be at least 1");
+            break;
+        case 'a':
+            if (!strcmp(optarg, "rr"))
+                s_assign = ASSIGN_ROUND_ROBIN;
+            else if (!strcmp(optarg, "least"))
+                s_assign = ASSIGN_LEAST_LOADED;
+            else
+                die("--assign takes rr or least");
+            break;
+        case 'C':
+            s_first_cpu = atoi(optarg);
+            break;
+        case 'r':
+            s_recv_depth = atoi(optarg);
+            if (s_recv_depth < FLOW_MIN_DEPTH || s_recv_depth > FLOW_MAX_DEPTH)
+                die("--depth must be between 4 and 4096");
+            break;
+        case 'i':
+            s_max_inline = atoi(optarg);
+            if (s_max_inline < 0)
+                die("--inline must not be negative");
+            break;
+        case 'R':
+            s_num_reactors = atoi(optarg);
+            if (s_num_reactors < 0 || s_num_reactors > MAX_REACTORS)
+                die("--reactors must be between 0 and 64");
+            break;
+        case 'b':
+            s_backlog = atoi(optarg);
+            if (s_backlog < 1)
+                die("--backlog must be at least 1");
+            break;
+        case 'L':
+            s_num_cm_workers = atoi(optarg);
+            if (s_num_cm_workers < 0 || s_num_cm_workers > MAX_REACTORS / 2)
+                die("--cm-threads must be between 0 and 32");
+            break;
+        case 'B':
+            s_coalesce_us = atoi(optarg);
+            if (s_coalesce_us < 0)
+                die("--batch-us must not be negative");
+            break;
         default:
             fprintf(stderr, "Unrecognised option\n");
             fprintf(stderr,
-                    "usage: server_rdma [-s<local address>] [-c <server address>] [-p port]\n");
+                    "usage: server_rdma [-s<local address>] [-c <server address>] [-p port]\n"
+                    "                   [-q cqs per device] [-n expected connections per device]\n"
+                    "                   [-a rr|least] [-C first reactor cpu] [-r receive depth]\n"
+                    "                   [-i max inline bytes, 0 = off]\n"
+                    "                   [-R reactor threads, 0 = one per cq]\n"
+                    "                   [-b listen backlog] [-L cm threads, 0 = accept on the main thread]\n"
+                    "                   [-B longest a coalesced reply waits, us]\n");
             done_option = true;
             break;
         }
@@ -251,86 +1292,29 @@ int main(int argc, char* argv[])
     TEST_Z(ec = rdma_create_event_channel());
     TEST_NZ(rdma_create_id(ec, &listener, 0, RDMA_PS_TCP));
     TEST_NZ(rdma_bind_addr(listener, (struct sockaddr * )&addr));
-    TEST_NZ(rdma_listen(listener, 10)); /* backlog=10 is arbitrary */
+    TEST_NZ(rdma_listen(listener, s_backlog));
 
     port = ntohs(rdma_get_src_port(listener));
-    printf("listening on port %d.\n", port);
-
-    while (rdma_get_cm_event(ec, &event) == 0)
-    {
-        rdma_cm_event event_copy;
-        //event only lasts till the next one is on the queue therefore,
-        //copy it to a more sustainable location
+    printf("listening on port %d, backlog %d.\n", port, s_backlog);
 
-        memcpy(&event_copy, event, sizeof(rdma_cm_event));
-        rdma_ack_cm_event(event);
-        switch (event_copy.event)
-        {
-        case RDMA_CM_EVENT_CONNECT_REQUEST:
-
-            printf("Connection Requested\n");
-            build_context(event_copy.id->verbs);
-            printf("  -- Built context\n");
-            build_qp_attr(&qp_attr);
-            printf("  -- Built QP attributes\n");
+    rlog_init();
 
-            if (rdma_create_qp(event_copy.id, s_ctx->pd, &qp_attr) != 0)
-            {
-                printf("  -- ERROR: Failed to create Queue Pair\n");
-            }
+    /* reactor 0 is this thread: CM events, the report and maybe some CQs */
+    TEST_NZ(reactor_init(&s_main, 0,
+            s_num_reactors ? s_first_cpu % (ncpus > 0 ? ncpus : 1) : -1));
+    pin_thread(&s_main);
+    for (i = 1; i < s_num_reactors; ++i)
+        start_reactor((s_first_cpu + i) % (ncpus > 0 ? ncpus : 1));
+    for (i = 0; i < s_num_cm_workers; ++i)
+        start_cm_worker();
 
-            event_copy.id->context = conn = (struct connection *) malloc(
-                    sizeof(struct connection));
-            conn->qp = event_copy.id->qp;
+    TEST_NZ(reactor_add(&s_main, &cm_source, ec->fd, on_cm_events, ec));
+    report_timer.fire = report_throughput;
+    TEST_NZ(reactor_schedule(&s_main, &report_timer,
+            reactor_now() + REPORT_INTERVAL * 1000000000ULL));
 
-            register_memory(conn);
-            post_receives(conn);
+    reactor_run(&s_main);
+    die("main: epoll_wait failed.");
 
-            memset(&cm_params, 0, sizeof(cm_params));
-            TEST_NZ(rdma_accept(event_copy.id, &cm_params));
-
-            break;
-        case RDMA_CM_EVENT_ESTABLISHED:
-
-            printf("Connection Established\n");
-            printf("  -- connected\n");
-            memset(&wr, 0, sizeof(wr));
-            //memset(conn, 0 , sizeof(connection));
-            event_copy.id->context = conn;
-            snprintf(conn->send_region, BUFFER_SIZE,
-                    "message from passive/server side with pid %d", getpid());
-            wr.opcode = IBV_WR_SEND;
-            wr.sg_list = &sge;
-            wr.num_sge = 1;
-            wr.send_flags = IBV_SEND_SIGNALED;
-            sge.addr = (uintptr_t) conn->send_region;
-            sge.length = BUFFER_SIZE;
-            sge.lkey = conn->send_mr->lkey;
-            TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
-            printf("  -- posting send ...\n");
-            break;
-
-        case RDMA_CM_EVENT_DISCONNECTED:
-            printf("Connection disconnected\n");
-            printf("peer disconnected.\n");
-
-            rdma_destroy_qp(event_copy.id);
-
-            ibv_dereg_mr(conn->send_mr);
-            ibv_dereg_mr(conn->recv_mr);
-
-            free(conn->send_region);
-            free(conn->recv_region);
-
-            free(conn);
-
-            rdma_destroy_id(event_copy.id);
-            break;
-
-        default:
-            break;
-
-        }
-    }
     return 0;
 }
@@ -0,0 +1,276 @@
+/*
+ * storm - open many connections to server_rdma at once, the way a cluster
+ * does when every node starts together, and report how fast the server
+ * accepted them and how long the slowest ones took.
+ *
+ * All ids share one event channel, PD and CQ. Up to <window> of them are
+ * in setup at any time (address, route, connect), each moved along by its
+ * own events; setup time is from rdma_resolve_addr() to ESTABLISHED. The
+ * connections ask for echo mode, so the server never sends and no receive
+ * needs to be posted. Once every attempt is done they are all closed.
+ *
+ * usage: storm [-n connections] [-w window, 0 = all] <server-address> <server-port>
+ */
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <rdma/rdma_cma.h>
+
+#include <algorithm>
+
+#include "credit_flow.h"
+
+#define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
+#define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
+
+const int TIMEOUT_IN_MS = 2000; /* ms, per resolve step */
+
+struct attempt
+{
+    struct rdma_cm_id *id;
+    unsigned long long start_ns;
+    unsigned long long addr_ns;         /* each step, from start */
+    unsigned long long route_ns;
+    unsigned long long established_ns;
+    int connected;
+};
+
+static struct ibv_context *s_verbs = 0;
+static struct ibv_pd *s_pd = 0;
+static struct ibv_cq *s_cq = 0;
+
+static struct addrinfo *s_addr = 0;
+static int s_connections = 1000;
+static int s_window = 0;
+
+static struct attempt *s_attempts;
+static int s_started = 0;
+static int s_in_setup = 0;
+static int s_established = 0;
+static int s_failed[RDMA_CM_EVENT_TIMEWAIT_EXIT + 1];
+static int s_num_failed = 0;
+
+static void die(const char *reason)
+{
+    fprintf(stderr, "%s\n", reason);
+    exit(EXIT_FAILURE);
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Kick off attempts until the window is full or all have started. */
+static void start_more(struct rdma_event_channel *ec)
+{
+    struct attempt *a;
+
+    while (s_started < s_connections && (!s_window || s_in_setup < s_window))
+    {
+        a = &s_attempts[s_started++];
+        ++s_in_setup;
+        a->start_ns = now_ns();
+        TEST_NZ(rdma_create_id(ec, &a->id, a, RDMA_PS_TCP));
+        TEST_NZ(rdma_resolve_addr(a->id, NULL, s_addr->ai_addr, TIMEOUT_IN_MS));
+    }
+}
+
+static void create_qp(struct attempt *a)
+{
+    struct ibv_qp_init_attr qp_attr;
+
+    if (!s_verbs)
+    {
+        s_verbs = a->id->verbs;
+        TEST_Z(s_pd = ibv_alloc_pd(s_verbs));
+        /* nothing is ever posted, so the CQ never fills */
+        TEST_Z(s_cq = ibv_create_cq(s_verbs, 64, NULL, NULL, 0));
+    }
+    else if (a->id->verbs != s_verbs)
+        die("storm: all connections must resolve to the same device.");
+
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.send_cq = s_cq;
+    qp_attr.recv_cq = s_cq;
+    qp_attr.qp_type = IBV_QPT_RC;
+    qp_attr.cap.max_send_wr = 1;
+    qp_attr.cap.max_recv_wr = 1;
+    qp_attr.cap.max_send_sge = 1;
+    qp_attr.cap.max_recv_sge = 1;
+
+    TEST_NZ(rdma_create_qp(a->id, s_pd, &qp_attr));
+}
+
+static void on_failure(struct attempt *a, enum rdma_cm_event_type event)
+{
+    ++s_failed[event];
+    ++s_num_failed;
+    --s_in_setup;
+    if (a->id->qp)
+        rdma_destroy_qp(a->id);
+    rdma_destroy_id(a->id);
+    a->id = 0;
+}
+
+static void on_event(struct rdma_cm_event *event)
+{
+    struct attempt *a = (struct attempt *) event->id->context;
+    struct rdma_conn_param cm_params;
+    struct flow_params params;
+
+    switch (event->event)
+    {
+    case RDMA_CM_EVENT_ADDR_RESOLVED:
+        a->addr_ns = now_ns() - a->start_ns;
+        create_qp(a);
+        TEST_NZ(rdma_resolve_route(a->id, TIMEOUT_IN_MS));
+        break;
+
+    case RDMA_CM_EVENT_ROUTE_RESOLVED:
+        a->route_ns = now_ns() - a->start_ns;
+        memset(&params, 0, sizeof(params));
+        params.depth = FLOW_MIN_DEPTH;
+        params.flags = FLOW_ECHO;
+        memset(&cm_params, 0, sizeof(cm_params));
+        cm_params.private_data = &params;
+        cm_params.private_data_len = sizeof(params);
+        TEST_NZ(rdma_connect(a->id, &cm_params));
+        break;
+
+    case RDMA_CM_EVENT_ESTABLISHED:
+        a->established_ns = now_ns() - a->start_ns;
+        a->connected = 1;
+        ++s_established;
+        --s_in_setup;
+        break;
+
+    case RDMA_CM_EVENT_ADDR_ERROR:
+    case RDMA_CM_EVENT_ROUTE_ERROR:
+    case RDMA_CM_EVENT_CONNECT_ERROR:
+    case RDMA_CM_EVENT_UNREACHABLE:
+    case RDMA_CM_EVENT_REJECTED:
+        on_failure(a, event->event);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static double percentile(unsigned long long *sorted, int n, double pct)
+{
+    int i = (int) (n * pct / 100);
+
+    return sorted[i < n ? i : n - 1] / 1e3;
+}
+
+static double average(unsigned long long attempt::*field)
+{
+    unsigned long long sum = 0;
+    int i;
+
+    for (i = 0; i < s_connections; ++i)
+        if (s_attempts[i].connected)
+            sum += s_attempts[i].*field;
+
+    return (double) sum / s_established / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+    struct rdma_event_channel *ec;
+    struct rdma_cm_event *event;
+    unsigned long long start, secs_ns, *setup;
+    int opt, i, n, closing;
+
+    while ((opt = getopt(argc, argv, "n:w:")) != -1)
+    {
+        if (opt == 'n')
+            s_connections = atoi(optarg);
+        else if (opt == 'w')
+            s_window = atoi(optarg);
+        else
+            break;
+    }
+    if (opt != -1 || argc - optind != 2 || s_connections < 1 || s_window < 0)
+        die("usage: storm [-n connections] [-w window, 0 = all] <server-address> <server-port>");
+
+    TEST_NZ(getaddrinfo(argv[optind], argv[optind + 1], NULL, &s_addr));
+    TEST_Z(s_attempts = (struct attempt *) calloc(s_connections,
+            sizeof(struct attempt)));
+    TEST_Z(setup = (unsigned long long *) calloc(s_connections,
+            sizeof(unsigned long long)));
+    TEST_Z(ec = rdma_create_event_channel());
+
+    start = now_ns();
+    start_more(ec);
+    while (s_established + s_num_failed < s_connections)
+    {
+        struct rdma_cm_event event_copy;
+
+        TEST_NZ(rdma_get_cm_event(ec, &event));
+        /* acked first: a failed id is destroyed, which waits for its acks */
+        memcpy(&event_copy, event, sizeof(*event));
+        rdma_ack_cm_event(event);
+        on_event(&event_copy);
+        start_more(ec);
+    }
+    secs_ns = now_ns() - start;
+
+    for (i = n = 0; i < s_connections; ++i)
+        if (s_attempts[i].connected)
+            setup[n++] = s_attempts[i].established_ns;
+    std::sort(setup, setup + n);
+
+    printf("%d of %d connections in %.3f s: %.0f connections/s, window %d\n",
+            s_established, s_connections, secs_ns / 1e9,
+            s_established / (secs_ns / 1e9), s_window ? s_window : s_connections);
+    for (i = 0; i <= RDMA_CM_EVENT_TIMEWAIT_EXIT; ++i)
+        if (s_failed[i])
+            printf("  %d failed with %s\n", s_failed[i],
+                    rdma_event_str((enum rdma_cm_event_type) i));
+    if (n)
+    {
+        printf("setup: avg %.2f p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f us\n",
+                average(&attempt::established_ns), percentile(setup, n, 50),
+                percentile(setup, n, 90), percentile(setup, n, 99),
+                percentile(setup, n, 99.9), setup[n - 1] / 1e3);
+        printf("  average step: address %.2f route %.2f connect %.2f us\n",
+                average(&attempt::addr_ns),
+                average(&attempt::route_ns) - average(&attempt::addr_ns),
+                average(&attempt::established_ns) - average(&attempt::route_ns));
+    }
+
+    for (i = closing = 0; i < s_connections; ++i)
+        if (s_attempts[i].connected && !rdma_disconnect(s_attempts[i].id))
+            ++closing;
+    while (closing)
+    {
+        TEST_NZ(rdma_get_cm_event(ec, &event));
+        if (event->event == RDMA_CM_EVENT_DISCONNECTED)
+            --closing;
+        rdma_ack_cm_event(event);
+    }
+    for (i = 0; i < s_connections; ++i)
+        if (s_attempts[i].id)
+        {
+            rdma_destroy_qp(s_attempts[i].id);
+            rdma_destroy_id(s_attempts[i].id);
+        }
+
+    if (s_cq)
+        ibv_destroy_cq(s_cq);
+    if (s_pd)
+        ibv_dealloc_pd(s_pd);
+    rdma_destroy_event_channel(ec);
+    freeaddrinfo(s_addr);
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "buf_pool.h"
+
+static unsigned long gcd(unsigned long a, unsigned long b)
+{
+	while (b) {
+		unsigned long t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+int buf_pool_parse_size(const char *arg, size_t *size)
+{
+	char *end;
+	unsigned long long val;
+
+	val = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 'g': case 'G':
+		val <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		val <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		val <<= 10;
+		++end;
+		break;
+	}
+	if (*end || !val)
+		return 1;
+	*size = val;
+	return 0;
+}
+
+int buf_pool_parse_rotation(const char *arg, enum buf_rotation *mode,
+			    unsigned long *stride)
+{
+	*stride = BUF_POOL_DEF_STRIDE;
+	if (!strcmp(arg, "seq"))
+		*mode = ROTATE_SEQ;
+	else if (!strcmp(arg, "rand"))
+		*mode = ROTATE_RAND;
+	else if (!strncmp(arg, "stride", 6)) {
+		*mode = ROTATE_STRIDE;
+		if (arg[6] == ':') {
+			*stride = strtoul(arg + 7, NULL, 0);
+			if (!*stride)
+				return 1;
+		} else if (arg[6])
+			return 1;
+	} else
+		return 1;
+	return 0;
+}
+
+const char *buf_pool_mode_str(enum buf_rotation mode)
+{
+	switch (mode) {
+	case ROTATE_SEQ:    return "sequential";
+	case ROTATE_STRIDE: return "strided";
+	case ROTATE_RAND:   return "random";
+	default:            return "none";
+	}
+}
+
+int buf_pool_init(struct buf_pool *pool, void *base, size_t footprint,
+		  size_t slot_size, enum buf_rotation mode,
+		  unsigned long stride)
+{
+	slot_size = (slot_size + BUF_POOL_SLOT_ALIGN - 1) & ~(size_t)(BUF_POOL_SLOT_ALIGN - 1);
+	if (!slot_size || footprint < slot_size) {
+		fprintf(stderr, "Buffer pool of %zu bytes can't hold a %zu byte slot\n",
+			footprint, slot_size);
+		return 1;
+	}
+
+	pool->base      = base;
+	pool->footprint = footprint;
+	pool->slot_size = slot_size;
+	pool->nslots    = footprint / slot_size;
+	pool->cur       = 0;
+	pool->mode      = mode;
+	pool->seed      = 0x9E3779B97F4A7C15ULL ^ (uint64_t)getpid();
+
+	/* a stride sharing a factor with nslots would only visit a subset */
+	pool->stride = stride % pool->nslots;
+	if (!pool->stride)
+		pool->stride = 1;
+	while (gcd(pool->stride, pool->nslots) != 1)
+		++pool->stride;
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $Id$
+ */
+
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Buffer rotation over one large registered region.
+ *
+ * Without a pool every WR reuses ctx->buf, so the payload stays in the LLC
+ * (and in DDIO ways on the receiver) for the whole run.  With a pool each WR
+ * takes the next slot of a region that is much larger than the cache, which
+ * is closer to what a service touching fresh memory per message sees.
+ */
+enum buf_rotation {
+	ROTATE_NONE = 0,	/* always the first slot (classic behaviour) */
+	ROTATE_SEQ,		/* slot 0, 1, 2, ... wrapping at the end */
+	ROTATE_STRIDE,		/* jump <stride> slots each time */
+	ROTATE_RAND		/* uniformly random slot */
+};
+
+#define BUF_POOL_SLOT_ALIGN	64
+#define BUF_POOL_DEF_STRIDE	8
+
+struct buf_pool {
+	char               *base;
+	size_t              footprint;
+	size_t              slot_size;
+	unsigned long       nslots;
+	unsigned long       cur;
+	unsigned long       stride;
+	uint64_t            seed;
+	enum buf_rotation   mode;
+};
+
+/* Accepts plain byte counts or K/M/G suffixes, e.g. "4G". */
+extern int buf_pool_parse_size(const char *arg, size_t *size);
+/* Accepts "seq", "rand", "stride" or "stride:<slots>". */
+extern int buf_pool_parse_rotation(const char *arg, enum buf_rotation *mode,
+				   unsigned long *stride);
+extern const char *buf_pool_mode_str(enum buf_rotation mode);
+/*
+ * Carve [base, base + footprint) into slots of at least slot_size bytes.
+ * May be called again with a new slot_size when the message size changes.
+ */
+extern int buf_pool_init(struct buf_pool *pool, void *base, size_t footprint,
+			 size_t slot_size, enum buf_rotation mode,
+			 unsigned long stride);
+
+static inline unsigned long buf_pool_next_slot(struct buf_pool *pool)
+{
+	unsigned long slot = pool->cur;
+
+	switch (pool->mode) {
+	case ROTATE_SEQ:
+		if (++pool->cur == pool->nslots)
+			pool->cur = 0;
+		break;
+	case ROTATE_STRIDE:
+		pool->cur += pool->stride;
+		if (pool->cur >= pool->nslots)
+			pool->cur -= pool->nslots;
+		break;
+	case ROTATE_RAND:
+		/* xorshift64*, cheap enough for the post path */
+		pool->seed ^= pool->seed >> 12;
+		pool->seed ^= pool->seed << 25;
+		pool->seed ^= pool->seed >> 27;
+		pool->cur = (pool->seed * 2685821657736338717ULL) % pool->nslots;
+		break;
+	default:
+		break;
+	}
+	return slot;
+}
+
+static inline char *buf_pool_next(struct buf_pool *pool)
+{
+	return pool->base + buf_pool_next_slot(pool) * pool->slot_size;
+}
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $Id$
+ */
+
+#include <string.h>
+#include "data_touch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define GEN_STEP 0x9E3779B97F4A7C15ULL
+
+int touch_parse_fill(const char *arg, enum touch_fill *mode)
+{
+	if (!strcmp(arg, "memcpy"))
+		*mode = FILL_MEMCPY;
+	else if (!strcmp(arg, "nt"))
+		*mode = FILL_NT;
+	else if (!strcmp(arg, "gen"))
+		*mode = FILL_GEN;
+	else
+		return 1;
+	return 0;
+}
+
+int touch_parse_consume(const char *arg, enum touch_consume *mode)
+{
+	if (!strcmp(arg, "read"))
+		*mode = CONSUME_READ;
+	else if (!strcmp(arg, "csum"))
+		*mode = CONSUME_CSUM;
+	else
+		return 1;
+	return 0;
+}
+
+const char *touch_fill_str(enum touch_fill mode)
+{
+	switch (mode) {
+	case FILL_MEMCPY: return "memcpy";
+	case FILL_NT:     return "non-temporal copy";
+#ifdef HAVE_X86_SIMD
+	case FILL_GEN:    return __builtin_cpu_supports("avx512f") ? "AVX-512 generator" :
+				 __builtin_cpu_supports("avx2") ? "AVX2 generator" :
+				 "scalar generator";
+#else
+	case FILL_GEN:    return "scalar generator";
+#endif
+	default:          return "none";
+	}
+}
+
+const char *touch_consume_str(enum touch_consume mode)
+{
+	switch (mode) {
+	case CONSUME_READ: return "read-all";
+	case CONSUME_CSUM: return "checksum";
+	default:           return "none";
+	}
+}
+
+static void fill_gen_scalar(uint64_t *dst, size_t words, uint64_t seed)
+{
+	uint64_t v = seed * GEN_STEP;
+	size_t i;
+
+	for (i = 0; i < words; ++i)
+		dst[i] = v + i;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static void fill_gen_avx2(uint64_t *dst, size_t words, uint64_t seed)
+{
+	__m256i v = _mm256_add_epi64(_mm256_set1_epi64x(seed * GEN_STEP),
+				     _mm256_set_epi64x(3, 2, 1, 0));
+	const __m256i step = _mm256_set1_epi64x(4);
+	size_t i;
+
+	for (i = 0; i + 4 <= words; i += 4) {
+		_mm256_storeu_si256((__m256i *) (dst + i), v);
+		v = _mm256_add_epi64(v, step);
+	}
+	for (; i < words; ++i)
+		dst[i] = seed * GEN_STEP + i;
+}
+
+__attribute__((target("avx512f")))
+static void fill_gen_avx512(uint64_t *dst, size_t words, uint64_t seed)
+{
+	__m512i v = _mm512_add_epi64(_mm512_set1_epi64(seed * GEN_STEP),
+				     _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0));
+	const __m512i step = _mm512_set1_epi64(8);
+	size_t i;
+
+	for (i = 0; i + 8 <= words; i += 8) {
+		_mm512_storeu_si512((void *) (dst + i), v);
+		v = _mm512_add_epi64(v, step);
+	}
+	for (; i < words; ++i)
+		dst[i] = seed * GEN_STEP + i;
+}
+
+static void copy_nt(char *dst, const char *src, size_t len)
+{
+	size_t head = (16 - ((uintptr_t) dst & 15)) & 15;
+
+	if (head > len)
+		head = len;
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	len -= head;
+	for (; len >= 16; len -= 16, dst += 16, src += 16)
+		_mm_stream_si128((__m128i *) dst,
+				 _mm_loadu_si128((const __m128i *) src));
+	_mm_sfence();
+	memcpy(dst, src, len);
+}
+#endif
+
+void touch_fill(enum touch_fill mode, void *dst, const void *src,
+		size_t len, uint64_t seed)
+{
+	size_t words = len / sizeof(uint64_t);
+
+	switch (mode) {
+	case FILL_MEMCPY:
+		memcpy(dst, src, len);
+		break;
+	case FILL_NT:
+#ifdef HAVE_X86_SIMD
+		copy_nt(dst, src, len);
+#else
+		memcpy(dst, src, len);
+#endif
+		break;
+	case FILL_GEN:
+#ifdef HAVE_X86_SIMD
+		if (__builtin_cpu_supports("avx512f"))
+			fill_gen_avx512(dst, words, seed);
+		else if (__builtin_cpu_supports("avx2"))
+			fill_gen_avx2(dst, words, seed);
+		else
+#endif
+			fill_gen_scalar(dst, words, seed);
+		memset((char *) dst + words * sizeof(uint64_t), (int) seed,
+		       len - words * sizeof(uint64_t));
+		break;
+	default:
+		break;
+	}
+}
+
+uint64_t touch_consume(enum touch_consume mode, const void *buf, size_t len)
+{
+	const uint64_t *p = buf;
+	const unsigned char *tail;
+	size_t words = len / sizeof(uint64_t);
+	uint64_t a = 0, b = 0;
+	size_t i;
+
+	switch (mode) {
+	case CONSUME_READ:
+		for (i = 0; i < words; ++i)
+			a ^= p[i];
+		break;
+	case CONSUME_CSUM:
+		for (i = 0; i < words; ++i) {
+			a += p[i];
+			b += a;
+		}
+		break;
+	default:
+		return 0;
+	}
+	tail = (const unsigned char *) (p + words);
+	for (i = 0; i < len - words * sizeof(uint64_t); ++i)
+		a += tail[i];
+	return a ^ b;
+}
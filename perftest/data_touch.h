@@ -0,0 +1,69 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $Id$
+ */
+
+#ifndef DATA_TOUCH_H
+#define DATA_TOUCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CPU stages around the NIC transfer.  A real pipeline copies or serialises
+ * into the send buffer before posting and parses the payload after the
+ * receive completes; these modes let the tests charge that work to the
+ * measured time so memory bandwidth shows up next to fabric bandwidth.
+ */
+enum touch_fill {
+	FILL_NONE = 0,
+	FILL_MEMCPY,		/* memcpy from a private, cache-hot source */
+	FILL_NT,		/* same copy with non-temporal streaming stores */
+	FILL_GEN		/* generate the payload in registers (AVX-512/AVX2/scalar) */
+};
+
+enum touch_consume {
+	CONSUME_NONE = 0,
+	CONSUME_READ,		/* load every word once */
+	CONSUME_CSUM		/* Fletcher-style checksum over the payload */
+};
+
+extern int touch_parse_fill(const char *arg, enum touch_fill *mode);
+extern int touch_parse_consume(const char *arg, enum touch_consume *mode);
+extern const char *touch_fill_str(enum touch_fill mode);
+extern const char *touch_consume_str(enum touch_consume mode);
+
+/* src is only read for FILL_MEMCPY and FILL_NT; seed only for FILL_GEN. */
+extern void touch_fill(enum touch_fill mode, void *dst, const void *src,
+		       size_t len, uint64_t seed);
+/* Returns a value derived from every byte so the loads can't be elided. */
+extern uint64_t touch_consume(enum touch_consume mode, const void *buf, size_t len);
+
+#endif
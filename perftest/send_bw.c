@@ -57,6 +57,10 @@
 #include <infiniband/verbs.h>
 
 #include "get_clock.h"
+#include "buf_pool.h"
+#include "data_touch.h"
+#include "verify.h"
+#include "sge.h"
 
 #define PINGPONG_SEND_WRID  1
 #define PINGPONG_RECV_WRID  2
@@ -85,6 +89,14 @@ struct user_parameters {
 	int inline_size;
 	int qp_timeout;
 	int gid_index; /* if value not negative, we use gid AND gid_index=value */
+	size_t pool_size; /* if not 0, rotate WRs over a region this big */
+	enum buf_rotation rotation;
+	unsigned long stride;
+	enum touch_fill fill;
+	enum touch_consume consume;
+	int verify;
+	enum sge_mode sge_mode;
+	struct sge_layout sge_layout;
 };
 static int sl = 0;
 static int page_size;
@@ -99,9 +111,37 @@ struct pingpong_context {
 	struct ibv_cq      *cq;
 	struct ibv_qp      *qp;
 	void               *buf;
+	size_t              buf_size;
 	unsigned            size;
 	int                 tx_depth;
 	int                 rx_depth;
+	struct buf_pool     tx_pool;
+	struct buf_pool     rx_pool;
+	void               *src_buf;	/* cache-hot source for memcpy/nt fill */
+	uintptr_t          *rx_addr;	/* posted receive buffers, in post order */
+	int                 rx_head;
+	int                 rx_tail;
+	cycles_t            fill_cycles;
+	cycles_t            consume_cycles;
+	cycles_t            rx_first;
+	cycles_t            rx_last;
+	unsigned long       nfilled;
+	unsigned long       nconsumed;
+	uint64_t            sink;
+	cycles_t            stamp_cycles;
+	cycles_t            check_cycles;
+	unsigned long       nstamped;
+	unsigned long       nchecked;
+	unsigned long       bad_crc;
+	unsigned long       bad_seq;
+	unsigned long       verify_errors;	/* whole run, all sizes */
+	char               *frag_buf;	/* sources of the message fragments */
+	struct ibv_mr      *frag_mr;
+	enum sge_mode       sge_pass;	/* SGE_GATHER or SGE_COPY for this run */
+	struct ibv_sge      sge[SGE_MAX_FRAGS];
+	int                 nsge;
+	cycles_t            copy_cycles;
+	unsigned long       ncopied;
 	struct ibv_sge      list;
 	struct ibv_sge recv_list;
 	struct ibv_send_wr  wr;
@@ -422,21 +462,55 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev,
 	ctx->tx_depth = tx_depth;
 	ctx->rx_depth = rx_depth + tx_depth;
 	/* in case of UD need space for the GRH */
-	if (user_parm->connection_type==UD) {
-		ctx->buf = memalign(page_size, ( size + 40 ) * 2);
-		if (!ctx->buf) {
-			fprintf(stderr, "Couldn't allocate work buf.\n");
+	if (user_parm->connection_type==UD)
+		ctx->buf_size = ( size + 40 ) * 2;
+	else
+		ctx->buf_size = size * 2;
+	if (user_parm->pool_size > ctx->buf_size)
+		ctx->buf_size = user_parm->pool_size;
+
+	ctx->buf = memalign(page_size, ctx->buf_size);
+	if (!ctx->buf) {
+		fprintf(stderr, "Couldn't allocate work buf.\n");
+		return NULL;
+	}
+	memset(ctx->buf, 0, ctx->buf_size);
+
+	ctx->src_buf = NULL;
+	if (user_parm->fill == FILL_MEMCPY || user_parm->fill == FILL_NT) {
+		ctx->src_buf = memalign(page_size, size);
+		if (!ctx->src_buf) {
+			fprintf(stderr, "Couldn't allocate fill source buf.\n");
 			return NULL;
 		}
-		memset(ctx->buf, 0, ( size + 40 ) * 2);
-	} else {
-		ctx->buf = memalign(page_size, size * 2);
-		if (!ctx->buf) {
-			fprintf(stderr, "Couldn't allocate work buf.\n");
+		touch_fill(FILL_GEN, ctx->src_buf, NULL, size, 1);
+	}
+	ctx->frag_buf = NULL;
+	ctx->frag_mr = NULL;
+	ctx->sge_pass = SGE_OFF;
+	if (user_parm->sge_mode) {
+		sge_layout_init(&user_parm->sge_layout, size);
+		ctx->frag_buf = memalign(page_size, user_parm->sge_layout.footprint);
+		if (!ctx->frag_buf) {
+			fprintf(stderr, "Couldn't allocate fragment buf.\n");
 			return NULL;
 		}
-		memset(ctx->buf, 0, size * 2);
+		touch_fill(FILL_GEN, ctx->frag_buf, NULL, user_parm->sge_layout.footprint, 1);
 	}
+	/* RC/UC/UD receives complete in post order, so a FIFO finds the data */
+	ctx->rx_addr = malloc(ctx->rx_depth * sizeof *ctx->rx_addr);
+	if (!ctx->rx_addr) {
+		fprintf(stderr, "Couldn't allocate receive tracking.\n");
+		return NULL;
+	}
+	ctx->rx_head = ctx->rx_tail = 0;
+
+	/* receives are always posted for the largest message */
+	if (user_parm->pool_size &&
+	    buf_pool_init(&ctx->rx_pool, ctx->buf, ctx->buf_size,
+			  user_parm->connection_type==UD ? size + 40 : size,
+			  user_parm->rotation, user_parm->stride))
+		return NULL;
 
 
 	ctx->context = ibv_open_device(ib_dev);
@@ -473,18 +547,17 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev,
 	/* We dont really want IBV_ACCESS_LOCAL_WRITE, but IB spec says:
 	 * The Consumer is not allowed to assign Remote Write or Remote Atomic to
 	 * a Memory Region that has not been assigned Local Write. */
-	if (user_parm->connection_type==UD) {
-		ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, (size + 40 ) * 2,
-				     IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE);
-		if (!ctx->mr) {
-			fprintf(stderr, "Couldn't allocate MR\n");
-			return NULL;
-		}
-	} else {
-		ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, size * 2,
-				     IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE);
-		if (!ctx->mr) {
-			fprintf(stderr, "Couldn't allocate MR\n");
+	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, ctx->buf_size,
+			     IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE);
+	if (!ctx->mr) {
+		fprintf(stderr, "Couldn't allocate MR\n");
+		return NULL;
+	}
+	if (ctx->frag_buf) {
+		ctx->frag_mr = ibv_reg_mr(ctx->pd, ctx->frag_buf, user_parm->sge_layout.footprint,
+					  IBV_ACCESS_LOCAL_WRITE);
+		if (!ctx->frag_mr) {
+			fprintf(stderr, "Couldn't allocate fragment MR\n");
 			return NULL;
 		}
 	}
@@ -503,7 +576,7 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev,
 		/* Work around:  driver doesnt support
 		 * recv_wr = 0 */
 		attr.cap.max_recv_wr  = ctx->rx_depth;
-		attr.cap.max_send_sge = 1;
+		attr.cap.max_send_sge = user_parm->sge_mode ? user_parm->sge_layout.nfrags : 1;
 		attr.cap.max_recv_sge = 1;
 		attr.cap.max_inline_data = user_parm->inline_size;
 		switch (user_parm->connection_type) {
@@ -577,6 +650,152 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev,
 	return ctx;
 }
 
+/*
+ * Per-WR buffer handling: pick the next pool slot (if any), and run the
+ * producer fill before a send / the consumer pass after a receive.
+ */
+static inline void pp_prepare_send(struct pingpong_context *ctx, struct user_parameters *user_param,
+				   int size, int scnt)
+{
+	cycles_t t;
+
+	if (user_param->pool_size)
+		ctx->list.addr = (uintptr_t) buf_pool_next(&ctx->tx_pool) +
+			(user_param->connection_type == UD ? 40 : 0);
+	if (ctx->sge_pass == SGE_COPY) {
+		t = get_cycles();
+		sge_coalesce((void *) (uintptr_t) ctx->list.addr, ctx->sge, ctx->nsge);
+		ctx->copy_cycles += get_cycles() - t;
+		++ctx->ncopied;
+	}
+	if (user_param->fill) {
+		t = get_cycles();
+		touch_fill(user_param->fill, (void *) (uintptr_t) ctx->list.addr,
+			   ctx->src_buf, size, scnt);
+		ctx->fill_cycles += get_cycles() - t;
+		++ctx->nfilled;
+	}
+	if (user_param->verify && size >= VERIFY_HDR_LEN) {
+		t = get_cycles();
+		verify_stamp((void *) (uintptr_t) ctx->list.addr, size, scnt);
+		ctx->stamp_cycles += get_cycles() - t;
+		++ctx->nstamped;
+	}
+}
+
+static inline void pp_prepare_recv(struct pingpong_context *ctx, struct user_parameters *user_param)
+{
+	if (user_param->pool_size)
+		ctx->recv_list.addr = (uintptr_t) buf_pool_next(&ctx->rx_pool);
+	ctx->rx_addr[ctx->rx_head] = ctx->recv_list.addr;
+	if (++ctx->rx_head == ctx->rx_depth)
+		ctx->rx_head = 0;
+}
+
+static inline void pp_complete_recv(struct pingpong_context *ctx, struct user_parameters *user_param,
+				    struct ibv_wc *wc)
+{
+	uintptr_t addr = ctx->rx_addr[ctx->rx_tail];
+	unsigned len = wc->byte_len;
+	cycles_t t;
+
+	if (++ctx->rx_tail == ctx->rx_depth)
+		ctx->rx_tail = 0;
+	if (user_param->connection_type == UD) {
+		addr += 40;
+		len -= 40;
+	}
+	if (user_param->verify && len >= VERIFY_HDR_LEN) {
+		enum verify_result r;
+
+		t = get_cycles();
+		r = verify_check((void *) addr, len, ctx->nchecked);
+		ctx->check_cycles += get_cycles() - t;
+		if (r != VERIFY_OK) {
+			if (!ctx->bad_crc && !ctx->bad_seq)
+				fprintf(stderr, "Data verification failed at message %lu (%u bytes): %s\n",
+					ctx->nchecked, len, r == VERIFY_BAD_CRC ? "bad checksum" : "out of sequence");
+			if (r == VERIFY_BAD_CRC)
+				++ctx->bad_crc;
+			else
+				++ctx->bad_seq;
+			++ctx->verify_errors;
+		}
+		++ctx->nchecked;
+	}
+	if (user_param->consume) {
+		t = get_cycles();
+		if (!ctx->nconsumed)
+			ctx->rx_first = t;
+		ctx->sink += touch_consume(user_param->consume, (void *) addr, len);
+		ctx->rx_last = get_cycles();
+		ctx->consume_cycles += ctx->rx_last - t;
+		++ctx->nconsumed;
+	}
+}
+
+/*
+ * Slots a pool hands out before it comes back to one: with -v, a WR's
+ * stamp or received data must stay put until it completes. Random
+ * rotation can come back at any time.
+ */
+static unsigned long pool_period(const struct buf_pool *pool)
+{
+	unsigned long a = pool->stride, b = pool->nslots, t;
+
+	if (pool->mode == ROTATE_SEQ)
+		return pool->nslots;
+	if (pool->mode != ROTATE_STRIDE)
+		return 0;
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a ? pool->nslots / a : 0;
+}
+
+/*
+ * Reset the per-size counters, split the message into fragments for this
+ * size and lay the send pool out.
+ */
+static int pp_init_run(struct pingpong_context *ctx, struct user_parameters *user_param,
+		       int size)
+{
+	ctx->wr.sg_list = &ctx->list;
+	ctx->wr.num_sge = 1;
+	ctx->copy_cycles = 0;
+	ctx->ncopied = 0;
+	if (ctx->sge_pass) {
+		ctx->nsge = sge_build(&user_param->sge_layout, size, ctx->frag_buf,
+				      ctx->frag_mr->lkey, ctx->sge);
+		if (ctx->sge_pass == SGE_GATHER) {
+			ctx->wr.sg_list = ctx->sge;
+			ctx->wr.num_sge = ctx->nsge;
+		}
+	}
+	ctx->fill_cycles = ctx->consume_cycles = 0;
+	ctx->nfilled = ctx->nconsumed = 0;
+	ctx->stamp_cycles = ctx->check_cycles = 0;
+	ctx->nstamped = ctx->nchecked = 0;
+	ctx->bad_crc = ctx->bad_seq = 0;
+	if (!user_param->pool_size)
+		return 0;
+	if (buf_pool_init(&ctx->tx_pool, ctx->buf, ctx->buf_size,
+			  user_param->connection_type == UD ? size + 40 : size,
+			  user_param->rotation, user_param->stride))
+		return 1;
+	if (user_param->verify &&
+	    (pool_period(&ctx->tx_pool) < (unsigned long) ctx->tx_depth ||
+	     pool_period(&ctx->rx_pool) < (unsigned long) ctx->rx_depth)) {
+		fprintf(stderr, "--verify needs a pool slot per WR in flight (%d sends, %d receives) "
+			"that doesn't come round again early; use a bigger --buf-pool, not --rotate=rand\n",
+			ctx->tx_depth, ctx->rx_depth);
+		return 1;
+	}
+	return 0;
+}
+
 static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 			  struct pingpong_dest *dest, struct user_parameters *user_parm)
 {
@@ -709,11 +928,13 @@ static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 			ctx->recv_list.length = ctx->size;
 		}
 		ctx->recv_list.lkey = ctx->mr->lkey;
-		for (i = 0; i < ctx->rx_depth; ++i)
+		for (i = 0; i < ctx->rx_depth; ++i) {
+			pp_prepare_recv(ctx, user_parm);
 			if (ibv_post_recv(ctx->qp, &ctx->rwr, &bad_wr_recv)) {
 				fprintf(stderr, "Couldn't post recv: counter=%d\n", i);
 				return 14;
 			}
+		}
 	}
 	post_recv = ctx->rx_depth;
 	return 0;
@@ -746,11 +967,22 @@ static void usage(const char *argv0)
 	printf("  -e, --events                sleep on CQ events (default poll)\n");
 	printf("  -N, --no peak-bw            cancel peak-bw calculation (default with peak-bw)\n");
 	printf("  -F, --CPU-freq              do not fail even if cpufreq_ondemand module is loaded\n");
+	printf("  -P, --buf-pool=<size>       rotate WRs over a registered region of <size> bytes, K/M/G allowed (default off)\n");
+	printf("  -R, --rotate=<mode>         buffer pool rotation seq/stride[:<slots>]/rand (default seq)\n");
+	printf("  -f, --fill=<mode>           CPU fills each message before posting: memcpy/nt/gen (default off)\n");
+	printf("  -k, --consume=<mode>        CPU reads each received message: read/csum (default off)\n");
+	printf("  -v, --verify                stamp each message with seq + CRC32C and check it on receive (needs -P, not -b)\n");
+	printf("  -G, --sge=<n|len,...>       split each message into n fragments, or fragments of the given\n");
+	printf("                              lengths with one \"*\" taking the rest (e.g. 64,*) (default off)\n");
+	printf("  -M, --sge-mode=<mode>       send fragments as SGEs (gather), memcpy them into one buffer\n");
+	printf("                              (copy), or run both and report the crossover (default both)\n");
 }
 
-static void print_report(unsigned int iters, unsigned size, int duplex,
-			 cycles_t *tposted, cycles_t *tcompleted, int noPeak, int no_cpu_freq_fail)
+/* Returns the average BW in MB/sec. */
+static double print_report(unsigned int iters, unsigned size, int duplex,
+			   cycles_t *tposted, cycles_t *tcompleted, int noPeak, int no_cpu_freq_fail)
 {
+	double bw_avg;
 	double cycles_to_units;
 	unsigned long tsize;	/* Transferred size, in megabytes */
 	int i, j;
@@ -778,10 +1010,60 @@ static void print_report(unsigned int iters, unsigned size, int duplex,
 
 	tsize = duplex ? 2 : 1;
 	tsize = tsize * size;
+	bw_avg = tsize * iters * cycles_to_units /(tcompleted[iters - 1] - tposted[0]) / 0x100000;
 	printf("%7d        %d            %7.2f               %7.2f\n",
 	       size,iters,!(noPeak) * tsize * cycles_to_units / opt_delta / 0x100000,
-	       tsize * iters * cycles_to_units /(tcompleted[iters - 1] - tposted[0]) / 0x100000);
+	       bw_avg);
+	return bw_avg;
+}
+
+/*
+ * CPU side of the run.  The send timestamps are taken before the fill, so the
+ * average BW above and the latency here are what the application sees.
+ */
+static void print_touch_report(struct pingpong_context *ctx, unsigned int iters, unsigned size,
+			       struct user_parameters *user_param, int no_cpu_freq_fail)
+{
+	double mhz;
+	cycles_t lat = 0;
+	int i;
+
+	if (!ctx->nfilled && !ctx->nconsumed && !user_param->verify && !ctx->sge_pass)
+		return;
+	mhz = get_cpu_mhz(no_cpu_freq_fail);
+	if (ctx->sge_pass == SGE_GATHER)
+		printf("   sge     %-20s %d SGEs (%s)\n", "gather", ctx->nsge,
+		       sge_layout_str(&user_param->sge_layout));
+	else if (ctx->sge_pass == SGE_COPY)
+		printf("   sge     %-20s %d fragments (%s) -> 1 SGE, copy %8.3f usec/msg\n", "copy",
+		       ctx->nsge, sge_layout_str(&user_param->sge_layout),
+		       ctx->ncopied ? ctx->copy_cycles / mhz / ctx->ncopied : 0.);
+	if (ctx->nfilled) {
+		for (i = 0; i < iters; ++i)
+			lat += tcompleted[i] - tposted[i];
+		printf("   fill    %-20s %8.3f usec/msg %10.2f MB/sec, app-visible latency %8.2f usec\n",
+		       touch_fill_str(user_param->fill),
+		       ctx->fill_cycles / mhz / ctx->nfilled,
+		       (double) size * ctx->nfilled * mhz * 1000000 / ctx->fill_cycles / 0x100000,
+		       lat / mhz / iters);
+	}
+	if (ctx->nconsumed)
+		printf("   consume %-20s %8.3f usec/msg %10.2f MB/sec, app-visible RX %10.2f MB/sec\n",
+		       touch_consume_str(user_param->consume),
+		       ctx->consume_cycles / mhz / ctx->nconsumed,
+		       (double) size * ctx->nconsumed * mhz * 1000000 / ctx->consume_cycles / 0x100000,
+		       ctx->rx_last > ctx->rx_first ?
+		       (double) size * ctx->nconsumed * mhz * 1000000 / (ctx->rx_last - ctx->rx_first) / 0x100000 : 0.);
+	if (user_param->verify && size < VERIFY_HDR_LEN)
+		printf("   verify  skipped, messages shorter than %d bytes\n", (int) VERIFY_HDR_LEN);
+	else if (user_param->verify)
+		printf("   verify  %-20s stamp %8.3f usec/msg, check %8.3f usec/msg, %lu checked, %lu bad crc, %lu out of sequence\n",
+		       crc32c_impl(),
+		       ctx->nstamped ? ctx->stamp_cycles / mhz / ctx->nstamped : 0.,
+		       ctx->nchecked ? ctx->check_cycles / mhz / ctx->nchecked : 0.,
+		       ctx->nchecked, ctx->bad_crc, ctx->bad_seq);
 }
+
 int run_iter_bi(struct pingpong_context *ctx, struct user_parameters *user_param,
 		struct pingpong_dest *rem_dest, int size)
 {
@@ -822,6 +1104,8 @@ int run_iter_bi(struct pingpong_context *ctx, struct user_parameters *user_param
 		ctx->wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 
 	ctx->list.length = size;
+	if (pp_init_run(ctx, user_param, size))
+		return 1;
 	scnt = 0;
 	ccnt = 0;
 	rcnt = 0;
@@ -834,6 +1118,7 @@ int run_iter_bi(struct pingpong_context *ctx, struct user_parameters *user_param
 		       (scnt - ccnt) < user_param->tx_depth / 2) {
 			struct ibv_send_wr *bad_wr;
 			tposted[scnt] = get_cycles();
+			pp_prepare_send(ctx, user_param, size, scnt);
 			if (ibv_post_send(qp, &ctx->wr, &bad_wr)) {
 				fprintf(stderr, "Couldn't post send: scnt=%d\n",
 					scnt);
@@ -877,10 +1162,12 @@ int run_iter_bi(struct pingpong_context *ctx, struct user_parameters *user_param
 				ccnt += 1;
 				break;
 			case PINGPONG_RECV_WRID:
+				pp_complete_recv(ctx, user_param, &wc);
 				if (--post_recv <= ctx->rx_depth - 2) {
 					while (rcnt < user_param->iters &&
 					       (ctx->rx_depth - post_recv) > 0 ) {
 						++post_recv;
+						pp_prepare_recv(ctx, user_param);
 						if (ibv_post_recv(qp, &ctx->rwr, &bad_wr_recv)) {
 							fprintf(stderr, "Couldn't post recv: rcnt=%d\n",
 								rcnt);
@@ -933,6 +1220,8 @@ int run_iter_uni(struct pingpong_context *ctx, struct user_parameters *user_para
 		ctx->wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 	}
 	ctx->list.length = size;
+	if (pp_init_run(ctx, user_param, size))
+		return 1;
 	scnt = 0;
 	ccnt = 0;
 	rcnt = 0;
@@ -972,6 +1261,8 @@ int run_iter_uni(struct pingpong_context *ctx, struct user_parameters *user_para
 						return 1;
 					}
 					++rcnt;
+					pp_complete_recv(ctx, user_param, &wc);
+					pp_prepare_recv(ctx, user_param);
 					if (ibv_post_recv(qp, &ctx->rwr, &bad_wr_recv)) {
 						fprintf(stderr, "Couldn't post recv: rcnt=%d\n",
 							rcnt);
@@ -992,6 +1283,7 @@ int run_iter_uni(struct pingpong_context *ctx, struct user_parameters *user_para
 			while (scnt < user_param->iters && (scnt - ccnt) < user_param->tx_depth ) {
 				struct ibv_send_wr *bad_wr;
 				tposted[scnt] = get_cycles();
+				pp_prepare_send(ctx, user_param, size, scnt);
 				if (ibv_post_send(qp, &ctx->wr, &bad_wr)) {
 					fprintf(stderr, "Couldn't post send: scnt=%d\n",
 						scnt);
@@ -1067,6 +1359,11 @@ int main(int argc, char *argv[])
 	struct ibv_context       *context;
 	int                      no_cpu_freq_fail = 0;
 	union ibv_gid            gid;
+	enum sge_mode            first_pass, last_pass, pass;
+	unsigned                 sge_sizes[24];
+	double                   sge_bw[24][2];
+	int                      nsizes = 0;
+	double                   bw;
 	/* init default values to user's parameters */
 	memset(&user_param, 0, sizeof(struct user_parameters));
 	user_param.mtu = 0;
@@ -1078,6 +1375,8 @@ int main(int argc, char *argv[])
 	user_param.inline_size = MAX_INLINE;
 	user_param.qp_timeout = 14;
 	user_param.gid_index = -1; /*gid will not be used*/
+	user_param.rotation = ROTATE_SEQ;
+	user_param.stride = BUF_POOL_DEF_STRIDE;
 	/* Parameter parsing. */
 	while (1) {
 		int c;
@@ -1103,10 +1402,17 @@ int main(int argc, char *argv[])
 			{ .name = "mcg",            .has_arg = 0, .val = 'g' },
 			{ .name = "noPeak",         .has_arg = 0, .val = 'N' },
 			{ .name = "CPU-freq",       .has_arg = 0, .val = 'F' },
+			{ .name = "buf-pool",       .has_arg = 1, .val = 'P' },
+			{ .name = "rotate",         .has_arg = 1, .val = 'R' },
+			{ .name = "fill",           .has_arg = 1, .val = 'f' },
+			{ .name = "consume",        .has_arg = 1, .val = 'k' },
+			{ .name = "verify",         .has_arg = 0, .val = 'v' },
+			{ .name = "sge",            .has_arg = 1, .val = 'G' },
+			{ .name = "sge-mode",       .has_arg = 1, .val = 'M' },
 			{ 0 }
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:m:c:s:n:t:I:r:u:S:x:ebaVgNF", long_options, NULL);
+		c = getopt_long(argc, argv, "p:d:i:m:c:s:n:t:I:r:u:S:x:P:R:f:k:G:M:ebaVgNFv", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -1217,12 +1523,78 @@ int main(int argc, char *argv[])
 			if (sl > 15) { usage(argv[0]); return 1; }
 			break;
 
+		case 'P':
+			if (buf_pool_parse_size(optarg, &user_param.pool_size)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'R':
+			if (buf_pool_parse_rotation(optarg, &user_param.rotation, &user_param.stride)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'f':
+			if (touch_parse_fill(optarg, &user_param.fill)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'k':
+			if (touch_parse_consume(optarg, &user_param.consume)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'v':
+			user_param.verify = 1;
+			break;
+
+		case 'G':
+			if (sge_parse_layout(optarg, &user_param.sge_layout)) {
+				usage(argv[0]);
+				return 1;
+			}
+			if (!user_param.sge_mode)
+				user_param.sge_mode = SGE_BOTH;
+			break;
+
+		case 'M':
+			if (sge_parse_mode(optarg, &user_param.sge_mode)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
 		default:
 			usage(argv[0]);
 			return 1;
 		}
 	}
 
+	if (user_param.verify && !user_param.pool_size) {
+		fprintf(stderr, "--verify needs --buf-pool: without one every WR in flight shares the same buffer\n");
+		return 1;
+	}
+	if (user_param.verify && user_param.duplex) {
+		fprintf(stderr, "--verify doesn't go with --bidirectional: receives would land on send slots still in flight\n");
+		return 1;
+	}
+	if (user_param.sge_mode && !user_param.sge_layout.nfrags) {
+		fprintf(stderr, "--sge-mode needs a fragment layout (--sge)\n");
+		return 1;
+	}
+	if (user_param.sge_mode && (user_param.fill ||
+				    (user_param.verify && user_param.sge_mode != SGE_COPY))) {
+		fprintf(stderr, "--sge only goes with --verify in copy mode, and not with --fill\n");
+		return 1;
+	}
+
 	if (optind == argc - 1)
 		user_param.servername = strdupa(argv[optind]);
 	else if (optind < argc) {
@@ -1299,6 +1671,23 @@ int main(int argc, char *argv[])
 		user_param.inline_size = 1;
 	}
 	printf("Inline data is used up to %d bytes message\n", user_param.inline_size);
+	if (user_param.sge_mode) {
+		if (user_param.sge_layout.nfrags > device_attribute.max_sge) {
+			fprintf(stderr, "%d fragments asked for, device supports %d SGEs\n",
+				user_param.sge_layout.nfrags, device_attribute.max_sge);
+			return 1;
+		}
+		printf("Fragments : %s, %s\n", sge_layout_str(&user_param.sge_layout),
+		       sge_mode_str(user_param.sge_mode));
+	}
+	if (user_param.pool_size)
+		printf("Buffer pool : %zu bytes, %s rotation\n", user_param.pool_size,
+		       buf_pool_mode_str(user_param.rotation));
+	if (user_param.fill || user_param.consume)
+		printf("Data touch : fill %s, consume %s\n", touch_fill_str(user_param.fill),
+		       touch_consume_str(user_param.consume));
+	if (user_param.verify)
+		printf("Data verification : sequence + %s\n", crc32c_impl());
 
 	ctx = pp_init_ctx(ib_dev, size, user_param.tx_depth, user_param.rx_depth,
 			  ib_port, &user_param);
@@ -1401,6 +1790,10 @@ int main(int argc, char *argv[])
 		perror("malloc");
 		return 1;
 	}
+	/* gather and copy back to back when comparing, otherwise a single pass */
+	first_pass = user_param.sge_mode == SGE_BOTH ? SGE_GATHER : user_param.sge_mode;
+	last_pass  = user_param.sge_mode == SGE_BOTH ? SGE_COPY : user_param.sge_mode;
+
 	/* send */
 	if (user_param.connection_type == UD) {
 		ctx->list.addr = (uintptr_t) ctx->buf + 40;
@@ -1440,33 +1833,61 @@ int main(int argc, char *argv[])
 
 		for (i = 1; i < size_max_pow ; ++i) {
 			size = 1 << i;
+			sge_sizes[nsizes] = size;
+			for (pass = first_pass; pass <= last_pass; ++pass) {
+				ctx->sge_pass = pass;
+				if (user_param.duplex) {
+					if(run_iter_bi(ctx, &user_param, rem_dest, size))
+						return 17;
+				} else {
+					if(run_iter_uni(ctx, &user_param, rem_dest, size))
+						return 17;
+				}
+				if (user_param.servername) {
+					bw = print_report(user_param.iters, size, user_param.duplex, tposted, tcompleted, noPeak, no_cpu_freq_fail);
+					if (pass)
+						sge_bw[nsizes][pass - SGE_GATHER] = bw;
+					print_touch_report(ctx, user_param.iters, size, &user_param, no_cpu_freq_fail);
+					/* sync again for the sake of UC/UC */
+					rem_dest = pp_client_exch_dest(sockfd, &my_dest, &user_param);
+				} else {
+					print_touch_report(ctx, user_param.iters, size, &user_param, no_cpu_freq_fail);
+					rem_dest = pp_server_exch_dest(sockfd, &my_dest, &user_param);
+				}
+			}
+			++nsizes;
+		}
+	} else {
+		sge_sizes[nsizes] = size;
+		for (pass = first_pass; pass <= last_pass; ++pass) {
+			ctx->sge_pass = pass;
 			if (user_param.duplex) {
-				if(run_iter_bi(ctx, &user_param, rem_dest, size))
-					return 17;
-			} else {
+				if (run_iter_bi(ctx, &user_param, rem_dest, size))
+					return 18;
+			}
+			else {
 				if(run_iter_uni(ctx, &user_param, rem_dest, size))
-					return 17;
+					return 18;
 			}
+
 			if (user_param.servername) {
-				print_report(user_param.iters, size, user_param.duplex, tposted, tcompleted, noPeak, no_cpu_freq_fail);
-				/* sync again for the sake of UC/UC */
-				rem_dest = pp_client_exch_dest(sockfd, &my_dest, &user_param);
-			} else
-				rem_dest = pp_server_exch_dest(sockfd, &my_dest, &user_param);
-		}
-	} else {
-		if (user_param.duplex) {
-			if (run_iter_bi(ctx, &user_param, rem_dest, size))
-				return 18;
-		}
-		else {
-			if(run_iter_uni(ctx, &user_param, rem_dest, size))
-				return 18;
+				bw = print_report(user_param.iters, size, user_param.duplex, tposted, tcompleted, noPeak, no_cpu_freq_fail);
+				if (pass)
+					sge_bw[nsizes][pass - SGE_GATHER] = bw;
+			}
+			print_touch_report(ctx, user_param.iters, size, &user_param, no_cpu_freq_fail);
+			/* both passes start from a quiet QP */
+			if (pass < last_pass) {
+				if (user_param.servername)
+					rem_dest = pp_client_exch_dest(sockfd, &my_dest, &user_param);
+				else
+					rem_dest = pp_server_exch_dest(sockfd, &my_dest, &user_param);
+			}
 		}
-
-		if (user_param.servername)
-			print_report(user_param.iters, size, user_param.duplex, tposted, tcompleted, noPeak, no_cpu_freq_fail);
+		++nsizes;
 	}
+	if (user_param.servername && user_param.sge_mode == SGE_BOTH)
+		sge_print_crossover(&user_param.sge_layout, nsizes, sge_sizes, sge_bw);
 
 	/* close sockets */
 	if (user_param.servername)
@@ -1485,5 +1906,9 @@ int main(int argc, char *argv[])
 	free(tcompleted);
 
 	printf("------------------------------------------------------------------\n");
+	if (ctx->verify_errors) {
+		fprintf(stderr, "%lu messages failed data verification\n", ctx->verify_errors);
+		return 19;
+	}
 	return 0;
 }
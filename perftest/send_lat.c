@@ -56,6 +56,7 @@
 #include <infiniband/verbs.h>
 
 #include "get_clock.h"
+#include "buf_pool.h"
 
 #define PINGPONG_SEND_WRID  1
 #define PINGPONG_RECV_WRID  2
@@ -83,6 +84,9 @@ struct user_parameters {
 	int use_mcg;
 	int qp_timeout;
 	int gid_index; /* if value not negative, we use gid AND gid_index=value */
+	size_t pool_size; /* if not 0, rotate WRs over a region this big */
+	enum buf_rotation rotation;
+	unsigned long stride;
 };
 
 struct report_options {
@@ -106,6 +110,9 @@ struct pingpong_context {
 	struct ibv_qp      *qp;
 	struct ibv_ah		*ah;
 	void               *buf;
+	size_t              buf_size;
+	struct buf_pool     tx_pool;
+	struct buf_pool     rx_pool;
 	volatile char      *post_buf;
 	volatile char      *poll_buf;
 	int                 size;
@@ -398,21 +405,26 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 	ctx->size     = size;
 	ctx->tx_depth = tx_depth;
 	/* in case of UD need space for the GRH */
-	if (user_parm->connection_type==UD) {
-		ctx->buf = memalign(page_size, ( size + 40 ) * 2);
-		if (!ctx->buf) {
-			fprintf(stderr, "Couldn't allocate work buf.\n");
-			return NULL;
-		}
-		memset(ctx->buf, 0, ( size + 40 ) * 2);
-	} else {
-		ctx->buf = memalign(page_size, size * 2);
-		if (!ctx->buf) {
-			fprintf(stderr, "Couldn't allocate work buf.\n");
-			return NULL;
-		}
-		memset(ctx->buf, 0, size * 2);
+	if (user_parm->connection_type==UD)
+		ctx->buf_size = ( size + 40 ) * 2;
+	else
+		ctx->buf_size = size * 2;
+	if (user_parm->pool_size > ctx->buf_size)
+		ctx->buf_size = user_parm->pool_size;
+
+	ctx->buf = memalign(page_size, ctx->buf_size);
+	if (!ctx->buf) {
+		fprintf(stderr, "Couldn't allocate work buf.\n");
+		return NULL;
 	}
+	memset(ctx->buf, 0, ctx->buf_size);
+
+	/* receives are always posted for the largest message */
+	if (user_parm->pool_size &&
+	    buf_pool_init(&ctx->rx_pool, ctx->buf, ctx->buf_size,
+			  user_parm->connection_type==UD ? size + 40 : size,
+			  user_parm->rotation, user_parm->stride))
+		return NULL;
 
 	ctx->post_buf = (char*)ctx->buf + (size - 1);
 	ctx->poll_buf = (char*)ctx->buf + (2 * size - 1);
@@ -447,20 +459,11 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev, int size,
 		fprintf(stderr, "Couldn't allocate PD\n");
 		return NULL;
 	}
-	if (user_parm->connection_type==UD) {
-		ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, (size + 40 ) * 2,
-				     IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE);
-		if (!ctx->mr) {
-			fprintf(stderr, "Couldn't allocate MR\n");
-			return NULL;
-		}
-	} else {
-		ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, size * 2,
-				     IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE);
-		if (!ctx->mr) {
-			fprintf(stderr, "Couldn't allocate MR\n");
-			return NULL;
-		}
+	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, ctx->buf_size,
+			     IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE);
+	if (!ctx->mr) {
+		fprintf(stderr, "Couldn't allocate MR\n");
+		return NULL;
 	}
 
 	ctx->scq = ibv_create_cq(ctx->context, tx_depth, NULL, ctx->channel, 0);
@@ -701,6 +704,8 @@ static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 		}
 		ctx->recv_list.lkey = ctx->mr->lkey;
 		for (i = 0; i < user_parm->tx_depth / 2; ++i) {
+			if (user_parm->pool_size)
+				ctx->recv_list.addr = (uintptr_t) buf_pool_next(&ctx->rx_pool);
 			if (ibv_post_recv(ctx->qp, &ctx->rwr, &bad_wr_recv)) {
 				fprintf(stderr, "Couldn't post recv: counter=%d\n",
 					i);
@@ -833,6 +838,8 @@ static void usage(const char *argv0)
 	printf("  -e, --events                 sleep on CQ events (default poll)\n");
 	printf("  -g, --mcg                    send messages to multicast group(only available in UD connection\n");
 	printf("  -F, --CPU-freq               do not fail even if cpufreq_ondemand module is loaded\n");
+	printf("  -P, --buf-pool=<size>        rotate WRs over a registered region of <size> bytes, K/M/G allowed (default off)\n");
+	printf("  -R, --rotate=<mode>          buffer pool rotation seq/stride[:<slots>]/rand (default seq)\n");
 }
 
 /*
@@ -964,6 +971,12 @@ int run_iter(struct pingpong_context *ctx, struct user_parameters *user_param,
 
 	ctx->recv_list.lkey = ctx->mr->lkey;
 
+	if (user_param->pool_size &&
+	    buf_pool_init(&ctx->tx_pool, ctx->buf, ctx->buf_size,
+			  user_param->connection_type==UD ? size + 40 : size,
+			  user_param->rotation, user_param->stride))
+		return 1;
+
 	scnt = 0;
 	rcnt = 0;
 	ccnt = 0;
@@ -983,6 +996,8 @@ int run_iter(struct pingpong_context *ctx, struct user_parameters *user_param,
 			struct ibv_wc wc;
 			/*Server is polling on recieve first */
 			++rcnt;
+			if (user_param->pool_size)
+				ctx->recv_list.addr = (uintptr_t) buf_pool_next(&ctx->rx_pool);
 			if (ibv_post_recv(qp, &rwr, &bad_wr_recv)) {
 				fprintf(stderr, "Couldn't post recv: rcnt=%d\n",
 					rcnt);
@@ -1039,6 +1054,9 @@ int run_iter(struct pingpong_context *ctx, struct user_parameters *user_param,
 			}
 			struct ibv_send_wr *bad_wr;
 			/* client post first */
+			if (user_param->pool_size)
+				ctx->list.addr = (uintptr_t) buf_pool_next(&ctx->tx_pool) +
+					(user_param->connection_type==UD ? 40 : 0);
 			tstamp[scnt] = get_cycles();
 			*post_buf = (char)++scnt;
 			if (ibv_post_send(qp, wr, &bad_wr)) {
@@ -1128,6 +1146,8 @@ int main(int argc, char *argv[])
 	user_param.signal_comp = 0;
 	user_param.qp_timeout = 14;
 	user_param.gid_index = -1; /*gid will not be used*/
+	user_param.rotation = ROTATE_SEQ;
+	user_param.stride = BUF_POOL_DEF_STRIDE;
 	/* Parameter parsing. */
 	while (1) {
 		int c;
@@ -1154,9 +1174,11 @@ int main(int argc, char *argv[])
 			{ .name = "events",         .has_arg = 0, .val = 'e' },
 			{ .name = "mcg",            .has_arg = 0, .val = 'g' },
 			{ .name = "CPU-freq",       .has_arg = 0, .val = 'F' },
+			{ .name = "buf-pool",       .has_arg = 1, .val = 'P' },
+			{ .name = "rotate",         .has_arg = 1, .val = 'R' },
 			{ 0 }
 		};
-		c = getopt_long(argc, argv, "p:c:m:d:i:s:n:t:I:u:S:x:laeCHUVgF", long_options, NULL);
+		c = getopt_long(argc, argv, "p:c:m:d:i:s:n:t:I:u:S:x:P:R:laeCHUVgF", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -1270,6 +1292,20 @@ int main(int argc, char *argv[])
 			if (sl > 15) { usage(argv[0]); return 6; }
 			break;
 
+		case 'P':
+			if (buf_pool_parse_size(optarg, &user_param.pool_size)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'R':
+			if (buf_pool_parse_rotation(optarg, &user_param.rotation, &user_param.stride)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
 		default:
 			usage(argv[0]);
 			return 7;
@@ -1298,6 +1334,9 @@ int main(int argc, char *argv[])
 	else
 		printf("                    Send Latency Test\n");
 	printf("Inline data is used up to %d bytes message\n", user_param.inline_size);
+	if (user_param.pool_size)
+		printf("Buffer pool : %zu bytes, %s rotation\n", user_param.pool_size,
+		       buf_pool_mode_str(user_param.rotation));
 	if (user_param.connection_type==RC) {
 		printf("Connection type : RC\n");
 	} else if (user_param.connection_type==UC) { 
@@ -0,0 +1,202 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sge.h"
+
+#define SGE_ALIGN 64
+
+int sge_parse_layout(const char *arg, struct sge_layout *layout)
+{
+	char *end;
+	unsigned long v;
+	int n = 0;
+
+	memset(layout, 0, sizeof *layout);
+	layout->rest = -1;
+	if (!strchr(arg, ',') && strcmp(arg, "*")) {
+		v = strtoul(arg, &end, 0);
+		if (*end || v < 1 || v > SGE_MAX_FRAGS)
+			return 1;
+		layout->nfrags = v;
+		layout->equal = 1;
+		return 0;
+	}
+	for (;;) {
+		if (n == SGE_MAX_FRAGS)
+			return 1;
+		if (*arg == '*') {
+			if (layout->rest >= 0)
+				return 1;
+			layout->rest = n;
+			end = (char *) arg + 1;
+		} else {
+			v = strtoul(arg, &end, 0);
+			if (end == arg || !v || v > 0x7fffffff)
+				return 1;
+			layout->len[n] = v;
+		}
+		++n;
+		if (!*end)
+			break;
+		if (*end != ',')
+			return 1;
+		arg = end + 1;
+	}
+	if (layout->rest < 0)
+		layout->rest = n - 1;
+	layout->nfrags = n;
+	return 0;
+}
+
+int sge_parse_mode(const char *arg, enum sge_mode *mode)
+{
+	if (!strcmp(arg, "gather"))
+		*mode = SGE_GATHER;
+	else if (!strcmp(arg, "copy"))
+		*mode = SGE_COPY;
+	else if (!strcmp(arg, "both"))
+		*mode = SGE_BOTH;
+	else
+		return 1;
+	return 0;
+}
+
+const char *sge_mode_str(enum sge_mode mode)
+{
+	switch (mode) {
+	case SGE_GATHER: return "gather";
+	case SGE_COPY:   return "copy";
+	case SGE_BOTH:   return "gather vs copy";
+	default:         return "off";
+	}
+}
+
+const char *sge_layout_str(const struct sge_layout *layout)
+{
+	static char str[SGE_MAX_FRAGS * 12];
+	size_t n = 0;
+	int i;
+
+	if (layout->equal) {
+		snprintf(str, sizeof str, "%d equal", layout->nfrags);
+		return str;
+	}
+	str[0] = '\0';
+	for (i = 0; i < layout->nfrags && n < sizeof str; ++i) {
+		if (i == layout->rest && !layout->len[i])
+			n += snprintf(str + n, sizeof str - n, "%s*", i ? "," : "");
+		else
+			n += snprintf(str + n, sizeof str - n, "%s%u", i ? "," : "",
+				      layout->len[i]);
+	}
+	return str;
+}
+
+/*
+ * Length of fragment i for a size byte message: the fixed lengths are
+ * served in list order, and whatever is left over goes to the rest fragment.
+ */
+static unsigned sge_frag_len(const struct sge_layout *layout, int i, unsigned size)
+{
+	unsigned fixed = 0, before = 0, len = 0;
+	int j;
+
+	if (layout->equal)
+		return size / layout->nfrags + ((unsigned) i < size % layout->nfrags);
+	for (j = 0; j < layout->nfrags; ++j) {
+		if (j < i)
+			before += layout->len[j];
+		fixed += layout->len[j];
+	}
+	if (size > before)
+		len = size - before < layout->len[i] ? size - before : layout->len[i];
+	if (i == layout->rest && size > fixed)
+		len += size - fixed;
+	return len;
+}
+
+size_t sge_layout_init(struct sge_layout *layout, size_t max_size)
+{
+	size_t off = 0;
+	int i;
+
+	for (i = 0; i < layout->nfrags; ++i) {
+		layout->off[i] = off;
+		off += (sge_frag_len(layout, i, max_size) + SGE_ALIGN - 1) & ~(size_t) (SGE_ALIGN - 1);
+		off += SGE_FRAG_GAP;
+	}
+	layout->footprint = off;
+	return off;
+}
+
+int sge_build(const struct sge_layout *layout, unsigned size,
+	      char *base, uint32_t lkey, struct ibv_sge *sge)
+{
+	unsigned len;
+	int i, n = 0;
+
+	for (i = 0; i < layout->nfrags; ++i) {
+		len = sge_frag_len(layout, i, size);
+		if (!len)
+			continue;
+		sge[n].addr   = (uintptr_t) base + layout->off[i];
+		sge[n].length = len;
+		sge[n].lkey   = lkey;
+		++n;
+	}
+	return n;
+}
+
+void sge_print_crossover(const struct sge_layout *layout, int nsizes,
+			 const unsigned *sizes, double (*bw)[2])
+{
+	int i, last_copy = -1;
+
+	printf("------------------------------------------------------------------\n");
+	printf(" SGE gather vs copy, fragments %s\n", sge_layout_str(layout));
+	printf(" #bytes   gather[MB/sec]     copy[MB/sec]   faster\n");
+	for (i = 0; i < nsizes; ++i) {
+		printf("%7u     %10.2f       %10.2f   %s\n", sizes[i], bw[i][0], bw[i][1],
+		       bw[i][0] >= bw[i][1] ? "gather" : "copy");
+		if (bw[i][0] < bw[i][1])
+			last_copy = i;
+	}
+	if (last_copy < 0)
+		printf(" gather is faster at every size\n");
+	else if (last_copy == nsizes - 1)
+		printf(" copy is faster up to the largest size\n");
+	else
+		printf(" crossover: gather is faster from %u bytes\n", sizes[last_copy + 1]);
+}
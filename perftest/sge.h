@@ -0,0 +1,108 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $Id$
+ */
+
+#ifndef SGE_H
+#define SGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <infiniband/verbs.h>
+
+/*
+ * Fragmented messages: a header, a payload and maybe a trailer living in
+ * separate objects.  They can go out as one WR with several SGEs (the HCA
+ * gathers) or be copied into one bounce buffer and sent with a single SGE
+ * (the CPU gathers).  Which one wins depends on fragment count and size.
+ */
+enum sge_mode {
+	SGE_OFF = 0,
+	SGE_GATHER,		/* one SGE per fragment */
+	SGE_COPY,		/* memcpy the fragments into the send buffer */
+	SGE_BOTH		/* run every size both ways and compare */
+};
+
+#define SGE_MAX_FRAGS	30
+/* Fragments are this far apart so they look like unrelated objects. */
+#define SGE_FRAG_GAP	4096
+
+struct sge_layout {
+	int                 nfrags;
+	int                 equal;		/* split the message evenly */
+	int                 rest;		/* index of the fragment taking the remainder */
+	unsigned            len[SGE_MAX_FRAGS];	/* fixed lengths, unused if equal */
+	size_t              off[SGE_MAX_FRAGS];	/* source offset of each fragment */
+	size_t              footprint;
+};
+
+/*
+ * Accepts a fragment count ("4", equal split) or a list of fragment sizes
+ * with at most one "*" taking the rest of the message ("64,*", "64,*,16").
+ * Without a "*" the last fragment takes the rest.
+ */
+extern int sge_parse_layout(const char *arg, struct sge_layout *layout);
+/* Accepts "gather", "copy" or "both". */
+extern int sge_parse_mode(const char *arg, enum sge_mode *mode);
+extern const char *sge_mode_str(enum sge_mode mode);
+/* Short description of the layout, e.g. "4 equal" or "64,*,16". */
+extern const char *sge_layout_str(const struct sge_layout *layout);
+/*
+ * Place the fragment sources for messages up to max_size bytes and return
+ * the number of bytes the source region needs (also in layout->footprint).
+ */
+extern size_t sge_layout_init(struct sge_layout *layout, size_t max_size);
+/*
+ * Split a size byte message over the fragment sources at base.  Fragments
+ * that come out empty are dropped; returns the number of SGEs filled in.
+ */
+extern int sge_build(const struct sge_layout *layout, unsigned size,
+		     char *base, uint32_t lkey, struct ibv_sge *sge);
+/*
+ * Gather vs copy side by side, bw[i] = { gather, copy } MB/sec for sizes[i],
+ * and the size from which the HCA gather stays ahead of the memcpy.
+ */
+extern void sge_print_crossover(const struct sge_layout *layout, int nsizes,
+				const unsigned *sizes, double (*bw)[2]);
+
+/* The CPU gather: copy the fragments back to back into dst. */
+static inline void sge_coalesce(void *dst, const struct ibv_sge *sge, int nsge)
+{
+	char *p = dst;
+	int i;
+
+	for (i = 0; i < nsge; ++i) {
+		memcpy(p, (void *) (uintptr_t) sge[i].addr, sge[i].length);
+		p += sge[i].length;
+	}
+}
+
+#endif
@@ -0,0 +1,191 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $Id$
+ */
+
+#include <string.h>
+#include "verify.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+#define CRC32C_POLY	0x82F63B78	/* reflected Castagnoli */
+#define CRC32C_BLOCK	1024		/* bytes per stream in the 3-way loop */
+
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_shift1;		/* x^(8 * CRC32C_BLOCK) mod P */
+static uint32_t crc32c_shift2;		/* x^(16 * CRC32C_BLOCK) mod P */
+static int crc32c_ready;
+
+/* a * b mod P, both in the reflected representation (x^0 is bit 31) */
+static uint32_t crc32c_multmod(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if (!(a & (m - 1)))
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^(8 * n) mod P */
+static uint32_t crc32c_xpow8n(size_t n)
+{
+	uint32_t p = 1U << 31, sq = 1U << 23;
+
+	while (n) {
+		if (n & 1)
+			p = crc32c_multmod(sq, p);
+		sq = crc32c_multmod(sq, sq);
+		n >>= 1;
+	}
+	return p;
+}
+
+static void crc32c_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; ++i) {
+		c = i;
+		for (k = 0; k < 8; ++k)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[i] = c;
+	}
+	crc32c_shift1 = crc32c_xpow8n(CRC32C_BLOCK);
+	crc32c_shift2 = crc32c_xpow8n(2 * CRC32C_BLOCK);
+	crc32c_ready = 1;
+}
+
+/* The raw register update, no pre/post inversion. */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c0 = crc, c1, c2;
+	uint64_t w;
+	size_t i;
+
+	/*
+	 * crc32 has a 3 cycle latency and 1 cycle throughput, so run three
+	 * independent streams and fold them back together:
+	 * U(r, A|B|C) = U(r, A) * x^2B  ^  U(0, B) * x^B  ^  U(0, C)
+	 */
+	while (len >= 3 * CRC32C_BLOCK) {
+		c1 = c2 = 0;
+		for (i = 0; i < CRC32C_BLOCK; i += 8) {
+			memcpy(&w, p + i, 8);
+			c0 = _mm_crc32_u64(c0, w);
+			memcpy(&w, p + CRC32C_BLOCK + i, 8);
+			c1 = _mm_crc32_u64(c1, w);
+			memcpy(&w, p + 2 * CRC32C_BLOCK + i, 8);
+			c2 = _mm_crc32_u64(c2, w);
+		}
+		c0 = crc32c_multmod(crc32c_shift2, (uint32_t) c0) ^
+		     crc32c_multmod(crc32c_shift1, (uint32_t) c1) ^ (uint32_t) c2;
+		p += 3 * CRC32C_BLOCK;
+		len -= 3 * CRC32C_BLOCK;
+	}
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		c0 = _mm_crc32_u64(c0, w);
+	}
+	crc = (uint32_t) c0;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	if (!crc32c_ready)
+		crc32c_init();
+#ifdef HAVE_SSE42_CRC
+	if (__builtin_cpu_supports("sse4.2"))
+		return ~crc32c_hw(~crc, buf, len);
+#endif
+	return ~crc32c_sw(~crc, buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+#ifdef HAVE_SSE42_CRC
+	if (__builtin_cpu_supports("sse4.2"))
+		return "crc32c/sse4.2";
+#endif
+	return "crc32c/table";
+}
+
+static uint32_t verify_crc(const struct verify_hdr *hdr, const void *buf, size_t len)
+{
+	uint32_t crc;
+
+	crc = crc32c(0, &hdr->seq, sizeof(hdr->seq) + sizeof(hdr->len));
+	return crc32c(crc, (const char *) buf + VERIFY_HDR_LEN, len - VERIFY_HDR_LEN);
+}
+
+void verify_stamp(void *buf, size_t len, uint64_t seq)
+{
+	struct verify_hdr hdr;
+
+	hdr.seq = seq;
+	hdr.len = len;
+	hdr.crc = verify_crc(&hdr, buf, len);
+	memcpy(buf, &hdr, sizeof hdr);
+}
+
+enum verify_result verify_check(const void *buf, size_t len, uint64_t seq)
+{
+	struct verify_hdr hdr;
+
+	memcpy(&hdr, buf, sizeof hdr);
+	if (hdr.len != len || hdr.crc != verify_crc(&hdr, buf, len))
+		return VERIFY_BAD_CRC;
+	if (hdr.seq != seq)
+		return VERIFY_BAD_SEQ;
+	return VERIFY_OK;
+}
@@ -0,0 +1,67 @@
+/*
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * $Id$
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Line-rate integrity check.  The sender stamps the first bytes of every
+ * message with its sequence number, length and a CRC32C of the rest of the
+ * message; the receiver recomputes it right after the completion.  CRC32C
+ * uses the SSE4.2 crc32 instruction on three interleaved streams when the
+ * CPU has it, and a table otherwise.
+ */
+struct verify_hdr {
+	uint64_t seq;
+	uint32_t len;
+	uint32_t crc;
+};
+
+#define VERIFY_HDR_LEN	sizeof(struct verify_hdr)
+
+enum verify_result {
+	VERIFY_OK = 0,
+	VERIFY_BAD_CRC,
+	VERIFY_BAD_SEQ
+};
+
+extern uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+extern const char *crc32c_impl(void);
+
+/* Both need len >= VERIFY_HDR_LEN. */
+extern void verify_stamp(void *buf, size_t len, uint64_t seq);
+extern enum verify_result verify_check(const void *buf, size_t len, uint64_t seq);
+
+#endif
@@ -56,6 +56,8 @@
 #include <infiniband/verbs.h>
 
 #include "get_clock.h"
+#include "buf_pool.h"
+#include "sge.h"
 
 #define PINGPONG_RDMA_WRID	3
 #define VERSION 2.0
@@ -76,6 +78,11 @@ struct user_parameters {
     int inline_size;
 	int qp_timeout;
 	int gid_index; /* if value not negative, we use gid AND gid_index=value */
+	size_t pool_size; /* if not 0, rotate WRs over a region this big */
+	enum buf_rotation rotation;
+	unsigned long stride;
+	enum sge_mode sge_mode;
+	struct sge_layout sge_layout;
 };
 struct extended_qp {
   struct ibv_qp           *qp;
@@ -93,8 +100,17 @@ struct pingpong_context {
 	struct ibv_cq      *cq;
 	struct ibv_qp      **qp;
 	void               *buf;
+	size_t              buf_size;
 	unsigned            size;
 	int                 tx_depth;
+	struct buf_pool     pool;
+	char               *frag_buf;	/* sources of the message fragments */
+	struct ibv_mr      *frag_mr;
+	enum sge_mode       sge_pass;	/* SGE_GATHER or SGE_COPY for this run */
+	struct ibv_sge      sge[SGE_MAX_FRAGS];
+	int                 nsge;
+	cycles_t            copy_cycles;
+	unsigned long       ncopied;
 	struct ibv_sge      list;
     struct ibv_send_wr  wr;
     int                 *scnt;
@@ -426,13 +442,29 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev,
 	memset(ctx->scnt, 0, user_parm->numofqps * sizeof (int));
 	memset(ctx->ccnt, 0, user_parm->numofqps * sizeof (int));
 	
-	ctx->buf = memalign(page_size, size * 2 * user_parm->numofqps  );
+	ctx->buf_size = (size_t) size * 2 * user_parm->numofqps;
+	if (user_parm->pool_size > ctx->buf_size)
+		ctx->buf_size = user_parm->pool_size;
+	ctx->buf = memalign(page_size, ctx->buf_size);
 	if (!ctx->buf) {
 		fprintf(stderr, "Couldn't allocate work buf.\n");
 		return NULL;
 	}
 
-	memset(ctx->buf, 0, size * 2 * user_parm->numofqps);
+	memset(ctx->buf, 0, ctx->buf_size);
+
+	ctx->frag_buf = NULL;
+	ctx->frag_mr = NULL;
+	ctx->sge_pass = SGE_OFF;
+	if (user_parm->sge_mode) {
+		sge_layout_init(&user_parm->sge_layout, size);
+		ctx->frag_buf = memalign(page_size, user_parm->sge_layout.footprint);
+		if (!ctx->frag_buf) {
+			fprintf(stderr, "Couldn't allocate fragment buf.\n");
+			return NULL;
+		}
+		memset(ctx->frag_buf, 0x5a, user_parm->sge_layout.footprint);
+	}
 
 	ctx->context = ibv_open_device(ib_dev);
 	if (!ctx->context) {
@@ -461,12 +493,20 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev,
 	/* We dont really want IBV_ACCESS_LOCAL_WRITE, but IB spec says:
 	 * The Consumer is not allowed to assign Remote Write or Remote Atomic to
 	 * a Memory Region that has not been assigned Local Write. */
-	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, size * 2 * user_parm->numofqps,
+	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, ctx->buf_size,
 			     IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE);
 	if (!ctx->mr) {
 		fprintf(stderr, "Couldn't allocate MR\n");
 		return NULL;
 	}
+	if (ctx->frag_buf) {
+		ctx->frag_mr = ibv_reg_mr(ctx->pd, ctx->frag_buf, user_parm->sge_layout.footprint,
+					  IBV_ACCESS_LOCAL_WRITE);
+		if (!ctx->frag_mr) {
+			fprintf(stderr, "Couldn't allocate fragment MR\n");
+			return NULL;
+		}
+	}
 
 	ctx->cq = ibv_create_cq(ctx->context, tx_depth * user_parm->numofqps , NULL, NULL, 0);
 	if (!ctx->cq) {
@@ -484,7 +524,7 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev,
 		/* Work around:  driver doesnt support
 		 * recv_wr = 0 */
 		initattr.cap.max_recv_wr  = 1;
-		initattr.cap.max_send_sge = 1;
+		initattr.cap.max_send_sge = user_parm->sge_mode ? user_parm->sge_layout.nfrags : 1;
 		initattr.cap.max_recv_sge = 1;
 		initattr.cap.max_inline_data = user_parm->inline_size;
 
@@ -614,6 +654,32 @@ static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 	return 0;
 }
 
+/*
+ * Pick the next pool slot as the local source and write into the same offset
+ * of the peer's pool; both sides run with the same -P so the offset fits.
+ * In SGE copy mode the fragments are gathered into the source first.
+ */
+static inline void pp_rotate_write(struct pingpong_context *ctx, struct user_parameters *user_param,
+				   struct pingpong_dest *rem_dest)
+{
+	char *slot;
+	cycles_t t;
+
+	if (!user_param->pool_size) {
+		ctx->wr.wr.rdma.remote_addr = rem_dest->vaddr;
+	} else {
+		slot = buf_pool_next(&ctx->pool);
+		ctx->list.addr = (uintptr_t) slot;
+		ctx->wr.wr.rdma.remote_addr = rem_dest->vaddr + (slot - (char *) ctx->buf);
+	}
+	if (ctx->sge_pass == SGE_COPY) {
+		t = get_cycles();
+		sge_coalesce((void *) (uintptr_t) ctx->list.addr, ctx->sge, ctx->nsge);
+		ctx->copy_cycles += get_cycles() - t;
+		++ctx->ncopied;
+	}
+}
+
 static void usage(const char *argv0)
 {
 	printf("Usage:\n");
@@ -640,12 +706,20 @@ static void usage(const char *argv0)
 	printf("  -V, --version             display version number\n");
 	printf("  -N, --no peak-bw          cancel peak-bw calculation (default with peak-bw)\n");
 	printf("  -F, --CPU-freq            do not fail even if cpufreq_ondemand module is loaded\n");
+	printf("  -P, --buf-pool=<size>     rotate WRs over a registered region of <size> bytes, K/M/G allowed (default off)\n");
+	printf("  -R, --rotate=<mode>       buffer pool rotation seq/stride[:<slots>]/rand (default seq)\n");
+	printf("  -G, --sge=<n|len,...>     split each message into n fragments, or fragments of the given\n");
+	printf("                            lengths with one \"*\" taking the rest (e.g. 64,*) (default off)\n");
+	printf("  -M, --sge-mode=<mode>     send fragments as SGEs (gather), memcpy them into one buffer\n");
+	printf("                            (copy), or run both and report the crossover (default both)\n");
 }
 
-static void print_report(unsigned int iters, unsigned size, int duplex,
-			 cycles_t *tposted, cycles_t *tcompleted, struct user_parameters *user_param,
-			 int noPeak, int no_cpu_freq_fail)
+/* Returns the average BW in MB/sec. */
+static double print_report(unsigned int iters, unsigned size, int duplex,
+			   cycles_t *tposted, cycles_t *tcompleted, struct user_parameters *user_param,
+			   int noPeak, int no_cpu_freq_fail)
 {
+	double bw_avg;
 	double cycles_to_units;
 	unsigned long tsize;	/* Transferred size, in megabytes */
 	int i, j;
@@ -673,9 +747,23 @@ static void print_report(unsigned int iters, unsigned size, int duplex,
 
 	tsize = duplex ? 2 : 1;
 	tsize = tsize * size;
+	bw_avg = tsize * iters * user_param->numofqps * cycles_to_units /(tcompleted[(iters* user_param->numofqps) - 1] - tposted[0]) / 0x100000;
 	printf("%7d        %d            %7.2f               %7.2f\n",
 	       size,iters,!(noPeak) * tsize * cycles_to_units / opt_delta / 0x100000,
-	       tsize * iters * user_param->numofqps * cycles_to_units /(tcompleted[(iters* user_param->numofqps) - 1] - tposted[0]) / 0x100000);
+	       bw_avg);
+	return bw_avg;
+}
+
+static void print_sge_report(struct pingpong_context *ctx, struct user_parameters *user_param,
+			     int no_cpu_freq_fail)
+{
+	if (ctx->sge_pass == SGE_GATHER)
+		printf("   sge     %-20s %d SGEs (%s)\n", "gather", ctx->nsge,
+		       sge_layout_str(&user_param->sge_layout));
+	else if (ctx->sge_pass == SGE_COPY)
+		printf("   sge     %-20s %d fragments (%s) -> 1 SGE, copy %8.3f usec/msg\n", "copy",
+		       ctx->nsge, sge_layout_str(&user_param->sge_layout),
+		       ctx->ncopied ? ctx->copy_cycles / get_cpu_mhz(no_cpu_freq_fail) / ctx->ncopied : 0.);
 }
 int run_iter(struct pingpong_context *ctx, struct user_parameters *user_param,
 	     struct pingpong_dest **rem_dest, int size)
@@ -702,6 +790,20 @@ int run_iter(struct pingpong_context *ctx, struct user_parameters *user_param,
 		ctx->wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
 	}
 	ctx->wr.next       = NULL;
+	ctx->copy_cycles = 0;
+	ctx->ncopied = 0;
+	if (ctx->sge_pass) {
+		ctx->nsge = sge_build(&user_param->sge_layout, size, ctx->frag_buf,
+				      ctx->frag_mr->lkey, ctx->sge);
+		if (ctx->sge_pass == SGE_GATHER) {
+			ctx->wr.sg_list = ctx->sge;
+			ctx->wr.num_sge = ctx->nsge;
+		}
+	}
+	if (user_param->pool_size &&
+	    buf_pool_init(&ctx->pool, ctx->buf, ctx->buf_size, size,
+			  user_param->rotation, user_param->stride))
+		return 1;
 
 	totscnt = 0;
 	totccnt = 0;
@@ -717,7 +819,7 @@ int run_iter(struct pingpong_context *ctx, struct user_parameters *user_param,
        1 for each qp till all qps have 100  */
 	for (warmindex =0 ;warmindex < user_param->maxpostsofqpiniteration ;warmindex ++ ) {
 	  for (index =0 ; index < user_param->numofqps ; index++) {
-      	    ctx->wr.wr.rdma.remote_addr = rem_dest[index]->vaddr;
+            pp_rotate_write(ctx, user_param, rem_dest[index]);
             ctx->wr.wr.rdma.rkey = rem_dest[index]->rkey;
             qp = ctx->qp[index];
             ctx->wr.wr_id      = index ;
@@ -735,11 +837,11 @@ int run_iter(struct pingpong_context *ctx, struct user_parameters *user_param,
 	while (totscnt < (user_param->iters * user_param->numofqps)  || totccnt < (user_param->iters * user_param->numofqps) ) {
 	  /* main loop to run over all the qps and post each time n messages */
 	  for (index =0 ; index < user_param->numofqps ; index++) {
-          ctx->wr.wr.rdma.remote_addr = rem_dest[index]->vaddr;
           ctx->wr.wr.rdma.rkey = rem_dest[index]->rkey;
           qp = ctx->qp[index];
           ctx->wr.wr_id      = index ;
           while (ctx->scnt[index] < user_param->iters && (ctx->scnt[index] - ctx->ccnt[index]) < user_param->maxpostsofqpiniteration) {
+	      pp_rotate_write(ctx, user_param, rem_dest[index]);
 	      tposted[totscnt] = get_cycles();
 	      if (ibv_post_send(qp, &ctx->wr, &bad_wr)) {
               fprintf(stderr, "Couldn't post send: qp index = %d qp scnt=%d total scnt %d\n",
@@ -800,6 +902,11 @@ int main(int argc, char *argv[])
 	struct ibv_context       *context;
 	int                      no_cpu_freq_fail = 0;
 	union ibv_gid            gid;
+	enum sge_mode            first_pass, last_pass, pass;
+	unsigned                 sge_sizes[24];
+	double                   sge_bw[24][2];
+	int                      nsizes = 0;
+	double                   bw;
 
 	/* init default values to user's parameters */
 	memset(&user_param, 0, sizeof(struct user_parameters));
@@ -812,6 +919,8 @@ int main(int argc, char *argv[])
 	user_param.inline_size = MAX_INLINE;
 	user_param.qp_timeout = 14;
 	user_param.gid_index = -1; /*gid will not be used*/
+	user_param.rotation = ROTATE_SEQ;
+	user_param.stride = BUF_POOL_DEF_STRIDE;
 	/* Parameter parsing. */
 	while (1) {
 		int c;
@@ -836,10 +945,14 @@ int main(int argc, char *argv[])
 			{ .name = "version",        .has_arg = 0, .val = 'V' },
 			{ .name = "noPeak",         .has_arg = 0, .val = 'N' },
 			{ .name = "CPU-freq",       .has_arg = 0, .val = 'F' },
+			{ .name = "buf-pool",       .has_arg = 1, .val = 'P' },
+			{ .name = "rotate",         .has_arg = 1, .val = 'R' },
+			{ .name = "sge",            .has_arg = 1, .val = 'G' },
+			{ .name = "sge-mode",       .has_arg = 1, .val = 'M' },
 			{ 0 }
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:m:q:g:c:s:n:t:I:u:S:x:baVNF", long_options, NULL);
+		c = getopt_long(argc, argv, "p:d:i:m:q:g:c:s:n:t:I:u:S:x:P:R:G:M:baVNF", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -944,12 +1057,47 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+		case 'P':
+			if (buf_pool_parse_size(optarg, &user_param.pool_size)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'R':
+			if (buf_pool_parse_rotation(optarg, &user_param.rotation, &user_param.stride)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'G':
+			if (sge_parse_layout(optarg, &user_param.sge_layout)) {
+				usage(argv[0]);
+				return 1;
+			}
+			if (!user_param.sge_mode)
+				user_param.sge_mode = SGE_BOTH;
+			break;
+
+		case 'M':
+			if (sge_parse_mode(optarg, &user_param.sge_mode)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
 		default:
 			usage(argv[0]);
 			return 1;
 		}
 	}
 
+	if (user_param.sge_mode && !user_param.sge_layout.nfrags) {
+		fprintf(stderr, "--sge-mode needs a fragment layout (--sge)\n");
+		return 1;
+	}
+
 	if (optind == argc - 1)
 		user_param.servername = strdupa(argv[optind]);
 	else if (optind < argc) {
@@ -1022,6 +1170,18 @@ int main(int argc, char *argv[])
 		user_param.inline_size = 1;
         }
 	printf("Inline data is used up to %d bytes message\n", user_param.inline_size);
+	if (user_param.sge_mode) {
+		if (user_param.sge_layout.nfrags > device_attribute.max_sge) {
+			fprintf(stderr, "%d fragments asked for, device supports %d SGEs\n",
+				user_param.sge_layout.nfrags, device_attribute.max_sge);
+			return 1;
+		}
+		printf("Fragments : %s, %s\n", sge_layout_str(&user_param.sge_layout),
+		       sge_mode_str(user_param.sge_mode));
+	}
+	if (user_param.pool_size)
+		printf("Buffer pool : %zu bytes, %s rotation\n", user_param.pool_size,
+		       buf_pool_mode_str(user_param.rotation));
 
 	ctx = pp_init_ctx(ib_dev, size, user_param.tx_depth, ib_port, &user_param);
 	if (!ctx)
@@ -1072,7 +1232,8 @@ int main(int argc, char *argv[])
 	  my_dest[i].qpn = ctx->qp[i]->qp_num;
 	  /* TBD this should be changed inot VA and different key to each qp */
 	  my_dest[i].rkey = ctx->mr->rkey;
-	  my_dest[i].vaddr = (uintptr_t)ctx->buf + ctx->size;
+	  /* with a buffer pool the peer addresses our whole region by offset */
+	  my_dest[i].vaddr = (uintptr_t)ctx->buf + (user_param.pool_size ? 0 : ctx->size);
 	  
 	  printf("  local address:  LID %#04x, QPN %#06x, PSN %#06x "
 		 "RKey %#08x VAddr %#016Lx\n",
@@ -1148,18 +1309,40 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* gather and copy back to back when comparing, otherwise a single pass */
+	first_pass = user_param.sge_mode == SGE_BOTH ? SGE_GATHER : user_param.sge_mode;
+	last_pass  = user_param.sge_mode == SGE_BOTH ? SGE_COPY : user_param.sge_mode;
+
 	if (user_param.all == ALL) {
 		for (i = 1; i < 24 ; ++i) {
 			size = 1 << i;
-			if(run_iter(ctx, &user_param, rem_dest, size))
-				return 17;
-			print_report(user_param.iters, size, duplex, tposted, tcompleted, &user_param, noPeak, no_cpu_freq_fail);
+			sge_sizes[nsizes] = size;
+			for (pass = first_pass; pass <= last_pass; ++pass) {
+				ctx->sge_pass = pass;
+				if(run_iter(ctx, &user_param, rem_dest, size))
+					return 17;
+				bw = print_report(user_param.iters, size, duplex, tposted, tcompleted, &user_param, noPeak, no_cpu_freq_fail);
+				if (pass)
+					sge_bw[nsizes][pass - SGE_GATHER] = bw;
+				print_sge_report(ctx, &user_param, no_cpu_freq_fail);
+			}
+			++nsizes;
 		}
 	} else {
-		if(run_iter(ctx, &user_param, rem_dest, size))
-			return 18;
-		print_report(user_param.iters, size, duplex, tposted, tcompleted, &user_param, noPeak, no_cpu_freq_fail);
+		sge_sizes[nsizes] = size;
+		for (pass = first_pass; pass <= last_pass; ++pass) {
+			ctx->sge_pass = pass;
+			if(run_iter(ctx, &user_param, rem_dest, size))
+				return 18;
+			bw = print_report(user_param.iters, size, duplex, tposted, tcompleted, &user_param, noPeak, no_cpu_freq_fail);
+			if (pass)
+				sge_bw[nsizes][pass - SGE_GATHER] = bw;
+			print_sge_report(ctx, &user_param, no_cpu_freq_fail);
+		}
+		++nsizes;
 	}
+	if (user_param.sge_mode == SGE_BOTH)
+		sge_print_crossover(&user_param.sge_layout, nsizes, sge_sizes, sge_bw);
 	/* the 0th place is arbitrary to signal finish ... */
 	if (user_param.servername) {
 		rem_dest[0] = pp_client_exch_dest(sockfd, &my_dest[0], &user_param);
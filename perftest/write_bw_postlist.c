@@ -76,6 +76,8 @@ struct user_parameters {
     int inline_size;
 	int qp_timeout;
 	int gid_index; /* if value not negative, we use gid AND gid_index=value */
+	int qp_sweep; /* if not 0, ramp the QP count 1, 2, 4, ... up to this */
+	int outstanding; /* WRs in flight across all QPs during a sweep */
 };
 struct extended_qp {
   struct ibv_qp           *qp;
@@ -92,7 +94,9 @@ struct pingpong_context {
 	struct ibv_mr      *mr;
 	struct ibv_cq      *cq;
 	struct ibv_qp      **qp;
+	int                 num_qps;	/* created so far */
 	void               *buf;
+	size_t              buf_size;
 	unsigned            size;
 	int                 tx_depth;
 	struct ibv_sge      list;
@@ -399,6 +403,56 @@ out:
 	return rem_dest;
 }
 
+/* Create QP <index> and take it to INIT. */
+static int pp_create_qp(struct pingpong_context *ctx, struct user_parameters *user_parm,
+			int port, int index, int send_wr)
+{
+	struct ibv_qp_init_attr initattr;
+	struct ibv_qp_attr attr;
+
+	memset(&initattr, 0, sizeof(struct ibv_qp_init_attr));
+	initattr.send_cq = ctx->cq;
+	initattr.recv_cq = ctx->cq;
+	initattr.cap.max_send_wr  = send_wr;
+	/* Work around:  driver doesnt support
+	 * recv_wr = 0 */
+	initattr.cap.max_recv_wr  = 1;
+	initattr.cap.max_send_sge = 1;
+	initattr.cap.max_recv_sge = 1;
+	initattr.cap.max_inline_data = user_parm->inline_size;
+
+	if (user_parm->connection_type == 1) {
+		initattr.qp_type = IBV_QPT_UC;
+	} else {
+		initattr.qp_type = IBV_QPT_RC;
+	}
+	ctx->qp[index] = ibv_create_qp(ctx->pd, &initattr);
+	if (!ctx->qp[index])  {
+		fprintf(stderr, "Couldn't create QP %d\n", index);
+		return 1;
+	}
+
+	attr.qp_state        = IBV_QPS_INIT;
+	attr.pkey_index      = 0;
+	attr.port_num        = port;
+	attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE;
+
+	if (ibv_modify_qp(ctx->qp[index], &attr,
+			  IBV_QP_STATE              |
+			  IBV_QP_PKEY_INDEX         |
+			  IBV_QP_PORT               |
+			  IBV_QP_ACCESS_FLAGS)) {
+		fprintf(stderr, "Failed to modify QP to INIT\n");
+		return 1;
+	}
+	ctx->num_qps = index + 1;
+	return 0;
+}
+
+/*
+ * With a QP sweep only the PD, MR and CQ are set up here; the QPs are added
+ * a step at a time by run_qp_sweep().
+ */
 static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev,
 					    unsigned size,
 					    int tx_depth, int port, struct user_parameters *user_parm)
@@ -406,33 +460,37 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev,
 	struct pingpong_context *ctx;
 	struct ibv_device_attr device_attr;
 	int counter;
+	int max_qps = user_parm->qp_sweep ? user_parm->qp_sweep : user_parm->numofqps;
 
 	ctx = malloc(sizeof *ctx);
 	if (!ctx)
 		return NULL;
-	ctx->qp = malloc(sizeof (struct ibv_qp*) * user_parm->numofqps );
+	ctx->qp = malloc(sizeof (struct ibv_qp*) * max_qps );
+	ctx->num_qps = 0;
 	ctx->size     = size;
 	ctx->tx_depth = tx_depth;
-	ctx->scnt = malloc(user_parm->numofqps * sizeof (int));
+	ctx->scnt = malloc(max_qps * sizeof (int));
 	if (!ctx->scnt) {
 		perror("malloc");
 		return NULL;
 	}
-	ctx->ccnt = malloc(user_parm->numofqps * sizeof (int));
+	ctx->ccnt = malloc(max_qps * sizeof (int));
 	if (!ctx->ccnt) {
 		perror("malloc");
 		return NULL;
 	}
-	memset(ctx->scnt, 0, user_parm->numofqps * sizeof (int));
-	memset(ctx->ccnt, 0, user_parm->numofqps * sizeof (int));
+	memset(ctx->scnt, 0, max_qps * sizeof (int));
+	memset(ctx->ccnt, 0, max_qps * sizeof (int));
 	
-	ctx->buf = memalign(page_size, size * 2 * user_parm->numofqps  );
+	/* all QPs of a sweep write from and into the same pair of buffers */
+	ctx->buf_size = (size_t) size * 2 * (user_parm->qp_sweep ? 1 : user_parm->numofqps);
+	ctx->buf = memalign(page_size, ctx->buf_size);
 	if (!ctx->buf) {
 		fprintf(stderr, "Couldn't allocate work buf.\n");
 		return NULL;
 	}
 
-	memset(ctx->buf, 0, size * 2 * user_parm->numofqps);
+	memset(ctx->buf, 0, ctx->buf_size);
 
 	ctx->context = ibv_open_device(ib_dev);
 	if (!ctx->context) {
@@ -461,58 +519,26 @@ static struct pingpong_context *pp_init_ctx(struct ibv_device *ib_dev,
 	/* We dont really want IBV_ACCESS_LOCAL_WRITE, but IB spec says:
 	 * The Consumer is not allowed to assign Remote Write or Remote Atomic to
 	 * a Memory Region that has not been assigned Local Write. */
-	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, size * 2 * user_parm->numofqps,
+	ctx->mr = ibv_reg_mr(ctx->pd, ctx->buf, ctx->buf_size,
 			     IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE);
 	if (!ctx->mr) {
 		fprintf(stderr, "Couldn't allocate MR\n");
 		return NULL;
 	}
 
-	ctx->cq = ibv_create_cq(ctx->context, tx_depth * user_parm->numofqps , NULL, NULL, 0);
+	/* a sweep never has more than <outstanding> signaled WRs in flight */
+	ctx->cq = ibv_create_cq(ctx->context,
+				user_parm->qp_sweep ? user_parm->outstanding :
+				tx_depth * user_parm->numofqps, NULL, NULL, 0);
 	if (!ctx->cq) {
 		fprintf(stderr, "Couldn't create CQ\n");
 		return NULL;
 	}
+	if (user_parm->qp_sweep)
+		return ctx;
 	for (counter =0 ; counter < user_parm->numofqps ; counter++)
-	{
-		struct ibv_qp_init_attr initattr;
-		struct ibv_qp_attr attr;
-		memset(&initattr, 0, sizeof(struct ibv_qp_init_attr));
-		initattr.send_cq = ctx->cq;
-		initattr.recv_cq = ctx->cq;
-		initattr.cap.max_send_wr  = tx_depth;
-		/* Work around:  driver doesnt support
-		 * recv_wr = 0 */
-		initattr.cap.max_recv_wr  = 1;
-		initattr.cap.max_send_sge = 1;
-		initattr.cap.max_recv_sge = 1;
-		initattr.cap.max_inline_data = user_parm->inline_size;
-
-		if (user_parm->connection_type == 1) {
-			initattr.qp_type = IBV_QPT_UC;
-		} else {
-			initattr.qp_type = IBV_QPT_RC;
-		}
-		ctx->qp[counter] = ibv_create_qp(ctx->pd, &initattr);
-		if (!ctx->qp[counter])  {
-			fprintf(stderr, "Couldn't create QP\n");
+		if (pp_create_qp(ctx, user_parm, port, counter, tx_depth))
 			return NULL;
-		}
-	
-		attr.qp_state        = IBV_QPS_INIT;
-		attr.pkey_index      = 0;
-		attr.port_num        = port;
-		attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE;
-
-		if (ibv_modify_qp(ctx->qp[counter], &attr,
-				  IBV_QP_STATE              |
-				  IBV_QP_PKEY_INDEX         |
-				  IBV_QP_PORT               |
-				  IBV_QP_ACCESS_FLAGS)) {
-			fprintf(stderr, "Failed to modify QP to INIT\n");
-			return NULL;
-		}
-	}
 
 	return ctx;
 }
@@ -541,7 +567,8 @@ static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 		attr.path_mtu               = IBV_MTU_4096;
 		break;
 	}
-	printf("Mtu : %d\n", user_parm->mtu);
+	if (!qpindex)
+		printf("Mtu : %d\n", user_parm->mtu);
 	attr.dest_qp_num 	= dest->qpn;
 	attr.rq_psn 		= dest->psn;
 	if (user_parm->connection_type==RC) {
@@ -614,6 +641,80 @@ static int pp_connect_ctx(struct pingpong_context *ctx, int port, int my_psn,
 	return 0;
 }
 
+/*
+ * Exchange addresses for QP <i> over the socket and bring it to RTS.  The
+ * sweep calls this tens of thousands of times, so it only prints when asked.
+ */
+static int pp_connect_qp(struct pingpong_context *ctx, struct user_parameters *user_param,
+			 int sockfd, int ib_port, union ibv_gid gid, struct pingpong_dest *my_dest,
+			 struct pingpong_dest **rem_dest, int i, int verbose)
+{
+	/* Create connection between client and server.
+	 * We do it by exchanging data over a TCP socket connection. */
+	my_dest[i].lid = pp_get_local_lid(ctx, ib_port);
+	my_dest[i].psn = lrand48() & 0xffffff;
+	if (user_param->gid_index < 0) {/*We do not fail test upon lid in RDMA0E/Eth conf*/
+		if (!my_dest[i].lid) {
+			fprintf(stderr, "Local lid 0x0 detected. Is an SM running? If you are running on an RMDAoE interface you must use GIDs\n");
+			return 1;
+		}
+	}
+	my_dest[i].dgid = gid;
+	my_dest[i].qpn = ctx->qp[i]->qp_num;
+	/* TBD this should be changed into VA and diffreent key to each qp */
+	my_dest[i].rkey = ctx->mr->rkey;
+	my_dest[i].vaddr = (uintptr_t)ctx->buf + ctx->size;
+
+	if (verbose) {
+		printf("  local address:  LID %#04x, QPN %#06x, PSN %#06x "
+		       "RKey %#08x VAddr %#016Lx\n",
+		       my_dest[i].lid, my_dest[i].qpn, my_dest[i].psn,
+		       my_dest[i].rkey, my_dest[i].vaddr);
+		if (user_param->gid_index > -1) {
+			printf("                  GID %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
+			my_dest[i].dgid.raw[0],my_dest[i].dgid.raw[1],
+			my_dest[i].dgid.raw[2], my_dest[i].dgid.raw[3], my_dest[i].dgid.raw[4],
+			my_dest[i].dgid.raw[5], my_dest[i].dgid.raw[6], my_dest[i].dgid.raw[7],
+			my_dest[i].dgid.raw[8], my_dest[i].dgid.raw[9], my_dest[i].dgid.raw[10],
+			my_dest[i].dgid.raw[11], my_dest[i].dgid.raw[12], my_dest[i].dgid.raw[13],
+			my_dest[i].dgid.raw[14], my_dest[i].dgid.raw[15]);
+		}
+	}
+	if (user_param->servername) {
+		rem_dest[i] = pp_client_exch_dest(sockfd, &my_dest[i], user_param);
+	} else {
+		rem_dest[i] = pp_server_exch_dest(sockfd, &my_dest[i], user_param);
+	}
+	if (!rem_dest[i])
+		return 1;
+	if (verbose) {
+		printf("  remote address: LID %#04x, QPN %#06x, PSN %#06x, "
+		       "RKey %#08x VAddr %#016Lx\n",
+		       rem_dest[i]->lid, rem_dest[i]->qpn, rem_dest[i]->psn,
+		       rem_dest[i]->rkey, rem_dest[i]->vaddr);
+		if (user_param->gid_index > -1) {
+			printf("                  GID %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
+			rem_dest[i]->dgid.raw[0],rem_dest[i]->dgid.raw[1],
+			rem_dest[i]->dgid.raw[2], rem_dest[i]->dgid.raw[3], rem_dest[i]->dgid.raw[4],
+			rem_dest[i]->dgid.raw[5], rem_dest[i]->dgid.raw[6], rem_dest[i]->dgid.raw[7],
+			rem_dest[i]->dgid.raw[8], rem_dest[i]->dgid.raw[9], rem_dest[i]->dgid.raw[10],
+			rem_dest[i]->dgid.raw[11], rem_dest[i]->dgid.raw[12], rem_dest[i]->dgid.raw[13],
+			rem_dest[i]->dgid.raw[14], rem_dest[i]->dgid.raw[15]);
+		}
+	}
+	if (pp_connect_ctx(ctx, ib_port, my_dest[i].psn, rem_dest[i], user_param, i))
+		return 1;
+
+	/* An additional handshake is required *after* moving qp to RTR.
+	   Arbitrarily reuse exch_dest for this purpose. */
+	if (user_param->servername) {
+		rem_dest[i] = pp_client_exch_dest(sockfd, &my_dest[i], user_param);
+	} else {
+		rem_dest[i] = pp_server_exch_dest(sockfd, &my_dest[i], user_param);
+	}
+	return !rem_dest[i];
+}
+
 static void usage(const char *argv0)
 {
 	printf("Usage:\n");
@@ -639,6 +740,8 @@ static void usage(const char *argv0)
 	printf("  -b, --bidirectional       measure bidirectional bandwidth (default unidirectional)\n");
 	printf("  -V, --version             display version number\n");
 	printf("  -F, --CPU-freq            do not fail even if cpufreq_ondemand module is loaded\n");
+	printf("  -Q, --qp-sweep=<max>      ramp the QP count 1, 2, 4, ... up to <max> and report rate/latency per step\n");
+	printf("  -O, --outstanding=<wrs>   WRs in flight across all QPs during a sweep (default tx_depth)\n");
 }
 
 static void print_report(unsigned int iters, unsigned size, int duplex,
@@ -778,6 +881,212 @@ int run_iter(struct pingpong_context *ctx, struct user_parameters *user_param,
 	return(0);
 }
 
+static int cmp_cycles(const void *a, const void *b)
+{
+	cycles_t x = *(const cycles_t *) a, y = *(const cycles_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * One point of the QP sweep: <msgs> writes over the first <nqps> QPs with at
+ * most <budget> in flight in total.  QPs are visited round robin, each one
+ * topped up to its share with a single post list, so every QP context is
+ * touched in turn.  The wr_id carries the QP index and the message number.
+ */
+static int run_sweep_point(struct pingpong_context *ctx, struct user_parameters *user_param,
+			   struct ibv_send_wr *wrlist, int nqps, int qp_depth, int budget,
+			   int msgs, cycles_t *t_end)
+{
+	struct ibv_send_wr *bad_wr;
+	struct ibv_wc wc[16];
+	int posted = 0, completed = 0, inflight = 0;
+	int qpindex = 0, idle, n, i, ne;
+	cycles_t now = 0;
+
+	for (i = 0; i < nqps; i++) {
+		ctx->scnt[i] = 0;
+		ctx->ccnt[i] = 0;
+	}
+	while (completed < msgs) {
+		for (idle = 0; posted < msgs && inflight < budget && idle < nqps; ) {
+			n = qp_depth - (ctx->scnt[qpindex] - ctx->ccnt[qpindex]);
+			if (n > budget - inflight)
+				n = budget - inflight;
+			if (n > msgs - posted)
+				n = msgs - posted;
+			if (n > 0) {
+				for (i = 0; i < n; i++) {
+					wrlist[i].wr_id = (uint64_t) qpindex << 32 | (posted + i);
+					wrlist[i].next = i + 1 < n ? &wrlist[i + 1] : NULL;
+				}
+				now = get_cycles();
+				for (i = 0; i < n; i++)
+					tposted[posted + i] = now;
+				if (ibv_post_send(ctx->qp[qpindex], wrlist, &bad_wr)) {
+					fprintf(stderr, "Couldn't post %d send: qp index = %d, %d QPs, total scnt %d\n",
+						n, qpindex, nqps, posted);
+					return 1;
+				}
+				ctx->scnt[qpindex] += n;
+				posted += n;
+				inflight += n;
+				idle = 0;
+			} else
+				++idle;
+			if (++qpindex == nqps)
+				qpindex = 0;
+		}
+
+		ne = ibv_poll_cq(ctx->cq, 16, wc);
+		if (ne < 0) {
+			fprintf(stderr, "poll CQ failed %d\n", ne);
+			return 1;
+		}
+		now = get_cycles();
+		for (i = 0; i < ne; i++) {
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "Completion wth error at %s:\n",
+					user_param->servername ? "client" : "server");
+				fprintf(stderr, "Failed status %d: qp index %d, msg %d, %d QPs\n",
+					wc[i].status, (int) (wc[i].wr_id >> 32),
+					(int) (wc[i].wr_id & 0xffffffff), nqps);
+				return 1;
+			}
+			tcompleted[wc[i].wr_id & 0xffffffff] = now;
+			++ctx->ccnt[wc[i].wr_id >> 32];
+		}
+		completed += ne;
+		inflight -= ne;
+	}
+	*t_end = now;
+	return 0;
+}
+
+/*
+ * Ramp the QP count 1, 2, 4, ... up to --qp-sweep with the same number of
+ * WRs in flight at every step, to find where the HCA's QP context cache
+ * starts thrashing.  New QPs are created and connected incrementally, with
+ * the server doing the same on its side, and that setup time is reported
+ * apart from the message rate and the post-to-completion latency.
+ */
+static int run_qp_sweep(struct pingpong_context *ctx, struct user_parameters *user_param,
+			int sockfd, int ib_port, union ibv_gid gid, struct pingpong_dest *my_dest,
+			struct pingpong_dest **rem_dest, int size, int duplex, int no_cpu_freq_fail)
+{
+	struct ibv_send_wr *wrlist;
+	struct pingpong_dest *sync;
+	int nqps, prev = 0, i, msgs, max_msgs, budget;
+	int qp_depth = user_param->tx_depth;
+	int measure = user_param->servername || duplex;
+	cycles_t t0, t_create, t_connect, t_end, lat;
+	cycles_t tot_create = 0, tot_connect = 0;
+	double mhz;
+
+	max_msgs = user_param->iters > 4 * user_param->qp_sweep ?
+		user_param->iters : 4 * user_param->qp_sweep;
+	tposted = malloc(max_msgs * sizeof *tposted);
+	tcompleted = malloc(max_msgs * sizeof *tcompleted);
+	wrlist = malloc(qp_depth * sizeof *wrlist);
+	if (!tposted || !tcompleted || !wrlist) {
+		perror("malloc");
+		return 1;
+	}
+	mhz = get_cpu_mhz(no_cpu_freq_fail);
+
+	ctx->list.addr = (uintptr_t) ctx->buf;
+	ctx->list.length = size;
+	ctx->list.lkey = ctx->mr->lkey;
+	memset(&ctx->wr, 0, sizeof ctx->wr);
+	ctx->wr.sg_list    = &ctx->list;
+	ctx->wr.num_sge    = 1;
+	ctx->wr.opcode     = IBV_WR_RDMA_WRITE;
+	if (size > user_param->inline_size) {/* complaince to perf_main */
+		ctx->wr.send_flags = IBV_SEND_SIGNALED;
+	} else {
+		ctx->wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+	}
+
+	printf("------------------------------------------------------------------\n");
+	printf("   #QPs  create[usec/QP] connect[usec/QP]  in flight    #msgs   Mmsg/sec   lat avg / p50 / p99 [usec]\n");
+	for (nqps = 1; ; nqps = 2 * nqps < user_param->qp_sweep ? 2 * nqps : user_param->qp_sweep) {
+		t0 = get_cycles();
+		for (i = prev; i < nqps; i++)
+			if (pp_create_qp(ctx, user_param, ib_port, i, qp_depth))
+				return 1;
+		t_create = get_cycles() - t0;
+		t0 = get_cycles();
+		for (i = prev; i < nqps; i++)
+			if (pp_connect_qp(ctx, user_param, sockfd, ib_port, gid, my_dest, rem_dest, i, 0))
+				return 1;
+		t_connect = get_cycles() - t0;
+		tot_create += t_create;
+		tot_connect += t_connect;
+
+		/* every QP writes into the peer's buffer behind QP 0 */
+		ctx->wr.wr.rdma.remote_addr = rem_dest[0]->vaddr;
+		ctx->wr.wr.rdma.rkey = rem_dest[0]->rkey;
+		for (i = 0; i < qp_depth; i++)
+			wrlist[i] = ctx->wr;
+		budget = nqps * qp_depth < user_param->outstanding ?
+			nqps * qp_depth : user_param->outstanding;
+		msgs = user_param->iters > 4 * nqps ? user_param->iters : 4 * nqps;
+
+		printf("%7d  %15.2f %16.2f", nqps, t_create / mhz / (nqps - prev),
+		       t_connect / mhz / (nqps - prev));
+		if (measure) {
+			if (run_sweep_point(ctx, user_param, wrlist, nqps, qp_depth, budget, msgs, &t_end))
+				return 1;
+			lat = 0;
+			for (i = 0; i < msgs; i++) {
+				tcompleted[i] -= tposted[i];
+				lat += tcompleted[i];
+			}
+			qsort(tcompleted, msgs, sizeof *tcompleted, cmp_cycles);
+			printf("  %9d %8d %10.3f   %8.2f %8.2f %8.2f\n", budget, msgs,
+			       msgs * mhz / (t_end - tposted[0]),
+			       lat / mhz / msgs, tcompleted[msgs / 2] / mhz,
+			       tcompleted[msgs - 1 - msgs / 100] / mhz);
+		} else
+			printf("\n");
+		fflush(stdout);
+
+		/* step done on both sides before the next batch of QPs */
+		if (user_param->servername)
+			sync = pp_client_exch_dest(sockfd, &my_dest[0], user_param);
+		else
+			sync = pp_server_exch_dest(sockfd, &my_dest[0], user_param);
+		if (!sync)
+			return 1;
+		free(sync);
+
+		prev = nqps;
+		if (nqps == user_param->qp_sweep)
+			break;
+	}
+	printf("------------------------------------------------------------------\n");
+	printf("Setup of %d QPs: create %.2f msec, connect %.2f msec\n", prev,
+	       tot_create / mhz / 1000, tot_connect / mhz / 1000);
+
+	/* the 0th place is arbitrary to signal finish ... */
+	if (user_param->servername)
+		sync = pp_client_exch_dest(sockfd, &my_dest[0], user_param);
+	else
+		sync = pp_server_exch_dest(sockfd, &my_dest[0], user_param);
+	free(sync);
+	if (write(sockfd, "done", sizeof "done") != sizeof "done"){
+		perror("write");
+		fprintf(stderr, "Couldn't write to socket\n");
+		return 1;
+	}
+	close(sockfd);
+
+	free(wrlist);
+	free(tposted);
+	free(tcompleted);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	struct ibv_device      **dev_list;
@@ -798,6 +1107,7 @@ int main(int argc, char *argv[])
 	struct ibv_context       *context;
 	int                      no_cpu_freq_fail = 0;
 	union ibv_gid            gid;
+	int                      max_qps;
 
 	/* init default values to user's parameters */
 	memset(&user_param, 0, sizeof(struct user_parameters));
@@ -833,10 +1143,12 @@ int main(int argc, char *argv[])
 			{ .name = "bidirectional",  .has_arg = 0, .val = 'b' },
 			{ .name = "version",        .has_arg = 0, .val = 'V' },
 			{ .name = "CPU-freq",       .has_arg = 0, .val = 'F' },
+			{ .name = "qp-sweep",       .has_arg = 1, .val = 'Q' },
+			{ .name = "outstanding",    .has_arg = 1, .val = 'O' },
 			{ 0 }
 		};
 
-		c = getopt_long(argc, argv, "p:d:i:m:q:g:c:s:n:t:I:u:S:x:baVF", long_options, NULL);
+		c = getopt_long(argc, argv, "p:d:i:m:q:g:c:s:n:t:I:u:S:x:Q:O:baVF", long_options, NULL);
 		if (c == -1)
 			break;
 
@@ -938,6 +1250,22 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+		case 'Q':
+			user_param.qp_sweep = strtol(optarg, NULL, 0);
+			if (user_param.qp_sweep < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		case 'O':
+			user_param.outstanding = strtol(optarg, NULL, 0);
+			if (user_param.outstanding < 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
 		default:
 			usage(argv[0]);
 			return 1;
@@ -958,7 +1286,17 @@ int main(int argc, char *argv[])
 	  printf("                    RDMA_Write Post List BW Test\n");
 	}
 	
-	printf("Number of qp's running %d\n",user_param.numofqps);
+	if (user_param.qp_sweep) {
+		if (user_param.all == ALL) {
+			fprintf(stderr, "QP sweep runs a single message size\n");
+			return 1;
+		}
+		if (!user_param.outstanding)
+			user_param.outstanding = user_param.tx_depth;
+		printf("QP sweep 1 .. %d, %d WRs in flight\n", user_param.qp_sweep,
+		       user_param.outstanding);
+	} else
+		printf("Number of qp's running %d\n",user_param.numofqps);
 	if (user_param.connection_type==RC) {
 		printf("Connection type : RC\n");
 	} else {
@@ -1013,6 +1351,15 @@ int main(int argc, char *argv[])
 		user_param.inline_size = 1;
         }
 	printf("Inline data is used up to %d bytes message\n", user_param.inline_size);
+	if (user_param.qp_sweep > device_attribute.max_qp) {
+		printf("Device supports %d QPs, sweeping up to that\n", device_attribute.max_qp);
+		user_param.qp_sweep = device_attribute.max_qp;
+	}
+	if (user_param.outstanding > device_attribute.max_cqe) {
+		printf("Device CQs hold %d entries, limiting WRs in flight to that\n",
+		       device_attribute.max_cqe);
+		user_param.outstanding = device_attribute.max_cqe;
+	}
 
 	ctx = pp_init_ctx(ib_dev, size, user_param.tx_depth, ib_port, &user_param);
 	if (!ctx)
@@ -1038,70 +1385,21 @@ int main(int argc, char *argv[])
 	    return 1;
 	}
 	
-	my_dest = malloc(user_param.numofqps * sizeof *my_dest);
-	rem_dest = malloc(sizeof (struct pingpong_dest*) * user_param.numofqps );
+	max_qps = user_param.qp_sweep ? user_param.qp_sweep : user_param.numofqps;
+	my_dest = malloc(max_qps * sizeof *my_dest);
+	rem_dest = malloc(sizeof (struct pingpong_dest*) * max_qps );
+	if (!my_dest || !rem_dest) {
+		perror("malloc");
+		return 1;
+	}
 	
-	for (i =0 ; i<user_param.numofqps; i++) {
-	  /* Create connection between client and server.
-	   * We do it by exchanging data over a TCP socket connection. */
-	  my_dest[i].lid = pp_get_local_lid(ctx, ib_port);
-	  my_dest[i].psn = lrand48() & 0xffffff;
-	  if (user_param.gid_index < 0) {/*We do not fail test upon lid in RDMA0E/Eth conf*/
-			if (!my_dest[i].lid) {
-				fprintf(stderr, "Local lid 0x0 detected. Is an SM running? If you are running on an RMDAoE interface you must use GIDs\n");
+	if (user_param.qp_sweep)
+		return run_qp_sweep(ctx, &user_param, sockfd, ib_port, gid, my_dest, rem_dest,
+				    size, duplex, no_cpu_freq_fail);
+
+	for (i =0 ; i<user_param.numofqps; i++)
+		if (pp_connect_qp(ctx, &user_param, sockfd, ib_port, gid, my_dest, rem_dest, i, 1))
 			return 1;
-		}
-	  }
-	  my_dest[i].dgid = gid;
-	  my_dest[i].qpn = ctx->qp[i]->qp_num;
-	  /* TBD this should be changed into VA and diffreent key to each qp */
-	  my_dest[i].rkey = ctx->mr->rkey;
-	  my_dest[i].vaddr = (uintptr_t)ctx->buf + ctx->size;
-	  
-	  printf("  local address:  LID %#04x, QPN %#06x, PSN %#06x "
-		 "RKey %#08x VAddr %#016Lx\n",
-		 my_dest[i].lid, my_dest[i].qpn, my_dest[i].psn,
-		 my_dest[i].rkey, my_dest[i].vaddr);
-	  if (user_param.gid_index > -1) {
-		printf("                  GID %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
-		my_dest[i].dgid.raw[0],my_dest[i].dgid.raw[1],
-		my_dest[i].dgid.raw[2], my_dest[i].dgid.raw[3], my_dest[i].dgid.raw[4],
-		my_dest[i].dgid.raw[5], my_dest[i].dgid.raw[6], my_dest[i].dgid.raw[7],
-		my_dest[i].dgid.raw[8], my_dest[i].dgid.raw[9], my_dest[i].dgid.raw[10],
-		my_dest[i].dgid.raw[11], my_dest[i].dgid.raw[12], my_dest[i].dgid.raw[13],
-		my_dest[i].dgid.raw[14], my_dest[i].dgid.raw[15]);
-	  }
-	  if (user_param.servername) {
-	    rem_dest[i] = pp_client_exch_dest(sockfd, &my_dest[i], &user_param);
-	  } else {
-	    rem_dest[i] = pp_server_exch_dest(sockfd, &my_dest[i], &user_param);
-	  }
-	  if (!rem_dest[i])
-	    return 1;
-	  printf("  remote address: LID %#04x, QPN %#06x, PSN %#06x, "
-		 "RKey %#08x VAddr %#016Lx\n",
-		 rem_dest[i]->lid, rem_dest[i]->qpn, rem_dest[i]->psn,
-		 rem_dest[i]->rkey, rem_dest[i]->vaddr);
-	  if (user_param.gid_index > -1) {
-		printf("                  GID %02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x:%02x\n",
-		rem_dest[i]->dgid.raw[0],rem_dest[i]->dgid.raw[1],
-		rem_dest[i]->dgid.raw[2], rem_dest[i]->dgid.raw[3], rem_dest[i]->dgid.raw[4],
-		rem_dest[i]->dgid.raw[5], rem_dest[i]->dgid.raw[6], rem_dest[i]->dgid.raw[7],
-		rem_dest[i]->dgid.raw[8], rem_dest[i]->dgid.raw[9], rem_dest[i]->dgid.raw[10],
-		rem_dest[i]->dgid.raw[11], rem_dest[i]->dgid.raw[12], rem_dest[i]->dgid.raw[13],
-		rem_dest[i]->dgid.raw[14], rem_dest[i]->dgid.raw[15]);
-	  }
-	  if (pp_connect_ctx(ctx, ib_port, my_dest[i].psn, rem_dest[i], &user_param, i))
-	  return 1;
-	  
-	  /* An additional handshake is required *after* moving qp to RTR.
-	     Arbitrarily reuse exch_dest for this purpose. */
-	  if (user_param.servername) {
-	    rem_dest[i] = pp_client_exch_dest(sockfd, &my_dest[i], &user_param);
-	  } else {
-	    rem_dest[i] = pp_server_exch_dest(sockfd, &my_dest[i], &user_param);
-	  }  
-	}
        
 	printf("------------------------------------------------------------------\n");
 	printf(" #bytes #iterations    BW peak[MB/sec]    BW average[MB/sec]  \n");
@@ -1,28 +1,187 @@
+/*
+ * usage: client [-b] [-c chunk KB] [-d] [-j readers] [-k] [-n streams] [-p first cpu]
+ *               [-r | -s] [-w chunks in flight] <server-address> <server-port>
+ *               [<file or directory>]
+ *
+ * Without a file, exchanges one greeting with the server. With one, sends
+ * it to the server's directory as described in transfer.h: RDMA WRITEs
+ * into the server's mapping of the destination, or with -s SENDs into
+ * receives posted on it; the server may ask for SENDs in its XFER_READY
+ * even without -s. The file is mapped and registered as a whole if
+ * it takes up at most half of RAM, since registration pins every page;
+ * bigger files, or any file with -b, are read through a ring of
+ * <chunks in flight> registered chunk buffers per stream instead.
+ *
+ * With -r the server pulls the file with RDMA READs at its own pace (its
+ * -r sets how many are in flight); the file has to be mapped for that,
+ * and the client only waits for each stream's XFER_ACK.
+ *
+ * With -k every chunk is checksummed once it is posted, while it is in
+ * flight, and the server checks the file against the resulting manifest
+ * before it acknowledges it; the client exits non-zero if it didn't match.
+ *
+ * With -n, the file is striped over that many connections. Each has its
+ * own CQ and a poller thread pinned to its own CPU, counting up from -p,
+ * and sends one contiguous range of chunks with its own window; stream 0
+ * makes the offer and the others join the transfer once it is accepted.
+ *
+ * A directory is walked up front and its regular files and directories
+ * laid out as a packed stream (XFER_PACK in transfer.h), so millions of
+ * small files cost a few big chunks rather than a transfer each. Chunks
+ * are then filled by a pool of -j reader threads, which post each one as
+ * soon as it is ready; the streams' pollers only recycle the buffers.
+ * Symbolic links and special files are skipped.
+ *
+ * With -d only what the server's copy of the file lacks is sent
+ * (XFER_DELTA in transfer.h). Stream 0 RDMA READs the signatures of the
+ * copy's blocks, -c KB each, and -j threads scan the file for them at
+ * every offset, each in a few chunks of one stripe; then the streams
+ * write the bytes not found, and copy instructions for the rest. It
+ * implies -k, which is how the server knows a block that only looked the
+ * same, and needs the file mapped. Smaller chunks find more.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <rdma/rdma_cma.h>
 
+#include "message.h"
+#include "transfer.h"
+
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
 
 const int BUFFER_SIZE = 1024;
 const int TIMEOUT_IN_MS = 500; /* ms */
 
+#define DEFAULT_READERS 8 /* threads filling packed chunks, or scanning for a delta */
+#define SCAN_SPLIT 4 /* -d: regions per scanning thread, so they finish together */
+#define NO_BLOCK UINT64_MAX
+
 struct context {
   struct ibv_context *ctx;
   struct ibv_pd *pd;
-  struct ibv_cq *cq;
-  struct ibv_comp_channel *comp_channel;
+  int max_responder;           /* RDMA READs a QP can serve at once */
+};
 
-  pthread_t cq_poller_thread;
+/* the file being sent, shared by the streams */
+struct outgoing {
+  int fd;
+  uint64_t size;
+  char *map;                   /* the whole file, or NULL */
+  struct ibv_mr *mr;           /* of the map */
+
+  uint64_t chunks;
+  uint32_t id;                 /* from XFER_READY on stream 0 */
+  unsigned long long start_ns;
+  int streams_done;
+
+  uint32_t *sums;              /* -k: the manifest, a CRC32C per chunk */
+  struct ibv_mr *sums_mr;
+  int corrupt;                 /* the server found chunks that don't match */
+  int refused;                 /*   or wouldn't take the file, on some stream */
+};
+
+/* a directory being sent, as the list of records each chunk is packed with */
+struct pack_entry {
+  char *path;                  /* as walked; what the server gets starts at root_len */
+  uint64_t size;
+  uint32_t mode;
+};
+
+struct pack_piece {
+  uint32_t entry;
+  uint32_t length;
+  uint64_t offset;
+};
+
+struct packed_tree {
+  size_t root_len;
+  struct pack_entry *entries;
+  size_t num_entries;
+  struct pack_piece *pieces;
+  size_t num_pieces;
+  uint64_t *first_piece;       /* of each chunk, and one past the last chunk */
+
+  unsigned long long files;
+  unsigned long long dirs;
+  unsigned long long bytes;
+  unsigned long long skipped;
+  unsigned long long read_ns;  /* by all the readers */
+};
+
+struct fill_job {
+  struct connection *conn;
+  uint64_t chunk;
+  int slot;
+};
+
+/* -d: bytes of the file the server's copy doesn't have, within one chunk */
+struct literal {
+  uint64_t offset;
+  uint32_t len;
+};
+
+/* a few chunks of one stripe, scanned by one thread; copies can't leave it */
+struct scan_region {
+  uint64_t first;
+  uint64_t end;
+  struct literal *literals;
+  size_t num_literals;
+  struct xfer_copy *copies;
+  size_t num_copies;
+};
+
+struct delta_scan {
+  uint64_t basis_size;         /* of the server's copy */
+  uint64_t blocks;             /*   whole ones in it */
+  struct xfer_sig *sigs;
+  struct ibv_mr *sigs_mr;
+  uint64_t sigs_addr;          /* from XFER_READY */
+  uint32_t sigs_rkey;
+  uint64_t sigs_read;          /* bytes of them so far */
+
+  uint64_t *heads;             /* blocks by weak sum, chained through next */
+  uint64_t *next;
+  int shift;
+
+  struct scan_region *regions;
+  int num_regions;
+  int next_region;
+
+  struct xfer_copy *copies;    /* laid out as on the server: a stream's from its first chunk */
+  struct ibv_mr *copies_mr;
+  uint64_t num_copies;
+  uint64_t literal_bytes;
+  unsigned long long sigs_ns;
+  unsigned long long scan_ns;
 };
 
+/* one per stream; everything below the CQ belongs to its poller thread */
 struct connection {
   struct rdma_cm_id *id;
   struct ibv_qp *qp;
+  int max_inline;
+  int stream;
+  int gone;                    /* disconnected, CM thread */
+
+  struct ibv_cq *cq;
+  struct ibv_comp_channel *comp_channel;
+  pthread_t cq_poller_thread;
+  int cpu;
+  int epfd;                    /* the poller waits on the channel and on wake_fd */
+  int wake_fd;                 /* eventfd: the CM thread saw the stream go */
 
   struct ibv_mr *recv_mr;
   struct ibv_mr *send_mr;
@@ -31,40 +190,197 @@ struct connection {
   char *send_region;
 
   int num_completions;
+
+  char *ring;                  /* s_window chunk buffers when not mapped */
+  struct ibv_mr *ring_mr;
+
+  uint64_t addr;               /* destination, from XFER_READY */
+  uint32_t rkey;
+  enum ibv_wr_opcode opcode;   /*   and how chunks go there, RDMA READ if pulled */
+
+  uint64_t first;              /* this stream's chunks, [first, end) */
+  uint64_t end;
+  uint64_t posted;
+  uint64_t completed;          /* sends complete in order */
+  unsigned long long ready_ns;
+  unsigned long long done_ns;
+  unsigned long long crc_ns;   /* of it spent on checksums */
+  uint64_t sums;               /* -k: where the manifest goes, from XFER_READY */
+  uint32_t sums_rkey;
+  uint64_t copies;             /* -d: and the copies */
+  uint32_t copies_rkey;
+  struct literal *literals;    /*   what this stream writes instead of chunks */
+  uint64_t num_literals;
+  uint64_t num_copies;
+
+  /*
+   * A directory: ring slots not being filled or sent, and those posted by
+   * the readers, in the order they were, which is that of the completions.
+   */
+  int *free_slots;
+  int num_free;
+  int *sent;
+  uint64_t sent_head;
+  uint64_t sent_tail;
+  pthread_mutex_t sent_lock;
 };
 
 static void die(const char *reason);
 
 static void build_context(struct ibv_context *verbs);
-static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
+static void build_qp_attr(struct connection *conn, struct ibv_qp_init_attr *qp_attr);
+static void build_stream(struct connection *conn);
 static void * poll_cq(void *);
+static void poll_completions(struct connection *conn);
+static void close_connection(struct connection *conn);
+static void post_chunks(struct connection *conn);
 static void post_receives(struct connection *conn);
+static void prepare_file(void);
+static void read_signatures(struct connection *conn);
+static void scan_file(void);
+static void * scan_regions(void *);
+static void scan_region(struct scan_region *r);
+static uint64_t find_block(const unsigned char *buf, uint32_t weak);
+static void add_literal(struct scan_region *r, uint64_t from, uint64_t to);
+static void start_stream(struct connection *conn);
+static uint32_t fill_chunk(uint64_t chunk, char *buf);
+static void pack_tree(const char *root);
+static void queue_fill(struct connection *conn, uint64_t chunk, int slot);
+static void * read_packed(void *);
+static void stop_readers(void);
+static void read_chunk(int fd, char *buf, uint32_t len, uint64_t offset);
 static void register_memory(struct connection *conn);
+static void report(void);
+static void send_control(struct connection *conn, uint32_t op);
+static void send_done(struct connection *conn);
+static void send_offer(struct connection *conn);
 
 static int on_addr_resolved(struct rdma_cm_id *id);
+static void on_ack(struct connection *conn, struct xfer_msg *x);
 static void on_completion(struct ibv_wc *wc);
 static int on_connection(void *context);
 static int on_disconnect(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
+static void on_ready(struct connection *conn, struct xfer_msg *x);
 static int on_route_resolved(struct rdma_cm_id *id);
+static void on_signatures(struct connection *conn);
 
 static struct context *s_ctx = NULL;
 
+static const char *s_file = NULL;
+static struct outgoing s_out;
+static uint32_t s_chunk_size = XFER_DEFAULT_CHUNK;
+static int s_window = XFER_DEFAULT_WINDOW;
+static int s_send = 0;
+static int s_pull = 0;
+static int s_crc = 0;
+static int s_pack = 0;
+static int s_delta = 0;
+static struct delta_scan s_scan;
+static int s_readers = DEFAULT_READERS;
+static struct packed_tree s_tree;
+
+static struct fill_job *s_fill_queue;
+static unsigned s_fill_size;
+static unsigned s_fill_head = 0;
+static unsigned s_fill_tail = 0;
+static pthread_mutex_t s_fill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_fill_ready = PTHREAD_COND_INITIALIZER;
+static pthread_t *s_fill_threads = NULL;
+static int s_fill_stop = 0;
+static int s_buffered = 0;
+
+static struct connection *s_conns[XFER_MAX_STREAMS];
+static int s_streams = 1;
+static int s_first_cpu = 0;
+static int s_connected = 0;
+static int s_disconnected = 0;
+
 int main(int argc, char **argv)
 {
   struct addrinfo *addr;
   struct rdma_cm_event *event = NULL;
   struct rdma_cm_id *conn= NULL;
   struct rdma_event_channel *ec = NULL;
+  struct stat st;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "bc:dj:kn:p:rsw:")) != -1) {
+    if (opt == 'b')
+      s_buffered = 1;
+    else if (opt == 'c')
+      s_chunk_size = strtoul(optarg, NULL, 0) * 1024;
+    else if (opt == 'd')
+      s_delta = s_crc = 1;
+    else if (opt == 'j')
+      s_readers = atoi(optarg);
+    else if (opt == 'k')
+      s_crc = 1;
+    else if (opt == 'n')
+      s_streams = atoi(optarg);
+    else if (opt == 'p')
+      s_first_cpu = atoi(optarg);
+    else if (opt == 'r')
+      s_pull = 1;
+    else if (opt == 's')
+      s_send = 1;
+    else if (opt == 'w')
+      s_window = atoi(optarg);
+    else
+      break;
+  }
+
+  if (opt != -1 || argc - optind < 2 || argc - optind > 3
+      || !s_chunk_size || s_chunk_size > XFER_MAX_CHUNK
+      || s_window < 1 || s_window > XFER_MAX_WINDOW
+      || s_streams < 1 || s_streams > XFER_MAX_STREAMS || s_first_cpu < 0 || (s_pull && (s_send || s_crc))
+      || (s_delta && s_send) || s_readers < 1)
+    die("usage: client [-b] [-c chunk KB] [-d] [-j readers] [-k] [-n streams, 1 to 64] [-p first cpu]\n"
+        "              [-r | -s] [-w chunks in flight, 1 to 128] <server-address> <server-port>\n"
+        "              [<file or directory>]");
+
+  if (argc - optind == 3) {
+    char *path = argv[optind + 2];
+    size_t len = strlen(path);
+
+    /* the offer carries the last part of the path, so "dir/" must become "dir" */
+    while (len > 1 && path[len - 1] == '/')
+      path[--len] = '\0';
+    s_file = path;
+
+    TEST_Z((s_out.fd = open(s_file, O_RDONLY)) >= 0);
+    TEST_NZ(fstat(s_out.fd, &st));
+    if (S_ISDIR(st.st_mode) && !s_pull && !s_delta) {
+      close(s_out.fd);
+      s_out.fd = -1;
+      s_pack = 1;
+      pack_tree(s_file);
+    } else if (S_ISREG(st.st_mode)) {
+      s_out.size = st.st_size;
+      s_out.chunks = xfer_chunks(s_out.size, s_chunk_size);
+    } else {
+      die("client: not a regular file, or a directory with -r or -d.");
+    }
+  }
 
-  if (argc != 3)
-    die("usage: client <server-address> <server-port>");
+  if (s_pack) {
+    s_fill_size = s_streams * s_window;
+    TEST_Z(s_fill_queue = (struct fill_job *)calloc(s_fill_size, sizeof(struct fill_job)));
+    TEST_Z(s_fill_threads = (pthread_t *)calloc(s_readers, sizeof(pthread_t)));
+    for (i = 0; i < s_readers; ++i)
+      TEST_NZ(pthread_create(&s_fill_threads[i], NULL, read_packed, NULL));
+  }
 
-  TEST_NZ(getaddrinfo(argv[1], argv[2], NULL, &addr));
+  TEST_NZ(getaddrinfo(argv[optind], argv[optind + 1], NULL, &addr));
 
   TEST_Z(ec = rdma_create_event_channel());
-  TEST_NZ(rdma_create_id(ec, &conn, NULL, RDMA_PS_TCP));
-  TEST_NZ(rdma_resolve_addr(conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+  for (i = 0; i < s_streams; ++i) {
+    TEST_Z(s_conns[i] = (struct connection *)calloc(1, sizeof(struct connection)));
+    s_conns[i]->stream = i;
+
+    TEST_NZ(rdma_create_id(ec, &conn, s_conns[i], RDMA_PS_TCP));
+    TEST_NZ(rdma_resolve_addr(conn, NULL, addr->ai_addr, TIMEOUT_IN_MS));
+  }
 
   freeaddrinfo(addr);
 
@@ -80,7 +396,7 @@ int main(int argc, char **argv)
 
   rdma_destroy_event_channel(ec);
 
-  return 0;
+  return s_out.corrupt || s_out.refused ? EXIT_FAILURE : 0;
 }
 
 void die(const char *reason)
@@ -91,6 +407,8 @@ void die(const char *reason)
 
 void build_context(struct ibv_context *verbs)
 {
+  struct ibv_device_attr attr;
+
   if (s_ctx) {
     if (s_ctx->ctx != verbs)
       die("cannot handle events in more than one context.");
@@ -103,42 +421,197 @@ void build_context(struct ibv_context *verbs)
   s_ctx->ctx = verbs;
 
   TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
-  TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
-  TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
+  TEST_NZ(ibv_query_device(s_ctx->ctx, &attr));
+  s_ctx->max_responder = attr.max_qp_rd_atom;
 
-  TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+  if (s_file)
+    prepare_file();
 }
 
-void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
+void build_qp_attr(struct connection *conn, struct ibv_qp_init_attr *qp_attr)
 {
   memset(qp_attr, 0, sizeof(*qp_attr));
 
-  qp_attr->send_cq = s_ctx->cq;
-  qp_attr->recv_cq = s_ctx->cq;
+  qp_attr->send_cq = conn->cq;
+  qp_attr->recv_cq = conn->cq;
   qp_attr->qp_type = IBV_QPT_RC;
 
-  qp_attr->cap.max_send_wr = 10;
+  qp_attr->cap.max_send_wr = s_window + 2; /* the chunks and a control message */
   qp_attr->cap.max_recv_wr = 10;
   qp_attr->cap.max_send_sge = 1;
   qp_attr->cap.max_recv_sge = 1;
 }
 
-void * poll_cq(void *ctx)
+/* The CQ and poller of one stream, and its ring if the file isn't mapped. */
+void build_stream(struct connection *conn)
+{
+  size_t ring_size = (size_t)s_window * s_chunk_size;
+  struct epoll_event ev;
+
+  TEST_Z(conn->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
+  TEST_Z(conn->cq = ibv_create_cq(s_ctx->ctx, s_window + 10, NULL, conn->comp_channel, 0));
+  TEST_NZ(ibv_req_notify_cq(conn->cq, 0));
+
+  /* data.ptr NULL is the completion channel, conn the CM thread's wakeup */
+  TEST_Z((conn->epfd = epoll_create1(EPOLL_CLOEXEC)) >= 0);
+  TEST_Z((conn->wake_fd = eventfd(0, EFD_CLOEXEC)) >= 0);
+  TEST_NZ(fcntl(conn->comp_channel->fd, F_SETFL, fcntl(conn->comp_channel->fd, F_GETFL) | O_NONBLOCK));
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  TEST_NZ(epoll_ctl(conn->epfd, EPOLL_CTL_ADD, conn->comp_channel->fd, &ev));
+  ev.data.ptr = conn;
+  TEST_NZ(epoll_ctl(conn->epfd, EPOLL_CTL_ADD, conn->wake_fd, &ev));
+
+  if (s_file && s_out.size && !s_out.map) {
+    TEST_Z(conn->ring = malloc(ring_size));
+    TEST_Z(conn->ring_mr = ibv_reg_mr(s_ctx->pd, conn->ring, ring_size, IBV_ACCESS_LOCAL_WRITE));
+  }
+
+  if (s_pack) {
+    TEST_Z(conn->free_slots = (int *)malloc(s_window * sizeof(int)));
+    TEST_Z(conn->sent = (int *)malloc(s_window * sizeof(int)));
+    for (conn->num_free = 0; conn->num_free < s_window; ++conn->num_free)
+      conn->free_slots[conn->num_free] = s_window - 1 - conn->num_free;
+    TEST_NZ(pthread_mutex_init(&conn->sent_lock, NULL));
+  }
+
+  conn->cpu = (s_first_cpu + conn->stream) % sysconf(_SC_NPROCESSORS_ONLN);
+  TEST_NZ(pthread_create(&conn->cq_poller_thread, NULL, poll_cq, conn));
+}
+
+/* Until on_disconnect() has it take the stream down. */
+void * poll_cq(void *arg)
+{
+  struct connection *conn = (struct connection *)arg;
+  struct epoll_event events[2];
+  cpu_set_t cpus;
+  int i, n, gone = 0;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(conn->cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+    fprintf(stderr, "poll_cq: could not pin stream %d to CPU %d.\n", conn->stream, conn->cpu);
+
+  while (!gone) {
+    if ((n = epoll_wait(conn->epfd, events, 2, -1)) < 0) {
+      if (errno == EINTR)
+        continue;
+      die("poll_cq: epoll_wait failed.");
+    }
+
+    for (i = 0; i < n; ++i)
+      if (!events[i].data.ptr)
+        poll_completions(conn);
+      else
+        gone = 1;
+  }
+
+  close_connection(conn);
+
+  return NULL;
+}
+
+/* The channel is non-blocking, so a wakeup with no event is just ignored. */
+void poll_completions(struct connection *conn)
 {
   struct ibv_cq *cq;
   struct ibv_wc wc;
+  void *ctx;
 
-  while (1) {
-    TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx));
-    ibv_ack_cq_events(cq, 1);
-    TEST_NZ(ibv_req_notify_cq(cq, 0));
+  if (ibv_get_cq_event(conn->comp_channel, &cq, &ctx))
+    return;
+  ibv_ack_cq_events(cq, 1);
+  TEST_NZ(ibv_req_notify_cq(cq, 0));
+
+  while (ibv_poll_cq(cq, 1, &wc))
+    on_completion(&wc);
+}
+
+/*
+ * The poller's last act: nothing else posts on the stream by now, as the
+ * readers were stopped if they could still have been filling its ring.
+ * What the QP flushed on its way out is only thrown away.
+ */
+void close_connection(struct connection *conn)
+{
+  struct ibv_wc wc;
+
+  rdma_destroy_qp(conn->id);
+  while (ibv_poll_cq(conn->cq, 1, &wc))
+    ;
+
+  ibv_dereg_mr(conn->send_mr);
+  ibv_dereg_mr(conn->recv_mr);
+
+  free(conn->send_region);
+  free(conn->recv_region);
 
-    while (ibv_poll_cq(cq, 1, &wc))
-      on_completion(&wc);
+  if (conn->ring_mr)
+    ibv_dereg_mr(conn->ring_mr);
+  free(conn->ring);
+  free(conn->free_slots);
+  free(conn->sent);
+  free(conn->literals);
+
+  TEST_NZ(ibv_destroy_cq(conn->cq));
+  TEST_NZ(ibv_destroy_comp_channel(conn->comp_channel));
+  close(conn->wake_fd);
+  close(conn->epfd);
+}
+
+/* Keep s_window chunks in flight. Only the ring case touches the data. */
+void post_chunks(struct connection *conn)
+{
+  struct ibv_mr *mr = conn->ring ? conn->ring_mr : s_out.mr;
+  uint64_t offset;
+  uint32_t len;
+  char *buf;
+
+  /* -d: the literals, straight from the mapping */
+  if (s_delta) {
+    struct literal *l;
+
+    while (conn->posted < conn->num_literals && conn->posted - conn->completed < (uint64_t)s_window) {
+      l = &conn->literals[conn->posted++];
+      TEST_NZ(xfer_post_chunk(conn->qp, conn->opcode, s_out.map + l->offset, l->len, s_out.mr->lkey,
+        conn->addr + l->offset, conn->rkey, 0, (uintptr_t)conn | XFER_DATA));
+    }
+    return;
   }
 
-  return NULL;
+  /* a directory's chunks are filled and posted by the readers */
+  if (s_pack) {
+    while (conn->posted < conn->end && conn->num_free)
+      queue_fill(conn, conn->posted++, conn->free_slots[--conn->num_free]);
+    return;
+  }
+
+  while (conn->posted < conn->end && conn->posted - conn->first - conn->completed < (uint64_t)s_window) {
+    offset = conn->posted * s_chunk_size;
+    len = xfer_chunk_len(s_out.size, s_chunk_size, conn->posted);
+
+    if (!conn->ring) {
+      buf = s_out.map + offset;
+    } else {
+      /* the chunk s_window back has completed, so its buffer is free */
+      buf = conn->ring + ((conn->posted - conn->first) % s_window) * (size_t)s_chunk_size;
+      read_chunk(s_out.fd, buf, len, offset);
+    }
+
+    TEST_NZ(xfer_post_chunk(conn->qp, conn->opcode,
+      buf, len, mr->lkey, conn->addr + offset, conn->rkey, 0,
+      (uintptr_t)conn | XFER_DATA));
+
+    /* the HCA only reads the chunk, so it can be summed while it goes out */
+    if (s_crc) {
+      unsigned long long start = xfer_now();
+
+      s_out.sums[conn->posted] = xfer_crc32c(0, buf, len);
+      conn->crc_ns += xfer_now() - start;
+    }
+
+    ++conn->posted;
+  }
 }
 
 void post_receives(struct connection *conn)
@@ -158,6 +631,471 @@ void post_receives(struct connection *conn)
   TEST_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr));
 }
 
+/* Map and register the file if it fits; build_stream() makes rings otherwise. */
+void prepare_file(void)
+{
+  uint64_t ram = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  void *map;
+
+  if (!s_out.size)
+    return;
+
+  if (s_crc) {
+    TEST_Z(s_out.sums = (uint32_t *)calloc(s_out.chunks, sizeof(uint32_t)));
+    TEST_Z(s_out.sums_mr = ibv_reg_mr(s_ctx->pd, s_out.sums, s_out.chunks * sizeof(uint32_t), 0));
+  }
+
+  if (s_delta) {
+    TEST_Z(s_scan.copies = (struct xfer_copy *)calloc(s_out.chunks, sizeof(struct xfer_copy)));
+    TEST_Z(s_scan.copies_mr = ibv_reg_mr(s_ctx->pd, s_scan.copies, s_out.chunks * sizeof(struct xfer_copy), 0));
+  }
+
+  if (!s_buffered && !s_pack && s_out.size <= ram / 2) {
+    TEST_Z((map = mmap(NULL, s_out.size, PROT_READ, MAP_SHARED, s_out.fd, 0)) != MAP_FAILED);
+    s_out.map = (char *)map;
+
+    /* the HCA only reads from it, for us or for the server's READs */
+    TEST_Z(s_out.mr = ibv_reg_mr(s_ctx->pd, s_out.map, s_out.size,
+      s_pull ? IBV_ACCESS_REMOTE_READ : 0));
+  } else if (s_pull || s_delta) {
+    die("prepare_file: the server can only pull, and we only scan, a mapped file; it is bigger than half of RAM or -b is set.");
+  } else if (!s_pack) {
+    posix_fadvise(s_out.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+}
+
+static int add_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+  struct pack_entry *e;
+  size_t cap = s_tree.num_entries ? s_tree.num_entries : 1;
+
+  if (ftw->level == 0)
+    return 0;
+  if (!((type == FTW_F && S_ISREG(st->st_mode)) || type == FTW_D)) {
+    ++s_tree.skipped;
+    return 0;
+  }
+
+  /* grows by doubling */
+  if (!(s_tree.num_entries & (s_tree.num_entries - 1)))
+    TEST_Z(s_tree.entries = (struct pack_entry *)realloc(s_tree.entries, 2 * cap * sizeof(*e)));
+
+  e = &s_tree.entries[s_tree.num_entries++];
+  TEST_Z(e->path = strdup(path));
+  e->mode = st->st_mode;
+  e->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+
+  if (S_ISREG(st->st_mode)) {
+    ++s_tree.files;
+    s_tree.bytes += e->size;
+  } else {
+    ++s_tree.dirs;
+  }
+
+  return 0;
+}
+
+/*
+ * Walk <root> and lay out the packed stream: which pieces of which files
+ * go in each chunk. The layout is all fill_chunk() needs, and gives the
+ * size of the stream for the offer.
+ */
+void pack_tree(const char *root)
+{
+  const uint32_t start = sizeof(struct xfer_pack_chunk);
+  struct pack_entry *e;
+  uint64_t left, offset, chunks = 0;
+  uint32_t header, len, pos = s_chunk_size;
+  size_t i, pieces_cap = 0, chunks_cap = 0;
+
+  if (nftw(root, add_entry, 64, FTW_PHYS))
+    die("pack_tree: cannot walk the directory.");
+  s_tree.root_len = strlen(root) + 1;
+
+  for (i = 0; i < s_tree.num_entries; ++i) {
+    e = &s_tree.entries[i];
+    header = xfer_pack_header_len(strlen(e->path + s_tree.root_len));
+    if (start + header + 8 > s_chunk_size)
+      die("pack_tree: a path is too long for the chunk size.");
+
+    left = e->size;
+    offset = 0;
+    do {
+      /* a new chunk, unless this one has room for the header and some data */
+      if (pos + header + (left ? 8 : 0) > s_chunk_size) {
+        if (chunks + 2 > chunks_cap) {
+          chunks_cap = chunks_cap ? 2 * chunks_cap : 1024;
+          TEST_Z(s_tree.first_piece = (uint64_t *)realloc(s_tree.first_piece, chunks_cap * sizeof(uint64_t)));
+        }
+        s_tree.first_piece[chunks++] = s_tree.num_pieces;
+        pos = start;
+      }
+
+      len = (s_chunk_size - pos - header) & ~7U;
+      if (left < len)
+        len = left;
+
+      if (s_tree.num_pieces == pieces_cap) {
+        pieces_cap = pieces_cap ? 2 * pieces_cap : 1024;
+        TEST_Z(s_tree.pieces = (struct pack_piece *)realloc(s_tree.pieces, pieces_cap * sizeof(struct pack_piece)));
+      }
+      s_tree.pieces[s_tree.num_pieces].entry = i;
+      s_tree.pieces[s_tree.num_pieces].length = len;
+      s_tree.pieces[s_tree.num_pieces].offset = offset;
+      ++s_tree.num_pieces;
+
+      pos += header + xfer_align8(len);
+      offset += len;
+      left -= len;
+    } while (left);
+  }
+
+  if (chunks) {
+    s_tree.first_piece[chunks] = s_tree.num_pieces;
+    s_out.size = (chunks - 1) * s_chunk_size + pos;
+  }
+  s_out.chunks = chunks;
+
+  printf("packed %llu files and %llu directories (%llu bytes) into %llu chunks of %u KB.\n",
+    s_tree.files, s_tree.dirs, s_tree.bytes, (unsigned long long)chunks, s_chunk_size / 1024);
+}
+
+/* Pack chunk <chunk> into <buf> as laid out by pack_tree(); returns its length. */
+uint32_t fill_chunk(uint64_t chunk, char *buf)
+{
+  struct xfer_pack_chunk *c = (struct xfer_pack_chunk *)buf;
+  struct xfer_pack_record *r;
+  struct pack_piece *p;
+  struct pack_entry *e;
+  uint32_t pos = sizeof(*c), header, path_len;
+  uint64_t i;
+  int fd;
+
+  c->records = 0;
+
+  for (i = s_tree.first_piece[chunk]; i < s_tree.first_piece[chunk + 1]; ++i) {
+    p = &s_tree.pieces[i];
+    e = &s_tree.entries[p->entry];
+    path_len = strlen(e->path + s_tree.root_len);
+    header = xfer_pack_header_len(path_len);
+
+    r = (struct xfer_pack_record *)(buf + pos);
+    memset(r, 0, header);
+    r->size = e->size;
+    r->offset = p->offset;
+    r->length = p->length;
+    r->mode = e->mode;
+    r->path_len = path_len;
+    memcpy(r->path, e->path + s_tree.root_len, path_len);
+
+    if (p->length) {
+      TEST_Z((fd = open(e->path, O_RDONLY | O_CLOEXEC)) >= 0);
+      read_chunk(fd, buf + pos + header, p->length, p->offset);
+      close(fd);
+      memset(buf + pos + header + p->length, 0, xfer_align8(p->length) - p->length);
+    }
+
+    pos += header + xfer_align8(p->length);
+    ++c->records;
+  }
+
+  c->used = pos;
+  return pos;
+}
+
+/* Called by a stream's poller for a free slot; the queue has room for every slot. */
+void queue_fill(struct connection *conn, uint64_t chunk, int slot)
+{
+  struct fill_job *job;
+
+  pthread_mutex_lock(&s_fill_lock);
+  job = &s_fill_queue[s_fill_tail++ % s_fill_size];
+  job->conn = conn;
+  job->chunk = chunk;
+  job->slot = slot;
+  pthread_cond_signal(&s_fill_ready);
+  pthread_mutex_unlock(&s_fill_lock);
+}
+
+/*
+ * A reader: fill a chunk and post it. Chunks go out in whatever order
+ * they are ready in, since each carries its index as the immediate.
+ */
+void * read_packed(void *arg)
+{
+  struct fill_job job;
+  struct connection *conn;
+  unsigned long long start;
+  uint32_t len;
+  char *buf;
+
+  while (1) {
+    pthread_mutex_lock(&s_fill_lock);
+    while (s_fill_head == s_fill_tail && !s_fill_stop)
+      pthread_cond_wait(&s_fill_ready, &s_fill_lock);
+    if (s_fill_stop) {
+      pthread_mutex_unlock(&s_fill_lock);
+      break;
+    }
+    job = s_fill_queue[s_fill_head++ % s_fill_size];
+    pthread_mutex_unlock(&s_fill_lock);
+
+    conn = job.conn;
+    buf = conn->ring + (size_t)job.slot * s_chunk_size;
+
+    start = xfer_now();
+    len = fill_chunk(job.chunk, buf);
+    __atomic_add_fetch(&s_tree.read_ns, xfer_now() - start, __ATOMIC_RELAXED);
+
+    /* summed before it is posted: the last completion may come before we'd be done */
+    if (s_crc)
+      s_out.sums[job.chunk] = xfer_crc32c(0, buf, len);
+
+    pthread_mutex_lock(&conn->sent_lock);
+    TEST_NZ(xfer_post_chunk(conn->qp, conn->opcode, buf, len, conn->ring_mr->lkey,
+      conn->addr + job.chunk * s_chunk_size, conn->rkey, job.chunk,
+      (uintptr_t)conn | XFER_DATA));
+    conn->sent[conn->sent_tail++ % s_window] = job.slot;
+    pthread_mutex_unlock(&conn->sent_lock);
+  }
+
+  return NULL;
+}
+
+/*
+ * CM thread: once this returns, no reader is filling a ring or posting on
+ * a QP, and the chunks still queued never will be.
+ */
+void stop_readers(void)
+{
+  int i;
+
+  if (!s_fill_threads || s_fill_stop)
+    return;
+
+  pthread_mutex_lock(&s_fill_lock);
+  s_fill_stop = 1;
+  pthread_cond_broadcast(&s_fill_ready);
+  pthread_mutex_unlock(&s_fill_lock);
+
+  for (i = 0; i < s_readers; ++i)
+    TEST_NZ(pthread_join(s_fill_threads[i], NULL));
+}
+
+void read_chunk(int fd, char *buf, uint32_t len, uint64_t offset)
+{
+  ssize_t n;
+
+  while (len) {
+    if ((n = pread(fd, buf, len, offset)) <= 0)
+      die("read_chunk: cannot read the file.");
+
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+}
+
+/*
+ * Stream 0, -d: RDMA READ the signatures, at most a largest chunk at a
+ * time, one after the other; on_signatures() goes on from each.
+ */
+void read_signatures(struct connection *conn)
+{
+  uint64_t size = s_scan.blocks * sizeof(struct xfer_sig);
+  uint64_t len = size - s_scan.sigs_read < XFER_MAX_CHUNK ? size - s_scan.sigs_read : XFER_MAX_CHUNK;
+
+  if (!s_scan.sigs) {
+    s_scan.sigs_ns = xfer_now();
+    TEST_Z(s_scan.sigs = (struct xfer_sig *)malloc(size));
+    TEST_Z(s_scan.sigs_mr = ibv_reg_mr(s_ctx->pd, s_scan.sigs, size, IBV_ACCESS_LOCAL_WRITE));
+  }
+
+  TEST_NZ(xfer_post_chunk(conn->qp, IBV_WR_RDMA_READ, (char *)s_scan.sigs + s_scan.sigs_read, len,
+    s_scan.sigs_mr->lkey, s_scan.sigs_addr + s_scan.sigs_read, s_scan.sigs_rkey, 0, (uintptr_t)conn));
+  s_scan.sigs_read += len;
+}
+
+/*
+ * Find the blocks of the server's copy in the file: chain the blocks by
+ * weak sum, have -j threads scan regions of it, then hand each stream
+ * its literals, and its copies at its first chunk's index in the table
+ * they are written from.
+ */
+void scan_file(void)
+{
+  unsigned long long start = xfer_now();
+  struct connection *conn;
+  struct scan_region *r;
+  pthread_t *threads;
+  uint64_t first, end, i, j, bits = 0;
+  int per, s, k;
+
+  while (bits < 30 && (1ULL << bits) < 2 * s_scan.blocks)
+    ++bits;
+  s_scan.shift = 32 - (bits ? bits : 1);
+  TEST_Z(s_scan.heads = (uint64_t *)malloc((1ULL << (32 - s_scan.shift)) * sizeof(uint64_t)));
+  memset(s_scan.heads, 0xff, (1ULL << (32 - s_scan.shift)) * sizeof(uint64_t));
+  if (s_scan.blocks)
+    TEST_Z(s_scan.next = (uint64_t *)malloc(s_scan.blocks * sizeof(uint64_t)));
+
+  /* backwards, so a chain tries the lowest block first */
+  for (i = s_scan.blocks; i-- > 0; ) {
+    j = (uint32_t)(s_scan.sigs[i].weak * 2654435761U) >> s_scan.shift;
+    s_scan.next[i] = s_scan.heads[j];
+    s_scan.heads[j] = i;
+  }
+
+  per = (s_readers * SCAN_SPLIT + s_streams - 1) / s_streams;
+  TEST_Z(s_scan.regions = (struct scan_region *)calloc((size_t)per * s_streams, sizeof(struct scan_region)));
+  for (s = 0; s < s_streams; ++s) {
+    xfer_stripe(s_out.chunks, s_streams, s, &first, &end);
+    for (k = 0; k < per; ++k) {
+      r = &s_scan.regions[s_scan.num_regions++];
+      xfer_stripe(end - first, per, k, &r->first, &r->end);
+      r->first += first;
+      r->end += first;
+
+      /* a copy covers a chunk's worth, so there is at most one per chunk, and a literal more */
+      TEST_Z(r->literals = (struct literal *)malloc((2 * (r->end - r->first) + 1) * sizeof(struct literal)));
+      TEST_Z(r->copies = (struct xfer_copy *)malloc((r->end - r->first + 1) * sizeof(struct xfer_copy)));
+    }
+  }
+
+  TEST_Z(threads = (pthread_t *)malloc(s_readers * sizeof(pthread_t)));
+  for (k = 0; k < s_readers; ++k)
+    TEST_NZ(pthread_create(&threads[k], NULL, scan_regions, NULL));
+  for (k = 0; k < s_readers; ++k)
+    TEST_NZ(pthread_join(threads[k], NULL));
+  free(threads);
+
+  for (s = 0, r = s_scan.regions; s < s_streams; ++s) {
+    conn = s_conns[s];
+    xfer_stripe(s_out.chunks, s_streams, s, &first, &end);
+
+    for (k = 0, i = 0; k < per; ++k)
+      i += r[k].num_literals;
+    TEST_Z(conn->literals = (struct literal *)malloc((i + 1) * sizeof(struct literal)));
+
+    for (k = 0; k < per; ++k, ++r) {
+      memcpy(conn->literals + conn->num_literals, r->literals, r->num_literals * sizeof(struct literal));
+      conn->num_literals += r->num_literals;
+      if (r->num_copies)
+        memcpy(s_scan.copies + first + conn->num_copies, r->copies, r->num_copies * sizeof(struct xfer_copy));
+      conn->num_copies += r->num_copies;
+      free(r->literals);
+      free(r->copies);
+    }
+
+    for (i = 0; i < conn->num_literals; ++i)
+      s_scan.literal_bytes += conn->literals[i].len;
+    s_scan.num_copies += conn->num_copies;
+  }
+
+  free(s_scan.regions);
+  free(s_scan.heads);
+  free(s_scan.next);
+  s_scan.scan_ns = xfer_now() - start;
+
+  printf("found %llu of %llu blocks of the server's copy; %llu of %llu bytes to send.\n",
+    (unsigned long long)s_scan.num_copies, (unsigned long long)s_scan.blocks,
+    (unsigned long long)s_scan.literal_bytes, (unsigned long long)s_out.size);
+}
+
+void * scan_regions(void *arg)
+{
+  int i;
+
+  while ((i = __atomic_fetch_add(&s_scan.next_region, 1, __ATOMIC_RELAXED)) < s_scan.num_regions)
+    scan_region(&s_scan.regions[i]);
+
+  return NULL;
+}
+
+/*
+ * Take the manifest's checksums of the region's chunks, then roll the
+ * weak sum of a block's worth along it a byte at a time, jumping a block
+ * ahead wherever one of the server's matches. A block has to end in the
+ * region to count.
+ */
+void scan_region(struct scan_region *r)
+{
+  const uint32_t n = s_chunk_size;
+  const unsigned char *map = (const unsigned char *)s_out.map;
+  uint64_t p = r->first * n, end = r->end * n < s_out.size ? r->end * n : s_out.size;
+  uint64_t literal = p, block, i;
+  uint32_t a = 0, b = 0;
+  int rolling = 0;
+
+  for (i = r->first; i < r->end; ++i)
+    s_out.sums[i] = xfer_crc32c(0, map + i * n, xfer_chunk_len(s_out.size, n, i));
+
+  while (s_scan.blocks && p + n <= end) {
+    if (!rolling) {
+      xfer_weak_sums(map + p, n, &a, &b);
+      rolling = 1;
+    }
+
+    if ((block = find_block(map + p, xfer_weak(a, b))) != NO_BLOCK) {
+      add_literal(r, literal, p);
+      r->copies[r->num_copies].offset = p;
+      r->copies[r->num_copies].block = block;
+      ++r->num_copies;
+      p += n;
+      literal = p;
+      rolling = 0;
+      continue;
+    }
+
+    if (p + n == end)
+      break;
+    a += map[p + n] - map[p];
+    b += a - n * map[p];
+    ++p;
+  }
+
+  add_literal(r, literal, end);
+}
+
+/* A block of the server's copy that <buf> holds, or NO_BLOCK; the strong sum only for weak matches. */
+uint64_t find_block(const unsigned char *buf, uint32_t weak)
+{
+  uint64_t i = s_scan.heads[(uint32_t)(weak * 2654435761U) >> s_scan.shift];
+  uint64_t strong[2] = { 0, 0 };
+  int summed = 0;
+
+  for (; i != NO_BLOCK; i = s_scan.next[i]) {
+    if (s_scan.sigs[i].weak != weak)
+      continue;
+    if (!summed) {
+      xfer_strong(buf, s_chunk_size, strong);
+      summed = 1;
+    }
+    if (s_scan.sigs[i].strong[0] == strong[0] && s_scan.sigs[i].strong[1] == strong[1])
+      return i;
+  }
+
+  return NO_BLOCK;
+}
+
+/* Bytes [from, to) go as they are, cut where chunks end. */
+void add_literal(struct scan_region *r, uint64_t from, uint64_t to)
+{
+  struct literal *l;
+  uint64_t len;
+
+  while (from < to) {
+    len = (from / s_chunk_size + 1) * s_chunk_size - from;
+    if (to - from < len)
+      len = to - from;
+
+    l = &r->literals[r->num_literals++];
+    l->offset = from;
+    l->len = len;
+    from += len;
+  }
+}
+
 void register_memory(struct connection *conn)
 {
   conn->send_region = malloc(BUFFER_SIZE);
@@ -176,20 +1114,71 @@ void register_memory(struct connection *conn)
     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
 }
 
+/* Called by whichever stream finishes last; the others are done with their fields. */
+void report(void)
+{
+  struct connection *conn;
+  uint64_t bytes;
+  double secs = (xfer_now() - s_out.start_ns) / 1e9;
+  int i;
+
+  printf("sent %s: %llu bytes in %.3f s, %.2f GB/s (%s, %u KB chunks, %d in flight, %d stream(s), %s%s).\n",
+    s_file, (unsigned long long)s_out.size, secs, s_out.size / secs / 1e9,
+    s_conns[0]->opcode == IBV_WR_SEND ? "SEND"
+      : s_conns[0]->opcode == IBV_WR_RDMA_READ ? "RDMA READ by the server"
+      : s_conns[0]->opcode == IBV_WR_SEND_WITH_IMM ? "SEND with immediate" : "RDMA WRITE",
+    s_chunk_size / 1024, s_window, s_streams,
+    s_pack ? "packed" : s_out.map || !s_out.size ? "mapped" : "buffered", s_crc ? ", verified" : "");
+
+  if (s_pack)
+    printf("  %llu files and %llu directories, %llu bytes in them: %.0f files/s, %.2f GB/s of file data"
+      " (%llu skipped; %d readers, %.3f s reading).\n",
+      s_tree.files, s_tree.dirs, s_tree.bytes, (s_tree.files + s_tree.dirs) / secs,
+      s_tree.bytes / secs / 1e9, s_tree.skipped, s_readers, s_tree.read_ns / 1e9);
+
+  if (s_delta)
+    printf("  delta against the server's copy of %llu bytes: %llu bytes sent, %llu (%.1f%%) copied there"
+      " as %llu blocks; %.3f s reading its signatures, %.3f s scanning on %d threads.\n",
+      (unsigned long long)s_scan.basis_size, (unsigned long long)s_scan.literal_bytes,
+      (unsigned long long)(s_out.size - s_scan.literal_bytes),
+      s_out.size ? 100.0 * (s_out.size - s_scan.literal_bytes) / s_out.size : 0,
+      (unsigned long long)s_scan.num_copies, s_scan.sigs_ns / 1e9, s_scan.scan_ns / 1e9, s_readers);
+
+  if (s_crc) {
+    unsigned long long crc_ns = 0;
+
+    for (i = 0; i < s_streams; ++i)
+      crc_ns += s_conns[i]->crc_ns;
+    printf("  CRC32C of %llu chunks took %.3f s, over %d stream(s); the server %s.\n",
+      (unsigned long long)s_out.chunks, crc_ns / 1e9, s_streams,
+      s_out.corrupt ? "found chunks that DON'T MATCH" : "found them all matching");
+  }
+
+  if (s_streams == 1)
+    return;
+
+  for (i = 0; i < s_streams; ++i) {
+    conn = s_conns[i];
+    bytes = xfer_stripe_bytes(s_out.size, s_chunk_size, conn->first, conn->end);
+    secs = (conn->done_ns - conn->ready_ns) / 1e9;
+
+    printf("  stream %2d on cpu %2d: %llu chunks, %.3f s, %.2f GB/s\n", i, conn->cpu,
+      (unsigned long long)(conn->end - conn->first), secs, secs > 0 ? bytes / secs / 1e9 : 0);
+  }
+}
+
 int on_addr_resolved(struct rdma_cm_id *id)
 {
   struct ibv_qp_init_attr qp_attr;
-  struct connection *conn;
+  struct connection *conn = (struct connection *)id->context;
 
   printf("address resolved.\n");
 
   build_context(id->verbs);
-  build_qp_attr(&qp_attr);
-
-  TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
-
-  id->context = conn = (struct connection *)malloc(sizeof(struct connection));
+  build_stream(conn);
+  build_qp_attr(conn, &qp_attr);
 
+  TEST_Z((conn->max_inline = create_qp_inline(id, s_ctx->pd, &qp_attr)) >= 0);
   conn->id = id;
   conn->qp = id->qp;
   conn->num_completions = 0;
@@ -202,69 +1191,312 @@ int on_addr_resolved(struct rdma_cm_id *id)
   return 0;
 }
 
+void send_control(struct connection *conn, uint32_t op)
+{
+  struct message *msg = (struct message *)conn->send_region;
+  struct xfer_msg *x = xfer_prepare(msg, op);
+
+  /* the server knows a stream by its connection once it has joined */
+  if (op == XFER_JOIN) {
+    x->id = s_out.id;
+    x->stream = conn->stream;
+  }
+  if (op == XFER_DONE)
+    x->size = conn->num_copies;
+
+  TEST_NZ(post_message(conn->qp, msg, conn->send_mr->lkey, conn->max_inline, (uintptr_t)conn));
+}
+
+void send_offer(struct connection *conn)
+{
+  struct message *msg = (struct message *)conn->send_region;
+  struct xfer_msg *x;
+  const char *name;
+
+  name = strrchr(s_file, '/') ? strrchr(s_file, '/') + 1 : s_file;
+  if (strlen(name) > XFER_NAME_MAX || sizeof(*msg) + sizeof(*x) + strlen(name) + 1 > BUFFER_SIZE)
+    die("send_offer: file name too long.");
+
+  x = xfer_prepare(msg, XFER_OFFER);
+  x->flags = (s_pull ? XFER_PULL : s_send ? XFER_SEND : 0) | (s_crc ? XFER_CRC : 0)
+    | (s_pack ? XFER_PACK : 0) | (s_delta ? XFER_DELTA : 0);
+  x->size = s_out.size;
+  if (s_pull) {
+    x->addr = (uintptr_t)s_out.map;
+    x->rkey = s_out.mr ? s_out.mr->rkey : 0;
+  }
+  x->chunk_size = s_chunk_size;
+  x->streams = s_streams;
+  strcpy(x->name, name);
+  msg->len += strlen(name) + 1;
+
+  printf("connected. offering %s (%llu bytes) over %d stream(s)...\n", name,
+    (unsigned long long)s_out.size, s_streams);
+
+  s_out.start_ns = xfer_now();
+  TEST_NZ(post_message(conn->qp, msg, conn->send_mr->lkey, conn->max_inline, (uintptr_t)conn));
+}
+
+/*
+ * With -k, this stream's part of the manifest goes first, and with -d its
+ * copies: RC puts them in place before the SEND lands.
+ */
+void send_done(struct connection *conn)
+{
+  if (s_crc && conn->first < conn->end)
+    TEST_NZ(xfer_post_chunk(conn->qp, IBV_WR_RDMA_WRITE,
+      s_out.sums + conn->first, (conn->end - conn->first) * sizeof(uint32_t), s_out.sums_mr->lkey,
+      conn->sums + conn->first * sizeof(uint32_t), conn->sums_rkey, 0, (uintptr_t)conn));
+  if (conn->num_copies)
+    TEST_NZ(xfer_post_chunk(conn->qp, IBV_WR_RDMA_WRITE,
+      s_scan.copies + conn->first, conn->num_copies * sizeof(struct xfer_copy), s_scan.copies_mr->lkey,
+      conn->copies + conn->first * sizeof(struct xfer_copy), conn->copies_rkey, 0, (uintptr_t)conn));
+
+  send_control(conn, XFER_DONE);
+}
+
+void on_ack(struct connection *conn, struct xfer_msg *x)
+{
+  __atomic_store_n(&conn->done_ns, xfer_now(), __ATOMIC_RELEASE);
+  /* the other streams may still be waiting for their XFER_READY; on_disconnect() hangs them up */
+  if (x->flags & XFER_REFUSED) {
+    if (!__atomic_exchange_n(&s_out.refused, 1, __ATOMIC_ACQ_REL))
+      printf("the server refused %s.\n", s_file);
+    rdma_disconnect(conn->id);
+    return;
+  }
+  if (x->flags & XFER_CORRUPT)
+    s_out.corrupt = 1;
+
+  if (__atomic_add_fetch(&s_out.streams_done, 1, __ATOMIC_ACQ_REL) == s_streams)
+    report();
+
+  rdma_disconnect(conn->id);
+}
+
+/*
+ * The offer (on stream 0) or a join was accepted. Stream 0 brings the
+ * other streams in from here: their own pollers are idle until their
+ * XFER_READY, so nothing else posts sends on their QPs.
+ */
+void on_ready(struct connection *conn, struct xfer_msg *x)
+{
+  int i;
+
+  conn->addr = x->addr;
+  conn->rkey = x->rkey;
+  conn->sums = x->sums;
+  conn->sums_rkey = x->sums_rkey;
+  conn->copies = x->copies;
+  conn->copies_rkey = x->copies_rkey;
+  conn->opcode = (x->flags & XFER_PULL) ? IBV_WR_RDMA_READ
+    : (x->flags & XFER_IMM) ? IBV_WR_SEND_WITH_IMM
+    : (x->flags & XFER_SEND) ? IBV_WR_SEND : IBV_WR_RDMA_WRITE;
+  conn->ready_ns = xfer_now();
+
+  if (conn->stream == 0) {
+    s_out.id = x->id;
+
+    /* -d: the others join once the scan has given them their literals */
+    if (s_delta) {
+      s_scan.basis_size = x->size;
+      s_scan.blocks = x->size / s_chunk_size;
+      s_scan.sigs_addr = x->sigs;
+      s_scan.sigs_rkey = x->sigs_rkey;
+      if (s_scan.blocks)
+        read_signatures(conn);
+      else
+        on_signatures(conn);
+      return;
+    }
+
+    for (i = 1; i < s_streams; ++i)
+      send_control(s_conns[i], XFER_JOIN);
+  }
+
+  start_stream(conn);
+}
+
+/* All the signatures are in, or after each READ of them. */
+void on_signatures(struct connection *conn)
+{
+  int i;
+
+  if (s_scan.sigs_read < s_scan.blocks * sizeof(struct xfer_sig)) {
+    read_signatures(conn);
+    return;
+  }
+  if (s_scan.sigs_ns)
+    s_scan.sigs_ns = xfer_now() - s_scan.sigs_ns;
+
+  scan_file();
+
+  for (i = 1; i < s_streams; ++i)
+    send_control(s_conns[i], XFER_JOIN);
+  start_stream(conn);
+}
+
+void start_stream(struct connection *conn)
+{
+  xfer_stripe(s_out.chunks, s_streams, conn->stream, &conn->first, &conn->end);
+  conn->posted = s_delta ? 0 : conn->first;
+
+  /* the server reads the stripe and acknowledges it when it has it all */
+  if (conn->opcode == IBV_WR_RDMA_READ)
+    return;
+
+  if (s_delta ? conn->num_literals > 0 : conn->first < conn->end)
+    post_chunks(conn);
+  else
+    send_done(conn);
+}
+
 void on_completion(struct ibv_wc *wc)
 {
-  struct connection *conn = (struct connection *)(uintptr_t)wc->wr_id;
+  struct connection *conn = (struct connection *)(uintptr_t)(wc->wr_id & ~XFER_DATA);
 
+  /* once refused, the streams' work is flushed as they are hung up */
+  if (wc->status != IBV_WC_SUCCESS && __atomic_load_n(&s_out.refused, __ATOMIC_ACQUIRE))
+    return;
   if (wc->status != IBV_WC_SUCCESS)
     die("on_completion: status is not IBV_WC_SUCCESS.");
 
-  if (wc->opcode & IBV_WC_RECV)
-    printf("received message: %s\n", conn->recv_region);
-  else if (wc->opcode == IBV_WC_SEND)
+  if (wc->wr_id & XFER_DATA) {
+    if (s_pack) {
+      pthread_mutex_lock(&conn->sent_lock);
+      conn->free_slots[conn->num_free++] = conn->sent[conn->sent_head++ % s_window];
+      pthread_mutex_unlock(&conn->sent_lock);
+    }
+
+    ++conn->completed;
+    if (s_delta ? conn->completed == conn->num_literals : conn->first + conn->completed == conn->end)
+      send_done(conn);
+    else
+      post_chunks(conn);
+    return;
+  }
+
+  if (wc->opcode & IBV_WC_RECV) {
+    struct message *msg = parse_message(conn->recv_region, wc->byte_len);
+    struct xfer_msg *x;
+
+    if (!msg)
+      die("on_completion: malformed message.");
+
+    if (!(x = xfer_parse(msg)))
+      printf("received message: %.*s\n", (int)msg->len, msg->data);
+    else if (x->op == XFER_READY)
+      on_ready(conn, x);
+    else if (x->op == XFER_ACK) {
+      on_ack(conn, x);
+      return;
+    } else
+      die("on_completion: unexpected control message.");
+
+    /* the greeting and XFER_READY come in either order, then XFER_ACK */
+    if (s_file)
+      post_receives(conn);
+  } else if (wc->opcode == IBV_WC_RDMA_WRITE) {
+    return; /* the manifest, or the copies */
+  } else if (wc->opcode == IBV_WC_RDMA_READ) {
+    on_signatures(conn);
+    return;
+  } else if (wc->opcode == IBV_WC_SEND)
     printf("send completed successfully.\n");
   else
     die("on_completion: completion isn't a send or a receive.");
 
-  if (++conn->num_completions == 2)
+  if (!s_file && ++conn->num_completions == 2)
     rdma_disconnect(conn->id);
 }
 
 int on_connection(void *context)
 {
   struct connection *conn = (struct connection *)context;
-  struct ibv_send_wr wr, *bad_wr = NULL;
-  struct ibv_sge sge;
+  struct message *msg = (struct message *)conn->send_region;
 
-  snprintf(conn->send_region, BUFFER_SIZE, "message from active/client side with pid %d", getpid());
+  /* the offer waits for every stream, so none can miss its join */
+  if (s_file) {
+    if (++s_connected == s_streams)
+      send_offer(s_conns[0]);
 
-  printf("connected. posting send...\n");
-
-  memset(&wr, 0, sizeof(wr));
+    return 0;
+  }
 
-  wr.wr_id = (uintptr_t)conn;
-  wr.opcode = IBV_WR_SEND;
-  wr.sg_list = &sge;
-  wr.num_sge = 1;
-  wr.send_flags = IBV_SEND_SIGNALED;
+  /* the terminating NUL goes along so the peer can print it as is */
+  msg->type = MSG_TEXT;
+  msg->len = snprintf(msg->data, BUFFER_SIZE - sizeof(*msg), "message from active/client side with pid %d", getpid()) + 1;
 
-  sge.addr = (uintptr_t)conn->send_region;
-  sge.length = BUFFER_SIZE;
-  sge.lkey = conn->send_mr->lkey;
+  printf("connected. posting send (%s)...\n", sizeof(*msg) + msg->len <= conn->max_inline ? "inline" : "from buffer");
 
-  TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+  TEST_NZ(post_message(conn->qp, msg, conn->send_mr->lkey, conn->max_inline, (uintptr_t)conn));
 
   return 0;
 }
 
+/*
+ * The stream's poller may still be posting on it, and with a refusal the
+ * readers filling its ring: stop them first, then have the poller take
+ * the stream down and wait for it.
+ */
 int on_disconnect(struct rdma_cm_id *id)
 {
   struct connection *conn = (struct connection *)id->context;
+  uint64_t one = 1;
+  int i;
 
   printf("disconnected.\n");
 
-  rdma_destroy_qp(id);
-
-  ibv_dereg_mr(conn->send_mr);
-  ibv_dereg_mr(conn->recv_mr);
-
-  free(conn->send_region);
-  free(conn->recv_region);
+  conn->gone = 1;
+  /* a stream lost before its ACK takes the transfer with it, as a refusal does */
+  if (s_file && !__atomic_load_n(&conn->done_ns, __ATOMIC_ACQUIRE)
+      && !__atomic_exchange_n(&s_out.refused, 1, __ATOMIC_ACQ_REL))
+    printf("lost a stream of %s.\n", s_file);
+  if (__atomic_load_n(&s_out.refused, __ATOMIC_ACQUIRE)) {
+    for (i = 0; i < s_streams; ++i)
+      if (!s_conns[i]->gone)
+        rdma_disconnect(s_conns[i]->id);
+    stop_readers();
+  } else if (s_disconnected + 1 == s_streams) {
+    stop_readers();
+  }
 
-  free(conn);
+  TEST_Z(write(conn->wake_fd, &one, sizeof(one)) == sizeof(one));
+  TEST_NZ(pthread_join(conn->cq_poller_thread, NULL));
 
   rdma_destroy_id(id);
 
+  if (++s_disconnected < s_streams)
+    return 0;
+
+  if (s_out.mr)
+    ibv_dereg_mr(s_out.mr);
+  if (s_pack) {
+    free(s_fill_threads);
+    free(s_fill_queue);
+    for (i = 0; i < (int)s_tree.num_entries; ++i)
+      free(s_tree.entries[i].path);
+    free(s_tree.entries);
+    free(s_tree.pieces);
+    free(s_tree.first_piece);
+  }
+  if (s_scan.sigs_mr)
+    ibv_dereg_mr(s_scan.sigs_mr);
+  free(s_scan.sigs);
+  if (s_scan.copies_mr)
+    ibv_dereg_mr(s_scan.copies_mr);
+  free(s_scan.copies);
+  if (s_out.sums_mr)
+    ibv_dereg_mr(s_out.sums_mr);
+  free(s_out.sums);
+  if (s_out.map)
+    munmap(s_out.map, s_out.size);
+  if (s_file && s_out.fd >= 0)
+    close(s_out.fd);
+
+  for (i = 0; i < s_streams; ++i)
+    free(s_conns[i]);
+
   return 1; /* exit event loop */
 }
 
@@ -293,6 +1525,11 @@ int on_route_resolved(struct rdma_cm_id *id)
   printf("route resolved.\n");
 
   memset(&cm_params, 0, sizeof(cm_params));
+  cm_params.rnr_retry_count = 7; /* in send mode chunks can get ahead of the server's receives */
+  if (s_pull)
+    cm_params.responder_resources = s_ctx->max_responder;
+  if (s_delta)
+    cm_params.initiator_depth = 1; /* for the signatures */
   TEST_NZ(rdma_connect(id, &cm_params));
 
   return 0;
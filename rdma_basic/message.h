@@ -0,0 +1,77 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <rdma/rdma_cma.h>
+
+/*
+ * Messages carry their length up front so only the bytes in use go on the
+ * wire. Messages that fit in the QP's inline limit are copied into the WQE
+ * by ibv_post_send: no lkey, and no DMA read of the buffer by the HCA.
+ */
+
+#define MESSAGE_MAX_INLINE 256 /* what we ask for; the device may give less */
+
+struct message {
+  uint32_t len;                /* bytes of data that follow */
+  uint32_t type;               /* enum message_type in transfer.h */
+  char data[];
+};
+
+/*
+ * Create the QP asking for MESSAGE_MAX_INLINE bytes of inline data, and
+ * without inline if the device refuses. Returns the inline limit the QP
+ * got, or -1 if it could not be created at all.
+ */
+static inline int create_qp_inline(struct rdma_cm_id *id, struct ibv_pd *pd,
+                                   struct ibv_qp_init_attr *qp_attr)
+{
+  qp_attr->cap.max_inline_data = MESSAGE_MAX_INLINE;
+  if (rdma_create_qp(id, pd, qp_attr)) {
+    qp_attr->cap.max_inline_data = 0;
+    if (rdma_create_qp(id, pd, qp_attr))
+      return -1;
+  }
+
+  return qp_attr->cap.max_inline_data;
+}
+
+/* Post the header and msg->len bytes of data as one signaled send. */
+static inline int post_message(struct ibv_qp *qp, struct message *msg,
+                               uint32_t lkey, uint32_t max_inline,
+                               uint64_t wr_id)
+{
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  memset(&wr, 0, sizeof(wr));
+
+  wr.wr_id = wr_id;
+  wr.opcode = IBV_WR_SEND;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+
+  sge.addr = (uintptr_t)msg;
+  sge.length = sizeof(*msg) + msg->len;
+  sge.lkey = lkey;
+
+  if (sge.length <= max_inline)
+    wr.send_flags |= IBV_SEND_INLINE;
+
+  return ibv_post_send(qp, &wr, &bad_wr);
+}
+
+/* The message in a receive buffer, or NULL if its length doesn't add up. */
+static inline struct message * parse_message(void *buf, uint32_t byte_len)
+{
+  struct message *msg = (struct message *)buf;
+
+  if (byte_len < sizeof(*msg) || msg->len > byte_len - sizeof(*msg))
+    return NULL;
+
+  return msg;
+}
+
+#endif
@@ -1,48 +1,274 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <rdma/rdma_cma.h>
 
+#include "message.h"
+#include "rdma_log.h"
+#include "transfer.h"
+#include "uring.h"
+
 #define TEST_NZ(x) do { if ( (x)) die("error: " #x " failed (returned non-zero)." ); } while (0)
 #define TEST_Z(x)  do { if (!(x)) die("error: " #x " failed (returned zero/null)."); } while (0)
 
 const int BUFFER_SIZE = 1024;
-
+#define MAX_CONTEXTS 16
+#define REPORT_INTERVAL 1 /* seconds */
+#define DEFAULT_BACKLOG 1024 /* capped by net.rdma_ucm.max_backlog */
+#define CQ_SIZE 1024 /* to start with; grows with the connections on the device */
+#define RECV_WINDOW 64 /* chunk receives posted ahead in send mode */
+#define DEFAULT_READ_DEPTH 16 /* pull mode: RDMA READs in flight per stream */
+#define MAX_TRANSFERS 64 /* files being received at once */
+#define MAX_EVENTS 16 /* per epoll_wait() of a poller */
+#define DEFAULT_CHUNK_BUFFERS 64 /* -D and XFER_PACK: receive buffers per file */
+#define DIRECT_ALIGN 4096 /* O_DIRECT buffers, offsets and lengths */
+#define SYNC_TAG UINT64_MAX /* user_data of the final fdatasync */
+#define DEFAULT_WORKERS 4 /* threads checking XFER_CRC chunks, unpacking XFER_PACK ones and patching XFER_DELTA files */
+#define CHUNK_QUEUE 1024 /* chunks waiting for one */
+#define SIGN_JOBS 4 /* jobs per worker an old copy is signed in */
+#define GONE 0x1 /* low bit of a pointer on the pipe: a connection whose client hung up */
+#define REFILL 0x2 /* on the pipe by itself: a worker gave buffers back to a pool that had run out */
+
+/*
+ * One per device; the counters are only written by its poller thread,
+ * which waits on the completion channel and, with -D, on the eventfds of
+ * the files' io_urings.
+ */
 struct context {
   struct ibv_context *ctx;
   struct ibv_pd *pd;
   struct ibv_cq *cq;
   struct ibv_comp_channel *comp_channel;
+  int epfd;
+  int worked[2];               /* pipe: files the workers are done with, buffers back, connections to tear down */
+  int max_initiator_depth;     /* RDMA READs a QP can have in flight */
+  int max_responder;           /*   and serve at once */
+  int cqe;                     /* CQ entries, grown by the CM thread */
+  int max_cqe;
 
   pthread_t cq_poller_thread;
+
+  unsigned long long bytes;
+  unsigned long long persisted;
+  int at_disk;
+  int num_connections;
+};
+
+struct connection;
+
+/*
+ * XFER_CRC, XFER_PACK: the pollers queue each chunk as it completes, and
+ * the worker threads take its CRC32C and unpack it while the network
+ * moves on. Whoever brings pending to 0, the last chunk's worker or the
+ * last XFER_DONE, has the file acknowledged; a worker sends it back to
+ * the poller over the context's pipe, as only the poller posts on the
+ * connections.
+ *
+ * XFER_DELTA: the workers sign the blocks of the old copy before the
+ * XFER_READY, and once every stream is done, apply the copies to each
+ * chunk of the new file and check it.
+ */
+struct chunk_job {
+  struct incoming *in;
+  uint64_t chunk;
+  const char *buf;
+  uint32_t len;                /* signing: blocks, from <chunk> on */
+};
+
+/*
+ * -D and XFER_PACK: chunks are received into a pool of aligned buffers
+ * rather than a mapping of the whole file. A buffer goes back to the
+ * receive side once its chunk is written out, to the disk or unpacked by
+ * a worker, so the pool bounds both what the network can get ahead of
+ * either and what is pinned for the transfer. The workers give buffers
+ * back from their own threads, hence the lock.
+ */
+struct chunk_pool {
+  char *bufs;
+  struct ibv_mr *mr;
+  int buffers;
+  pthread_mutex_t lock;
+  int *free;                   /* stack of free buffer indices */
+  int num_free;
+  int starved;                 /* a receive found none since one was last given back */
+
+  unsigned long long waits;    /* times a receive found no free buffer */
+  unsigned long long busy;     /* buffers in use, integrated over ns */
+  unsigned long long last_ns;
+};
+
+/*
+ * -D: the pool is registered with io_uring as fixed buffers too, and
+ * chunks are written to the file with O_DIRECT straight from there.
+ */
+struct persist {
+  struct uring ring;           /* file 0 is the destination */
+  int efd;
+  int at_disk;                 /* writes in flight */
+  int max_at_disk;
+  int syncing;
+};
+
+/*
+ * A file being received, shared by the connections it is striped over.
+ * They must all be on one device, so one PD and one poller.
+ */
+struct incoming {
+  uint32_t id;
+  struct context *ctx;
+  int fd;
+  char *map;
+  uint64_t size;
+  uint32_t chunk_size;
+  uint32_t flags;
+  struct ibv_mr *mr;
+  uint64_t src_addr;           /* pull mode: the sender's registered file */
+  uint32_t src_rkey;
+
+  uint64_t chunks;
+  int streams;
+  int finished;                /* streams that sent XFER_DONE */
+  int left;                    /*   or went away */
+  unsigned long long start_ns;
+
+  struct chunk_pool *pool;     /* -D and XFER_PACK, instead of map and mr */
+  struct persist *disk;        /* -D */
+  struct connection *conns[XFER_MAX_STREAMS];
+
+  uint32_t *sums;              /* XFER_CRC: the manifest, written by the client */
+  struct ibv_mr *sums_mr;
+  uint32_t *got;               /*   and what the chunks here came to */
+  int pending;                 /* chunks queued or being worked on, plus streams not done */
+  int jobs;                    /* chunks queued or being worked on */
+  int waiting;                 /* for a worker to hand it to finish_file(), so not to be freed */
+  const char *failed;          /* why a worker gave up on it; the ACKs say XFER_REFUSED */
+  unsigned long long verify_ns;
+  uint64_t corrupt;
+
+  unsigned long long files;    /* XFER_PACK: files and directories unpacked */
+  unsigned long long unpack_ns;
+
+  int basis_fd;                /* XFER_DELTA: the copy we had; the file is a new one beside it */
+  char *basis;
+  uint64_t basis_size;
+  uint64_t blocks;             /*   whole ones in it */
+  struct xfer_sig *sigs;
+  struct ibv_mr *sigs_mr;
+  int signing;                 /*   the workers sign the blocks, rather than check chunks */
+  struct xfer_copy *copies;    /*   written by the streams, one slice each, then packed together */
+  struct ibv_mr *copies_mr;
+  uint64_t stream_copies[XFER_MAX_STREAMS];
+  uint64_t num_copies;
+  int patching;
+  unsigned long long sign_ns;
+  unsigned long long patch_ns;
+
+  char name[XFER_NAME_MAX + 1];
 };
 
 struct connection {
+  struct context *ctx;
+  struct rdma_cm_id *id;
   struct ibv_qp *qp;
+  int max_inline;
+  uint32_t send_len;
+  int read_depth;              /* pull mode: as agreed with the client, at most -r */
 
   struct ibv_mr *recv_mr;
   struct ibv_mr *send_mr;
 
   char *recv_region;
   char *send_region;
+
+  struct incoming *in;         /* the file this connection carries a stripe of */
+  int stream;
+  uint64_t first;              /* its chunks, [first, end) */
+  uint64_t end;
+  uint64_t posted;             /* send mode: chunk receives posted, pull mode: reads */
+  uint64_t received;           /*   and completed, in order */
+  int slots[RECV_WINDOW];      /* -D: buffer of each chunk posted, by chunk % RECV_WINDOW */
+  int broken;                  /* a WR failed: being dropped, completions are ignored */
 };
 
 static void die(const char *reason);
 
-static void build_context(struct ibv_context *verbs);
-static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
+static struct context * build_context(struct ibv_context *verbs);
+static void add_connection(struct context *ctx, struct ibv_qp_init_attr *qp_attr);
+static void build_qp_attr(struct context *ctx, struct ibv_qp_init_attr *qp_attr);
 static void * poll_cq(void *);
+static void poll_completions(struct context *ctx);
+static void * report_throughput(void *);
 static void post_receives(struct connection *conn);
+static void post_chunks(struct connection *conn);
 static void register_memory(struct connection *conn);
-
-static void on_completion(struct ibv_wc *wc);
-static int on_connect_request(struct rdma_cm_id *id);
+static void close_incoming(struct incoming *in);
+static void finish_file(struct incoming *in);
+static void part_path(struct incoming *in, char *path);
+static const char * sign_basis(struct incoming *in, const char *path);
+static void sign_blocks(struct incoming *in);
+static void on_signed(struct incoming *in);
+static int patch_file(struct incoming *in);
+static void patch_chunk(struct incoming *in, uint64_t chunk, uint32_t len);
+static void queue_chunk(struct incoming *in, uint64_t chunk, const char *buf, uint32_t len);
+static void * work_chunks(void *);
+static int make_parents(char *path, size_t root_len);
+static const char * unpack_chunk(struct incoming *in, const char *buf, uint32_t len);
+static void maybe_sync(struct incoming *in);
+static void persist_chunk(struct connection *conn, uint64_t chunk);
+static const char * start_persist(struct context *ctx, struct incoming *in, const char *path);
+static const char * start_pool(struct context *ctx, struct incoming *in);
+static int take_buffer(struct chunk_pool *p);
+static int give_buffer(struct chunk_pool *p, int b);
+static void track_buffers(struct chunk_pool *p);
+static void refill(struct context *ctx);
+static void join_stream(struct connection *conn, struct incoming *in, int stream);
+static void leave_stream(struct connection *conn, int finished);
+static void close_connection(struct connection *conn);
+static void send_control(struct connection *conn, uint32_t op, struct incoming *in);
+static void send_ack(struct connection *conn, uint32_t flags);
+static void refuse(struct connection *conn, const char *why);
+static const char * check_offer(struct connection *conn, struct xfer_msg *x, uint32_t len, char *path);
+
+static void on_completion(struct context *ctx, struct ibv_wc *wc);
+static void on_disk_completion(struct context *ctx, struct incoming *in);
+static void on_worked(struct context *ctx);
+static void on_done(struct connection *conn, struct xfer_msg *x);
+static void on_stripe_done(struct connection *conn);
+static void on_join(struct connection *conn, struct xfer_msg *x);
+static void on_offer(struct connection *conn, struct xfer_msg *x, uint32_t len);
+static int on_connect_request(struct rdma_cm_id *id, struct rdma_conn_param *param);
 static int on_connection(void *context);
 static int on_disconnect(struct rdma_cm_id *id);
 static int on_event(struct rdma_cm_event *event);
 
-static struct context *s_ctx = NULL;
+static struct context *s_ctx[MAX_CONTEXTS];
+static int s_num_ctx = 0;
+static const char *s_dir = ".";
+static int s_direct = 0;
+static int s_chunk_buffers = DEFAULT_CHUNK_BUFFERS;
+static int s_read_depth = DEFAULT_READ_DEPTH;
+static int s_workers = DEFAULT_WORKERS;
+
+static struct chunk_job s_chunk_queue[CHUNK_QUEUE];
+static unsigned s_chunk_head = 0;
+static unsigned s_chunk_tail = 0;
+static pthread_mutex_t s_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_chunk_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t s_chunk_room = PTHREAD_COND_INITIALIZER;
+
+/* by id, for XFER_JOIN; a transfer sits in slot id % MAX_TRANSFERS */
+static struct incoming *s_transfers[MAX_TRANSFERS];
+static uint32_t s_next_id = 1;
+static pthread_mutex_t s_transfers_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int main(int argc, char **argv)
 {
@@ -51,6 +277,32 @@ int main(int argc, char **argv)
   struct rdma_cm_id *listener = NULL;
   struct rdma_event_channel *ec = NULL;
   uint16_t port = 0;
+  pthread_t report_thread, worker;
+  int backlog = DEFAULT_BACKLOG;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "b:d:Dj:q:r:")) != -1) {
+    if (opt == 'b' && (backlog = atoi(optarg)) > 0)
+      continue;
+    if (opt == 'd') {
+      s_dir = optarg;
+      continue;
+    }
+    if (opt == 'D') {
+      s_direct = 1;
+      continue;
+    }
+    if (opt == 'j' && (s_workers = atoi(optarg)) > 0)
+      continue;
+    if (opt == 'q' && (s_chunk_buffers = atoi(optarg)) > 0)
+      continue;
+    if (opt == 'r' && (s_read_depth = atoi(optarg)) > 0 && s_read_depth <= RECV_WINDOW)
+      continue;
+    die("usage: server [-b listen backlog] [-d directory for received files]\n"
+        "              [-D] [-q receive buffers per file, with -D or for a directory]\n"
+        "              [-j checksum, unpack and delta threads]\n"
+        "              [-r RDMA READs in flight per stream when pulling, 1 to 64]");
+  }
 
   memset(&addr, 0, sizeof(addr));
   addr.sin_family = AF_INET;
@@ -58,12 +310,17 @@ int main(int argc, char **argv)
   TEST_Z(ec = rdma_create_event_channel());
   TEST_NZ(rdma_create_id(ec, &listener, NULL, RDMA_PS_TCP));
   TEST_NZ(rdma_bind_addr(listener, (struct sockaddr *)&addr));
-  TEST_NZ(rdma_listen(listener, 10)); /* backlog=10 is arbitrary */
+  TEST_NZ(rdma_listen(listener, backlog));
 
   port = ntohs(rdma_get_src_port(listener));
 
   printf("listening on port %d.\n", port);
 
+  rlog_init();
+  TEST_NZ(pthread_create(&report_thread, NULL, report_throughput, NULL));
+  for (i = 0; i < s_workers; ++i)
+    TEST_NZ(pthread_create(&worker, NULL, work_chunks, NULL));
+
   while (rdma_get_cm_event(ec, &event) == 0) {
     struct rdma_cm_event event_copy;
 
@@ -82,62 +339,183 @@ int main(int argc, char **argv)
 
 void die(const char *reason)
 {
+  rlog_flush();
   fprintf(stderr, "%s\n", reason);
   exit(EXIT_FAILURE);
 }
 
-void build_context(struct ibv_context *verbs)
+/*
+ * Find the context of the device a connection arrived on, or set one up
+ * (PD, CQ, poller) the first time we see it. CM event loop only.
+ */
+struct context * build_context(struct ibv_context *verbs)
 {
-  if (s_ctx) {
-    if (s_ctx->ctx != verbs)
-      die("cannot handle events in more than one context.");
+  struct context *ctx;
+  struct ibv_device_attr attr;
+  struct epoll_event ev;
+  int i;
+
+  for (i = 0; i < s_num_ctx; ++i)
+    if (s_ctx[i]->ctx == verbs)
+      return s_ctx[i];
+
+  if (s_num_ctx == MAX_CONTEXTS)
+    die("build_context: too many devices.");
+
+  TEST_Z(ctx = (struct context *)calloc(1, sizeof(struct context)));
+
+  ctx->ctx = verbs;
 
+  TEST_Z(ctx->pd = ibv_alloc_pd(ctx->ctx));
+  TEST_NZ(ibv_query_device(ctx->ctx, &attr));
+  ctx->max_initiator_depth = attr.max_qp_init_rd_atom;
+  ctx->max_responder = attr.max_qp_rd_atom;
+  ctx->max_cqe = attr.max_cqe;
+  ctx->cqe = CQ_SIZE < ctx->max_cqe ? CQ_SIZE : ctx->max_cqe;
+  TEST_Z(ctx->comp_channel = ibv_create_comp_channel(ctx->ctx));
+  TEST_Z(ctx->cq = ibv_create_cq(ctx->ctx, ctx->cqe, NULL, ctx->comp_channel, 0));
+  TEST_NZ(ibv_req_notify_cq(ctx->cq, 0));
+
+  /* data.ptr NULL is the completion channel, ctx the workers' pipe, anything else a file's ring */
+  TEST_Z((ctx->epfd = epoll_create1(EPOLL_CLOEXEC)) >= 0);
+  TEST_NZ(fcntl(ctx->comp_channel->fd, F_SETFL, fcntl(ctx->comp_channel->fd, F_GETFL) | O_NONBLOCK));
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  TEST_NZ(epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->comp_channel->fd, &ev));
+
+  TEST_NZ(pipe2(ctx->worked, O_CLOEXEC));
+  TEST_NZ(fcntl(ctx->worked[0], F_SETFL, O_NONBLOCK));
+  ev.data.ptr = ctx;
+  TEST_NZ(epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->worked[0], &ev));
+
+  TEST_NZ(pthread_create(&ctx->cq_poller_thread, NULL, poll_cq, ctx));
+
+  printf("new context for device %s.\n", ibv_get_device_name(verbs->device));
+
+  s_ctx[s_num_ctx] = ctx;
+  __atomic_store_n(&s_num_ctx, s_num_ctx + 1, __ATOMIC_RELEASE);
+
+  return ctx;
+}
+
+/*
+ * Count one more connection on the device and grow its CQ, in powers of
+ * two, once the sends and receives all of them can have posted no longer
+ * fit. CM event loop only; the CQ never shrinks.
+ */
+void add_connection(struct context *ctx, struct ibv_qp_init_attr *qp_attr)
+{
+  int n = __atomic_add_fetch(&ctx->num_connections, 1, __ATOMIC_RELAXED);
+  long need = (long)n * (qp_attr->cap.max_send_wr + qp_attr->cap.max_recv_wr);
+  int cqe = ctx->cqe;
+
+  if (need <= cqe || cqe >= ctx->max_cqe)
     return;
-  }
+  while (cqe < need && cqe < ctx->max_cqe)
+    cqe *= 2;
+  if (cqe > ctx->max_cqe)
+    cqe = ctx->max_cqe;
 
-  s_ctx = (struct context *)malloc(sizeof(struct context));
+  if (ibv_resize_cq(ctx->cq, cqe))
+    LOG_WARN("could not grow the CQ to %lld entries.\n", cqe);
+  else
+    ctx->cqe = cqe;
+}
 
-  s_ctx->ctx = verbs;
+/* per-device and aggregate throughput, whenever something moved */
+void * report_throughput(void *arg)
+{
+  unsigned long long last[MAX_CONTEXTS] = { 0 }, last_persisted[MAX_CONTEXTS] = { 0 };
+  unsigned long long bytes, delta, total, persisted, persisted_delta;
+  int i, n;
 
-  TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
-  TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
-  TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
+  while (1) {
+    sleep(REPORT_INTERVAL);
+
+    n = __atomic_load_n(&s_num_ctx, __ATOMIC_ACQUIRE);
+    total = 0;
+    for (i = 0; i < n; ++i) {
+      bytes = __atomic_load_n(&s_ctx[i]->bytes, __ATOMIC_RELAXED);
+      delta = bytes - last[i];
+      last[i] = bytes;
+      total += delta;
+      persisted = __atomic_load_n(&s_ctx[i]->persisted, __ATOMIC_RELAXED);
+      persisted_delta = persisted - last_persisted[i];
+      last_persisted[i] = persisted;
+      if (delta)
+        printf("  %-16s %10.2f MB/s, %d connection(s)\n",
+          ibv_get_device_name(s_ctx[i]->ctx->device),
+          (double)delta / REPORT_INTERVAL / 0x100000,
+          __atomic_load_n(&s_ctx[i]->num_connections, __ATOMIC_RELAXED));
+      if (persisted_delta || __atomic_load_n(&s_ctx[i]->at_disk, __ATOMIC_RELAXED))
+        printf("  %-16s %10.2f MB/s to disk, %d buffer(s) at the disk\n",
+          ibv_get_device_name(s_ctx[i]->ctx->device),
+          (double)persisted_delta / REPORT_INTERVAL / 0x100000,
+          __atomic_load_n(&s_ctx[i]->at_disk, __ATOMIC_RELAXED));
+    }
+    if (total)
+      printf("aggregate: %10.2f MB/s over %d device(s)\n",
+        (double)total / REPORT_INTERVAL / 0x100000, n);
+  }
 
-  TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+  return NULL;
 }
 
-void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
+void build_qp_attr(struct context *ctx, struct ibv_qp_init_attr *qp_attr)
 {
   memset(qp_attr, 0, sizeof(*qp_attr));
 
-  qp_attr->send_cq = s_ctx->cq;
-  qp_attr->recv_cq = s_ctx->cq;
+  qp_attr->send_cq = ctx->cq;
+  qp_attr->recv_cq = ctx->cq;
   qp_attr->qp_type = IBV_QPT_RC;
 
-  qp_attr->cap.max_send_wr = 10;
-  qp_attr->cap.max_recv_wr = 10;
+  qp_attr->cap.max_send_wr = RECV_WINDOW + 10; /* reads when pulling, and control messages */
+  qp_attr->cap.max_recv_wr = RECV_WINDOW + 1;
   qp_attr->cap.max_send_sge = 1;
   qp_attr->cap.max_recv_sge = 1;
 }
 
-void * poll_cq(void *ctx)
+void * poll_cq(void *arg)
 {
-  struct ibv_cq *cq;
-  struct ibv_wc wc;
+  struct context *ctx = (struct context *)arg;
+  struct epoll_event events[MAX_EVENTS];
+  int i, n;
 
   while (1) {
-    TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx));
-    ibv_ack_cq_events(cq, 1);
-    TEST_NZ(ibv_req_notify_cq(cq, 0));
-
-    while (ibv_poll_cq(cq, 1, &wc))
-      on_completion(&wc);
+    if ((n = epoll_wait(ctx->epfd, events, MAX_EVENTS, -1)) < 0) {
+      if (errno == EINTR)
+        continue;
+      die("poll_cq: epoll_wait failed.");
+    }
+
+    for (i = 0; i < n; ++i)
+      if (!events[i].data.ptr)
+        poll_completions(ctx);
+      else if (events[i].data.ptr == ctx)
+        on_worked(ctx);
+      else
+        on_disk_completion(ctx, (struct incoming *)events[i].data.ptr);
   }
 
   return NULL;
 }
 
+/* The channel is non-blocking, so a wakeup with no event is just ignored. */
+void poll_completions(struct context *ctx)
+{
+  struct ibv_cq *cq;
+  struct ibv_wc wc;
+  void *cq_context;
+
+  if (ibv_get_cq_event(ctx->comp_channel, &cq, &cq_context))
+    return;
+  ibv_ack_cq_events(cq, 1);
+  TEST_NZ(ibv_req_notify_cq(cq, 0));
+
+  while (ibv_poll_cq(cq, 1, &wc))
+    on_completion(ctx, &wc);
+}
+
 void post_receives(struct connection *conn)
 {
   struct ibv_recv_wr wr, *bad_wr = NULL;
@@ -155,60 +533,1264 @@ void post_receives(struct connection *conn)
   TEST_NZ(ibv_post_recv(conn->qp, &wr, &bad_wr));
 }
 
+/*
+ * Send mode: keep up to RECV_WINDOW receives posted on the next chunks of
+ * the mapping, or with a pool in as many free buffers as there are; a
+ * packed chunk can be any of the stream's, so each takes a whole one.
+ * Receives are consumed in the order they were posted, so the one for
+ * XFER_DONE can only go in behind the last chunk.
+ *
+ * Pull mode: the same, with up to read_depth RDMA READs of the chunks from
+ * the sender's file; how fast they are issued is up to us alone.
+ */
+void post_chunks(struct connection *conn)
+{
+  struct incoming *in = conn->in;
+  uint64_t window = (in->flags & XFER_PULL) ? conn->read_depth : RECV_WINDOW;
+  uint32_t len, lkey;
+  char *buf;
+  int b;
+
+  while (conn->posted < conn->end && conn->posted - conn->received < window) {
+    if (in->pool) {
+      if ((b = take_buffer(in->pool)) < 0)
+        break;
+      conn->slots[conn->posted % RECV_WINDOW] = b;
+      buf = in->pool->bufs + (size_t)b * in->chunk_size;
+      lkey = in->pool->mr->lkey;
+    } else {
+      buf = in->map + conn->posted * in->chunk_size;
+      lkey = in->mr->lkey;
+    }
+
+    len = xfer_chunk_len(in->size, in->chunk_size, conn->posted);
+    if (in->flags & XFER_IMM)
+      len = in->chunk_size; /* the immediate says which chunk it turns out to be */
+
+    if (in->flags & XFER_PULL) {
+      TEST_NZ(xfer_post_chunk(conn->qp, IBV_WR_RDMA_READ, buf, len, lkey,
+        in->src_addr + conn->posted * in->chunk_size, in->src_rkey, 0,
+        (uintptr_t)conn | XFER_DATA));
+      ++conn->posted;
+      continue;
+    }
+
+    TEST_NZ(xfer_post_recv(conn->qp, buf, len, lkey, (uintptr_t)conn | XFER_DATA));
+
+    if (++conn->posted == conn->end)
+      post_receives(conn);
+  }
+}
+
 void register_memory(struct connection *conn)
 {
   conn->send_region = malloc(BUFFER_SIZE);
   conn->recv_region = malloc(BUFFER_SIZE);
 
   TEST_Z(conn->send_mr = ibv_reg_mr(
-    s_ctx->pd, 
+    conn->ctx->pd, 
     conn->send_region, 
     BUFFER_SIZE, 
     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
 
   TEST_Z(conn->recv_mr = ibv_reg_mr(
-    s_ctx->pd, 
+    conn->ctx->pd, 
     conn->recv_region, 
     BUFFER_SIZE, 
     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
 }
 
-void on_completion(struct ibv_wc *wc)
+/* Unpublish and release <in>, once no stream refers to it any more. */
+void close_incoming(struct incoming *in)
+{
+  double secs = (xfer_now() - in->start_ns) / 1e9;
+
+  /* an offer refused before it got a slot has nothing to unpublish */
+  pthread_mutex_lock(&s_transfers_lock);
+  if (s_transfers[in->id % MAX_TRANSFERS] == in)
+    s_transfers[in->id % MAX_TRANSFERS] = NULL;
+  pthread_mutex_unlock(&s_transfers_lock);
+
+  if (in->failed)
+    printf("gave up on %s: %s.\n", in->name, in->failed);
+  else if (in->finished == in->streams)
+    printf("%s %s: %llu bytes in %.3f s, %.2f GB/s over %d stream(s)%s.\n",
+      in->flags & XFER_PULL ? "pulled" : "received", in->name,
+      (unsigned long long)in->size, secs, secs > 0 ? in->size / secs / 1e9 : 0, in->streams,
+      in->disk ? ", synced to disk" : "");
+  else
+    printf("gave up on %s: %d of %d stream(s) finished.\n", in->name, in->finished, in->streams);
+
+  /* chunks still queued when a transfer is given up on */
+  while (__atomic_load_n(&in->jobs, __ATOMIC_ACQUIRE))
+    sched_yield();
+
+  if ((in->flags & XFER_PACK) && in->finished == in->streams && !in->failed)
+    printf("  unpacked %llu files and directories into %s/%s, %.0f files/s; %.3f s of unpacking on %d workers.\n",
+      in->files, s_dir, in->name, secs > 0 ? in->files / secs : 0, in->unpack_ns / 1e9, s_workers);
+
+  if ((in->flags & XFER_DELTA) && in->finished == in->streams)
+    printf("  delta against the old copy of %llu bytes: %llu blocks copied from it, %llu bytes of literals;"
+      " %.3f s signing it, %.3f s of patching on %d workers%s.\n",
+      (unsigned long long)in->basis_size, (unsigned long long)in->num_copies,
+      (unsigned long long)(in->size - in->num_copies * in->chunk_size), in->sign_ns / 1e9,
+      in->patch_ns / 1e9, s_workers, in->corrupt ? "; the old copy stays" : "");
+
+  if (in->flags & XFER_DELTA) {
+    char part[PATH_MAX];
+
+    /* the old copy is whole until the new one is checked and renamed over it */
+    if (in->finished < in->streams) {
+      part_path(in, part);
+      unlink(part);
+    }
+
+    if (in->sigs_mr)
+      ibv_dereg_mr(in->sigs_mr);
+    if (in->copies_mr)
+      ibv_dereg_mr(in->copies_mr);
+    free(in->sigs);
+    free(in->copies);
+    if (in->basis)
+      munmap(in->basis, in->basis_size);
+    if (in->basis_fd >= 0)
+      close(in->basis_fd);
+  }
+
+  if (in->flags & XFER_CRC) {
+    if (in->finished == in->streams)
+      printf("  %llu chunks checked on %d workers, %.3f s of CRC32C: %s.\n",
+        (unsigned long long)in->chunks, s_workers, in->verify_ns / 1e9,
+        in->corrupt ? "SOME DID NOT MATCH" : "all match");
+    if (in->corrupt)
+      printf("  %llu chunk(s) of %s differ from the sender's.\n", (unsigned long long)in->corrupt, in->name);
+
+    if (in->sums_mr)
+      ibv_dereg_mr(in->sums_mr);
+    free(in->sums);
+    free(in->got);
+  }
+
+  if (in->pool) {
+    struct chunk_pool *p = in->pool;
+
+    track_buffers(p);
+    printf("  %d buffers of %u KB: %.1f in use on average, ",
+      p->buffers, in->chunk_size / 1024, secs > 0 ? p->busy / 1e9 / secs : 0);
+    if (in->disk)
+      printf("at most %d at the disk, ", in->disk->max_at_disk);
+    printf("%llu waits for one.\n", p->waits);
+  }
+
+  if (in->disk) {
+    struct persist *d = in->disk;
+
+    if (d->efd >= 0) {
+      epoll_ctl(in->ctx->epfd, EPOLL_CTL_DEL, d->efd, NULL);
+      close(d->efd);
+    }
+    if (d->ring.fd >= 0)
+      uring_exit(&d->ring);
+    free(d);
+  }
+
+  /* after the ring, which had the buffers registered */
+  if (in->pool) {
+    struct chunk_pool *p = in->pool;
+
+    if (p->mr)
+      ibv_dereg_mr(p->mr);
+    free(p->bufs);
+    free(p->free);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+  }
+
+  if (in->mr)
+    ibv_dereg_mr(in->mr);
+  if (in->map)
+    munmap(in->map, in->size);
+  if (in->fd >= 0)
+    close(in->fd);
+
+  free(in);
+}
+
+/*
+ * Take on stream <stream> of <in>: its receives, then XFER_READY. In send
+ * mode the receive for its XFER_DONE queues behind its chunks.
+ */
+void join_stream(struct connection *conn, struct incoming *in, int stream)
+{
+  conn->in = in;
+  conn->stream = stream;
+  in->conns[stream] = conn;
+  xfer_stripe(in->chunks, in->streams, stream, &conn->first, &conn->end);
+  conn->posted = conn->received = conn->first;
+
+  if ((in->flags & XFER_SEND) && conn->first < conn->end)
+    post_chunks(conn);
+  else
+    post_receives(conn);
+
+  send_control(conn, XFER_READY, in);
+
+  /* pulling, nothing more comes from the client before our XFER_ACK */
+  if (in->flags & XFER_PULL) {
+    if (conn->first < conn->end)
+      post_chunks(conn);
+    else
+      on_stripe_done(conn);
+  }
+}
+
+/*
+ * A stream is done with its file, acknowledged, refused or gone away,
+ * whichever comes first. The last one out closes it. <finished> counts
+ * the stream as finished, unless on_done() already has.
+ */
+void leave_stream(struct connection *conn, int finished)
+{
+  struct incoming *in = __atomic_exchange_n(&conn->in, NULL, __ATOMIC_ACQ_REL);
+
+  if (!in)
+    return;
+
+  in->conns[conn->stream] = NULL;
+
+  if (finished)
+    __atomic_add_fetch(&in->finished, 1, __ATOMIC_RELAXED);
+  if (__atomic_add_fetch(&in->left, 1, __ATOMIC_ACQ_REL) == in->streams && !in->waiting)
+    close_incoming(in);
+}
+
+/*
+ * Control replies use the second half of the send region: the greeting in
+ * the first half may not have gone out yet.
+ */
+void send_control(struct connection *conn, uint32_t op, struct incoming *in)
+{
+  struct message *msg = (struct message *)(conn->send_region + BUFFER_SIZE / 2);
+  struct xfer_msg *x = xfer_prepare(msg, op);
+
+  if (in) {
+    x->id = in->id;
+    x->flags = in->flags;
+    x->addr = (uintptr_t)in->map;
+    x->rkey = in->mr ? in->mr->rkey : 0;
+    x->sums = (uintptr_t)in->sums;
+    x->sums_rkey = in->sums_mr ? in->sums_mr->rkey : 0;
+    if (in->flags & XFER_DELTA) {
+      x->size = in->basis_size;
+      x->sigs = (uintptr_t)in->sigs;
+      x->sigs_rkey = in->sigs_mr ? in->sigs_mr->rkey : 0;
+      x->copies = (uintptr_t)in->copies;
+      x->copies_rkey = in->copies_mr ? in->copies_mr->rkey : 0;
+    }
+  }
+
+  TEST_NZ(post_message(conn->qp, msg, conn->send_mr->lkey, conn->max_inline, (uintptr_t)conn));
+}
+
+/* An XFER_ACK, which carries nothing but its flags. */
+void send_ack(struct connection *conn, uint32_t flags)
+{
+  struct message *msg = (struct message *)(conn->send_region + BUFFER_SIZE / 2);
+
+  xfer_prepare(msg, XFER_ACK)->flags = flags;
+  TEST_NZ(post_message(conn->qp, msg, conn->send_mr->lkey, conn->max_inline, (uintptr_t)conn));
+}
+
+/*
+ * Turn down what the client asked for on <conn>, rather than the whole
+ * server: the stream drops out of its transfer, if it was in one, and
+ * the client hangs up on XFER_REFUSED.
+ */
+void refuse(struct connection *conn, const char *why)
+{
+  printf("refused a request: %s.\n", why);
+  leave_stream(conn, 0);
+  send_ack(conn, XFER_REFUSED);
+}
+
+/* What is wrong with an offer, or NULL; <path> gets where it goes. */
+const char * check_offer(struct connection *conn, struct xfer_msg *x, uint32_t len, char *path)
+{
+  uint64_t chunks;
+
+  if (conn->in)
+    return "a transfer is already in progress";
+  if (!xfer_name_ok(x->name, len - sizeof(*x)) || !x->chunk_size || x->chunk_size > XFER_MAX_CHUNK
+      || x->streams < 1 || x->streams > XFER_MAX_STREAMS)
+    return "bad offer";
+  if (snprintf(path, PATH_MAX, "%s/%s", s_dir, x->name) >= PATH_MAX)
+    return "path too long";
+
+  chunks = xfer_chunks(x->size, x->chunk_size);
+  if ((x->flags & (XFER_CRC | XFER_PACK)) && ((x->flags & XFER_PULL) || s_direct))
+    return "checksums and packed directories only go with chunks pushed into the mapping";
+  if ((x->flags & XFER_PACK) && chunks > UINT32_MAX)
+    return "too many chunks to number in an immediate";
+  if ((x->flags & XFER_DELTA) && ((x->flags & (XFER_SEND | XFER_PACK)) || !(x->flags & XFER_CRC)))
+    return "a delta is for one file, written into the mapping and checked";
+  if ((x->flags & XFER_PULL) && !conn->read_depth)
+    return "the client takes no RDMA READs on this connection";
+  if (s_direct && x->chunk_size % DIRECT_ALIGN)
+    return "with -D the chunk size must be a multiple of 4 KB";
+
+  return NULL;
+}
+
+/*
+ * Create the file at its full size and register the mapping, so chunks
+ * land in its page cache directly, then publish it for the other streams
+ * to join. An empty file has nothing to map and is answered with a zero
+ * addr and rkey; so is a directory, which only needs a pool of buffers
+ * for the packed stream to pass through.
+ */
+void on_offer(struct connection *conn, struct xfer_msg *x, uint32_t len)
+{
+  struct incoming *in;
+  char path[PATH_MAX];
+  const char *why;
+  void *map;
+  int i;
+
+  if ((why = check_offer(conn, x, len, path))) {
+    refuse(conn, why);
+    return;
+  }
+
+  TEST_Z(in = (struct incoming *)calloc(1, sizeof(struct incoming)));
+  in->fd = -1;
+  strcpy(in->name, x->name);
+  in->ctx = conn->ctx;
+  in->size = x->size;
+  in->chunk_size = x->chunk_size;
+  in->flags = x->flags;
+  in->src_addr = x->addr;
+  in->src_rkey = x->rkey;
+  in->streams = x->streams;
+  in->chunks = xfer_chunks(in->size, in->chunk_size);
+  in->start_ns = xfer_now();
+
+  /*
+   * A WRITE leaves no completion to hand a chunk to the disk or a worker
+   * on. Packed chunks are SENDs numbered by their immediate, so they can
+   * come in any order, each into whichever buffer is posted next.
+   */
+  if (in->flags & XFER_PACK)
+    in->flags |= XFER_SEND | XFER_IMM;
+  else if ((s_direct || (in->flags & XFER_CRC)) && !(in->flags & (XFER_PULL | XFER_DELTA)))
+    in->flags |= XFER_SEND;
+
+  if (in->flags & (XFER_CRC | XFER_PACK))
+    in->pending = in->streams;
+
+  if (s_direct) {
+    why = start_persist(conn->ctx, in, path);
+  } else if (in->flags & XFER_PACK) {
+    /* the packed stream is only kept until it is unpacked, a pool at a time */
+    if (mkdir(path, 0755) && errno != EEXIST)
+      why = "cannot create the directory";
+    else
+      why = start_pool(conn->ctx, in);
+  } else {
+    if (in->flags & XFER_DELTA) {
+      char part[PATH_MAX];
+
+      in->basis_fd = -1;
+      part_path(in, part);
+      map = xfer_create_file(part, in->size, &in->fd);
+    } else {
+      map = xfer_create_file(path, in->size, &in->fd);
+    }
+
+    if (map == MAP_FAILED) {
+      why = "cannot create the file";
+    } else {
+      in->map = (char *)map;
+      if (in->size && !(in->mr = ibv_reg_mr(conn->ctx->pd, in->map, in->size,
+          IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE)))
+        why = "cannot register the file";
+    }
+  }
+
+  /* sized by the offer, like the file */
+  if (!why && (in->flags & XFER_CRC)) {
+    if (!(in->sums = (uint32_t *)calloc(in->chunks + 1, sizeof(uint32_t)))
+        || !(in->got = (uint32_t *)calloc(in->chunks + 1, sizeof(uint32_t)))
+        || (in->chunks && !(in->sums_mr = ibv_reg_mr(conn->ctx->pd, in->sums, in->chunks * sizeof(uint32_t),
+          IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE))))
+      why = "no room for the manifest";
+  }
+
+  if (!why && (in->flags & XFER_DELTA))
+    why = sign_basis(in, path);
+
+  if (!why) {
+    pthread_mutex_lock(&s_transfers_lock);
+    for (i = 0; i < MAX_TRANSFERS && s_transfers[s_next_id % MAX_TRANSFERS]; ++i)
+      ++s_next_id;
+    if (i < MAX_TRANSFERS) {
+      in->id = s_next_id++;
+      s_transfers[in->id % MAX_TRANSFERS] = in;
+    } else {
+      why = "too many transfers";
+    }
+    pthread_mutex_unlock(&s_transfers_lock);
+  }
+
+  if (why) {
+    refuse(conn, why);
+    close_incoming(in);
+    return;
+  }
+
+  /* XFER_DELTA: stream 0 has its XFER_READY once the workers have signed the old copy */
+  if (in->blocks) {
+    conn->in = in;
+    in->conns[0] = conn;
+    sign_blocks(in);
+    return;
+  }
+
+  join_stream(conn, in, 0);
+}
+
+void on_join(struct connection *conn, struct xfer_msg *x)
+{
+  struct incoming *in;
+
+  pthread_mutex_lock(&s_transfers_lock);
+  in = s_transfers[x->id % MAX_TRANSFERS];
+  pthread_mutex_unlock(&s_transfers_lock);
+
+  if (!in || in->id != x->id || conn->in || x->stream < 1 || x->stream >= in->streams || in->conns[x->stream]
+      || __atomic_load_n(&in->signing, __ATOMIC_ACQUIRE))
+    refuse(conn, "no such transfer or stream");
+  else if (in->ctx != conn->ctx)
+    refuse(conn, "all streams of a transfer must use the same device");
+  else if ((in->flags & XFER_PULL) && !conn->read_depth)
+    refuse(conn, "the client takes no RDMA READs on this connection");
+  else
+    join_stream(conn, in, x->stream);
+}
+
+void on_done(struct connection *conn, struct xfer_msg *x)
+{
+  struct incoming *in = conn->in;
+  uint64_t bytes;
+
+  if (!in || (in->flags & XFER_PULL) || ((in->flags & XFER_SEND) && conn->received < conn->end)) {
+    refuse(conn, "unexpected XFER_DONE");
+    return;
+  }
+
+  /* RDMA WRITEs bypass the completion path, so count them here; with XFER_DELTA only the literals moved */
+  bytes = xfer_stripe_bytes(in->size, in->chunk_size, conn->first, conn->end);
+  if (in->flags & XFER_DELTA) {
+    if (x->size > conn->end - conn->first) {
+      refuse(conn, "more copies than the stream has chunks");
+      return;
+    }
+    in->stream_copies[conn->stream] = x->size;
+    bytes -= x->size * in->chunk_size;
+  }
+  if (!(in->flags & XFER_SEND))
+    __atomic_store_n(&conn->ctx->bytes, conn->ctx->bytes + bytes, __ATOMIC_RELAXED);
+
+  post_receives(conn);
+  on_stripe_done(conn);
+}
+
+/* Every chunk of the stream is in: acknowledge it, or with -D once the whole file is on disk. */
+void on_stripe_done(struct connection *conn)
+{
+  struct incoming *in = conn->in;
+
+  if (in->disk) {
+    __atomic_add_fetch(&in->finished, 1, __ATOMIC_RELAXED);
+    maybe_sync(in);
+    return;
+  }
+
+  /* with XFER_CRC the manifest is in; the ACKs wait for the workers */
+  if (in->flags & (XFER_CRC | XFER_PACK)) {
+    __atomic_add_fetch(&in->finished, 1, __ATOMIC_RELAXED);
+    if (!__atomic_sub_fetch(&in->pending, 1, __ATOMIC_ACQ_REL))
+      finish_file(in);
+    else if (in->finished == in->streams)
+      in->waiting = 1;
+    return;
+  }
+
+  leave_stream(conn, 1);
+  send_ack(conn, 0);
+}
+
+/*
+ * Open the file for O_DIRECT with its blocks allocated, and set up the
+ * buffer pool and the ring: the pool registered as fixed buffers, the file
+ * as registered file 0, completions signalled on an eventfd the poller
+ * watches. Returns why the file can't be had, or NULL.
+ */
+const char * start_persist(struct context *ctx, struct incoming *in, const char *path)
+{
+  struct persist *d;
+  struct iovec *iov;
+  struct epoll_event ev;
+  const char *why = NULL;
+  int i, err, n;
+
+  if ((in->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644)) < 0)
+    return "cannot create the file";
+  if (in->size && (err = posix_fallocate(in->fd, 0, in->size)) && err != EOPNOTSUPP)
+    return "cannot allocate the file";
+  if ((why = start_pool(ctx, in)))
+    return why;
+
+  /* whatever gets set up here, close_incoming() takes down */
+  if (!(in->disk = d = (struct persist *)calloc(1, sizeof(struct persist))))
+    return "no room for the disk ring";
+  d->ring.fd = d->efd = -1;
+  n = in->pool->buffers;
+
+  if (!(iov = (struct iovec *)calloc(n, sizeof(struct iovec))))
+    return "no room for the disk ring";
+  for (i = 0; i < n; ++i) {
+    iov[i].iov_base = in->pool->bufs + (size_t)i * in->chunk_size;
+    iov[i].iov_len = in->chunk_size;
+  }
+
+  /* a write holds a buffer, so the rings can't overflow; +1 for the sync */
+  if (uring_init(&d->ring, n + 1)) {
+    memset(&d->ring, 0, sizeof(d->ring));
+    d->ring.fd = -1;
+    why = "cannot set up io_uring";
+  } else if (uring_register(&d->ring, IORING_REGISTER_BUFFERS, iov, n)
+             || uring_register(&d->ring, IORING_REGISTER_FILES, &in->fd, 1)) {
+    why = "cannot register with io_uring";
+  } else if ((d->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+             || uring_register(&d->ring, IORING_REGISTER_EVENTFD, &d->efd, 1)) {
+    why = "cannot have io_uring signal an eventfd";
+  }
+  free(iov);
+  if (why)
+    return why;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = in;
+  if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, d->efd, &ev)) {
+    close(d->efd);
+    d->efd = -1;
+    return "cannot poll the disk";
+  }
+
+  return NULL;
+}
+
+/*
+ * The -q buffers chunks are received into instead of a mapping, aligned
+ * for O_DIRECT. Returns why they can't be had, or NULL.
+ */
+const char * start_pool(struct context *ctx, struct incoming *in)
+{
+  struct chunk_pool *p;
+  size_t size;
+  int i;
+
+  /* whatever gets set up here, close_incoming() takes down */
+  if (!(in->pool = p = (struct chunk_pool *)calloc(1, sizeof(struct chunk_pool))))
+    return "no room for the chunk buffers";
+  pthread_mutex_init(&p->lock, NULL);
+  p->buffers = s_chunk_buffers;
+  size = (size_t)p->buffers * in->chunk_size;
+  p->last_ns = xfer_now();
+
+  if (posix_memalign((void **)&p->bufs, DIRECT_ALIGN, size)) {
+    p->bufs = NULL;
+    return "no room for the chunk buffers";
+  }
+  if (!(p->mr = ibv_reg_mr(ctx->pd, p->bufs, size, IBV_ACCESS_LOCAL_WRITE)))
+    return "cannot register the chunk buffers";
+  if (!(p->free = (int *)malloc(p->buffers * sizeof(int))))
+    return "no room for the chunk buffers";
+  for (i = 0; i < p->buffers; ++i)
+    p->free[i] = p->buffers - 1 - i;
+  p->num_free = p->buffers;
+
+  return NULL;
+}
+
+/* Buffers in use, integrated over time; call before every change, with the lock. */
+void track_buffers(struct chunk_pool *p)
+{
+  unsigned long long now = xfer_now();
+
+  p->busy += (unsigned long long)(p->buffers - p->num_free) * (now - p->last_ns);
+  p->last_ns = now;
+}
+
+/* A free buffer, or -1 if they are all posted, at the disk or being unpacked. */
+int take_buffer(struct chunk_pool *p)
+{
+  int b = -1;
+
+  pthread_mutex_lock(&p->lock);
+  if (!p->num_free) {
+    ++p->waits;
+    p->starved = 1;
+  } else {
+    track_buffers(p);
+    b = p->free[--p->num_free];
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return b;
+}
+
+/* Returns whether a receive went without a buffer meanwhile, so is yet to be posted. */
+int give_buffer(struct chunk_pool *p, int b)
+{
+  int starved;
+
+  pthread_mutex_lock(&p->lock);
+  track_buffers(p);
+  p->free[p->num_free++] = b;
+  starved = p->starved;
+  p->starved = 0;
+  pthread_mutex_unlock(&p->lock);
+
+  return starved;
+}
+
+/*
+ * A worker gave buffers back to a pool that had run out: post them on the
+ * streams of this device. Only this poller frees its transfers, so they
+ * stay put once found.
+ */
+void refill(struct context *ctx)
+{
+  struct incoming *in;
+  int i, s;
+
+  pthread_mutex_lock(&s_transfers_lock);
+  for (i = 0; i < MAX_TRANSFERS; ++i)
+    if ((in = s_transfers[i]) && in->ctx == ctx && in->pool)
+      for (s = 0; s < in->streams; ++s)
+        if (in->conns[s])
+          post_chunks(in->conns[s]);
+  pthread_mutex_unlock(&s_transfers_lock);
+}
+
+/* Hand the buffer chunk <chunk> was received into to the disk. */
+void persist_chunk(struct connection *conn, uint64_t chunk)
+{
+  struct incoming *in = conn->in;
+  struct persist *d = in->disk;
+  struct io_uring_sqe *sqe;
+  int b = conn->slots[chunk % RECV_WINDOW];
+  uint32_t len = xfer_chunk_len(in->size, in->chunk_size, chunk);
+
+  /* the last chunk goes out padded, and the file is trimmed before the sync */
+  len = (len + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+
+  TEST_Z(sqe = uring_get_sqe(&d->ring));
+  uring_prep_write_fixed(sqe, 0, in->pool->bufs + (size_t)b * in->chunk_size, len,
+    chunk * in->chunk_size, b, b);
+  TEST_Z(uring_submit(&d->ring) == 1);
+
+  if (++d->at_disk > d->max_at_disk)
+    d->max_at_disk = d->at_disk;
+  __atomic_store_n(&conn->ctx->at_disk, conn->ctx->at_disk + 1, __ATOMIC_RELAXED);
+}
+
+/* Once every stream is done and every write is in, trim the file and sync it. */
+void maybe_sync(struct incoming *in)
+{
+  struct persist *d = in->disk;
+  struct io_uring_sqe *sqe;
+
+  if (d->syncing || d->at_disk || in->finished < in->streams)
+    return;
+  d->syncing = 1;
+
+  /* a write failed: no use syncing, the ACKs say XFER_REFUSED */
+  if (!in->failed && ftruncate(in->fd, in->size))
+    in->failed = "cannot truncate the file";
+  if (in->failed) {
+    finish_file(in);
+    return;
+  }
+
+  TEST_Z(sqe = uring_get_sqe(&d->ring));
+  uring_prep_fdatasync(sqe, 0, SYNC_TAG);
+  if (uring_submit(&d->ring) != 1) {
+    in->failed = "cannot sync the file";
+    finish_file(in);
+  }
+}
+
+/*
+ * The file is on disk, or checked against its manifest: acknowledge every
+ * stream. The last leave_stream() frees <in>, or this if they have all
+ * gone while the workers were at it.
+ */
+void finish_file(struct incoming *in)
 {
-  if (wc->status != IBV_WC_SUCCESS)
-    die("on_completion: status is not IBV_WC_SUCCESS.");
+  struct connection *conns[XFER_MAX_STREAMS];
+  uint32_t flags;
+  uint64_t i;
+  int n = in->streams;
+
+  in->waiting = 0;
+  if (in->signing) {
+    on_signed(in);
+    return;
+  }
+  if (in->left == in->streams) {
+    close_incoming(in);
+    return;
+  }
 
-  if (wc->opcode & IBV_WC_RECV) {
-    struct connection *conn = (struct connection *)(uintptr_t)wc->wr_id;
+  /* XFER_DELTA: every stream is done, so the copies can go in, and then it is checked */
+  if ((in->flags & XFER_DELTA) && !in->patching && !in->failed && patch_file(in))
+    return;
 
-    printf("received message: %s\n", conn->recv_region);
+  if (in->failed)
+    in->flags |= XFER_REFUSED;
+  else if (in->flags & XFER_CRC) {
+    for (i = 0; i < in->chunks; ++i)
+      if (in->got[i] != in->sums[i])
+        ++in->corrupt;
+    if (in->corrupt)
+      in->flags |= XFER_CORRUPT;
+  }
 
+  if (in->flags & XFER_DELTA) {
+    char part[PATH_MAX], path[PATH_MAX];
+
+    part_path(in, part);
+    snprintf(path, sizeof(path), "%s/%s", s_dir, in->name);
+    if (!in->corrupt && !in->failed && rename(part, path)) {
+      in->failed = "cannot put the new copy in place";
+      in->flags |= XFER_REFUSED;
+    }
+    if (in->corrupt || in->failed)
+      unlink(part);
+  }
+
+  /* off the file before the ACK, which the client hangs up on; the last one frees it */
+  memcpy(conns, in->conns, n * sizeof(conns[0]));
+  flags = in->flags;
+
+  for (i = 0; i < (uint64_t)n; ++i)
+    if (conns[i]) {
+      leave_stream(conns[i], 0);
+      send_ack(conns[i], flags);
+    }
+}
+
+/* Where the new copy of an XFER_DELTA file is built; clients can't name dot files. */
+void part_path(struct incoming *in, char *path)
+{
+  if (snprintf(path, PATH_MAX, "%s/.%s.delta", s_dir, in->name) >= PATH_MAX)
+    die("part_path: path too long.");
+}
+
+/*
+ * Map the old copy, if there is one, and set up where its signatures are
+ * read from and the copies written to. Returns why the offer can't be
+ * taken, or NULL.
+ */
+const char * sign_basis(struct incoming *in, const char *path)
+{
+  struct stat st;
+
+  if ((in->basis_fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    if (errno != ENOENT)
+      return "cannot open the old copy";
+  } else {
+    TEST_NZ(fstat(in->basis_fd, &st));
+    if (!S_ISREG(st.st_mode))
+      return "the old copy is not a regular file";
+    in->basis_size = st.st_size;
+  }
+
+  in->blocks = in->basis_size / in->chunk_size;
+  if (in->chunks && (!(in->copies = (struct xfer_copy *)calloc(in->chunks, sizeof(struct xfer_copy)))
+      || !(in->copies_mr = ibv_reg_mr(in->ctx->pd, in->copies, in->chunks * sizeof(struct xfer_copy),
+        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE))))
+    return "no room for the copies";
+  if (!in->blocks)
+    return NULL;
+
+  in->basis = (char *)mmap(NULL, in->basis_size, PROT_READ, MAP_SHARED, in->basis_fd, 0);
+  if (in->basis == MAP_FAILED) {
+    in->basis = NULL;
+    return "cannot map the old copy";
+  }
+
+  if (!(in->sigs = (struct xfer_sig *)malloc(in->blocks * sizeof(struct xfer_sig)))
+      || !(in->sigs_mr = ibv_reg_mr(in->ctx->pd, in->sigs, in->blocks * sizeof(struct xfer_sig),
+        IBV_ACCESS_REMOTE_READ)))
+    return "no room for the signatures";
+
+  return NULL;
+}
+
+/*
+ * Have the workers sign the old copy's whole blocks for the client to RDMA
+ * READ, a run of them per job. The poller goes on with other transfers;
+ * the last worker hands this one back to it, for on_signed().
+ */
+void sign_blocks(struct incoming *in)
+{
+  uint64_t per = (in->blocks + SIGN_JOBS * s_workers - 1) / (SIGN_JOBS * s_workers), i;
+
+  in->sign_ns = xfer_now();
+  __atomic_store_n(&in->signing, 1, __ATOMIC_RELEASE);
+
+  /* held until every block is queued; on_signed() puts the streams' share back */
+  in->pending = 1;
+  for (i = 0; i < in->blocks; i += per)
+    queue_chunk(in, i, NULL, in->blocks - i < per ? in->blocks - i : per);
+
+  if (!__atomic_sub_fetch(&in->pending, 1, __ATOMIC_ACQ_REL))
+    on_signed(in);
+  else
+    in->waiting = 1;
+}
+
+/* The old copy is signed: on with the XFER_READY, unless stream 0 went meanwhile. */
+void on_signed(struct incoming *in)
+{
+  __atomic_store_n(&in->signing, 0, __ATOMIC_RELEASE);
+  in->sign_ns = xfer_now() - in->sign_ns;
+  in->pending = (in->flags & (XFER_CRC | XFER_PACK)) ? in->streams : 0;
+
+  if (!in->conns[0])
+    close_incoming(in);
+  else
+    join_stream(in->conns[0], in, 0);
+}
+
+/*
+ * Check the copies the streams wrote and pack them into one sorted list,
+ * then have the workers bring each chunk up to date and take its CRC32C.
+ * The copies never overlap, so the chunks are independent. Returns 1 if
+ * the workers hand the file back to finish_file(), 0 to carry on now:
+ * they were that quick, or a copy was bad and the file is given up on.
+ */
+int patch_file(struct incoming *in)
+{
+  struct xfer_copy *c;
+  uint64_t first, end, i, n = 0, next = 0;
+  int s;
+
+  for (s = 0; s < in->streams; ++s) {
+    xfer_stripe(in->chunks, in->streams, s, &first, &end);
+    for (i = 0; i < in->stream_copies[s]; ++i) {
+      c = &in->copies[first + i];
+      if (c->offset < next || c->offset < first * in->chunk_size || in->size < in->chunk_size
+          || c->offset > in->size - in->chunk_size || c->offset + in->chunk_size > end * in->chunk_size
+          || c->block >= in->blocks) {
+        in->failed = "bad copy from the client";
+        return 0;
+      }
+      next = c->offset + in->chunk_size;
+      in->copies[n++] = *c;
+    }
+  }
+  in->num_copies = n;
+
+  /* like a stream, held until every chunk is queued */
+  in->patching = 1;
+  in->pending = 1;
+  for (i = 0; i < in->chunks; ++i)
+    queue_chunk(in, i, in->map + i * in->chunk_size, xfer_chunk_len(in->size, in->chunk_size, i));
+
+  if (!__atomic_sub_fetch(&in->pending, 1, __ATOMIC_ACQ_REL))
+    return 0;
+  in->waiting = 1;
+  return 1;
+}
+
+/* Copy into chunk <chunk> the parts of the old copy's blocks that land in it. */
+void patch_chunk(struct incoming *in, uint64_t chunk, uint32_t len)
+{
+  const uint64_t n = in->chunk_size;
+  uint64_t start = chunk * n, end = start + len, lo = 0, hi = in->num_copies, mid, from, to;
+  struct xfer_copy *c;
+
+  /* the first copy that ends past the chunk's start */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (in->copies[mid].offset + n <= start)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (; lo < in->num_copies && (c = &in->copies[lo])->offset < end; ++lo) {
+    from = c->offset > start ? c->offset : start;
+    to = c->offset + n < end ? c->offset + n : end;
+    memcpy(in->map + from, in->basis + c->block * n + (from - c->offset), to - from);
+  }
+}
+
+/* Hand a chunk to the workers; waits if they are CHUNK_QUEUE behind. */
+void queue_chunk(struct incoming *in, uint64_t chunk, const char *buf, uint32_t len)
+{
+  struct chunk_job *job;
+
+  __atomic_add_fetch(&in->pending, 1, __ATOMIC_ACQ_REL);
+  __atomic_add_fetch(&in->jobs, 1, __ATOMIC_ACQ_REL);
+
+  pthread_mutex_lock(&s_chunk_lock);
+  while (s_chunk_tail - s_chunk_head == CHUNK_QUEUE)
+    pthread_cond_wait(&s_chunk_room, &s_chunk_lock);
+
+  job = &s_chunk_queue[s_chunk_tail++ % CHUNK_QUEUE];
+  job->in = in;
+  job->chunk = chunk;
+  job->buf = buf;
+  job->len = len;
+
+  pthread_cond_signal(&s_chunk_ready);
+  pthread_mutex_unlock(&s_chunk_lock);
+}
+
+void * work_chunks(void *arg)
+{
+  struct chunk_job job;
+  unsigned long long start;
+  uintptr_t refilled = REFILL;
+  const char *why;
+
+  while (1) {
+    pthread_mutex_lock(&s_chunk_lock);
+    while (s_chunk_head == s_chunk_tail)
+      pthread_cond_wait(&s_chunk_ready, &s_chunk_lock);
+    job = s_chunk_queue[s_chunk_head++ % CHUNK_QUEUE];
+    pthread_cond_signal(&s_chunk_room);
+    pthread_mutex_unlock(&s_chunk_lock);
+
+    if (job.in->signing) {
+      const uint32_t n = job.in->chunk_size;
+      const char *block;
+      uint64_t i;
+      uint32_t a, b;
+
+      for (i = job.chunk; i < job.chunk + job.len; ++i) {
+        block = job.in->basis + i * n;
+        xfer_weak_sums(block, n, &a, &b);
+        job.in->sigs[i].weak = xfer_weak(a, b);
+        job.in->sigs[i].pad = 0;
+        xfer_strong(block, n, job.in->sigs[i].strong);
+      }
+    } else if (job.in->flags & XFER_DELTA) {
+      start = xfer_now();
+      patch_chunk(job.in, job.chunk, job.len);
+      __atomic_add_fetch(&job.in->patch_ns, xfer_now() - start, __ATOMIC_RELAXED);
+    }
+
+    if ((job.in->flags & XFER_CRC) && !job.in->signing) {
+      start = xfer_now();
+      job.in->got[job.chunk] = xfer_crc32c(0, job.buf, job.len);
+      __atomic_add_fetch(&job.in->verify_ns, xfer_now() - start, __ATOMIC_RELAXED);
+    }
+
+    /* the rest of a bad transfer still comes in, but is only counted off */
+    if ((job.in->flags & XFER_PACK) && !__atomic_load_n(&job.in->failed, __ATOMIC_ACQUIRE)) {
+      start = xfer_now();
+      if ((why = unpack_chunk(job.in, job.buf, job.len)))
+        __atomic_store_n(&job.in->failed, why, __ATOMIC_RELEASE);
+      __atomic_add_fetch(&job.in->unpack_ns, xfer_now() - start, __ATOMIC_RELAXED);
+    }
+
+    /* its buffer can take another chunk; if a stream ran out, the poller posts it */
+    if ((job.in->flags & XFER_PACK)
+        && give_buffer(job.in->pool, (job.buf - job.in->pool->bufs) / job.in->chunk_size))
+      TEST_Z(write(job.in->ctx->worked[1], &refilled, sizeof(refilled)) == sizeof(refilled));
+
+    if (!__atomic_sub_fetch(&job.in->pending, 1, __ATOMIC_ACQ_REL))
+      TEST_Z(write(job.in->ctx->worked[1], &job.in, sizeof(job.in)) == sizeof(job.in));
+    __atomic_sub_fetch(&job.in->jobs, 1, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+/*
+ * Pieces of one file can be unpacked in any order, by any worker, so the
+ * directories on the way are made by whoever needs them first.
+ */
+int make_parents(char *path, size_t root_len)
+{
+  char *slash;
+  int r;
+
+  for (slash = strchr(path + root_len + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    r = mkdir(path, 0755) && errno != EEXIST ? -1 : 0;
+    *slash = '/';
+    if (r)
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Write out the records of a packed chunk; the client is trusted no more
+ * than for a file name. Returns what was wrong with it, or NULL; the
+ * transfer is given up on then, and only that.
+ */
+const char * unpack_chunk(struct incoming *in, const char *buf, uint32_t len)
+{
+  const struct xfer_pack_chunk *c = (const struct xfer_pack_chunk *)buf;
+  const struct xfer_pack_record *r;
+  char path[PATH_MAX];
+  uint32_t pos, i, header, mode;
+  size_t root_len;
+  int fd;
+
+  if (len < sizeof(*c) || c->used > len || c->used < sizeof(*c))
+    return "bad packed chunk";
+
+  root_len = snprintf(path, sizeof(path), "%s/%s", s_dir, in->name);
+
+  for (i = 0, pos = sizeof(*c); i < c->records; ++i) {
+    r = (const struct xfer_pack_record *)(buf + pos);
+    if (pos > c->used || c->used - pos < sizeof(*r)
+        || c->used - pos < (header = xfer_pack_header_len(r->path_len))
+        || c->used - pos - header < r->length
+        || !xfer_path_ok(r->path, r->path_len)
+        || r->length > r->size || r->offset > r->size - r->length
+        || root_len + 1 + r->path_len >= sizeof(path))
+      return "bad packed record";
+
+    path[root_len] = '/';
+    memcpy(path + root_len + 1, r->path, r->path_len + 1);
+    mode = r->mode & 07777;
+
+    if (S_ISDIR(r->mode)) {
+      if (mkdir(path, mode | S_IRWXU) && errno == ENOENT) {
+        if (make_parents(path, root_len))
+          return "cannot create a directory";
+        mkdir(path, mode | S_IRWXU);
+      }
+    } else if (S_ISREG(r->mode)) {
+      /* the owner keeps write permission, since another piece may still be on its way */
+      if ((fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW, mode | S_IWUSR)) < 0 && errno == ENOENT) {
+        if (make_parents(path, root_len))
+          return "cannot create a directory";
+        fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW, mode | S_IWUSR);
+      }
+      if (fd < 0)
+        return "cannot create a file";
+
+      if ((r->length && pwrite(fd, buf + pos + header, r->length, r->offset) != (ssize_t)r->length)
+          || (r->offset == 0 && ftruncate(fd, r->size))) {
+        close(fd);
+        return "cannot write a file";
+      }
+      close(fd);
+    } else {
+      return "bad packed record";
+    }
+
+    if (r->offset == 0)
+      __atomic_add_fetch(&in->files, 1, __ATOMIC_RELAXED);
+    pos += header + xfer_align8(r->length);
+  }
+
+  return NULL;
+}
+
+/*
+ * Files whose last chunk a worker finished with after their last
+ * XFER_DONE, buffers the workers gave back, and connections the CM
+ * thread saw go away.
+ */
+void on_worked(struct context *ctx)
+{
+  uintptr_t p;
+
+  while (read(ctx->worked[0], &p, sizeof(p)) == sizeof(p))
+    if (p == REFILL)
+      refill(ctx);
+    else if (p & GONE)
+      close_connection((struct connection *)(p & ~GONE));
+    else
+      finish_file((struct incoming *)p);
+}
+
+/* Writes done: their buffers go back to the receive side. */
+void on_disk_completion(struct context *ctx, struct incoming *in)
+{
+  struct persist *d = in->disk;
+  struct io_uring_cqe *cqe;
+  uint64_t events;
+  int i;
+
+  while (read(d->efd, &events, sizeof(events)) > 0)
+    ;
+
+  while ((cqe = uring_peek_cqe(&d->ring))) {
+    /* the transfer is given up on once every write is back, not the server */
+    if (cqe->res < 0 && !in->failed)
+      in->failed = cqe->user_data == SYNC_TAG ? "cannot sync the file" : "cannot write to the disk";
+
+    if (cqe->user_data == SYNC_TAG) {
+      uring_cqe_seen(&d->ring);
+      finish_file(in);
+      return;
+    }
+
+    if (cqe->res > 0)
+      __atomic_store_n(&ctx->persisted, ctx->persisted + cqe->res, __ATOMIC_RELAXED);
+    __atomic_store_n(&ctx->at_disk, ctx->at_disk - 1, __ATOMIC_RELAXED);
+    --d->at_disk;
+
+    give_buffer(in->pool, cqe->user_data);
+    uring_cqe_seen(&d->ring);
+  }
+
+  for (i = 0; i < in->streams; ++i)
+    if (in->conns[i])
+      post_chunks(in->conns[i]);
+
+  maybe_sync(in);
+}
+
+void on_completion(struct context *ctx, struct ibv_wc *wc)
+{
+  struct connection *conn = (struct connection *)(uintptr_t)(wc->wr_id & ~XFER_DATA);
+
+  /* the control receive still posted when the client goes away */
+  if (wc->status == IBV_WC_WR_FLUSH_ERR || conn->broken)
+    return;
+
+  /* the QP is in error, so no ACK gets through: drop the stream and the connection */
+  if (wc->status != IBV_WC_SUCCESS) {
+    printf("dropped a connection: %s.\n", ibv_wc_status_str(wc->status));
+    conn->broken = 1;
+    if (conn->in && !__atomic_load_n(&conn->in->failed, __ATOMIC_ACQUIRE))
+      __atomic_store_n(&conn->in->failed, "a stream's connection failed", __ATOMIC_RELEASE);
+    leave_stream(conn, 0);
+    rdma_disconnect(conn->id);
+    return;
+  }
+
+  __atomic_store_n(&ctx->bytes,
+    ctx->bytes + ((wc->opcode & IBV_WC_RECV) || wc->opcode == IBV_WC_RDMA_READ
+      ? wc->byte_len : conn->send_len),
+    __ATOMIC_RELAXED);
+
+  if (wc->wr_id & XFER_DATA) {
+    struct incoming *in = conn->in;
+    uint64_t chunk = conn->received;
+    uint32_t len;
+    char *buf;
+
+    /* the stream was refused, and the client is hanging up */
+    if (!in)
+      return;
+
+    /* packed chunks come in any order, numbered by the immediate, and are only as long as they are full */
+    if ((in->flags & XFER_IMM) && ((chunk = ntohl(wc->imm_data)) < conn->first || chunk >= conn->end)) {
+      refuse(conn, "chunk out of the stream's range");
+      return;
+    }
+    len = xfer_chunk_len(in->size, in->chunk_size, chunk);
+    if (in->flags & XFER_IMM) {
+      if (wc->byte_len > len) {
+        refuse(conn, "chunk longer than its place");
+        return;
+      }
+      len = wc->byte_len;
+    }
+
+    /* a chunk is already where it belongs in the mapping, or in a buffer for the disk or a worker */
+    buf = in->pool ? in->pool->bufs + (size_t)conn->slots[conn->received % RECV_WINDOW] * in->chunk_size
+      : in->map + chunk * in->chunk_size;
+    if (in->disk)
+      persist_chunk(conn, chunk);
+    if (in->flags & (XFER_CRC | XFER_PACK))
+      queue_chunk(in, chunk, buf, len);
+    if (++conn->received == conn->end && (in->flags & XFER_PULL))
+      on_stripe_done(conn);
+    else
+      post_chunks(conn);
+  } else if (wc->opcode & IBV_WC_RECV) {
+    struct message *msg = parse_message(conn->recv_region, wc->byte_len);
+    struct xfer_msg *x;
+
+    if (!msg) {
+      refuse(conn, "malformed message");
+    } else if (!(x = xfer_parse(msg))) {
+      LOG_TEXT(LOG_LEVEL_DEBUG, "received message: %s\n", msg->data);
+      post_receives(conn);
+    } else if (x->op == XFER_OFFER) {
+      on_offer(conn, x, msg->len);
+    } else if (x->op == XFER_JOIN) {
+      on_join(conn, x);
+    } else if (x->op == XFER_DONE) {
+      on_done(conn, x);
+    } else {
+      refuse(conn, "unexpected control message");
+    }
   } else if (wc->opcode == IBV_WC_SEND) {
-    printf("send completed successfully.\n");
+    LOG_DEBUG("send completed successfully.\n");
   }
 }
 
-int on_connect_request(struct rdma_cm_id *id)
+int on_connect_request(struct rdma_cm_id *id, struct rdma_conn_param *param)
 {
   struct ibv_qp_init_attr qp_attr;
   struct rdma_conn_param cm_params;
+  struct context *ctx;
   struct connection *conn;
 
-  printf("received connection request.\n");
-
-  build_context(id->verbs);
-  build_qp_attr(&qp_attr);
+  LOG_TEXT(LOG_LEVEL_INFO, "received connection request on %s.\n", ibv_get_device_name(id->verbs->device));
 
-  TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
+  ctx = build_context(id->verbs);
+  build_qp_attr(ctx, &qp_attr);
 
-  id->context = conn = (struct connection *)malloc(sizeof(struct connection));
+  TEST_Z(id->context = conn = (struct connection *)calloc(1, sizeof(struct connection)));
+  if ((conn->max_inline = create_qp_inline(id, ctx->pd, &qp_attr)) < 0) {
+    LOG_WARN("cannot create a QP, rejecting a connection.\n");
+    free(conn);
+    rdma_reject(id, NULL, 0);
+    rdma_destroy_id(id);
+    return 0;
+  }
+  conn->ctx = ctx;
+  conn->id = id;
   conn->qp = id->qp;
+  add_connection(ctx, &qp_attr);
 
   register_memory(conn);
   post_receives(conn);
 
   memset(&cm_params, 0, sizeof(cm_params));
-  TEST_NZ(rdma_accept(id, &cm_params));
+  cm_params.rnr_retry_count = 7; /* the client reposts its one receive between messages */
+  /* as many READs as the client will serve, if it pulls; within the device's limit */
+  cm_params.initiator_depth = param->responder_resources < ctx->max_initiator_depth
+    ? param->responder_resources : ctx->max_initiator_depth;
+  conn->read_depth = cm_params.initiator_depth < s_read_depth ? cm_params.initiator_depth : s_read_depth;
+  /* and the other way, for the signatures of an XFER_DELTA */
+  cm_params.responder_resources = param->initiator_depth < ctx->max_responder
+    ? param->initiator_depth : ctx->max_responder;
+  if (rdma_accept(id, &cm_params)) {
+    /* in a storm the client may well have timed out already */
+    LOG_WARN("cannot accept a connection, dropping it.\n");
+    return on_disconnect(id);
+  }
 
   return 0;
 }
@@ -216,37 +1798,51 @@ int on_connect_request(struct rdma_cm_id *id)
 int on_connection(void *context)
 {
   struct connection *conn = (struct connection *)context;
-  struct ibv_send_wr wr, *bad_wr = NULL;
-  struct ibv_sge sge;
+  struct message *msg = (struct message *)conn->send_region;
 
-  snprintf(conn->send_region, BUFFER_SIZE, "message from passive/server side with pid %d", getpid());
+  /* the terminating NUL goes along so the peer can print it as is */
+  msg->type = MSG_TEXT;
+  msg->len = snprintf(msg->data, BUFFER_SIZE / 2 - sizeof(*msg), "message from passive/server side with pid %d", getpid()) + 1;
+  conn->send_len = sizeof(*msg) + msg->len;
 
-  printf("connected. posting send...\n");
+  LOG_INFO("connected. posting send...\n");
 
-  memset(&wr, 0, sizeof(wr));
+  TEST_NZ(post_message(conn->qp, msg, conn->send_mr->lkey, conn->max_inline, (uintptr_t)conn));
 
-  wr.opcode = IBV_WR_SEND;
-  wr.sg_list = &sge;
-  wr.num_sge = 1;
-  wr.send_flags = IBV_SEND_SIGNALED;
+  return 0;
+}
 
-  sge.addr = (uintptr_t)conn->send_region;
-  sge.length = BUFFER_SIZE;
-  sge.lkey = conn->send_mr->lkey;
+/* The poller may be posting on the connection, or on its way to it through in->conns. */
+int on_disconnect(struct rdma_cm_id *id)
+{
+  uintptr_t p = (uintptr_t)id->context | GONE;
+  struct connection *conn = (struct connection *)id->context;
+
+  LOG_INFO("peer disconnected.\n");
 
-  TEST_NZ(ibv_post_send(conn->qp, &wr, &bad_wr));
+  TEST_Z(write(conn->ctx->worked[1], &p, sizeof(p)) == sizeof(p));
 
   return 0;
 }
 
-int on_disconnect(struct rdma_cm_id *id)
+/*
+ * On the poller: whatever the QP completed before the client went is seen
+ * to first, then the stream leaves its transfer (a transfer cut short
+ * leaves its partial file behind) and the connection goes.
+ */
+void close_connection(struct connection *conn)
 {
-  struct connection *conn = (struct connection *)id->context;
+  struct rdma_cm_id *id = conn->id;
+  struct ibv_wc wc;
 
-  printf("peer disconnected.\n");
+  while (ibv_poll_cq(conn->ctx->cq, 1, &wc))
+    on_completion(conn->ctx, &wc);
 
+  __atomic_sub_fetch(&conn->ctx->num_connections, 1, __ATOMIC_RELAXED);
   rdma_destroy_qp(id);
 
+  leave_stream(conn, 0);
+
   ibv_dereg_mr(conn->send_mr);
   ibv_dereg_mr(conn->recv_mr);
 
@@ -256,8 +1852,6 @@ int on_disconnect(struct rdma_cm_id *id)
   free(conn);
 
   rdma_destroy_id(id);
-
-  return 0;
 }
 
 int on_event(struct rdma_cm_event *event)
@@ -265,11 +1859,13 @@ int on_event(struct rdma_cm_event *event)
   int r = 0;
 
   if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
-    r = on_connect_request(event->id);
+    r = on_connect_request(event->id, &event->param.conn);
   else if (event->event == RDMA_CM_EVENT_ESTABLISHED)
     r = on_connection(event->id->context);
-  else if (event->event == RDMA_CM_EVENT_DISCONNECTED)
-    r = on_disconnect(event->id);
+  else if (event->event == RDMA_CM_EVENT_DISCONNECTED || event->event == RDMA_CM_EVENT_CONNECT_ERROR)
+    r = on_disconnect(event->id); /* accepted, but the client may give up before it is established */
+  else if (event->event == RDMA_CM_EVENT_TIMEWAIT_EXIT)
+    ; /* an id the poller hasn't destroyed yet; it may have by now */
   else
     die("on_event: unknown event.");
 
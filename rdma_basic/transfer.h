@@ -0,0 +1,545 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <rdma/rdma_cma.h>
+
+#include "message.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * File transfer over one RC connection, as control messages (struct
+ * message of type MSG_XFER carrying a struct xfer_msg) around a stream of
+ * chunks:
+ *
+ *   client                               server
+ *   XFER_OFFER size, chunk size, name -->
+ *                                        creates the file at full size,
+ *                                        maps it and registers the mapping
+ *                                   <--  XFER_READY addr, rkey
+ *   chunks, up to <window> in flight -->
+ *   XFER_DONE                        -->
+ *                                        unmaps and closes the file
+ *                                   <--  XFER_ACK
+ *
+ * A file can be striped over several connections to the same device.
+ * The offer then says how many streams there are, and each other stream
+ * sends XFER_JOIN with the id from XFER_READY and its index, and gets an
+ * XFER_READY of its own. Stream s moves the chunks xfer_stripe() gives it
+ * and ends with its own XFER_DONE/XFER_ACK; the file is closed after the
+ * last stream's XFER_DONE. The destination is registered once, so any
+ * stream's QP can write to it with the same rkey.
+ *
+ * Chunk i covers bytes [i * chunk size, (i + 1) * chunk size) of the file
+ * and goes either as an RDMA WRITE to addr + its offset, or with XFER_SEND
+ * as a SEND that lands in a receive the server posted on that part of the
+ * mapping; RC delivers SENDs to receives in order, so no header is needed.
+ * Either way the data goes from the sender's pages into the page cache of
+ * the destination file without a copy on the server. The server can also
+ * set XFER_SEND in its XFER_READY, when it wants a completion per chunk
+ * (to write it out itself), and the sender goes by that.
+ *
+ * With XFER_PULL the receiver moves the data instead: the offer carries
+ * the addr and rkey of the sender's registered file, and the server
+ * issues RDMA READs of each stream's chunks, as many in flight as it
+ * likes up to what the sender's QP takes (responder_resources at
+ * connect). No XFER_DONE is sent; the XFER_ACK says the stream's chunks
+ * are all in.
+ *
+ * With XFER_CRC (pushed chunks only) the sender takes the CRC32C of each
+ * chunk right after posting it, and the receiver its own as each chunk
+ * completes. XFER_READY then also carries where the manifest goes: one
+ * uint32_t per chunk, which each stream RDMA WRITEs for its chunks ahead
+ * of its XFER_DONE. The XFER_ACKs come once the whole file is checked,
+ * with XFER_CORRUPT set if any chunk didn't match.
+ *
+ * With XFER_PACK the offer is for a directory tree, packed into chunks
+ * of records (struct xfer_pack_record) that each carry a piece of one
+ * file, or a directory, so small files share chunks and a big one spans
+ * several. The name is the directory's, and the size that of the packed
+ * stream. Chunks are self-contained and need not arrive in order: the
+ * server sets XFER_SEND and XFER_IMM in its XFER_READY, and each chunk
+ * then goes as a SEND with immediate, the chunk's index, into whichever
+ * of the server's buffers is posted next. The server only has so many
+ * and reposts each once its chunk is unpacked, so a tree of any size
+ * passes through a bounded amount of memory. The ACKs come once every
+ * chunk is unpacked.
+ *
+ * With XFER_DELTA (pushed with XFER_CRC, one file) the server already has
+ * a copy by that name and only what changed is sent, the rsync way. Its
+ * XFER_READY carries the copy's size and where to RDMA READ a signature
+ * (struct xfer_sig) of each whole chunk-sized block of it. The sender
+ * looks for those blocks at every byte offset of its file with a rolling
+ * weak sum, RDMA WRITEs the bytes it didn't find (literals) to addr as
+ * usual, and, with its part of the manifest, writes a struct xfer_copy
+ * for each block it found to the table at copies: one per chunk at most,
+ * as a stream's copies don't overlap or leave its stripe, at the same
+ * index as its first chunk's checksum. Its XFER_DONE says how many there
+ * are. The server builds the file next to the old copy, applies the
+ * copies, checks the whole file against the manifest and only then puts
+ * it in the old copy's place. A block's strong sum is 128 bits and has
+ * nothing to do with the manifest's CRC32C, so a block matched by chance
+ * doesn't check out by the same chance: the file is XFER_CORRUPT and the
+ * old copy stays.
+ *
+ * An offer or join the server can't take, or a message that makes no
+ * sense where it comes, is answered with an XFER_ACK with XFER_REFUSED
+ * set; that stream is out of its transfer and the client hangs up on
+ * every stream of it. So are all the XFER_ACKs of a transfer the server
+ * gave up on along the way, e.g. over a packed record it couldn't unpack.
+ */
+
+enum message_type {
+  MSG_TEXT = 0,                /* NUL-terminated string */
+  MSG_XFER = 1                 /* struct xfer_msg */
+};
+
+enum xfer_op {
+  XFER_OFFER = 1,
+  XFER_READY,
+  XFER_DONE,
+  XFER_ACK,
+  XFER_JOIN
+};
+
+#define XFER_SEND 0x1            /* flags: chunks go as SENDs, not RDMA WRITEs */
+#define XFER_PULL 0x2            /*   or the receiver RDMA READs them */
+#define XFER_CRC  0x4            /* a manifest of chunk checksums is checked */
+#define XFER_CORRUPT 0x8         /* ACK: some chunk didn't match the manifest */
+#define XFER_PACK 0x10           /* a directory tree, packed */
+#define XFER_IMM  0x20           /* READY: chunks go as SENDs with immediate, their index */
+#define XFER_DELTA 0x40          /* only what the server's copy lacks is sent */
+#define XFER_REFUSED 0x80        /* ACK: the server won't take the request, or gave up on the file */
+
+#define XFER_DEFAULT_CHUNK  (1 << 20)
+#define XFER_MAX_CHUNK      (1 << 30)
+#define XFER_DEFAULT_WINDOW 16
+#define XFER_MAX_WINDOW     128
+#define XFER_NAME_MAX       255
+#define XFER_MAX_STREAMS    64
+
+/* low bit of wr_id: the completion is for a chunk, not a control message */
+#define XFER_DATA 0x1ULL
+
+struct xfer_msg {
+  uint32_t op;
+  uint32_t flags;
+  uint64_t size;               /* OFFER: file size in bytes, READY with XFER_DELTA:
+                                  the server's copy's, DONE: copies written */
+  uint32_t chunk_size;         /* OFFER */
+  uint32_t rkey;               /* READY, OFFER with XFER_PULL */
+  uint64_t addr;               /* READY: where byte 0 of the file goes,
+                                  OFFER with XFER_PULL: where it comes from */
+  uint32_t id;                 /* READY, JOIN: the transfer */
+  uint16_t stream;             /* JOIN: the offer is stream 0 */
+  uint16_t streams;            /* OFFER: 1 unless striped */
+  uint64_t sums;               /* READY with XFER_CRC: where the manifest goes */
+  uint32_t sums_rkey;
+  uint32_t sigs_rkey;          /* READY with XFER_DELTA: the signatures, */
+  uint64_t sigs;
+  uint64_t copies;             /*   and where the copies go */
+  uint32_t copies_rkey;
+  char name[];                 /* OFFER: NUL-terminated, no directories */
+};
+
+static inline unsigned long long xfer_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t xfer_chunks(uint64_t size, uint32_t chunk_size)
+{
+  return (size + chunk_size - 1) / chunk_size;
+}
+
+static inline uint32_t xfer_chunk_len(uint64_t size, uint32_t chunk_size,
+                                      uint64_t i)
+{
+  uint64_t left = size - i * chunk_size;
+
+  return left < chunk_size ? left : chunk_size;
+}
+
+/* Stream <stream> of <streams> sends chunks [*first, *end). */
+static inline void xfer_stripe(uint64_t chunks, int streams, int stream,
+                               uint64_t *first, uint64_t *end)
+{
+  *first = chunks * stream / streams;
+  *end = chunks * (stream + 1) / streams;
+}
+
+static inline uint64_t xfer_stripe_bytes(uint64_t size, uint32_t chunk_size,
+                                         uint64_t first, uint64_t end)
+{
+  uint64_t last = end * chunk_size < size ? end * chunk_size : size;
+
+  return first < end ? last - first * chunk_size : 0;
+}
+
+/*
+ * XFER_PACK: a chunk starts with a struct xfer_pack_chunk, and that many
+ * records follow, each with its path and then <length> bytes of data,
+ * both padded to 8 bytes. A file's pieces can be unpacked in any order.
+ */
+struct xfer_pack_chunk {
+  uint32_t records;
+  uint32_t used;               /* bytes of the chunk, this header included */
+};
+
+struct xfer_pack_record {
+  uint64_t size;               /* of the whole file */
+  uint64_t offset;             /* of this piece in it */
+  uint32_t length;             /* of this piece */
+  uint32_t mode;               /* st_mode: S_IFREG or S_IFDIR, and permissions */
+  uint16_t path_len;           /* without the NUL */
+  uint16_t pad[3];
+  char path[];                 /* relative to the directory sent, NUL-terminated */
+};
+
+static inline uint64_t xfer_align8(uint64_t n)
+{
+  return (n + 7) & ~7ULL;
+}
+
+/* Bytes a record takes before its data. */
+static inline uint32_t xfer_pack_header_len(uint32_t path_len)
+{
+  return xfer_align8(sizeof(struct xfer_pack_record) + path_len + 1);
+}
+
+/* A path the server may create under the directory: relative, no "." or ".." parts. */
+static inline int xfer_path_ok(const char *path, uint32_t len)
+{
+  const char *p = path, *end = path + len;
+  const char *slash;
+
+  if (!len || memchr(path, 0, len) || path[len] || *path == '/')
+    return 0;
+
+  for (; p < end; p = slash + 1) {
+    if (!(slash = memchr(p, '/', end - p)))
+      slash = end;
+    if (slash == p || (slash - p == 1 && p[0] == '.')
+        || (slash - p == 2 && p[0] == '.' && p[1] == '.'))
+      return 0;
+  }
+
+  return 1;
+}
+
+/* XFER_DELTA: a block of the server's copy, and where the sender wants one. */
+struct xfer_sig {
+  uint32_t weak;               /* xfer_weak() */
+  uint32_t pad;
+  uint64_t strong[2];          /* xfer_strong() */
+};
+
+struct xfer_copy {
+  uint64_t offset;             /* in the file sent, of a chunk size of bytes */
+  uint64_t block;              /* of the server's copy: bytes from block * chunk size */
+};
+
+/*
+ * CRC32C (Castagnoli), with the SSE 4.2 instruction where there is one;
+ * the bitwise fallback is only there so the code runs anywhere, not fast.
+ * Start from 0 and pass the result back in to continue.
+ */
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t xfer_crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t c = crc;
+  uint64_t word;
+
+  for (; len && ((uintptr_t)p & 7); --len)
+    c = _mm_crc32_u8((uint32_t)c, *p++);
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&word, p, 8);
+    c = _mm_crc32_u64(c, word);
+  }
+  for (; len; --len)
+    c = _mm_crc32_u8((uint32_t)c, *p++);
+
+  return (uint32_t)c;
+}
+#endif
+
+static inline uint32_t xfer_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  int k;
+
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    return ~xfer_crc32c_sse42(~crc, p, len);
+#endif
+
+  crc = ~crc;
+  while (len--) {
+    crc ^= *p++;
+    for (k = 0; k < 8; ++k)
+      crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+  }
+
+  return ~crc;
+}
+
+static inline uint64_t xfer_rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xfer_fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+
+  return k;
+}
+
+/*
+ * The strong sum of an XFER_DELTA block, MurmurHash3 x64_128 with seed 0:
+ * 128 bits, so two blocks only share one by design, and unrelated to
+ * CRC32C, so the manifest is a check of its own.
+ */
+static inline void xfer_strong(const void *buf, size_t len, uint64_t out[2])
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = 0, h2 = 0, k1, k2;
+  size_t i, n = len / 16;
+
+  for (i = 0; i < n; ++i, p += 16) {
+    memcpy(&k1, p, 8);
+    memcpy(&k2, p + 8, 8);
+
+    k1 *= c1; k1 = xfer_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = xfer_rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = xfer_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = xfer_rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  /* the tail, little-endian, as the reference does it */
+  k1 = k2 = 0;
+  for (i = len & 15; i > 8; --i)
+    k2 ^= (uint64_t)p[i - 1] << (8 * (i - 9));
+  for (; i > 0; --i)
+    k1 ^= (uint64_t)p[i - 1] << (8 * (i - 1));
+  if (len & 15) {
+    if ((len & 15) > 8) {
+      k2 *= c2; k2 = xfer_rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    k1 *= c1; k1 = xfer_rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= len; h2 ^= len;
+  h1 += h2; h2 += h1;
+  h1 = xfer_fmix64(h1); h2 = xfer_fmix64(h2);
+  h1 += h2; h2 += h1;
+
+  out[0] = h1;
+  out[1] = h2;
+}
+
+/*
+ * The weak sum of XFER_DELTA, rsync's: over bytes x[0..n), a = sum x[i]
+ * and b = sum (n - i) x[i], which rolls one byte along as
+ *
+ *   a += x[n] - x[0]; b += a - n * x[0];
+ *
+ * The sums wrap; only their low halves make the weak sum. A whole block
+ * is summed 32 bytes at a time with AVX2 where there is one.
+ */
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static inline void xfer_weak_sums_avx2(const unsigned char *p, size_t len,
+                                       uint32_t *a, uint32_t *b)
+{
+  const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+    24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i va = _mm256_setzero_si256(), vp = va, vw = va, x;
+  uint64_t lanes[4];
+  uint32_t words[8], sa = 0, sb = 0;
+  int k;
+
+  /* per 32 bytes: b gains 32 a (so far) and the bytes weighted 32 down to 1 */
+  for (; len >= 32; len -= 32, p += 32) {
+    x = _mm256_loadu_si256((const __m256i *)p);
+    vp = _mm256_add_epi64(vp, va);
+    va = _mm256_add_epi64(va, _mm256_sad_epu8(x, _mm256_setzero_si256()));
+    vw = _mm256_add_epi32(vw, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+  }
+
+  _mm256_storeu_si256((__m256i *)lanes, vp);
+  for (k = 0; k < 4; ++k)
+    sb += 32 * (uint32_t)lanes[k];
+  _mm256_storeu_si256((__m256i *)words, vw);
+  for (k = 0; k < 8; ++k)
+    sb += words[k];
+  _mm256_storeu_si256((__m256i *)lanes, va);
+  for (k = 0; k < 4; ++k)
+    sa += (uint32_t)lanes[k];
+
+  for (; len; --len) {
+    sa += *p++;
+    sb += sa;
+  }
+
+  *a = sa;
+  *b = sb;
+}
+#endif
+
+/* a and b of <len> bytes at <buf>. */
+static inline void xfer_weak_sums(const void *buf, size_t len, uint32_t *a, uint32_t *b)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    xfer_weak_sums_avx2(p, len, a, b);
+    return;
+  }
+#endif
+
+  *a = *b = 0;
+
+  for (; len; --len) {
+    *a += *p++;
+    *b += *a;
+  }
+}
+
+static inline uint32_t xfer_weak(uint32_t a, uint32_t b)
+{
+  return (a & 0xffff) | (b << 16);
+}
+
+/* Turn <msg> into an empty control message of type <op>. */
+static inline struct xfer_msg * xfer_prepare(struct message *msg, uint32_t op)
+{
+  struct xfer_msg *x = (struct xfer_msg *)msg->data;
+
+  msg->type = MSG_XFER;
+  msg->len = sizeof(*x);
+  memset(x, 0, sizeof(*x));
+  x->op = op;
+
+  return x;
+}
+
+/* The control message in <msg>, or NULL if it isn't one or is short. */
+static inline struct xfer_msg * xfer_parse(struct message *msg)
+{
+  if (msg->type != MSG_XFER || msg->len < sizeof(struct xfer_msg))
+    return NULL;
+
+  return (struct xfer_msg *)msg->data;
+}
+
+/* A name the server may create in its directory: no path, no dot files. */
+static inline int xfer_name_ok(const char *name, uint32_t max_len)
+{
+  size_t len = strnlen(name, max_len);
+
+  return len > 0 && len < max_len && len <= XFER_NAME_MAX
+    && name[0] != '.' && !strchr(name, '/');
+}
+
+/*
+ * One chunk as IBV_WR_RDMA_WRITE to <remote_addr> (_WITH_IMM: carrying
+ * <imm>), IBV_WR_RDMA_READ from it, or IBV_WR_SEND.
+ */
+static inline int xfer_post_chunk(struct ibv_qp *qp, enum ibv_wr_opcode opcode,
+                                  void *buf, uint32_t len, uint32_t lkey,
+                                  uint64_t remote_addr, uint32_t rkey,
+                                  uint32_t imm, uint64_t wr_id)
+{
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  memset(&wr, 0, sizeof(wr));
+
+  wr.wr_id = wr_id;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.opcode = opcode;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.wr.rdma.remote_addr = remote_addr;
+  wr.wr.rdma.rkey = rkey;
+  wr.imm_data = htonl(imm);
+
+  sge.addr = (uintptr_t)buf;
+  sge.length = len;
+  sge.lkey = lkey;
+
+  return ibv_post_send(qp, &wr, &bad_wr);
+}
+
+/* A receive of up to <len> bytes at <buf>. */
+static inline int xfer_post_recv(struct ibv_qp *qp, void *buf, uint32_t len,
+                                 uint32_t lkey, uint64_t wr_id)
+{
+  struct ibv_recv_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  wr.wr_id = wr_id;
+  wr.next = NULL;
+  wr.sg_list = &sge;
+  wr.num_sge = len ? 1 : 0;
+
+  sge.addr = (uintptr_t)buf;
+  sge.length = len;
+  sge.lkey = lkey;
+
+  return ibv_post_recv(qp, &wr, &bad_wr);
+}
+
+/*
+ * Create <path> with <size> bytes of blocks already allocated and map it
+ * shared and writable. Returns the mapping (NULL for an empty file) and
+ * sets *fd, or returns MAP_FAILED with errno set.
+ */
+static inline void * xfer_create_file(const char *path, uint64_t size, int *fd)
+{
+  void *map;
+  int err;
+
+  if ((*fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    return MAP_FAILED;
+  if (!size)
+    return NULL;
+
+  /* not every file system can allocate up front; a sparse file still works */
+  err = posix_fallocate(*fd, 0, size);
+  if (err && (err != EOPNOTSUPP || ftruncate(*fd, size))) {
+    close(*fd);
+    errno = err;
+    return MAP_FAILED;
+  }
+
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if (map == MAP_FAILED)
+    close(*fd);
+
+  return map;
+}
+
+#endif
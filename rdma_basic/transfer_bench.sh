@@ -0,0 +1,120 @@
+#!/bin/sh
+# end-to-end GB/s of one file sent by client, against cp to an NFS mount,
+# and how striping it over more streams scales; "read" is the server
+# pulling with RDMA READs (as many in flight as its -r), the rest push;
+# then the cost of per-chunk CRC32C checking (-k) against none; given a
+# directory of small files, sending it packed against one client per file;
+# then the file again, in full and as a delta (-d) of the copy the server
+# now has, which is the unchanged case: edit <file> between runs for others
+# needs server already running on <server> <port>; the page cache of <file>
+# is warmed first, so both sides read it from memory
+# example: transfer_bench.sh 10.0.0.1 7471 /data/big.img /mnt/nfs /data/src
+
+if [ $# -lt 4 ] ; then
+        echo "Usage: transfer_bench.sh <server> <port> <file> <nfs-directory> [<small-files-directory>]"
+        exit 3
+fi
+
+server=$1
+port=$2
+file=$3
+nfs=$4
+tree=$5
+client=$(dirname $0)/client
+bytes=$(stat -c %s $file)
+
+now() {
+        date +%s.%N
+}
+
+cat $file > /dev/null
+
+printf "%-24s %8s %10s %10s\n" method chunk_kb seconds GB/s
+for chunk in 64 256 1024 4096 ; do
+        for mode in write read send buffered ; do
+                case $mode in
+                        write) flags= ;;
+                        read) flags=-r ;;
+                        send) flags=-s ;;
+                        buffered) flags=-b ;;
+                esac
+                $client $flags -c $chunk $server $port $file | awk -v mode=$mode -v chunk=$chunk '
+                        /^sent / { for (i = 1; i < NF; i++) {
+                                if ($(i + 1) == "s,") secs = $i
+                                if ($(i + 1) == "GB/s") rate = $i } }
+                        END { printf "%-24s %8d %10s %10s\n", "rdma " mode, chunk, secs, rate }'
+        done
+done
+
+printf "\n%8s %10s %10s %14s\n" streams seconds GB/s slowest_GB/s
+for streams in 1 2 4 8 16 ; do
+        $client -n $streams $server $port $file | awk -v streams=$streams '
+                /^sent / { for (i = 1; i < NF; i++) {
+                        if ($(i + 1) == "s,") secs = $i
+                        if ($(i + 1) == "GB/s") rate = $i } }
+                /^  stream / { if (slowest == "" || $(NF - 1) < slowest) slowest = $(NF - 1) }
+                END { printf "%8d %10s %10s %14s\n", streams, secs, rate,
+                        slowest == "" ? rate : slowest }'
+done
+
+printf "\n%-24s %8s %10s %10s\n" checksums streams seconds GB/s
+for streams in 1 4 ; do
+        for check in none crc32c ; do
+                [ $check = crc32c ] && flags=-k || flags=
+                $client $flags -n $streams $server $port $file | awk -v check=$check -v streams=$streams '
+                        /^sent / { for (i = 1; i < NF; i++) {
+                                if ($(i + 1) == "s,") secs = $i
+                                if ($(i + 1) == "GB/s") rate = $i } }
+                        END { printf "%-24s %8d %10s %10s\n", check, streams, secs, rate }'
+        done
+done
+echo
+
+if [ -n "$tree" ] ; then
+        find $tree -type f -exec cat {} + > /dev/null
+        files=$(find $tree -type f | wc -l)
+        tree_bytes=$(find $tree -type f -printf "%s\n" | awk '{ n += $1 } END { print n + 0 }')
+
+        printf "%-24s %8s %10s %10s %10s\n" "small files" files seconds files/s GB/s
+        for readers in 1 8 ; do
+                $client -j $readers $server $port $tree | awk -v readers=$readers -v files=$files '
+                        /^sent / { for (i = 1; i < NF; i++) if ($(i + 1) == "s,") secs = $i }
+                        /^  .* files\/s, / { for (i = 1; i < NF; i++) {
+                                if ($(i + 1) == "files/s,") rate = $i
+                                if ($(i + 1) == "GB/s") gbs = $i } }
+                        END { printf "%-24s %8d %10s %10s %10s\n", "packed, " readers " readers", files, secs, rate, gbs }'
+        done
+
+        start=$(now)
+        find $tree -type f -exec sh -c 's=$1 p=$2 ; shift 2 ; for f ; do "$0" $s $p "$f" > /dev/null ; done' $client $server $port {} +
+        end=$(now)
+        echo $start $end $files $tree_bytes | awk '{ secs = $2 - $1
+                printf "%-24s %8d %10.3f %10.0f %10.2f\n", "a client per file", $3, secs, $3 / secs, $4 / secs / 1e9 }'
+        echo
+fi
+
+printf "%-24s %8s %10s %10s %14s %8s\n" update chunk_kb seconds GB/s bytes_sent saved
+for chunk in 64 1024 ; do
+        for mode in full delta ; do
+                # both checked, as a delta always is
+                [ $mode = delta ] && flags=-d || flags=-k
+                $client $flags -c $chunk $server $port $file | awk -v mode=$mode -v chunk=$chunk -v bytes=$bytes '
+                        /^sent / { for (i = 1; i < NF; i++) {
+                                if ($(i + 1) == "s,") secs = $i
+                                if ($(i + 1) == "GB/s") rate = $i } }
+                        /^  delta / { for (i = 1; i < NF; i++)
+                                if ($(i + 1) == "bytes" && $(i + 2) == "sent,") sent = $i }
+                        END { if (sent == "") sent = bytes
+                                printf "%-24s %8d %10s %10s %14.0f %7.1f%%\n", mode, chunk, secs, rate, sent,
+                                        bytes ? 100 * (bytes - sent) / bytes : 0 }'
+        done
+done
+echo
+
+# cp over NFS: the close() at the end flushes the dirty pages to the server
+start=$(now)
+cp $file $nfs/
+end=$(now)
+echo $start $end $bytes | awk '{ secs = $2 - $1
+        printf "%-24s %8s %10.3f %10.2f\n", "cp to nfs", "-", secs, $3 / secs / 1e9 }'
+rm -f $nfs/$(basename $file)
@@ -0,0 +1,200 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+/*
+ * The little of io_uring the server needs, on the raw system calls so
+ * there is no liburing to depend on: one ring per user, registered files
+ * and fixed buffers, an eventfd to learn about completions, and writes
+ * and fsyncs on registered files. A ring belongs to one thread.
+ */
+
+struct uring {
+  int fd;
+  unsigned sq_entries;
+  unsigned sq_tail;            /* ours, published on submit */
+  unsigned sq_submitted;
+
+  unsigned *sq_head;
+  unsigned *sq_ktail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+
+static inline int uring_register(struct uring *u, unsigned opcode,
+                                 const void *arg, unsigned nr_args)
+{
+  return syscall(__NR_io_uring_register, u->fd, opcode, arg, nr_args);
+}
+
+static inline void uring_exit(struct uring *u)
+{
+  if (u->sqes)
+    munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring && u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_ring_size);
+  if (u->sq_ring)
+    munmap(u->sq_ring, u->sq_ring_size);
+  close(u->fd);
+}
+
+/* Returns 0, or -1 with errno set. */
+static inline int uring_init(struct uring *u, unsigned entries)
+{
+  struct io_uring_params p;
+  void *ring;
+
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+
+  if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    return -1;
+
+  u->sq_entries = p.sq_entries;
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  /* since 5.4 both rings are one mapping */
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_size > u->sq_ring_size)
+      u->sq_ring_size = u->cq_ring_size;
+    u->cq_ring_size = u->sq_ring_size;
+  }
+
+  ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED)
+    goto fail;
+  u->sq_ring = ring;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_ring = u->sq_ring;
+  } else {
+    ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (ring == MAP_FAILED)
+      goto fail;
+    u->cq_ring = ring;
+  }
+
+  ring = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (ring == MAP_FAILED)
+    goto fail;
+  u->sqes = (struct io_uring_sqe *)ring;
+
+  u->sq_head = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+  u->sq_ktail = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+  u->sq_mask = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+  u->sq_tail = *u->sq_ktail;
+  u->sq_submitted = u->sq_tail;
+
+  u->cq_head = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+  u->cq_tail = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+  u->cq_mask = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+  return 0;
+
+fail:
+  uring_exit(u);
+  return -1;
+}
+
+/* A zeroed SQE to fill in, or NULL if the submission ring is full. */
+static inline struct io_uring_sqe * uring_get_sqe(struct uring *u)
+{
+  struct io_uring_sqe *sqe;
+  unsigned index;
+
+  if (u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+    return NULL;
+
+  index = u->sq_tail++ & *u->sq_mask;
+  u->sq_array[index] = index;
+  sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+
+  return sqe;
+}
+
+/* Hand everything got since the last call to the kernel; doesn't wait. */
+static inline int uring_submit(struct uring *u)
+{
+  unsigned n = u->sq_tail - u->sq_submitted;
+  int r;
+
+  if (!n)
+    return 0;
+
+  __atomic_store_n(u->sq_ktail, u->sq_tail, __ATOMIC_RELEASE);
+  if ((r = syscall(__NR_io_uring_enter, u->fd, n, 0, 0, NULL, 0)) > 0)
+    u->sq_submitted += r;
+
+  return r;
+}
+
+/* The oldest completion not yet seen, or NULL. */
+static inline struct io_uring_cqe * uring_peek_cqe(struct uring *u)
+{
+  unsigned head = *u->cq_head;
+
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  return &u->cqes[head & *u->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *u)
+{
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* A write of <len> bytes from fixed buffer <buf_index> to registered file <file>. */
+static inline void uring_prep_write_fixed(struct io_uring_sqe *sqe, int file,
+                                          const void *buf, unsigned len,
+                                          uint64_t offset, int buf_index,
+                                          uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = file;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->buf_index = buf_index;
+  sqe->user_data = user_data;
+}
+
+static inline void uring_prep_fdatasync(struct io_uring_sqe *sqe, int file,
+                                        uint64_t user_data)
+{
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = file;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->user_data = user_data;
+}
+
+#endif